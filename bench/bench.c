@@ -0,0 +1,673 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+/*
+ * Micro benchmarks for the metric update hot paths, scrape cost and
+ * metric/series/handle churn.  Results are written to stdout as a
+ * single JSON document so that runs can be compared for regressions.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "prometheus-c.h"
+
+#define barrier(ptr) __asm__ volatile ("" : : "r" (ptr) : "memory")
+
+/* Values per call of the batched update functions */
+#define BENCH_BATCH  64
+
+enum bench_op {
+    BENCH_COUNTER_INCREMENT,
+    BENCH_COUNTER_ADD,
+    BENCH_COUNTER_ADD_MANY,
+    BENCH_GAUGE_SET,
+    BENCH_GAUGE_ADD,
+    BENCH_HISTOGRAM_SAMPLE_EXPONENTIAL,
+    BENCH_HISTOGRAM_SAMPLE_LINEAR,
+    BENCH_HISTOGRAM_SAMPLE_MANY,
+    BENCH_HISTOGRAM_SAMPLE_SAMPLED,
+    BENCH_HISTOGRAM_SAMPLE_MIN_MAX,
+    BENCH_HISTOGRAM_TIME_CLOCK,
+    BENCH_HISTOGRAM_TIME_CLOCK_GETTIME,
+    BENCH_NUM_OPS,
+};
+
+static const char *bench_op_names[BENCH_NUM_OPS] = {
+    "counter_increment",
+    "counter_add",
+    "counter_add_many",
+    "gauge_set",
+    "gauge_add",
+    "histogram_sample_exponential",
+    "histogram_sample_linear",
+    "histogram_sample_many",
+    "histogram_sample_sampled",
+    "histogram_sample_min_max",
+    "histogram_time_clock",
+    "histogram_time_clock_gettime",
+};
+
+struct bench_counters {
+    int      cycles_fd;
+    int      instructions_fd;
+    uint64_t cycles;
+    uint64_t instructions;
+};
+
+struct bench_thread {
+    pthread_t                             thread;
+    pthread_barrier_t                    *start;
+    enum bench_op                         op;
+    uint64_t                              iterations;
+    struct prometheus_counter_instance   *counter;
+    struct prometheus_gauge_instance     *gauge;
+    struct prometheus_histogram_instance *histogram;
+    int64_t                               values[BENCH_BATCH];
+    uint64_t                              elapsed_ns;
+    struct bench_counters                 counters;
+};
+
+static int first_result = 1;
+
+static uint64_t
+bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+} /* bench_now_ns */
+
+static int
+bench_perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+} /* bench_perf_open */
+
+/*
+ * Hardware counters are often unavailable in containers and VMs, in
+ * which case IPC is reported as null rather than failing the run.
+ */
+
+static void
+bench_counters_start(struct bench_counters *counters)
+{
+    counters->cycles_fd       = bench_perf_open(PERF_COUNT_HW_CPU_CYCLES);
+    counters->instructions_fd = bench_perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+
+    if (counters->cycles_fd >= 0 && counters->instructions_fd >= 0) {
+        ioctl(counters->cycles_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->instructions_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+        ioctl(counters->instructions_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+} /* bench_counters_start */
+
+static void
+bench_counters_stop(struct bench_counters *counters)
+{
+    counters->cycles       = 0;
+    counters->instructions = 0;
+
+    if (counters->cycles_fd >= 0 && counters->instructions_fd >= 0) {
+        ioctl(counters->cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+        ioctl(counters->instructions_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (read(counters->cycles_fd, &counters->cycles, sizeof(uint64_t)) != sizeof(uint64_t) ||
+            read(counters->instructions_fd, &counters->instructions, sizeof(uint64_t)) != sizeof(uint64_t)) {
+            counters->cycles       = 0;
+            counters->instructions = 0;
+        }
+    }
+
+    if (counters->cycles_fd >= 0) {
+        close(counters->cycles_fd);
+    }
+
+    if (counters->instructions_fd >= 0) {
+        close(counters->instructions_fd);
+    }
+} /* bench_counters_stop */
+
+static void
+bench_result_begin(const char *benchmark)
+{
+    printf("%s\n    {\"benchmark\": \"%s\"", first_result ? "" : ",", benchmark);
+    first_result = 0;
+} /* bench_result_begin */
+
+static void
+bench_result_end(void)
+{
+    printf("}");
+} /* bench_result_end */
+
+static void
+bench_run_op(struct bench_thread *bt)
+{
+    uint64_t i, start;
+
+    /* The barrier keeps the compiler from collapsing the loop into one update */
+
+    switch (bt->op) {
+        case BENCH_COUNTER_INCREMENT:
+            for (i = 0; i < bt->iterations; i++) {
+                prometheus_counter_increment(bt->counter);
+                barrier(bt->counter);
+            }
+            break;
+        case BENCH_COUNTER_ADD:
+            for (i = 0; i < bt->iterations; i++) {
+                prometheus_counter_add(bt->counter, i);
+                barrier(bt->counter);
+            }
+            break;
+        case BENCH_COUNTER_ADD_MANY:
+            for (i = 0; i < bt->iterations; i += BENCH_BATCH) {
+                prometheus_counter_add_many(bt->counter, (const uint64_t *) bt->values, BENCH_BATCH);
+                barrier(bt->counter);
+            }
+            break;
+        case BENCH_GAUGE_SET:
+            for (i = 0; i < bt->iterations; i++) {
+                prometheus_gauge_set(bt->gauge, i);
+                barrier(bt->gauge);
+            }
+            break;
+        case BENCH_GAUGE_ADD:
+            for (i = 0; i < bt->iterations; i++) {
+                prometheus_gauge_add(bt->gauge, i & 1 ? 1 : -1);
+                barrier(bt->gauge);
+            }
+            break;
+        case BENCH_HISTOGRAM_SAMPLE_EXPONENTIAL:
+        case BENCH_HISTOGRAM_SAMPLE_LINEAR:
+        case BENCH_HISTOGRAM_SAMPLE_SAMPLED:
+        case BENCH_HISTOGRAM_SAMPLE_MIN_MAX:
+            for (i = 0; i < bt->iterations; i++) {
+                prometheus_histogram_sample(bt->histogram, (i & 0xffff) + 1);
+                barrier(bt->histogram);
+            }
+            break;
+        case BENCH_HISTOGRAM_SAMPLE_MANY:
+            for (i = 0; i < bt->iterations; i += BENCH_BATCH) {
+                prometheus_histogram_sample_many(bt->histogram, bt->values, BENCH_BATCH);
+                barrier(bt->histogram);
+            }
+            break;
+        case BENCH_HISTOGRAM_TIME_CLOCK:
+            for (i = 0; i < bt->iterations; i++) {
+                start = prometheus_clock_ticks();
+                prometheus_histogram_sample_elapsed(bt->histogram, start, PROMETHEUS_TIME_NS);
+                barrier(bt->histogram);
+            }
+            break;
+        case BENCH_HISTOGRAM_TIME_CLOCK_GETTIME:
+            for (i = 0; i < bt->iterations; i++) {
+                start = bench_now_ns();
+                prometheus_histogram_sample(bt->histogram, bench_now_ns() - start);
+                barrier(bt->histogram);
+            }
+            break;
+        default:
+            break;
+    } /* switch */
+} /* bench_run_op */
+
+static void *
+bench_thread_main(void *arg)
+{
+    struct bench_thread *bt = arg;
+    uint64_t             start;
+
+    pthread_barrier_wait(bt->start);
+
+    bench_counters_start(&bt->counters);
+
+    start = bench_now_ns();
+
+    bench_run_op(bt);
+
+    bt->elapsed_ns = bench_now_ns() - start;
+
+    bench_counters_stop(&bt->counters);
+
+    return NULL;
+} /* bench_thread_main */
+
+/*
+ * Each thread updates a private handle of one shared series, which is
+ * the usage pattern the library is designed around.
+ */
+
+static void
+bench_updates(
+    enum bench_op op,
+    int           num_threads,
+    uint64_t      iterations)
+{
+    struct prometheus_metrics          *metrics;
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *counter_series;
+    struct prometheus_gauge            *gauge;
+    struct prometheus_gauge_series     *gauge_series;
+    struct prometheus_histogram        *histogram;
+    struct prometheus_histogram_series *histogram_series;
+    struct bench_thread                *threads;
+    pthread_barrier_t                   start;
+    uint64_t                            elapsed = 0, cycles = 0, instructions = 0;
+    int                                 i, j;
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    counter        = prometheus_metrics_create_counter(metrics, "bench_counter", "Bench counter");
+    counter_series = prometheus_counter_create_series(counter, NULL, NULL, 0);
+    gauge          = prometheus_metrics_create_gauge(metrics, "bench_gauge", "Bench gauge");
+    gauge_series   = prometheus_gauge_create_series(gauge, NULL, NULL, 0);
+
+    if (op == BENCH_HISTOGRAM_SAMPLE_LINEAR) {
+        histogram = prometheus_metrics_create_histogram_linear(metrics, "bench_histogram", "Bench histogram",
+                                                               0, 4096, 16);
+    } else {
+        histogram = prometheus_metrics_create_histogram_exponential(metrics, "bench_histogram", "Bench histogram", 16);
+    }
+
+    if (op == BENCH_HISTOGRAM_SAMPLE_SAMPLED) {
+        prometheus_histogram_set_sampling(histogram, 64);
+    }
+
+    if (op == BENCH_HISTOGRAM_SAMPLE_MIN_MAX) {
+        prometheus_histogram_set_min_max(histogram, 1);
+    }
+
+    histogram_series = prometheus_histogram_create_series(histogram, NULL, NULL, 0);
+
+    threads = calloc(num_threads, sizeof(*threads));
+
+    pthread_barrier_init(&start, NULL, num_threads);
+
+    for (i = 0; i < num_threads; i++) {
+        threads[i].start      = &start;
+        threads[i].op         = op;
+        threads[i].iterations = iterations;
+        threads[i].counter    = prometheus_counter_series_create_instance(counter_series);
+        threads[i].gauge      = prometheus_gauge_series_create_instance(gauge_series);
+        threads[i].histogram  = prometheus_histogram_series_create_instance(histogram_series);
+
+        /* Spread the batch over the buckets as a mix of completion latencies would */
+        for (j = 0; j < BENCH_BATCH; j++) {
+            threads[i].values[j] = ((j * 2654435761UL) & 0xffff) + 1;
+        }
+
+        pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]);
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+
+        elapsed      += threads[i].elapsed_ns;
+        cycles       += threads[i].counters.cycles;
+        instructions += threads[i].counters.instructions;
+    }
+
+    bench_result_begin(bench_op_names[op]);
+
+    printf(", \"threads\": %d, \"iterations\": %lu, \"ns_per_op\": %.3f",
+           num_threads, iterations, (double) elapsed / (num_threads * iterations));
+
+    if (cycles) {
+        printf(", \"ipc\": %.3f", (double) instructions / cycles);
+    } else {
+        printf(", \"ipc\": null");
+    }
+
+    bench_result_end();
+
+    pthread_barrier_destroy(&start);
+
+    free(threads);
+
+    prometheus_metrics_destroy(metrics);
+} /* bench_updates */
+
+static void
+bench_scrape(
+    int num_series,
+    int handles_per_series,
+    int num_buckets)
+{
+    struct prometheus_metrics          *metrics;
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *counter_series;
+    struct prometheus_histogram        *histogram;
+    struct prometheus_histogram_series *histogram_series;
+    char                                label[32];
+    const char                         *label_names[]  = { "series" };
+    const char                         *label_values[] = { label };
+    char                               *buffer;
+    int                                 buffer_size = 256 * 1024 * 1024;
+    int                                 i, j, length = 0, rounds = 5;
+    uint64_t                            start, elapsed;
+
+    buffer = malloc(buffer_size);
+
+    metrics = prometheus_metrics_create((char *[]) { "host" }, (char *[]) { "bench" }, 1);
+
+    counter   = prometheus_metrics_create_counter(metrics, "bench_counter", "Bench counter");
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "bench_histogram", "Bench histogram",
+                                                                num_buckets);
+
+    for (i = 0; i < num_series; i++) {
+        snprintf(label, sizeof(label), "%d", i);
+
+        counter_series   = prometheus_counter_create_series(counter, label_names, label_values, 1);
+        histogram_series = prometheus_histogram_create_series(histogram, label_names, label_values, 1);
+
+        for (j = 0; j < handles_per_series; j++) {
+            prometheus_counter_add(prometheus_counter_series_create_instance(counter_series), i + j);
+            prometheus_histogram_sample(prometheus_histogram_series_create_instance(histogram_series), i + j + 1);
+        }
+    }
+
+    start = bench_now_ns();
+
+    for (i = 0; i < rounds; i++) {
+        length = prometheus_metrics_scrape(metrics, buffer, buffer_size);
+    }
+
+    elapsed = (bench_now_ns() - start) / rounds;
+
+    bench_result_begin("scrape");
+
+    printf(", \"series\": %d, \"handles_per_series\": %d, \"buckets\": %d, \"ns\": %lu, \"bytes\": %d",
+           num_series, handles_per_series, num_buckets, elapsed, length);
+
+    if (elapsed) {
+        printf(", \"mb_per_sec\": %.1f", (double) length * 1000.0 / elapsed);
+    }
+
+    bench_result_end();
+
+    prometheus_metrics_destroy(metrics);
+
+    free(buffer);
+} /* bench_scrape */
+
+/*
+ * Exposition encoding throughput on a registry of many labelled series
+ * holding large values, so that the scrape is dominated by formatting
+ * rather than by aggregation.  The same text is also produced with
+ * snprintf() as a baseline for the library's formatting kernels.
+ */
+
+static void
+bench_encode(int num_series)
+{
+    struct prometheus_metrics        *metrics;
+    struct prometheus_counter        *counter;
+    struct prometheus_counter_series *series;
+    char                            (*paths)[32];
+    const char                       *label_names[]  = { "method", "path", "code" };
+    const char                       *label_values[] = { "GET", NULL, "200" };
+    char                             *buffer, *bp, *end;
+    int                               buffer_size = 256 * 1024 * 1024;
+    int                               i, j, round, length = 0, rounds = 10;
+    uint64_t                          start, elapsed, baseline;
+
+    buffer = malloc(buffer_size);
+    paths  = calloc(num_series, sizeof(*paths));
+
+    metrics = prometheus_metrics_create((char *[]) { "host" }, (char *[]) { "bench" }, 1);
+    counter = prometheus_metrics_create_counter(metrics, "bench_encode_total", "Bench encode");
+
+    for (i = 0; i < num_series; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/api/v1/item/%d", i);
+
+        label_values[1] = paths[i];
+
+        series = prometheus_counter_create_series(counter, label_names, label_values, 3);
+
+        prometheus_counter_add(prometheus_counter_series_create_instance(series), 0x123456789abUL * (i + 1));
+    }
+
+    start = bench_now_ns();
+
+    for (round = 0; round < rounds; round++) {
+        length = prometheus_metrics_scrape(metrics, buffer, buffer_size);
+    }
+
+    elapsed = (bench_now_ns() - start) / rounds;
+
+    start = bench_now_ns();
+
+    for (round = 0; round < rounds; round++) {
+        bp  = buffer;
+        end = buffer + buffer_size;
+
+        for (i = 0; i < num_series; i++) {
+            label_values[1] = paths[i];
+
+            bp += snprintf(bp, end - bp, "%s%s{%s=\"%s\"", "bench_encode_total", "", "host", "bench");
+
+            for (j = 0; j < 3; j++) {
+                bp += snprintf(bp, end - bp, "%s%s=\"%s\"", ",", label_names[j], label_values[j]);
+            }
+
+            bp += snprintf(bp, end - bp, "} ");
+            bp += snprintf(bp, end - bp, "%lu\n", 0x123456789abUL * (i + 1));
+        }
+
+        barrier(buffer);
+    }
+
+    baseline = (bench_now_ns() - start) / rounds;
+
+    bench_result_begin("encode");
+
+    printf(", \"series\": %d, \"ns\": %lu, \"bytes\": %d", num_series, elapsed, length);
+
+    if (elapsed && baseline) {
+        printf(", \"mb_per_sec\": %.1f, \"printf_mb_per_sec\": %.1f",
+               (double) length * 1000.0 / elapsed, (double) (bp - buffer) * 1000.0 / baseline);
+    }
+
+    bench_result_end();
+
+    prometheus_metrics_destroy(metrics);
+
+    free(paths);
+    free(buffer);
+} /* bench_encode */
+
+static void
+bench_create_destroy(int count)
+{
+    struct prometheus_metrics           *metrics;
+    struct prometheus_counter           *counter;
+    struct prometheus_counter_series   **series;
+    struct prometheus_counter_instance **instances;
+    struct prometheus_histogram         *histogram;
+    struct prometheus_histogram_series **histogram_series;
+    char                                 label[32];
+    const char                          *label_names[]  = { "series" };
+    const char                          *label_values[] = { label };
+    uint64_t                             start, created, destroyed;
+    int                                  i;
+
+    series           = calloc(count, sizeof(*series));
+    instances        = calloc(count, sizeof(*instances));
+    histogram_series = calloc(count, sizeof(*histogram_series));
+
+    metrics   = prometheus_metrics_create(NULL, NULL, 0);
+    counter   = prometheus_metrics_create_counter(metrics, "bench_counter", "Bench counter");
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "bench_histogram", "Bench histogram", 32);
+
+    start = bench_now_ns();
+
+    for (i = 0; i < count; i++) {
+        snprintf(label, sizeof(label), "%d", i);
+        series[i] = prometheus_counter_create_series(counter, label_names, label_values, 1);
+    }
+
+    created = bench_now_ns() - start;
+    start   = bench_now_ns();
+
+    for (i = 0; i < count; i++) {
+        prometheus_counter_destroy_series(counter, series[i]);
+    }
+
+    destroyed = bench_now_ns() - start;
+
+    bench_result_begin("create_destroy");
+    printf(", \"object\": \"counter_series\", \"count\": %d, \"create_per_sec\": %.0f, \"destroy_per_sec\": %.0f",
+           count, count * 1e9 / created, count * 1e9 / destroyed);
+    bench_result_end();
+
+    start = bench_now_ns();
+
+    for (i = 0; i < count; i++) {
+        snprintf(label, sizeof(label), "%d", i);
+        histogram_series[i] = prometheus_histogram_create_series(histogram, label_names, label_values, 1);
+    }
+
+    created = bench_now_ns() - start;
+    start   = bench_now_ns();
+
+    for (i = 0; i < count; i++) {
+        prometheus_histogram_destroy_series(histogram, histogram_series[i]);
+    }
+
+    destroyed = bench_now_ns() - start;
+
+    bench_result_begin("create_destroy");
+    printf(", \"object\": \"histogram_series\", \"count\": %d, \"create_per_sec\": %.0f, \"destroy_per_sec\": %.0f",
+           count, count * 1e9 / created, count * 1e9 / destroyed);
+    bench_result_end();
+
+    series[0] = prometheus_counter_create_series(counter, NULL, NULL, 0);
+
+    start = bench_now_ns();
+
+    for (i = 0; i < count; i++) {
+        instances[i] = prometheus_counter_series_create_instance(series[0]);
+    }
+
+    created = bench_now_ns() - start;
+    start   = bench_now_ns();
+
+    for (i = 0; i < count; i++) {
+        prometheus_counter_series_destroy_instance(series[0], instances[i]);
+    }
+
+    destroyed = bench_now_ns() - start;
+
+    bench_result_begin("create_destroy");
+    printf(", \"object\": \"counter_instance\", \"count\": %d, \"create_per_sec\": %.0f, \"destroy_per_sec\": %.0f",
+           count, count * 1e9 / created, count * 1e9 / destroyed);
+    bench_result_end();
+
+    prometheus_metrics_destroy(metrics);
+
+    free(series);
+    free(instances);
+    free(histogram_series);
+} /* bench_create_destroy */
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t max_threads] [-i iterations] [-q]\n", prog);
+    fprintf(stderr, "  -t  largest thread count for update benchmarks (default: online cpus)\n");
+    fprintf(stderr, "  -i  iterations per thread for update benchmarks, rounded up to 64s (default: 100000000)\n");
+    fprintf(stderr, "  -q  quick run with reduced sizes and 1000000 default iterations\n");
+} /* usage */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    uint64_t iterations  = 0;
+    int      max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int      quick       = 0;
+    int      opt, op, threads, series, handles, buckets;
+
+    while ((opt = getopt(argc, argv, "t:i:qh")) != -1) {
+        switch (opt) {
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'i':
+                iterations = strtoull(optarg, NULL, 0);
+                break;
+            case 'q':
+                quick = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        } /* switch */
+    }
+
+    /* An explicit -i wins over the quick default */
+    if (!iterations) {
+        iterations = quick ? 1000000 : 100000000UL;
+    }
+
+    /* Batched operations run whole batches, so every op runs and reports the same rounded count */
+    iterations = (iterations + BENCH_BATCH - 1) / BENCH_BATCH * BENCH_BATCH;
+
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    printf("{\n  \"library\": \"prometheus-c\",\n  \"results\": [");
+
+    for (op = 0; op < BENCH_NUM_OPS; op++) {
+        for (threads = 1; threads <= max_threads; threads *= 2) {
+            bench_updates(op, threads, iterations);
+
+            if (threads < max_threads && threads * 2 > max_threads) {
+                bench_updates(op, max_threads, iterations);
+            }
+        }
+    }
+
+    for (series = 100; series <= (quick ? 1000 : 100000); series *= 10) {
+        for (handles = 1; handles <= 16; handles *= 4) {
+            for (buckets = 8; buckets <= 32; buckets *= 4) {
+                bench_scrape(series, handles, buckets);
+            }
+        }
+    }
+
+    bench_encode(quick ? 100000 : 1000000);
+
+    bench_create_destroy(quick ? 10000 : 100000);
+
+    printf("\n  ]\n}\n");
+
+    return 0;
+} /* main */
@@ -0,0 +1,169 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+/*
+ * Serve the metrics held in a shared memory segment created with
+ * prometheus_metrics_create_shared() over HTTP at /metrics, so that
+ * the process owning the segment never renders a scrape itself.
+ *
+ * Usage: prometheus-c-exporter [-p port] <segment path>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "prometheus-c.h"
+
+#define EXPORTER_MAX_BUFFER (64 * 1024 * 1024)
+
+static void
+respond(
+    int         fd,
+    const char *status,
+    const char *body,
+    int         length)
+{
+    char header[256];
+    int  header_length, rc;
+
+    header_length = snprintf(header, sizeof(header),
+                             "HTTP/1.1 %s\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %d\r\n"
+                             "Connection: close\r\n\r\n",
+                             status, length);
+
+    if (write(fd, header, header_length) != header_length) {
+        return;
+    }
+
+    while (length > 0) {
+        rc = write(fd, body, length);
+
+        if (rc <= 0) {
+            return;
+        }
+
+        body   += rc;
+        length -= rc;
+    }
+} /* respond */
+
+/*
+ * The segment is reopened for every request so that a restarted process,
+ * which replaces the segment file, is picked up without restarting the
+ * exporter.
+ */
+
+static void
+serve(
+    int         fd,
+    const char *path,
+    char      **buffer,
+    int        *buffer_size)
+{
+    struct prometheus_segment *segment;
+    char                       request[4096];
+    int                        length = 0, rc;
+
+    request[0] = '\0';
+
+    while (length < (int) sizeof(request) - 1 && !strstr(request, "\r\n\r\n")) {
+        rc = read(fd, request + length, sizeof(request) - 1 - length);
+
+        if (rc <= 0) {
+            break;
+        }
+
+        length         += rc;
+        request[length] = '\0';
+    }
+
+    request[length] = '\0';
+
+    if (strncmp(request, "GET /metrics ", 13) != 0) {
+        respond(fd, "404 Not Found", "", 0);
+        return;
+    }
+
+    segment = prometheus_segment_open(path);
+
+    if (!segment) {
+        respond(fd, "503 Service Unavailable", "", 0);
+        return;
+    }
+
+    while ((length = prometheus_segment_scrape(segment, *buffer, *buffer_size)) < 0 &&
+           *buffer_size < EXPORTER_MAX_BUFFER) {
+        *buffer_size *= 2;
+        *buffer       = realloc(*buffer, *buffer_size);
+    }
+
+    prometheus_segment_close(segment);
+
+    if (length < 0) {
+        respond(fd, "500 Internal Server Error", "", 0);
+    } else {
+        respond(fd, "200 OK", *buffer, length);
+    }
+} /* serve */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct sockaddr_in addr;
+    char              *buffer;
+    int                buffer_size = 64 * 1024;
+    int                port        = 9100, opt, listen_fd, fd, one = 1;
+
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] <segment path>\n", argv[0]);
+                return 1;
+        } /* switch */
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-p port] <segment path>\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(listen_fd, 16)) {
+        perror("bind");
+        return 1;
+    }
+
+    buffer = malloc(buffer_size);
+
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        serve(fd, argv[optind], &buffer, &buffer_size);
+        close(fd);
+    }
+
+    free(buffer);
+    close(listen_fd);
+
+    return 0;
+} /* main */
@@ -9,10 +9,48 @@
 #include <ctype.h>
 #include <math.h>
 #include <stddef.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <limits.h>
+#include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif /* if defined(__x86_64__) || defined(__i386__) */
+#ifdef PROMETHEUS_HAVE_ZLIB
+#include <zlib.h>
+#endif /* ifdef PROMETHEUS_HAVE_ZLIB */
+#ifdef PROMETHEUS_HAVE_ZSTD
+#include <zstd.h>
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
 #include "prometheus-c.h"
 
 #define PUBLIC __attribute__((visibility("default")))
 
+/*
+ * Hot loops built once per x86 feature level, with the best clone the
+ * CPU supports resolved when the library is loaded, so the vector units
+ * are used without building the whole library for a newer target.
+ */
+
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define PROMETHEUS_TARGET_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#endif /* if __has_attribute(target_clones) */
+#endif /* if defined(__x86_64__) && defined(__has_attribute) */
+
+#ifndef PROMETHEUS_TARGET_CLONES
+#define PROMETHEUS_TARGET_CLONES
+#endif /* ifndef PROMETHEUS_TARGET_CLONES */
+
 #define container_of(ptr, type, member) \
         ((type *) ((char *) (ptr) - offsetof(type, member)))
 
@@ -50,28 +88,97 @@
 #define list_foreach(head, cur) \
         for (cur = head; cur; cur = cur->next)
 
+/*
+ * A rollup view emits the series of a metric summed over the labels it
+ * drops.  The dropped names are interned, so they compare by pointer
+ * with series label names.  A view replacing the raw series is emitted
+ * in the family of its metric, any other in a family of its own named
+ * <name>:sum_without_<labels>, so that it is not summed with them.
+ */
+
+struct prometheus_rollup {
+    char                          **drop;
+    int                             num_drop;
+    struct prometheus_metric_base  *family;
+    struct prometheus_rollup       *prev;
+    struct prometheus_rollup       *next;
+};
+
+/*
+ * Fragments are pieces of exposition text rendered once when the
+ * metric or series is created, which scrapes copy or reference as is.
+ */
+
+struct prometheus_fragment {
+    char *text;
+    int   len;
+};
+
 struct prometheus_metric_base {
-    char *name;
-    char *help;
-    char  type[16];
+    struct prometheus_metrics      *metrics;
+    char                           *name;
+    int                             name_len;
+    struct prometheus_fragment      header;
+    char                           *help;
+    char                            type[16];
+    uint64_t                        segment_offset;
+    char                          **label_names;
+    int                             label_count;
+    struct prometheus_series_base **vec;
+    uint64_t                        vec_mask;
+    uint64_t                        vec_count;
+    struct prometheus_rollup       *rollups;
+    int                             rollup_replace;
 };
 
 struct prometheus_series_base {
-    char **label_names;
-    char **label_values;
-    int    label_count;
+    struct prometheus_metrics     *metrics;
+    char                         **label_names;
+    char                         **label_values;
+    int                            label_count;
+    int                            shared_names;
+    struct prometheus_fragment     labels;
+    uint64_t                       segment_offset;
+    struct prometheus_series_base *vec_next;
+    uint64_t                       vec_hash;
+};
+
+/*
+ * A sliding window holds the cumulative totals of a series as of each
+ * of the last aggregator passes, so that rates and averages over the
+ * window are the difference between its newest and oldest slots.
+ * Windows live in the series allocation and are protected by the
+ * series lock.
+ */
+
+struct prometheus_window {
+    int       slots;
+    int       used;
+    int       head;
+    uint64_t *time_ns;
+    uint64_t *value;
+    uint64_t *sum;
 };
 
 struct prometheus_counter_handle {
-    struct prometheus_counter_instance counter;
-    struct prometheus_counter_handle  *prev;
-    struct prometheus_counter_handle  *next;
+    struct prometheus_counter_instance  counter;
+    struct prometheus_counter_instance *instance;
+    struct prometheus_counter_handle   *prev;
+    struct prometheus_counter_handle   *next;
+    struct prometheus_handle_block     *block;
 } __attribute__((aligned(64)));
 
 struct prometheus_counter_series {
     struct prometheus_series_base     base;
     pthread_mutex_t                   lock;
     uint64_t                          saved;
+    uint64_t                          snapshot_seq;
+    uint64_t                          snapshot[2];
+    uint64_t                          pushed_value;
+    uint64_t                          pending_value;
+    int                               pushed;
+    int                               pending;
+    struct prometheus_window          window;
     struct prometheus_counter_handle *head;
     struct prometheus_counter_series *prev;
     struct prometheus_counter_series *next;
@@ -82,20 +189,31 @@ struct prometheus_counter {
     struct prometheus_metric_base     base;
     pthread_mutex_t                   lock;
     struct prometheus_counter_series *series;
+    int                               num_series;
+    int                               window_slots;
+    struct prometheus_counter        *peer;
     struct prometheus_counter        *prev;
     struct prometheus_counter        *next;
 };
 
 struct prometheus_gauge_handle {
-    struct prometheus_gauge_instance gauge;
-    struct prometheus_gauge_handle  *prev;
-    struct prometheus_gauge_handle  *next;
+    struct prometheus_gauge_instance  gauge;
+    struct prometheus_gauge_instance *instance;
+    struct prometheus_gauge_handle   *prev;
+    struct prometheus_gauge_handle   *next;
+    struct prometheus_handle_block   *block;
 } __attribute__((aligned(64)));
 
 struct prometheus_gauge_series {
     struct prometheus_series_base   base;
     pthread_mutex_t                 lock;
     uint64_t                        saved;
+    uint64_t                        snapshot_seq;
+    uint64_t                        snapshot[2];
+    uint64_t                        pushed_value;
+    uint64_t                        pending_value;
+    int                             pushed;
+    int                             pending;
     struct prometheus_gauge_handle *head;
     struct prometheus_gauge_series *prev;
     struct prometheus_gauge_series *next;
@@ -105,14 +223,18 @@ struct prometheus_gauge {
     struct prometheus_metric_base   base;
     pthread_mutex_t                 lock;
     struct prometheus_gauge_series *series;
+    int                             num_series;
+    struct prometheus_gauge        *peer;
     struct prometheus_gauge        *prev;
     struct prometheus_gauge        *next;
 };
 
 struct prometheus_histogram_handle {
-    struct prometheus_histogram_instance histogram;
-    struct prometheus_histogram_handle  *prev;
-    struct prometheus_histogram_handle  *next;
+    struct prometheus_histogram_instance  histogram;
+    struct prometheus_histogram_instance *instance;
+    struct prometheus_histogram_handle   *prev;
+    struct prometheus_histogram_handle   *next;
+    struct prometheus_handle_block       *block;
 } __attribute__((aligned(64)));
 
 struct prometheus_histogram_series {
@@ -122,7 +244,24 @@ struct prometheus_histogram_series {
     uint64_t                           *saved;
     uint64_t                            saved_sum;
     uint64_t                            saved_count;
+    uint64_t                            saved_min;
+    uint64_t                            saved_max;
+    uint64_t                            window_min;
+    uint64_t                            window_max;
+    uint64_t                            snapshot_seq;
+    uint64_t                           *snapshot_buckets[2];
+    uint64_t                            snapshot_sum[2];
+    uint64_t                            snapshot_count[2];
+    uint64_t                            pushed_sum;
+    uint64_t                            pushed_count;
+    uint64_t                            pending_sum;
+    uint64_t                            pending_count;
+    int                                 pushed;
+    int                                 pending;
     enum prometheus_histogram_type type;
+    uint32_t                            sample_every;
+    uint32_t                            min_max;
+    struct prometheus_window            window;
     uint64_t                            num_buckets;
     uint64_t                            start;
     uint64_t                            increment;
@@ -135,22 +274,490 @@ struct prometheus_histogram {
     struct prometheus_metric_base       base;
     pthread_mutex_t                     lock;
     struct prometheus_histogram_series *series;
+    int                                 num_series;
     struct prometheus_histogram        *prev;
     struct prometheus_histogram        *next;
     enum prometheus_histogram_type type;
+    uint32_t                            sample_every;
+    int                                 min_max;
+    int                                 window_slots;
+    struct prometheus_histogram        *peer;
+    struct prometheus_fragment         *le;
     uint64_t                            count;
     uint64_t                            start;
     uint64_t                            increment;
 };
 
-struct prometheus_metrics {
-    struct prometheus_counter   *counters;
-    struct prometheus_gauge     *gauges;
-    struct prometheus_histogram *histograms;
-    char                       **label_names;
-    char                       **label_values;
-    int                          label_count;
+/*
+ * Compressed scrapes render into a small staging buffer which is
+ * fed to the compressor whenever it fills, so the uncompressed
+ * exposition never exists in full.  The staging buffer and the
+ * compressor contexts are kept across scrapes and are protected
+ * by metrics->lock.
+ */
+
+#define PROMETHEUS_STAGING_SIZE (64 * 1024)
+#define PROMETHEUS_GZIP_LEVEL   1
+#define PROMETHEUS_ZSTD_LEVEL   1
+
+struct prometheus_compressor {
+    char                    *staging;
+    enum prometheus_encoding encoding;
+    char                    *out;
+    int                      out_size;
+    int                      out_length;
+    int                      grow;
+#ifdef PROMETHEUS_HAVE_ZLIB
+    z_stream                 zstream;
+    int                      zstream_ready;
+#endif /* ifdef PROMETHEUS_HAVE_ZLIB */
+#ifdef PROMETHEUS_HAVE_ZSTD
+    ZSTD_CCtx               *zstd;
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
+};
+
+/*
+ * A rendered scrape shared between concurrent scrapers.  The cache
+ * holds one reference to the latest result for each encoding and
+ * each caller of prometheus_metrics_scrape_cached() holds another
+ * until it calls prometheus_scrape_result_release().
+ */
+
+struct prometheus_scrape_result {
+    int      refcnt;
+    int      length;
+    int      size;
+    uint64_t timestamp;
+    char    *data;
+};
+
+struct prometheus_scrape_cache {
+    pthread_mutex_t                  lock;
+    pthread_cond_t                   cond;
+    uint64_t                         interval_ns;
+    struct prometheus_scrape_result *result[PROMETHEUS_ENCODING_ZSTD + 1];
+    int                              rendering[PROMETHEUS_ENCODING_ZSTD + 1];
+    int                              waiters[PROMETHEUS_ENCODING_ZSTD + 1];
+};
+
+struct prometheus_scrape_pool;
+
+struct prometheus_aggregator {
+    pthread_t                    thread;
     pthread_mutex_t              lock;
+    pthread_cond_t               cond;
+    uint64_t                     interval_ns;
+    int                          nice;
+    int                          started;
+    int                          running;
+    int                          stop;
+    struct prometheus_counter   *counter_cursor;
+    struct prometheus_gauge     *gauge_cursor;
+    struct prometheus_histogram *histogram_cursor;
+};
+
+struct prometheus_self_metrics {
+    int                                   enabled;
+    int64_t                               series;
+    int64_t                               handles;
+    int64_t                               allocated_bytes;
+    struct prometheus_histogram_instance *scrape_duration;
+    struct prometheus_counter_instance   *scrapes;
+    struct prometheus_counter_instance   *scrape_bytes;
+    struct prometheus_counter_instance   *lock_wait;
+    struct prometheus_gauge_instance     *series_gauge;
+    struct prometheus_gauge_instance     *handles_gauge;
+    struct prometheus_gauge_instance     *allocated_gauge;
+};
+
+/*
+ * Scratch buffers for remote-write encoding, reused across pushes and
+ * protected by metrics->lock.
+ */
+
+struct prometheus_remote_write {
+    char *protobuf;
+    int   protobuf_size;
+    char *compressed;
+    int   compressed_size;
+    int   staged;
+};
+
+enum prometheus_metric_type {
+    PROMETHEUS_METRIC_COUNTER,
+    PROMETHEUS_METRIC_GAUGE,
+    PROMETHEUS_METRIC_HISTOGRAM,
+};
+
+/*
+ * Shared memory segment layout.  The segment starts with a header and
+ * is followed by a sequence of 64 byte aligned records, each beginning
+ * with a prometheus_segment_record.  Records are only ever appended, up
+ * to header->used, except that freed handle records are recycled for
+ * new handles of the same length.  A record's payload is valid once its
+ * state is LIVE.  The generation is odd while a handle is being folded
+ * into its series so that readers can retry rather than count it twice.
+ */
+
+#define PROMETHEUS_SEGMENT_MAGIC   "PROMSEG"
+#define PROMETHEUS_SEGMENT_VERSION 2
+#define PROMETHEUS_SEGMENT_ALIGN   64
+
+enum prometheus_segment_kind {
+    PROMETHEUS_SEGMENT_LABELS = 1,
+    PROMETHEUS_SEGMENT_METRIC,
+    PROMETHEUS_SEGMENT_SERIES,
+    PROMETHEUS_SEGMENT_HANDLE,
+};
+
+enum prometheus_segment_state {
+    PROMETHEUS_SEGMENT_PENDING,
+    PROMETHEUS_SEGMENT_LIVE,
+    PROMETHEUS_SEGMENT_DEAD,
+    PROMETHEUS_SEGMENT_FREE,
+};
+
+struct prometheus_segment_header {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        record_offset;
+    uint64_t        size;
+    uint64_t        used;
+    uint64_t        generation;
+    uint64_t        free_list;
+    pthread_mutex_t lock;
+};
+
+struct prometheus_segment_record {
+    uint32_t length;
+    uint16_t kind;
+    uint16_t state;
+    uint32_t owner;
+    uint32_t reserved;
+    uint64_t parent;
+    uint64_t next_free;
+};
+
+/* Global labels, as label_count "name\0value\0" pairs */
+struct prometheus_segment_labels {
+    uint32_t label_count;
+    uint32_t reserved;
+    char     strings[];
+};
+
+/* Metric, followed by "name\0help\0" */
+struct prometheus_segment_metric {
+    uint32_t type;
+    uint32_t histogram_type;
+    uint64_t num_buckets;
+    uint64_t start;
+    uint64_t increment;
+    uint64_t sample_every;
+    char     strings[];
+};
+
+/*
+ * Series, holding the totals folded in from destroyed handles.  The
+ * saved bucket totals are followed by label_count "name\0value\0" pairs.
+ */
+struct prometheus_segment_series {
+    uint64_t saved;
+    uint64_t saved_count;
+    uint32_t num_buckets;
+    uint32_t label_count;
+    uint64_t buckets[];
+};
+
+/*
+ * Handle, with the live values at the given offsets from the start of
+ * the record: the counter or gauge value, or the histogram sum followed
+ * by the count, and the histogram buckets.  The list links of a handle
+ * are process local, so they are kept in a private handle whose address
+ * is recorded here for the owner and any children forked after it.
+ */
+struct prometheus_segment_handle {
+    uint64_t value_offset;
+    uint64_t buckets_offset;
+    uint64_t local;
+};
+
+#define PROMETHEUS_SEGMENT_HANDLE_OFFSET 64
+
+struct prometheus_segment {
+    struct prometheus_segment_header *header;
+    uint64_t                          size;
+    int                               detaching;
+};
+
+/*
+ * Checkpoints of counter and histogram totals.  Checkpoints alternate
+ * between two files, <path>.0 and <path>.1, each holding a header and
+ * a sequence of entries keyed by the metric name and series labels.
+ * The CRC covers the header and the entries, so a torn or corrupt file
+ * is ignored and the other, older, checkpoint is used instead.  Values
+ * are stored in host byte order.
+ */
+
+#define PROMETHEUS_CHECKPOINT_MAGIC   "PROMCKP"
+#define PROMETHEUS_CHECKPOINT_VERSION 1
+
+struct prometheus_checkpoint_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t crc;
+    uint64_t sequence;
+    uint64_t timestamp;
+    uint64_t length;
+    uint64_t num_entries;
+};
+
+/* Entry, followed by key_len bytes of "name\0" and label pairs, then num_values uint64_t */
+struct prometheus_checkpoint_entry {
+    uint32_t type;
+    uint32_t num_values;
+    uint32_t key_len;
+    uint32_t reserved;
+};
+
+struct prometheus_checkpoint_slot {
+    const char *key;
+    uint32_t    key_len;
+    uint32_t    type;
+    uint32_t    num_values;
+    int         applied;
+    const char *values;
+};
+
+struct prometheus_checkpoint {
+    pthread_mutex_t                    lock;
+    char                              *path;
+    uint64_t                           interval_ns;
+    uint64_t                           last_ns;
+    uint64_t                           sequence;
+    char                              *restored;
+    struct prometheus_checkpoint_slot *slots;
+    uint64_t                           slot_mask;
+};
+
+static struct prometheus_metrics *
+prometheus_segment_snapshot(struct prometheus_segment *segment);
+
+/*
+ * Interned strings.  Metric names, help text and label names and values
+ * are stored once per metrics context and reference counted, so series
+ * sharing a label name or value share one copy, and strings interned in
+ * the same context are equal exactly when their pointers are.
+ */
+
+struct prometheus_string {
+    struct prometheus_string *next;
+    uint64_t                  hash;
+    uint32_t                  refcnt;
+    uint32_t                  length;
+    char                      str[];
+};
+
+struct prometheus_string_table {
+    pthread_mutex_t            lock;
+    struct prometheus_string **buckets;
+    uint64_t                   mask;
+    uint64_t                   count;
+};
+
+/*
+ * Every metric of a registry is also listed in an array sorted by name,
+ * so that filtered scrapes find the metrics they render by binary search.
+ * Entries are protected by metrics->lock.
+ */
+
+struct prometheus_metric_index {
+    const char                 *name;
+    enum prometheus_metric_type type;
+    void                       *metric;
+    uint64_t                    filter_gen;
+};
+
+/*
+ * A label matcher of a filtered scrape resolved against the strings of
+ * one registry, so that series labels are matched by pointer.  A name
+ * or value the registry has never interned is NULL and matches no
+ * series.  context records whether the registry's own label satisfies
+ * the matcher for series that lack the label.
+ */
+
+struct prometheus_filter_label {
+    const char *name;
+    const char *value;
+    int         context;
+};
+
+/*
+ * A name is rendered as one family across a tree of registries, so it
+ * may only be used with one type anywhere in the tree.  The root keeps
+ * the type of every name in use in its tree, with the number of metrics
+ * using it, sorted by name under a lock of its own.
+ */
+
+struct prometheus_metric_name {
+    char                       *name;
+    enum prometheus_metric_type type;
+    int                         refs;
+};
+
+struct prometheus_metrics {
+    struct prometheus_counter      *counters;
+    struct prometheus_gauge        *gauges;
+    struct prometheus_histogram    *histograms;
+    char                          **label_names;
+    char                          **label_values;
+    int                             label_count;
+    pthread_mutex_t                 lock;
+    struct prometheus_compressor    compressor;
+    struct prometheus_scrape_cache  cache;
+    struct prometheus_aggregator    aggregator;
+    struct prometheus_scrape_pool  *pool;
+    struct prometheus_self_metrics  self;
+    struct prometheus_remote_write  remote_write;
+    struct prometheus_segment      *segment;
+    struct prometheus_checkpoint    checkpoint;
+    struct prometheus_string_table  strings;
+    struct prometheus_metric_index *index;
+    int                             index_count;
+    int                             index_size;
+    uint64_t                        filter_gen;
+    struct prometheus_filter_label *filter_labels;
+    pthread_mutex_t                 names_lock;
+    struct prometheus_metric_name  *names;
+    int                             names_count;
+    int                             names_size;
+    struct prometheus_metrics      *parent;
+    struct prometheus_metrics      *children;
+    struct prometheus_metrics      *prev;
+    struct prometheus_metrics      *next;
+};
+
+/*
+ * Output cursor used while rendering a scrape.  When the window
+ * [bp, end) runs out of room, flush() is asked to make at least
+ * 'need' bytes available, or the write fails and error is set.
+ * A NULL flush means the window is the caller's fixed buffer.
+ */
+
+struct prometheus_iov_sink;
+struct prometheus_encoder;
+
+struct prometheus_writer {
+    char                            *bp;
+    char                            *end;
+    char                            *base;
+    int                              (*flush)(
+        struct prometheus_writer *writer,
+        int                       need);
+    int                              (*direct)(
+        struct prometheus_writer *writer,
+        const char               *str,
+        int                       len);
+    void                            *private_data;
+    struct prometheus_iov_sink      *sink;
+    const struct prometheus_encoder *encoder;
+    int                              families;
+    int                              samples;
+    int                              error;
+};
+
+/*
+ * Encoders lay out the families and samples produced by the render
+ * walk in an output format.  The walk takes care of locking,
+ * aggregation, filtering, rollups and the merging of families across
+ * a tree, and calls the encoder once per family and once per sample.
+ * A sample is passed with its value, so a format that cannot represent
+ * a value, such as NaN, can leave the sample out.  The writer counts
+ * the families and the samples of the current family for formats
+ * that need separators.  The help text of companion families, such as
+ * the _rate of a counter, is formatted into PROMETHEUS_HELP_SIZE bytes.
+ */
+
+#define PROMETHEUS_HELP_SIZE 512
+
+struct prometheus_encoder {
+    void (*begin)(
+        struct prometheus_writer *writer);
+    void (*family)(
+        struct prometheus_writer      *writer,
+        struct prometheus_metric_base *base,
+        const char                    *suffix,
+        const char                    *type,
+        const char                    *help);
+    void (*family_end)(
+        struct prometheus_writer *writer);
+    void (*sample_u64)(
+        struct prometheus_writer      *writer,
+        struct prometheus_metric_base *base,
+        const char                    *suffix,
+        struct prometheus_series_base *series,
+        uint64_t                       value);
+    void (*sample_i64)(
+        struct prometheus_writer      *writer,
+        struct prometheus_metric_base *base,
+        const char                    *suffix,
+        struct prometheus_series_base *series,
+        int64_t                        value);
+    void (*sample_double)(
+        struct prometheus_writer      *writer,
+        struct prometheus_metric_base *base,
+        const char                    *suffix,
+        struct prometheus_series_base *series,
+        double                         value);
+    void (*histogram)(
+        struct prometheus_writer      *writer,
+        struct prometheus_metric_base *base,
+        struct prometheus_histogram   *histogram,
+        struct prometheus_series_base *series,
+        const uint64_t                *buckets,
+        uint64_t                       sum,
+        uint64_t                       count);
+    void (*end)(
+        struct prometheus_writer *writer);
+};
+
+/*
+ * Scatter/gather scrapes hand the exposition to a callback as iovecs.
+ * Fragments are referenced in place, and only text rendered during the
+ * scrape, mostly sample values, is written to the arena.  Both are
+ * handed off whenever the arena or the iovec array fills, and always
+ * while the scrape still holds the locks that keep the fragments alive.
+ * Fragments shorter than PROMETHEUS_IOV_MIN_REF are cheaper to copy
+ * into the arena than to give an iovec of their own.
+ */
+
+#define PROMETHEUS_IOV_MAX        1024
+#define PROMETHEUS_IOV_ARENA_SIZE (16 * 1024)
+#define PROMETHEUS_IOV_MIN_REF    32
+
+struct prometheus_iov_sink {
+    prometheus_scrape_iov_callback callback;
+    void                          *private_data;
+    char                          *mark;
+    int                            iovcnt;
+    int                            length;
+    struct iovec                   iov[PROMETHEUS_IOV_MAX];
+    char                           arena[PROMETHEUS_IOV_ARENA_SIZE];
+};
+
+/*
+ * Filtered scrapes render the metrics whose names are listed exactly or
+ * start with one of the prefixes, or every metric if there are neither,
+ * and within those only the series matching all of the label matchers.
+ */
+
+struct prometheus_scrape_filter {
+    char **names;
+    int    num_names;
+    char **prefixes;
+    int    num_prefixes;
+    char **label_names;
+    char **label_values;
+    int    num_labels;
 };
 
 static inline int
@@ -219,575 +826,8555 @@ prometheus_strdup(const char *str)
     return ptr;
 } /* prometheus_strdup */
 
-PUBLIC struct prometheus_metrics *
-prometheus_metrics_create(
-    char **label_names,
-    char **label_values,
-    int    label_count)
+static inline uint64_t
+prometheus_now_ns(void)
 {
-    struct prometheus_metrics *metrics;
+    struct timespec ts;
 
-    metrics = prometheus_calloc(1, sizeof(*metrics));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    metrics->label_count  = label_count;
-    metrics->label_names  = prometheus_calloc(label_count, sizeof(char *));
-    metrics->label_values = prometheus_calloc(label_count, sizeof(char *));
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+} /* prometheus_now_ns */
 
-    for (int i = 0; i < label_count; i++) {
-        metrics->label_names[i]  = prometheus_strdup(label_names[i]);
-        metrics->label_values[i] = prometheus_strdup(label_values[i]);
-    }
+/*
+ * Until calibration, or where no usable cycle counter exists, ticks are
+ * nanoseconds and only need scaling between units.
+ */
 
-    pthread_mutex_init(&metrics->lock, NULL);
+PUBLIC struct prometheus_clock prometheus_clock = {
+    .cycles = 0,
+    .mult   = {
+        UINT64_C(1) << PROMETHEUS_CLOCK_SHIFT,
+        (UINT64_C(1) << PROMETHEUS_CLOCK_SHIFT) / 1000,
+        (UINT64_C(1) << PROMETHEUS_CLOCK_SHIFT) / 1000000,
+    },
+};
 
-    return metrics;
-} /* prometheus_metrics_create */
+static pthread_once_t prometheus_clock_once = PTHREAD_ONCE_INIT;
 
 static void
-prometheus_metric_base_destroy(struct prometheus_metric_base *base)
+prometheus_clock_calibrate(void)
 {
-    free(base->name);
-    free(base->help);
-} /* prometheus_metric_base_destroy */
+    double ns_per_tick;
+    int    unit;
 
-static void
-prometheus_series_base_destroy(struct prometheus_series_base *base)
-{
-    int i;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    uint64_t     start_ns, end_ns, start_ticks, end_ticks;
 
-    for (i = 0; i < base->label_count; i++) {
-        free(base->label_names[i]);
-        free(base->label_values[i]);
+    /* Only an invariant TSC ticks at a constant rate across frequency changes */
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+        return;
     }
 
-    free(base->label_names);
-    free(base->label_values);
-} /* prometheus_series_base_destroy */
+    start_ns    = prometheus_now_ns();
+    start_ticks = __builtin_ia32_rdtsc();
+
+    do {
+        end_ns    = prometheus_now_ns();
+        end_ticks = __builtin_ia32_rdtsc();
+    } while (end_ns - start_ns < 2000000);
+
+    ns_per_tick = (double) (end_ns - start_ns) / (end_ticks - start_ticks);
+#elif defined(__aarch64__)
+    uint64_t freq;
+
+    __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r" (freq));
+
+    if (!freq) {
+        return;
+    }
+
+    ns_per_tick = 1e9 / freq;
+#else  /* if defined(__x86_64__) || defined(__i386__) */
+    return;
+#endif /* if defined(__x86_64__) || defined(__i386__) */
+
+    for (unit = 0; unit < PROMETHEUS_TIME_NUM_UNITS; unit++) {
+        prometheus_clock.mult[unit] = ns_per_tick * (UINT64_C(1) << PROMETHEUS_CLOCK_SHIFT) / pow(1000, unit);
+    }
+
+    prometheus_clock.cycles = 1;
+} /* prometheus_clock_calibrate */
 
+/*
+ * Bookkeeping for the optional self metrics.  The totals are kept as
+ * plain atomics at all times so that they are correct whenever self
+ * metrics are enabled, and are copied into the exported gauges at
+ * scrape time.
+ */
 
 static inline void
-prometheus_metric_base_init(
-    struct prometheus_metric_base *base,
-    const char                    *name,
-    const char                    *help,
-    const char                    *type)
+prometheus_self_account(
+    struct prometheus_metrics *metrics,
+    int64_t                    series,
+    int64_t                    handles,
+    int64_t                    bytes)
 {
-    base->name = prometheus_strdup(name);
-    base->help = prometheus_strdup(help);
-    snprintf(base->type, sizeof(base->type), "%s", type);
-} /* prometheus_metric_base_init */
+    __atomic_add_fetch(&metrics->self.series, series, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->self.handles, handles, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->self.allocated_bytes, bytes, __ATOMIC_RELAXED);
+} /* prometheus_self_account */
+
+/*
+ * Strings are interned and accounted for by the string table.  Series
+ * of a metric with a declared label schema share its label name array.
+ */
+
+static inline int64_t
+prometheus_series_labels_size(
+    struct prometheus_metric_base *metric,
+    int                            num_labels)
+{
+    return (metric->label_names ? 1 : 2) * num_labels * sizeof(char *);
+} /* prometheus_series_labels_size */
 
-static inline void
-prometheus_series_base_init(
-    struct prometheus_series_base *base,
-    int                            num_labels,
-    const char                   **label_names,
-    const char                   **label_values)
+static inline int64_t
+prometheus_series_base_size(struct prometheus_series_base *base)
 {
-    base->label_count  = num_labels;
-    base->label_names  = prometheus_calloc(num_labels, sizeof(char *));
-    base->label_values = prometheus_calloc(num_labels, sizeof(char *));
+    return (base->shared_names ? 1 : 2) * base->label_count * sizeof(char *);
+} /* prometheus_series_base_size */
 
-    for (int i = 0; i < num_labels; i++) {
-        base->label_names[i]  = prometheus_strdup(label_names[i]);
-        base->label_values[i] = prometheus_strdup(label_values[i]);
+static inline uint64_t
+prometheus_string_hash(
+    const char *str,
+    uint32_t   *length)
+{
+    uint64_t hash = 14695981039346656037UL;
+
+    for (*length = 0; str[*length]; (*length)++) {
+        hash = (hash ^ (uint8_t) str[*length]) * 1099511628211UL;
     }
-} /* prometheus_series_base_init */
 
-static inline char *
-prometheus_metrics_emit_base(
-    char                          *bp,
-    struct prometheus_metric_base *base)
-{
-    bp += sprintf(bp, "# HELP %s %s\n", base->name, base->help);
-    bp += sprintf(bp, "# TYPE %s %s\n", base->name, base->type);
+    return hash;
+} /* prometheus_string_hash */
 
-    return bp;
-} /* prometheus_metrics_emit_base */
+/*
+ * Look up or add a string in the intern table and take a reference to
+ * it.  The table doubles in size when its load factor exceeds one.
+ */
 
-static inline char *
-prometheus_metrics_emit_series_base(
-    char                          *bp,
-    struct prometheus_metrics     *metrics,
-    const char                    *metric_suffix,
-    struct prometheus_metric_base *metric_base,
-    struct prometheus_series_base *series_base,
-    const char                    *label_name,
-    const char                    *label_value)
+static char *
+prometheus_string_intern(
+    struct prometheus_metrics *metrics,
+    const char                *str)
 {
-    int i;
+    struct prometheus_string_table *table = &metrics->strings;
+    struct prometheus_string       *string, *next, **buckets;
+    uint64_t                        hash, i;
+    uint32_t                        length;
 
-    bp += sprintf(bp, "%s%s{", metric_base->name, metric_suffix);
+    hash = prometheus_string_hash(str, &length);
 
-    for (i = 0; i < metrics->label_count; i++) {
-        bp += sprintf(bp, "%s=\"%s\",", metrics->label_names[i], metrics->label_values[i]);
-    }
+    pthread_mutex_lock(&table->lock);
 
-    for (i = 0; i < series_base->label_count; i++) {
-        bp += sprintf(bp, "%s=\"%s\",", series_base->label_names[i], series_base->label_values[i]);
+    for (string = table->buckets[hash & table->mask]; string; string = string->next) {
+        if (string->hash == hash && string->length == length && memcmp(string->str, str, length) == 0) {
+            string->refcnt++;
+            pthread_mutex_unlock(&table->lock);
+            return string->str;
+        }
     }
 
-    if (label_name && label_value) {
-        bp += sprintf(bp, "%s=\"%s\",", label_name, label_value);
-    }
+    if (table->count > table->mask) {
+        buckets = prometheus_calloc(2 * (table->mask + 1), sizeof(*buckets));
+
+        for (i = 0; i <= table->mask; i++) {
+            for (string = table->buckets[i]; string; string = next) {
+                next                                           = string->next;
+                string->next                                   = buckets[string->hash & (2 * table->mask + 1)];
+                buckets[string->hash & (2 * table->mask + 1)] = string;
+            }
+        }
+
+        prometheus_self_account(metrics, 0, 0, (table->mask + 1) * sizeof(*buckets));
 
-    if (*(bp - 1) == ',') {
-        bp--;
-        *bp = '\0';
+        free(table->buckets);
+
+        table->buckets = buckets;
+        table->mask    = 2 * table->mask + 1;
     }
 
-    bp += sprintf(bp, "} ");
+    string         = prometheus_calloc(1, sizeof(*string) + length + 1);
+    string->hash   = hash;
+    string->refcnt = 1;
+    string->length = length;
+    memcpy(string->str, str, length);
 
-    return bp;
-} /* prometheus_metrics_emit_series_base */
+    string->next                       = table->buckets[hash & table->mask];
+    table->buckets[hash & table->mask] = string;
+    table->count++;
 
-PUBLIC int
-prometheus_metrics_scrape(
+    pthread_mutex_unlock(&table->lock);
+
+    prometheus_self_account(metrics, 0, 0, sizeof(*string) + length + 1);
+
+    return string->str;
+} /* prometheus_string_intern */
+
+/*
+ * Find the interned copy of a string without taking a reference, for
+ * callers that hold a lock keeping its users alive.  Returns NULL if
+ * the string is not interned.
+ */
+
+static const char *
+prometheus_string_lookup(
     struct prometheus_metrics *metrics,
-    char                      *buffer,
-    int                        buffer_size)
+    const char                *str)
 {
-    struct prometheus_counter          *counter;
-    struct prometheus_counter_series   *counter_series;
-    struct prometheus_counter_handle   *counter_hdl;
-    struct prometheus_gauge            *gauge;
-    struct prometheus_gauge_series     *gauge_series;
-    struct prometheus_gauge_handle     *gauge_hdl;
-    struct prometheus_histogram        *histogram;
-    struct prometheus_histogram_series *histogram_series;
-    struct prometheus_histogram_handle *histogram_hdl;
-    char                                bucket_threshold[64];
-    uint64_t                            value, sum, total;
-    int                                 i;
-    char                               *bp = buffer;
+    struct prometheus_string_table *table = &metrics->strings;
+    struct prometheus_string       *string;
+    uint64_t                        hash;
+    uint32_t                        length;
 
-    *bp = '\0';
+    hash = prometheus_string_hash(str, &length);
 
-    if (!metrics || !buffer || !buffer_size) {
-        return -1;
+    pthread_mutex_lock(&table->lock);
+
+    for (string = table->buckets[hash & table->mask]; string; string = string->next) {
+        if (string->hash == hash && string->length == length && memcmp(string->str, str, length) == 0) {
+            break;
+        }
     }
 
+    pthread_mutex_unlock(&table->lock);
 
-    pthread_mutex_lock(&metrics->lock);
+    return string ? string->str : NULL;
+} /* prometheus_string_lookup */
 
-    list_foreach(metrics->counters, counter)
-    {
+static void
+prometheus_string_release(
+    struct prometheus_metrics *metrics,
+    char                      *str)
+{
+    struct prometheus_string_table *table  = &metrics->strings;
+    struct prometheus_string       *string = container_of(str, struct prometheus_string, str);
+    struct prometheus_string      **link;
 
-        pthread_mutex_lock(&counter->lock);
+    pthread_mutex_lock(&table->lock);
 
-        bp = prometheus_metrics_emit_base(bp, &counter->base);
+    if (--string->refcnt) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
 
-        list_foreach(counter->series, counter_series)
-        {
-            pthread_mutex_lock(&counter_series->lock);
+    for (link = &table->buckets[string->hash & table->mask]; *link != string; link = &(*link)->next) {
+    }
 
-            value = counter_series->saved;
+    *link = string->next;
+    table->count--;
 
-            list_foreach(counter_series->head, counter_hdl)
-            {
-                value += counter_hdl->counter.value;
+    pthread_mutex_unlock(&table->lock);
 
-            }
+    prometheus_self_account(metrics, 0, 0, -(int64_t) (sizeof(*string) + string->length + 1));
 
-            bp = prometheus_metrics_emit_series_base(bp, metrics, "",
-                                                     &counter->base, &counter_series->base, NULL, NULL);
+    free(string);
+} /* prometheus_string_release */
 
-            bp += sprintf(bp, "%lu\n", value);
+/* Interned strings carry their length, so it is not rescanned */
 
-            pthread_mutex_unlock(&counter_series->lock);
-        }
+static inline int
+prometheus_string_length(const char *str)
+{
+    return container_of(str, struct prometheus_string, str)->length;
+} /* prometheus_string_length */
 
-        *bp++ = '\n';
-        *bp   = '\0';
+/*
+ * Acquire a lock on behalf of a scrape, charging any time spent
+ * blocked to the lock wait self metric.  The uncontended case costs
+ * only a trylock.
+ */
 
-        pthread_mutex_unlock(&counter->lock);
+static inline void
+prometheus_scrape_lock(
+    struct prometheus_metrics *metrics,
+    pthread_mutex_t           *lock)
+{
+    uint64_t start;
+
+    if (pthread_mutex_trylock(lock) == 0) {
+        return;
     }
 
-    list_foreach(metrics->gauges, gauge)
-    {
-        pthread_mutex_lock(&gauge->lock);
+    start = prometheus_now_ns();
 
-        bp = prometheus_metrics_emit_base(bp, &gauge->base);
+    pthread_mutex_lock(lock);
 
-        list_foreach(gauge->series, gauge_series)
-        {
-            pthread_mutex_lock(&gauge_series->lock);
+    if (metrics->self.lock_wait) {
+        __atomic_add_fetch(&metrics->self.lock_wait->value, prometheus_now_ns() - start, __ATOMIC_RELAXED);
+    }
+} /* prometheus_scrape_lock */
 
-            value = gauge_series->saved;
+PUBLIC struct prometheus_metrics *
+prometheus_metrics_create(
+    char **label_names,
+    char **label_values,
+    int    label_count)
+{
+    struct prometheus_metrics *metrics;
+    pthread_condattr_t         condattr;
 
-            list_foreach(gauge_series->head, gauge_hdl)
-            {
-                value += gauge_hdl->gauge.value;
-            }
+    pthread_once(&prometheus_clock_once, prometheus_clock_calibrate);
 
-            bp = prometheus_metrics_emit_series_base(bp, metrics, "",
-                                                     &gauge->base, &gauge_series->base, NULL, NULL);
+    metrics = prometheus_calloc(1, sizeof(*metrics));
 
-            bp += sprintf(bp, "%lu\n", value);
+    metrics->label_count  = label_count;
+    metrics->label_names  = prometheus_calloc(label_count, sizeof(char *));
+    metrics->label_values = prometheus_calloc(label_count, sizeof(char *));
 
-            pthread_mutex_unlock(&gauge_series->lock);
+    for (int i = 0; i < label_count; i++) {
+        metrics->label_names[i]  = prometheus_strdup(label_names[i]);
+        metrics->label_values[i] = prometheus_strdup(label_values[i]);
+    }
 
-        }
+    pthread_mutex_init(&metrics->lock, NULL);
+    pthread_mutex_init(&metrics->cache.lock, NULL);
+    pthread_cond_init(&metrics->cache.cond, NULL);
+    pthread_mutex_init(&metrics->aggregator.lock, NULL);
+    pthread_mutex_init(&metrics->checkpoint.lock, NULL);
+    pthread_mutex_init(&metrics->names_lock, NULL);
 
-        pthread_mutex_unlock(&gauge->lock);
-    }
+    pthread_mutex_init(&metrics->strings.lock, NULL);
+    metrics->strings.mask    = 255;
+    metrics->strings.buckets = prometheus_calloc(metrics->strings.mask + 1, sizeof(*metrics->strings.buckets));
 
-    list_foreach(metrics->histograms, histogram)
-    {
-        pthread_mutex_lock(&histogram->lock);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&metrics->aggregator.cond, &condattr);
+    pthread_condattr_destroy(&condattr);
 
-        bp = prometheus_metrics_emit_base(bp, &histogram->base);
+    return metrics;
+} /* prometheus_metrics_create */
 
-        list_foreach(histogram->series, histogram_series)
-        {
-            pthread_mutex_lock(&histogram_series->lock);
+/*
+ * A child registry carries the labels of its parent followed by its own,
+ * and is rendered by scrapes of the parent after the parent's metrics.
+ * The parent lock protects its list of children and is taken before
+ * the lock of a child.
+ */
 
-            for (i = 0; i < histogram->count; i++) {
+PUBLIC struct prometheus_metrics *
+prometheus_metrics_create_child(
+    struct prometheus_metrics *parent,
+    char                     **label_names,
+    char                     **label_values,
+    int                        label_count)
+{
+    struct prometheus_metrics *child;
+    char                     **names, **values;
+    int                        i, count = parent->label_count + label_count;
 
-                histogram_series->buckets[i] = histogram_series->saved[i];
+    /* Shared registries are rendered from their segment, which cannot hold a child */
+    if (parent->segment) {
+        return NULL;
+    }
 
-                list_foreach(histogram_series->head, histogram_hdl)
-                {
-                    histogram_series->buckets[i] += histogram_hdl->histogram.buckets[i];
-                }
+    names  = prometheus_calloc(count, sizeof(char *));
+    values = prometheus_calloc(count, sizeof(char *));
 
-                if (i + 1 < histogram->count) {
-                    if (histogram->type == PROMETHEUS_HISTOGRAM_EXPONENTIAL) {
-                        snprintf(bucket_threshold, sizeof(bucket_threshold), "%lu", (1UL << (i + 1)));
-                    } else {
-                        snprintf(bucket_threshold, sizeof(bucket_threshold), "%lu", histogram->start +
-                                 histogram->increment * (i + 1));
-                    }
-                } else {
-                    snprintf(bucket_threshold, sizeof(bucket_threshold), "+Inf");
-                }
+    for (i = 0; i < parent->label_count; i++) {
+        names[i]  = parent->label_names[i];
+        values[i] = parent->label_values[i];
+    }
 
-                bp = prometheus_metrics_emit_series_base(bp, metrics, "_bucket", &histogram->base, &
-                                                         histogram_series->base, "le", bucket_threshold);
+    for (i = 0; i < label_count; i++) {
+        names[parent->label_count + i]  = label_names[i];
+        values[parent->label_count + i] = label_values[i];
+    }
 
-                bp += sprintf(bp, "%lu\n", histogram_series->buckets[i]);
-            }
+    child = prometheus_metrics_create(names, values, count);
 
+    free(names);
+    free(values);
 
-            sum   = histogram_series->saved_sum;
-            total = histogram_series->saved_count;
+    child->parent = parent;
 
-            list_foreach(histogram_series->head, histogram_hdl)
-            {
-                sum   += histogram_hdl->histogram.sum;
-                total += histogram_hdl->histogram.count;
-            }
+    pthread_mutex_lock(&parent->lock);
+    list_append(parent->children, child);
+    pthread_mutex_unlock(&parent->lock);
 
-            bp = prometheus_metrics_emit_series_base(bp, metrics, "_sum",
-                                                     &histogram->base, &histogram_series->base, NULL, NULL);
+    return child;
+} /* prometheus_metrics_create_child */
 
-            bp += sprintf(bp, "%lu\n", sum);
+static void
+prometheus_fragment_printf(
+    struct prometheus_metrics  *metrics,
+    struct prometheus_fragment *fragment,
+    const char                 *fmt,
+    ...)
+{
+    va_list args;
 
-            bp = prometheus_metrics_emit_series_base(bp, metrics, "_count",
-                                                     &histogram->base, &histogram_series->base, NULL, NULL);
+    va_start(args, fmt);
+    fragment->len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
 
-            bp += sprintf(bp, "%lu\n", total);
+    fragment->text = prometheus_calloc(1, fragment->len + 1);
 
-            pthread_mutex_unlock(&histogram_series->lock);
-        }
+    va_start(args, fmt);
+    vsnprintf(fragment->text, fragment->len + 1, fmt, args);
+    va_end(args);
 
-        *bp++ = '\n';
-        *bp   = '\0';
+    prometheus_self_account(metrics, 0, 0, fragment->len + 1);
+} /* prometheus_fragment_printf */
 
-        pthread_mutex_unlock(&histogram->lock);
+static void
+prometheus_fragment_release(
+    struct prometheus_metrics  *metrics,
+    struct prometheus_fragment *fragment)
+{
+    if (!fragment->text) {
+        return;
     }
 
-    pthread_mutex_unlock(&metrics->lock);
+    prometheus_self_account(metrics, 0, 0, -(int64_t) (fragment->len + 1));
 
-    return bp - buffer;
+    free(fragment->text);
+
+    fragment->text = NULL;
+    fragment->len  = 0;
+} /* prometheus_fragment_release */
+
+static inline char *
+prometheus_label_render(
+    char       *bp,
+    const char *name,
+    const char *value)
+{
+    int len;
+
+    len = strlen(name);
+    memcpy(bp, name, len);
+    bp += len;
+
+    *bp++ = '=';
+    *bp++ = '"';
+
+    len = strlen(value);
+    memcpy(bp, value, len);
+    bp += len;
+
+    *bp++ = '"';
+
+    return bp;
+} /* prometheus_label_render */
+
+static void
+prometheus_metric_base_destroy(struct prometheus_metric_base *base)
+{
+    struct prometheus_rollup *rollup;
+    int                       i;
+
+    prometheus_fragment_release(base->metrics, &base->header);
+
+    prometheus_string_release(base->metrics, base->name);
+    prometheus_string_release(base->metrics, base->help);
+
+    if (base->label_names) {
+        for (i = 0; i < base->label_count; i++) {
+            prometheus_string_release(base->metrics, base->label_names[i]);
+        }
+
+        prometheus_self_account(base->metrics, 0, 0,
+                                -(int64_t) (base->label_count * sizeof(char *) +
+                                            (base->vec_mask + 1) * sizeof(*base->vec)));
+
+        free(base->label_names);
+        free(base->vec);
+    }
+
+    while ((rollup = base->rollups)) {
+        base->rollups = rollup->next;
+
+        for (i = 0; i < rollup->num_drop; i++) {
+            prometheus_string_release(base->metrics, rollup->drop[i]);
+        }
+
+        if (rollup->family != base) {
+            prometheus_metric_base_destroy(rollup->family);
+            prometheus_self_account(base->metrics, 0, 0, -(int64_t) sizeof(*rollup->family));
+            free(rollup->family);
+        }
+
+        prometheus_self_account(base->metrics, 0, 0, -(int64_t) (sizeof(*rollup) + rollup->num_drop * sizeof(char *)));
+
+        free(rollup);
+    }
+} /* prometheus_metric_base_destroy */
+
+static void
+prometheus_series_base_destroy(struct prometheus_series_base *base)
+{
+    int i;
+
+    for (i = 0; i < base->label_count; i++) {
+        if (!base->shared_names) {
+            prometheus_string_release(base->metrics, base->label_names[i]);
+        }
+
+        prometheus_string_release(base->metrics, base->label_values[i]);
+    }
+
+    prometheus_fragment_release(base->metrics, &base->labels);
+} /* prometheus_series_base_destroy */
+
+
+static inline void
+prometheus_metric_base_init(
+    struct prometheus_metric_base *base,
+    struct prometheus_metrics     *metrics,
+    const char                    *name,
+    const char                    *help,
+    const char                    *type)
+{
+    base->metrics = metrics;
+    base->name    = prometheus_string_intern(metrics, name);
+    base->help    = prometheus_string_intern(metrics, help);
+    snprintf(base->type, sizeof(base->type), "%s", type);
+
+    base->name_len = strlen(base->name);
+
+    prometheus_fragment_printf(metrics, &base->header, "# HELP %s %s\n# TYPE %s %s\n",
+                               base->name, base->help, base->name, base->type);
+} /* prometheus_metric_base_init */
+
+/*
+ * Render the constant labels of the registry followed by those of the
+ * series, as they appear between the braces of each of its samples.
+ */
+
+static void
+prometheus_series_base_render(struct prometheus_series_base *base)
+{
+    struct prometheus_metrics *metrics = base->metrics;
+    char                      *bp;
+    int                        i, len = 0;
+
+    for (i = 0; i < metrics->label_count; i++) {
+        len += strlen(metrics->label_names[i]) + strlen(metrics->label_values[i]) + 4;
+    }
+
+    for (i = 0; i < base->label_count; i++) {
+        len += strlen(base->label_names[i]) + strlen(base->label_values[i]) + 4;
+    }
+
+    /* Every pair but the first is preceded by a comma */
+    base->labels.len  = len ? len - 1 : 0;
+    base->labels.text = prometheus_calloc(1, base->labels.len + 1);
+
+    bp = base->labels.text;
+
+    for (i = 0; i < metrics->label_count; i++) {
+        if (bp != base->labels.text) {
+            *bp++ = ',';
+        }
+
+        bp = prometheus_label_render(bp, metrics->label_names[i], metrics->label_values[i]);
+    }
+
+    for (i = 0; i < base->label_count; i++) {
+        if (bp != base->labels.text) {
+            *bp++ = ',';
+        }
+
+        bp = prometheus_label_render(bp, base->label_names[i], base->label_values[i]);
+    }
+
+    prometheus_self_account(metrics, 0, 0, base->labels.len + 1);
+} /* prometheus_series_base_render */
+
+/*
+ * Series are allocated in one piece, with the label name and value
+ * arrays following the series structure.  The labels argument points
+ * at room for prometheus_series_labels_size() bytes within that
+ * allocation.  When the metric declared a label schema only the values
+ * are stored, and the names are those of the schema.
+ */
+
+static inline void
+prometheus_series_base_init(
+    struct prometheus_series_base *base,
+    struct prometheus_metric_base *metric,
+    int                            num_labels,
+    const char                   **label_names,
+    const char                   **label_values,
+    char                         **labels)
+{
+    base->metrics     = metric->metrics;
+    base->label_count = num_labels;
+
+    if (metric->label_names) {
+        base->label_names  = metric->label_names;
+        base->label_values = labels;
+        base->shared_names = 1;
+    } else {
+        base->label_names  = labels;
+        base->label_values = labels + num_labels;
+
+        for (int i = 0; i < num_labels; i++) {
+            base->label_names[i] = prometheus_string_intern(metric->metrics, label_names[i]);
+        }
+    }
+
+    for (int i = 0; i < num_labels; i++) {
+        base->label_values[i] = prometheus_string_intern(metric->metrics, label_values[i]);
+    }
+
+    prometheus_series_base_render(base);
+} /* prometheus_series_base_init */
+
+/*
+ * A metric with a declared label schema indexes its series by their
+ * label values, so a series can be found from its value tuple alone.
+ * The index is protected by the metric lock and doubles in size when
+ * its load factor exceeds one.
+ */
+
+static inline uint64_t
+prometheus_vec_hash(
+    const char **label_values,
+    int          num_labels)
+{
+    uint64_t    hash = 14695981039346656037UL;
+    const char *ch;
+    int         i;
+
+    for (i = 0; i < num_labels; i++) {
+        for (ch = label_values[i]; *ch; ch++) {
+            hash = (hash ^ (uint8_t) *ch) * 1099511628211UL;
+        }
+
+        /* Include the terminator so ("ab", "c") and ("a", "bc") differ */
+        hash *= 1099511628211UL;
+    }
+
+    return hash;
+} /* prometheus_vec_hash */
+
+static struct prometheus_series_base *
+prometheus_vec_find(
+    struct prometheus_metric_base *metric,
+    uint64_t                       hash,
+    const char                   **label_values)
+{
+    struct prometheus_series_base *series;
+    int                            i;
+
+    for (series = metric->vec[hash & metric->vec_mask]; series; series = series->vec_next) {
+        if (series->vec_hash != hash) {
+            continue;
+        }
+
+        for (i = 0; i < metric->label_count; i++) {
+            if (strcmp(series->label_values[i], label_values[i])) {
+                break;
+            }
+        }
+
+        if (i == metric->label_count) {
+            return series;
+        }
+    }
+
+    return NULL;
+} /* prometheus_vec_find */
+
+static void
+prometheus_vec_insert(
+    struct prometheus_metric_base *metric,
+    struct prometheus_series_base *series)
+{
+    struct prometheus_series_base **vec, *cur, *next;
+    uint64_t                        i, mask;
+
+    if (metric->vec_count > metric->vec_mask) {
+        mask = 2 * metric->vec_mask + 1;
+        vec  = prometheus_calloc(mask + 1, sizeof(*vec));
+
+        for (i = 0; i <= metric->vec_mask; i++) {
+            for (cur = metric->vec[i]; cur; cur = next) {
+                next                      = cur->vec_next;
+                cur->vec_next             = vec[cur->vec_hash & mask];
+                vec[cur->vec_hash & mask] = cur;
+            }
+        }
+
+        prometheus_self_account(metric->metrics, 0, 0, (metric->vec_mask + 1) * sizeof(*vec));
+
+        free(metric->vec);
+
+        metric->vec      = vec;
+        metric->vec_mask = mask;
+    }
+
+    series->vec_next                                 = metric->vec[series->vec_hash & metric->vec_mask];
+    metric->vec[series->vec_hash & metric->vec_mask] = series;
+    metric->vec_count++;
+} /* prometheus_vec_insert */
+
+static void
+prometheus_vec_remove(
+    struct prometheus_metric_base *metric,
+    struct prometheus_series_base *series)
+{
+    struct prometheus_series_base **link;
+
+    for (link = &metric->vec[series->vec_hash & metric->vec_mask]; *link != series; link = &(*link)->vec_next) {
+    }
+
+    *link = series->vec_next;
+    metric->vec_count--;
+} /* prometheus_vec_remove */
+
+/*
+ * Declare the label names every series of a metric carries.  The caller
+ * holds the metric lock and has checked that no series exist yet.
+ */
+
+static int
+prometheus_metric_base_declare_labels(
+    struct prometheus_metric_base *base,
+    const char                   **label_names,
+    int                            num_labels)
+{
+    int i;
+
+    if (base->label_names || num_labels <= 0) {
+        return -1;
+    }
+
+    for (i = 0; i < num_labels; i++) {
+        if (!prometheus_string_legal_name(label_names[i])) {
+            return -1;
+        }
+    }
+
+    base->label_names = prometheus_calloc(num_labels, sizeof(char *));
+    base->label_count = num_labels;
+    base->vec_mask    = 15;
+    base->vec         = prometheus_calloc(base->vec_mask + 1, sizeof(*base->vec));
+
+    for (i = 0; i < num_labels; i++) {
+        base->label_names[i] = prometheus_string_intern(base->metrics, label_names[i]);
+    }
+
+    prometheus_self_account(base->metrics, 0, 0,
+                            num_labels * sizeof(char *) + (base->vec_mask + 1) * sizeof(*base->vec));
+
+    return 0;
+} /* prometheus_metric_base_declare_labels */
+
+static int
+prometheus_metric_base_add_rollup(
+    struct prometheus_metric_base *base,
+    const char                   **drop_labels,
+    int                            num_drop,
+    uint32_t                       flags)
+{
+    struct prometheus_rollup *rollup;
+    char                      help[PROMETHEUS_HELP_SIZE];
+    char                     *name;
+    int                       i, len;
+
+    if (num_drop <= 0) {
+        return -1;
+    }
+
+    for (i = 0; i < num_drop; i++) {
+        if (!prometheus_string_legal_name(drop_labels[i])) {
+            return -1;
+        }
+    }
+
+    rollup           = prometheus_calloc(1, sizeof(*rollup) + num_drop * sizeof(char *));
+    rollup->drop     = (char **) (rollup + 1);
+    rollup->num_drop = num_drop;
+
+    for (i = 0; i < num_drop; i++) {
+        rollup->drop[i] = prometheus_string_intern(base->metrics, drop_labels[i]);
+    }
+
+    prometheus_self_account(base->metrics, 0, 0, sizeof(*rollup) + num_drop * sizeof(char *));
+
+    if (flags & PROMETHEUS_ROLLUP_REPLACE) {
+        rollup->family       = base;
+        base->rollup_replace = 1;
+    } else {
+        len = base->name_len + 12;
+
+        for (i = 0; i < num_drop; i++) {
+            len += strlen(drop_labels[i]) + 1;
+        }
+
+        name = prometheus_calloc(1, len + 1);
+        len  = snprintf(name, len + 1, "%s:sum_without", base->name);
+        snprintf(help, sizeof(help), "%s, summed without", base->help);
+
+        for (i = 0; i < num_drop; i++) {
+            len += sprintf(name + len, "_%s", drop_labels[i]);
+            snprintf(help + strlen(help), sizeof(help) - strlen(help), "%s%s", i ? ", " : " ", drop_labels[i]);
+        }
+
+        rollup->family = prometheus_calloc(1, sizeof(*rollup->family));
+        prometheus_metric_base_init(rollup->family, base->metrics, name, help, base->type);
+        prometheus_self_account(base->metrics, 0, 0, sizeof(*rollup->family));
+
+        free(name);
+    }
+
+    list_append(base->rollups, rollup);
+
+    return 0;
+} /* prometheus_metric_base_add_rollup */
+
+/*
+ * Series of a metric with a schema must use its names, in order.  The
+ * names passed by a vector lookup are the interned schema names
+ * themselves, so those compare by pointer.
+ */
+
+static inline int
+prometheus_metric_base_labels_match(
+    struct prometheus_metric_base *base,
+    const char                   **label_names,
+    int                            num_labels)
+{
+    int i;
+
+    if (!base->label_names) {
+        return 1;
+    }
+
+    if (num_labels != base->label_count) {
+        return 0;
+    }
+
+    for (i = 0; i < num_labels; i++) {
+        if (label_names[i] != base->label_names[i] && strcmp(label_names[i], base->label_names[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+} /* prometheus_metric_base_labels_match */
+
+static int
+prometheus_writer_flush(
+    struct prometheus_writer *writer,
+    int                       need)
+{
+    if (writer->error) {
+        return -1;
+    }
+
+    if (!writer->flush || writer->flush(writer, need)) {
+        writer->error = 1;
+        return -1;
+    }
+
+    return 0;
+} /* prometheus_writer_flush */
+
+/*
+ * Writers with a fixed size buffer, such as the compressor staging
+ * buffer, may take a write larger than the buffer directly.
+ */
+
+static int
+prometheus_writer_oversized(
+    struct prometheus_writer *writer,
+    int                       len)
+{
+    return writer->direct && len >= writer->end - writer->base;
+} /* prometheus_writer_oversized */
+
+static void
+prometheus_writer_direct(
+    struct prometheus_writer *writer,
+    const char               *str,
+    int                       len)
+{
+    if (!writer->error && writer->direct(writer, str, len)) {
+        writer->error = 1;
+    }
+} /* prometheus_writer_direct */
+
+static inline void
+prometheus_writer_write(
+    struct prometheus_writer *writer,
+    const char               *str,
+    int                       len)
+{
+    if (writer->end - writer->bp <= len) {
+
+        if (prometheus_writer_oversized(writer, len)) {
+            prometheus_writer_direct(writer, str, len);
+            return;
+        }
+
+        if (prometheus_writer_flush(writer, len + 1)) {
+            return;
+        }
+    }
+
+    memcpy(writer->bp, str, len);
+    writer->bp += len;
+} /* prometheus_writer_write */
+
+static void
+prometheus_writer_printf(
+    struct prometheus_writer *writer,
+    const char               *fmt,
+    ...)
+{
+    va_list args;
+    int     len;
+
+    if (writer->error) {
+        return;
+    }
+
+    va_start(args, fmt);
+    len = vsnprintf(writer->bp, writer->end - writer->bp, fmt, args);
+    va_end(args);
+
+    if (len >= writer->end - writer->bp) {
+
+        if (prometheus_writer_oversized(writer, len)) {
+            char *text = prometheus_calloc(1, len + 1);
+
+            va_start(args, fmt);
+            vsnprintf(text, len + 1, fmt, args);
+            va_end(args);
+
+            prometheus_writer_direct(writer, text, len);
+            free(text);
+            return;
+        }
+
+        if (prometheus_writer_flush(writer, len + 1)) {
+            return;
+        }
+
+        va_start(args, fmt);
+        len = vsnprintf(writer->bp, writer->end - writer->bp, fmt, args);
+        va_end(args);
+    }
+
+    writer->bp += len;
+} /* prometheus_writer_printf */
+
+/*
+ * Sample values and labels are by far the bulk of the exposition, so
+ * they are formatted by hand rather than through printf().  Integers
+ * are converted two digits at a time from a table of digit pairs.
+ */
+
+static const char prometheus_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline int
+prometheus_format_u64(
+    char    *bp,
+    uint64_t value)
+{
+    char  digits[20];
+    char *dp = digits + sizeof(digits);
+    int   len;
+
+    while (value >= 100) {
+        dp -= 2;
+        memcpy(dp, prometheus_digit_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+
+    if (value >= 10) {
+        dp -= 2;
+        memcpy(dp, prometheus_digit_pairs + value * 2, 2);
+    } else {
+        *--dp = '0' + value;
+    }
+
+    len = digits + sizeof(digits) - dp;
+
+    memcpy(bp, dp, len);
+
+    return len;
+} /* prometheus_format_u64 */
+
+static inline void
+prometheus_writer_u64(
+    struct prometheus_writer *writer,
+    uint64_t                  value)
+{
+    if (writer->end - writer->bp <= 20 && prometheus_writer_flush(writer, 21)) {
+        return;
+    }
+
+    writer->bp += prometheus_format_u64(writer->bp, value);
+} /* prometheus_writer_u64 */
+
+static inline void
+prometheus_writer_i64(
+    struct prometheus_writer *writer,
+    int64_t                   value)
+{
+    if (writer->end - writer->bp <= 21 && prometheus_writer_flush(writer, 22)) {
+        return;
+    }
+
+    if (value < 0) {
+        *writer->bp++ = '-';
+        writer->bp   += prometheus_format_u64(writer->bp, -(uint64_t) value);
+    } else {
+        writer->bp += prometheus_format_u64(writer->bp, value);
+    }
+} /* prometheus_writer_i64 */
+
+/* Append a value and the newline ending its sample line */
+
+static inline void
+prometheus_writer_u64_line(
+    struct prometheus_writer *writer,
+    uint64_t                  value)
+{
+    if (writer->end - writer->bp <= 21 && prometheus_writer_flush(writer, 22)) {
+        return;
+    }
+
+    writer->bp   += prometheus_format_u64(writer->bp, value);
+    *writer->bp++ = '\n';
+} /* prometheus_writer_u64_line */
+
+static inline void
+prometheus_writer_i64_line(
+    struct prometheus_writer *writer,
+    int64_t                   value)
+{
+    if (writer->end - writer->bp <= 22 && prometheus_writer_flush(writer, 23)) {
+        return;
+    }
+
+    if (value < 0) {
+        *writer->bp++ = '-';
+        writer->bp   += prometheus_format_u64(writer->bp, -(uint64_t) value);
+    } else {
+        writer->bp += prometheus_format_u64(writer->bp, value);
+    }
+
+    *writer->bp++ = '\n';
+} /* prometheus_writer_i64_line */
+
+/* Append a label pair, preceded by a comma unless it is the first */
+
+static inline void
+prometheus_writer_label(
+    struct prometheus_writer *writer,
+    int                       first,
+    const char               *name,
+    int                       name_len,
+    const char               *value,
+    int                       value_len)
+{
+    int len = name_len + value_len + 4;
+
+    if (prometheus_writer_oversized(writer, len)) {
+        prometheus_writer_write(writer, ",", !first);
+        prometheus_writer_write(writer, name, name_len);
+        prometheus_writer_write(writer, "=\"", 2);
+        prometheus_writer_write(writer, value, value_len);
+        prometheus_writer_write(writer, "\"", 1);
+        return;
+    }
+
+    if (writer->end - writer->bp <= len && prometheus_writer_flush(writer, len + 1)) {
+        return;
+    }
+
+    if (!first) {
+        *writer->bp++ = ',';
+    }
+
+    memcpy(writer->bp, name, name_len);
+    writer->bp += name_len;
+
+    *writer->bp++ = '=';
+    *writer->bp++ = '"';
+
+    memcpy(writer->bp, value, value_len);
+    writer->bp += value_len;
+
+    *writer->bp++ = '"';
+} /* prometheus_writer_label */
+
+/*
+ * Move the arena text written since the previous iovec into one of its
+ * own.  The caller must have room for it in the iovec array.
+ */
+
+static inline void
+prometheus_writer_iov_close(struct prometheus_writer *writer)
+{
+    struct prometheus_iov_sink *sink = writer->sink;
+
+    if (writer->bp > sink->mark) {
+        sink->iov[sink->iovcnt].iov_base = sink->mark;
+        sink->iov[sink->iovcnt].iov_len  = writer->bp - sink->mark;
+        sink->iovcnt++;
+        sink->mark = writer->bp;
+    }
+} /* prometheus_writer_iov_close */
+
+static int
+prometheus_writer_iov_flush(
+    struct prometheus_writer *writer,
+    int                       need)
+{
+    struct prometheus_iov_sink *sink = writer->sink;
+    int                         i;
+
+    prometheus_writer_iov_close(writer);
+
+    if (sink->iovcnt) {
+        for (i = 0; i < sink->iovcnt; i++) {
+            sink->length += sink->iov[i].iov_len;
+        }
+
+        if (sink->callback(sink->iov, sink->iovcnt, sink->private_data)) {
+            return -1;
+        }
+    }
+
+    sink->iovcnt = 0;
+    sink->mark   = writer->base;
+    writer->bp   = writer->base;
+
+    return need > writer->end - writer->base ? -1 : 0;
+} /* prometheus_writer_iov_flush */
+
+/*
+ * Append a string which outlives the scrape, such as a fragment.
+ * Scatter/gather scrapes reference it rather than copying it.
+ */
+
+static inline void
+prometheus_writer_ref(
+    struct prometheus_writer *writer,
+    const char               *str,
+    int                       len)
+{
+    struct prometheus_iov_sink *sink = writer->sink;
+
+    if (!sink || len < PROMETHEUS_IOV_MIN_REF) {
+        prometheus_writer_write(writer, str, len);
+        return;
+    }
+
+    if (writer->error) {
+        return;
+    }
+
+    /* Leave room for the pending arena text as well as the reference */
+    if (sink->iovcnt + 2 > PROMETHEUS_IOV_MAX && prometheus_writer_flush(writer, 0)) {
+        return;
+    }
+
+    prometheus_writer_iov_close(writer);
+
+    sink->iov[sink->iovcnt].iov_base = (void *) str;
+    sink->iov[sink->iovcnt].iov_len  = len;
+    sink->iovcnt++;
+} /* prometheus_writer_ref */
+
+/*
+ * Hand off any output referencing a registry which is about to be
+ * destroyed, such as a segment snapshot.
+ */
+
+static inline void
+prometheus_writer_sync(struct prometheus_writer *writer)
+{
+    if (writer->sink) {
+        prometheus_writer_flush(writer, 0);
+    }
+} /* prometheus_writer_sync */
+
+static inline void
+prometheus_metrics_emit_series_base(
+    struct prometheus_writer      *writer,
+    struct prometheus_metrics     *metrics,
+    const char                    *metric_suffix,
+    struct prometheus_metric_base *metric_base,
+    struct prometheus_series_base *series_base,
+    struct prometheus_fragment    *extra)
+{
+    int i, empty;
+
+    prometheus_writer_ref(writer, metric_base->name, metric_base->name_len);
+    prometheus_writer_write(writer, metric_suffix, strlen(metric_suffix));
+    prometheus_writer_write(writer, "{", 1);
+
+    if (series_base->labels.text) {
+        prometheus_writer_ref(writer, series_base->labels.text, series_base->labels.len);
+        empty = !series_base->labels.len;
+    } else {
+        /* Rollup views are built during the scrape and have no fragment */
+        for (i = 0; i < metrics->label_count; i++) {
+            prometheus_writer_label(writer, i == 0,
+                                    metrics->label_names[i], strlen(metrics->label_names[i]),
+                                    metrics->label_values[i], strlen(metrics->label_values[i]));
+        }
+
+        for (i = 0; i < series_base->label_count; i++) {
+            prometheus_writer_label(writer, i == 0 && !metrics->label_count,
+                                    series_base->label_names[i], prometheus_string_length(series_base->label_names[i]),
+                                    series_base->label_values[i], prometheus_string_length(series_base->label_values[i]));
+        }
+
+        empty = !metrics->label_count && !series_base->label_count;
+    }
+
+    if (extra) {
+        if (!empty) {
+            prometheus_writer_write(writer, ",", 1);
+        }
+
+        prometheus_writer_ref(writer, extra->text, extra->len);
+    }
+
+    prometheus_writer_write(writer, "} ", 2);
+} /* prometheus_metrics_emit_series_base */
+
+/*
+ * Sum the handles of a series into its current value.  The caller
+ * must hold the series lock.
+ */
+
+static inline uint64_t
+prometheus_counter_series_fold(struct prometheus_counter_series *series)
+{
+    struct prometheus_counter_handle *hdl;
+    uint64_t                          value = series->saved;
+
+    list_foreach(series->head, hdl)
+    {
+        value += hdl->instance->value;
+    }
+
+    return value;
+} /* prometheus_counter_series_fold */
+
+static inline uint64_t
+prometheus_gauge_series_fold(struct prometheus_gauge_series *series)
+{
+    struct prometheus_gauge_handle *hdl;
+    uint64_t                        value = series->saved;
+
+    list_foreach(series->head, hdl)
+    {
+        value += hdl->instance->value;
+    }
+
+    return value;
+} /* prometheus_gauge_series_fold */
+
+static inline void
+prometheus_histogram_series_fold(
+    struct prometheus_histogram_series *series,
+    uint64_t                           *buckets,
+    uint64_t                           *sum,
+    uint64_t                           *count)
+{
+    struct prometheus_histogram_handle *hdl;
+    int                                 i;
+
+    memcpy(buckets, series->saved, series->num_buckets * sizeof(uint64_t));
+
+    *sum   = series->saved_sum;
+    *count = series->saved_count;
+
+    list_foreach(series->head, hdl)
+    {
+        for (i = 0; i < series->num_buckets; i++) {
+            buckets[i] += hdl->instance->buckets[i];
+        }
+
+        *sum   += hdl->instance->sum;
+        *count += hdl->instance->count;
+    }
+} /* prometheus_histogram_series_fold */
+
+/*
+ * Snapshots are double buffered and published with a sequence count.
+ * The writer bumps the sequence to an odd value while it fills the
+ * buffer that is not currently published, then to the next even value
+ * to publish it, so generation (seq >> 1) lives in buffer (seq >> 1) & 1.
+ * A reader which observes seq advance by three or more from the even
+ * value it started with may have raced a rewrite of its buffer and
+ * must retry.  A sequence of zero means nothing was published yet.
+ */
+
+static inline int
+prometheus_snapshot_write_begin(uint64_t *seq)
+{
+    uint64_t cur = *seq;
+
+    __atomic_store_n(seq, cur + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return ((cur >> 1) + 1) & 1;
+} /* prometheus_snapshot_write_begin */
+
+static inline void
+prometheus_snapshot_write_end(uint64_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+} /* prometheus_snapshot_write_end */
+
+static inline int
+prometheus_snapshot_read_begin(
+    uint64_t *seq,
+    uint64_t *start)
+{
+    *start = __atomic_load_n(seq, __ATOMIC_ACQUIRE) & ~1UL;
+
+    if (*start == 0) {
+        return -1;
+    }
+
+    return (*start >> 1) & 1;
+} /* prometheus_snapshot_read_begin */
+
+static inline int
+prometheus_snapshot_read_retry(
+    uint64_t *seq,
+    uint64_t  start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) - start >= 3;
+} /* prometheus_snapshot_read_retry */
+
+/*
+ * Read the current value of a series, either from the snapshot kept by
+ * the background aggregator or, if there is none, by folding the handles.
+ */
+
+static inline uint64_t
+prometheus_counter_series_read(
+    struct prometheus_metrics        *metrics,
+    struct prometheus_counter_series *series)
+{
+    uint64_t value, start;
+    int      idx;
+
+    if (metrics->aggregator.running) {
+        do {
+            idx = prometheus_snapshot_read_begin(&series->snapshot_seq, &start);
+
+            if (idx < 0) {
+                break;
+            }
+
+            value = series->snapshot[idx];
+        } while (prometheus_snapshot_read_retry(&series->snapshot_seq, start));
+
+        if (idx >= 0) {
+            return value;
+        }
+    }
+
+    prometheus_scrape_lock(metrics, &series->lock);
+    value = prometheus_counter_series_fold(series);
+    pthread_mutex_unlock(&series->lock);
+
+    return value;
+} /* prometheus_counter_series_read */
+
+static inline uint64_t
+prometheus_gauge_series_read(
+    struct prometheus_metrics      *metrics,
+    struct prometheus_gauge_series *series)
+{
+    uint64_t value, start;
+    int      idx;
+
+    if (metrics->aggregator.running) {
+        do {
+            idx = prometheus_snapshot_read_begin(&series->snapshot_seq, &start);
+
+            if (idx < 0) {
+                break;
+            }
+
+            value = series->snapshot[idx];
+        } while (prometheus_snapshot_read_retry(&series->snapshot_seq, start));
+
+        if (idx >= 0) {
+            return value;
+        }
+    }
+
+    prometheus_scrape_lock(metrics, &series->lock);
+    value = prometheus_gauge_series_fold(series);
+    pthread_mutex_unlock(&series->lock);
+
+    return value;
+} /* prometheus_gauge_series_read */
+
+static inline void
+prometheus_histogram_series_read(
+    struct prometheus_metrics          *metrics,
+    struct prometheus_histogram_series *series,
+    uint64_t                           *buckets,
+    uint64_t                           *sum,
+    uint64_t                           *count)
+{
+    uint64_t start;
+    int      idx;
+
+    if (metrics->aggregator.running) {
+        do {
+            idx = prometheus_snapshot_read_begin(&series->snapshot_seq, &start);
+
+            if (idx < 0) {
+                break;
+            }
+
+            memcpy(buckets, series->snapshot_buckets[idx], series->num_buckets * sizeof(uint64_t));
+            *sum   = series->snapshot_sum[idx];
+            *count = series->snapshot_count[idx];
+        } while (prometheus_snapshot_read_retry(&series->snapshot_seq, start));
+
+        if (idx >= 0) {
+            return;
+        }
+    }
+
+    prometheus_scrape_lock(metrics, &series->lock);
+    prometheus_histogram_series_fold(series, buckets, sum, count);
+    pthread_mutex_unlock(&series->lock);
+} /* prometheus_histogram_series_read */
+
+/*
+ * Collect the extremes of a series since the window was last rolled and
+ * start a new window, with the series lock held.  The handles are reset
+ * without synchronizing with their owners, so an observation racing with
+ * the reset may be counted in either window.  An empty window is left
+ * with min > max.
+ */
+
+static void
+prometheus_histogram_series_roll_window(struct prometheus_histogram_series *series)
+{
+    struct prometheus_histogram_handle *hdl;
+
+    series->window_min = series->saved_min;
+    series->window_max = series->saved_max;
+    series->saved_min  = UINT64_MAX;
+    series->saved_max  = 0;
+
+    list_foreach(series->head, hdl)
+    {
+        series->window_min = hdl->instance->min < series->window_min ? hdl->instance->min : series->window_min;
+        series->window_max = hdl->instance->max > series->window_max ? hdl->instance->max : series->window_max;
+
+        hdl->instance->min = UINT64_MAX;
+        hdl->instance->max = 0;
+    }
+} /* prometheus_histogram_series_roll_window */
+
+/*
+ * Without an aggregator each scrape rolls the window, so the extremes
+ * cover the time since the previous scrape by any caller.  With one the
+ * aggregator rolls it on every pass and scrapes only read it.
+ */
+
+static void
+prometheus_histogram_series_window(
+    struct prometheus_metrics          *metrics,
+    struct prometheus_histogram_series *series)
+{
+    if (metrics->aggregator.running) {
+        return;
+    }
+
+    prometheus_scrape_lock(metrics, &series->lock);
+    prometheus_histogram_series_roll_window(series);
+    pthread_mutex_unlock(&series->lock);
+} /* prometheus_histogram_series_window */
+
+/*
+ * Resolve the label matchers of a filter against a registry and its
+ * children for the duration of a filtered scrape.  The caller holds the
+ * lock of every registry resolved, which keeps the strings interned.
+ */
+
+static void
+prometheus_scrape_filter_resolve(
+    struct prometheus_metrics             *metrics,
+    const struct prometheus_scrape_filter *filter)
+{
+    struct prometheus_filter_label *labels;
+    struct prometheus_metrics      *child;
+    int                             i, j;
+
+    labels = prometheus_calloc(filter->num_labels + 1, sizeof(*labels));
+
+    for (j = 0; j < filter->num_labels; j++) {
+        labels[j].name  = prometheus_string_lookup(metrics, filter->label_names[j]);
+        labels[j].value = prometheus_string_lookup(metrics, filter->label_values[j]);
+
+        for (i = 0; i < metrics->label_count; i++) {
+            if (strcmp(metrics->label_names[i], filter->label_names[j]) == 0) {
+                labels[j].context = strcmp(metrics->label_values[i], filter->label_values[j]) == 0;
+                break;
+            }
+        }
+    }
+
+    metrics->filter_labels = labels;
+
+    list_foreach(metrics->children, child)
+    {
+        prometheus_scrape_filter_resolve(child, filter);
+    }
+} /* prometheus_scrape_filter_resolve */
+
+static void
+prometheus_scrape_filter_release(struct prometheus_metrics *metrics)
+{
+    struct prometheus_metrics *child;
+
+    free(metrics->filter_labels);
+    metrics->filter_labels = NULL;
+
+    list_foreach(metrics->children, child)
+    {
+        prometheus_scrape_filter_release(child);
+    }
+} /* prometheus_scrape_filter_release */
+
+/*
+ * A label matcher is satisfied by a series label or, failing that, by a
+ * label of the metrics context.
+ */
+
+static int
+prometheus_scrape_filter_skip(
+    struct prometheus_metrics             *metrics,
+    const struct prometheus_scrape_filter *filter,
+    struct prometheus_series_base         *series)
+{
+    const struct prometheus_filter_label *label;
+    int                                   i, j;
+
+    if (!filter) {
+        return 0;
+    }
+
+    for (j = 0; j < filter->num_labels; j++) {
+        label = &metrics->filter_labels[j];
+
+        for (i = 0; i < series->label_count && series->label_names[i] != label->name; i++) {
+        }
+
+        if (i < series->label_count ? series->label_values[i] != label->value : !label->context) {
+            return 1;
+        }
+    }
+
+    return 0;
+} /* prometheus_scrape_filter_skip */
+
+/*
+ * A filter with label matchers may select none of the series of a
+ * metric, which is then left out rather than rendered as an empty
+ * family.
+ */
+
+static int
+prometheus_scrape_filter_selects(
+    struct prometheus_metrics             *metrics,
+    enum prometheus_metric_type            type,
+    void                                  *metric,
+    const struct prometheus_scrape_filter *filter)
+{
+    struct prometheus_counter          *counter;
+    struct prometheus_gauge            *gauge;
+    struct prometheus_histogram        *histogram;
+    struct prometheus_counter_series   *counter_series   = NULL;
+    struct prometheus_gauge_series     *gauge_series     = NULL;
+    struct prometheus_histogram_series *histogram_series = NULL;
+
+    if (!filter || !filter->num_labels) {
+        return 1;
+    }
+
+    switch (type) {
+        case PROMETHEUS_METRIC_COUNTER:
+            for (counter = metric; counter && !counter_series; counter = counter->peer) {
+                prometheus_scrape_lock(metrics, &counter->lock);
+
+                list_foreach(counter->series, counter_series)
+                {
+                    if (!prometheus_scrape_filter_skip(counter->base.metrics, filter, &counter_series->base)) {
+                        break;
+                    }
+                }
+
+                pthread_mutex_unlock(&counter->lock);
+            }
+            return counter_series != NULL;
+        case PROMETHEUS_METRIC_GAUGE:
+            for (gauge = metric; gauge && !gauge_series; gauge = gauge->peer) {
+                prometheus_scrape_lock(metrics, &gauge->lock);
+
+                list_foreach(gauge->series, gauge_series)
+                {
+                    if (!prometheus_scrape_filter_skip(gauge->base.metrics, filter, &gauge_series->base)) {
+                        break;
+                    }
+                }
+
+                pthread_mutex_unlock(&gauge->lock);
+            }
+            return gauge_series != NULL;
+        case PROMETHEUS_METRIC_HISTOGRAM:
+            for (histogram = metric; histogram && !histogram_series; histogram = histogram->peer) {
+                prometheus_scrape_lock(metrics, &histogram->lock);
+
+                list_foreach(histogram->series, histogram_series)
+                {
+                    if (!prometheus_scrape_filter_skip(histogram->base.metrics, filter, &histogram_series->base)) {
+                        break;
+                    }
+                }
+
+                pthread_mutex_unlock(&histogram->lock);
+            }
+            return histogram_series != NULL;
+    } /* switch */
+
+    return 0;
+} /* prometheus_scrape_filter_selects */
+
+/*
+ * Series grouped by a rollup view.  Each group is described by a label
+ * view holding the kept labels of its first series, and every series
+ * maps to its group, or to -1 if the scrape filter excludes it.
+ */
+
+struct prometheus_rollup_groups {
+    int                            num_groups;
+    int                           *group;
+    struct prometheus_series_base *views;
+    char                         **labels;
+};
+
+static inline int
+prometheus_rollup_drops(
+    struct prometheus_rollup *rollup,
+    const char               *name)
+{
+    int i;
+
+    for (i = 0; i < rollup->num_drop; i++) {
+        if (rollup->drop[i] == name) {
+            return 1;
+        }
+    }
+
+    return 0;
+} /* prometheus_rollup_drops */
+
+static inline int
+prometheus_rollup_view_equal(
+    struct prometheus_series_base *a,
+    struct prometheus_series_base *b)
+{
+    int i;
+
+    if (a->label_count != b->label_count) {
+        return 0;
+    }
+
+    /* Label names and values are interned, so equal strings share a pointer */
+    for (i = 0; i < a->label_count; i++) {
+        if (a->label_names[i] != b->label_names[i] || a->label_values[i] != b->label_values[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+} /* prometheus_rollup_view_equal */
+
+static void
+prometheus_rollup_group(
+    struct prometheus_rollup        *rollup,
+    struct prometheus_series_base  **series,
+    int                              num_series,
+    struct prometheus_rollup_groups *groups)
+{
+    struct prometheus_series_base *view;
+    uint64_t                       mask = 1, hash;
+    int                           *table;
+    int                            i, j, total = 0, pos = 0;
+
+    while (mask < 2 * (uint64_t) num_series) {
+        mask <<= 1;
+    }
+
+    mask--;
+
+    for (i = 0; i < num_series; i++) {
+        total += series[i] ? 2 * series[i]->label_count : 0;
+    }
+
+    table              = prometheus_calloc(mask + 1, sizeof(int));
+    groups->group      = prometheus_calloc(num_series + 1, sizeof(int));
+    groups->views      = prometheus_calloc(num_series + 1, sizeof(*groups->views));
+    groups->labels     = prometheus_calloc(total + 1, sizeof(char *));
+    groups->num_groups = 0;
+
+    /* Slots hold group + 1 so that the zeroed table reads as empty */
+
+    for (i = 0; i < num_series; i++) {
+        groups->group[i] = -1;
+
+        if (!series[i]) {
+            continue;
+        }
+
+        view               = &groups->views[groups->num_groups];
+        view->metrics      = series[i]->metrics;
+        view->label_names  = groups->labels + pos;
+        view->label_values = groups->labels + pos + series[i]->label_count;
+        view->label_count  = 0;
+        hash               = 0xcbf29ce484222325ULL;
+
+        for (j = 0; j < series[i]->label_count; j++) {
+            if (prometheus_rollup_drops(rollup, series[i]->label_names[j])) {
+                continue;
+            }
+
+            view->label_names[view->label_count]  = series[i]->label_names[j];
+            view->label_values[view->label_count] = series[i]->label_values[j];
+            view->label_count++;
+
+            hash = (hash ^ (uintptr_t) series[i]->label_names[j]) * 0x100000001b3ULL;
+            hash = (hash ^ (uintptr_t) series[i]->label_values[j]) * 0x100000001b3ULL;
+        }
+
+        for (hash &= mask; table[hash]; hash = (hash + 1) & mask) {
+            if (prometheus_rollup_view_equal(&groups->views[table[hash] - 1], view)) {
+                break;
+            }
+        }
+
+        if (table[hash]) {
+            groups->group[i] = table[hash] - 1;
+        } else {
+            groups->group[i] = groups->num_groups++;
+            table[hash]      = groups->num_groups;
+            pos             += 2 * series[i]->label_count;
+        }
+    }
+
+    free(table);
+} /* prometheus_rollup_group */
+
+static void
+prometheus_rollup_groups_release(struct prometheus_rollup_groups *groups)
+{
+    free(groups->group);
+    free(groups->views);
+    free(groups->labels);
+} /* prometheus_rollup_groups_release */
+
+/*
+ * The values a peer read for its rollups, one per series for counters
+ * and gauges and the buckets, sum and count of each series for
+ * histograms.  They are kept until the views replacing the raw series
+ * and the families of the other views have been emitted.
+ */
+
+struct prometheus_rollup_input {
+    struct prometheus_metric_base  *base;
+    struct prometheus_series_base **series;
+    uint64_t                       *values;
+    uint64_t                       *sums;
+    uint64_t                       *counts;
+    int                             num_series;
+    int                             is_signed;
+};
+
+static void
+prometheus_rollup_input_init(
+    struct prometheus_rollup_input *input,
+    struct prometheus_metric_base  *base,
+    int                             num_series,
+    int                             num_buckets,
+    int                             is_signed)
+{
+    input->base      = base;
+    input->series    = prometheus_calloc(num_series + 1, sizeof(*input->series));
+    input->is_signed = is_signed;
+
+    if (num_buckets) {
+        input->values = prometheus_calloc((uint64_t) num_series * num_buckets + 1, sizeof(uint64_t));
+        input->sums   = prometheus_calloc(num_series + 1, sizeof(uint64_t));
+        input->counts = prometheus_calloc(num_series + 1, sizeof(uint64_t));
+    } else {
+        input->values = prometheus_calloc(num_series + 1, sizeof(uint64_t));
+    }
+} /* prometheus_rollup_input_init */
+
+static void
+prometheus_rollup_input_release(struct prometheus_rollup_input *input)
+{
+    free(input->series);
+    free(input->values);
+    free(input->sums);
+    free(input->counts);
+} /* prometheus_rollup_input_release */
+
+/* Emit the views of one rollup, summed from the values its peer read */
+
+static void
+prometheus_metrics_render_rollup(
+    struct prometheus_writer       *writer,
+    struct prometheus_rollup       *rollup,
+    struct prometheus_rollup_input *input)
+{
+    struct prometheus_rollup_groups groups;
+    struct prometheus_histogram    *histogram = NULL;
+    uint64_t                       *sums, *group_sums = NULL, *group_counts = NULL;
+    uint64_t                        b, nb = 1;
+    int                             i, g;
+
+    prometheus_rollup_group(rollup, input->series, input->num_series, &groups);
+
+    if (input->sums) {
+        histogram    = container_of(input->base, struct prometheus_histogram, base);
+        nb           = histogram->count;
+        group_sums   = prometheus_calloc(groups.num_groups + 1, sizeof(uint64_t));
+        group_counts = prometheus_calloc(groups.num_groups + 1, sizeof(uint64_t));
+    }
+
+    sums = prometheus_calloc(groups.num_groups * nb + 1, sizeof(uint64_t));
+
+    for (i = 0; i < input->num_series; i++) {
+        g = groups.group[i];
+
+        if (g < 0) {
+            continue;
+        }
+
+        for (b = 0; b < nb; b++) {
+            sums[g * nb + b] += input->values[i * nb + b];
+        }
+
+        if (input->sums) {
+            group_sums[g]   += input->sums[i];
+            group_counts[g] += input->counts[i];
+        }
+    }
+
+    for (g = 0; g < groups.num_groups; g++) {
+        if (input->sums) {
+            writer->encoder->histogram(writer, rollup->family, histogram, &groups.views[g], sums + g * nb,
+                                       group_sums[g], group_counts[g]);
+        } else if (input->is_signed) {
+            writer->encoder->sample_i64(writer, rollup->family, "", &groups.views[g], sums[g]);
+        } else {
+            writer->encoder->sample_u64(writer, rollup->family, "", &groups.views[g], sums[g]);
+        }
+    }
+
+    free(sums);
+    free(group_sums);
+    free(group_counts);
+    prometheus_rollup_groups_release(&groups);
+} /* prometheus_metrics_render_rollup */
+
+/* Views replacing the raw series of a peer are emitted in its family */
+
+static void
+prometheus_metrics_render_rollups_replacing(
+    struct prometheus_writer       *writer,
+    struct prometheus_rollup_input *input)
+{
+    struct prometheus_rollup *rollup;
+
+    list_foreach(input->base->rollups, rollup)
+    {
+        if (rollup->family == input->base) {
+            prometheus_metrics_render_rollup(writer, rollup, input);
+        }
+    }
+} /* prometheus_metrics_render_rollups_replacing */
+
+static inline int
+prometheus_rollup_same_family(
+    struct prometheus_rollup       *rollup,
+    struct prometheus_rollup_input *input,
+    const char                     *name)
+{
+    return rollup->family != input->base && !strcmp(rollup->family->name, name);
+} /* prometheus_rollup_same_family */
+
+/*
+ * Emit each family of rollup views after the raw family, once for the
+ * whole peer chain.  A family is emitted when its first rollup in chain
+ * order is reached, and takes the views of the first rollup of each
+ * peer with the same name, which drops the same labels.
+ */
+
+static void
+prometheus_metrics_render_rollup_families(
+    struct prometheus_writer       *writer,
+    struct prometheus_rollup_input *inputs,
+    int                             num_inputs)
+{
+    struct prometheus_rollup *rollup, *other;
+    const char               *name;
+    int                       i, j, seen;
+
+    /* Peers without rollups leave their input zeroed */
+    for (i = 0; i < num_inputs; i++) {
+        if (!inputs[i].base) {
+            continue;
+        }
+
+        list_foreach(inputs[i].base->rollups, rollup)
+        {
+            if (rollup->family == inputs[i].base) {
+                continue;
+            }
+
+            name = rollup->family->name;
+            seen = 0;
+
+            for (j = 0; j <= i && !seen; j++) {
+                list_foreach(inputs[j].base ? inputs[j].base->rollups : NULL, other)
+                {
+                    if (other == rollup) {
+                        break;
+                    }
+
+                    seen |= prometheus_rollup_same_family(other, &inputs[j], name);
+                }
+            }
+
+            if (seen) {
+                continue;
+            }
+
+            writer->encoder->family(writer, rollup->family, "", rollup->family->type, rollup->family->help);
+
+            for (j = i; j < num_inputs; j++) {
+                list_foreach(inputs[j].base ? inputs[j].base->rollups : NULL, other)
+                {
+                    if (prometheus_rollup_same_family(other, &inputs[j], name)) {
+                        prometheus_metrics_render_rollup(writer, other, &inputs[j]);
+                        break;
+                    }
+                }
+            }
+
+            writer->encoder->family_end(writer);
+        }
+    }
+} /* prometheus_metrics_render_rollup_families */
+
+static void
+prometheus_metrics_render_extreme(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    struct prometheus_histogram           *histogram,
+    const struct prometheus_scrape_filter *filter,
+    int                                    max)
+{
+    struct prometheus_histogram        *peer;
+    struct prometheus_histogram_series *series;
+    const char                         *suffix = max ? "_max" : "_min";
+    char                                help[PROMETHEUS_HELP_SIZE];
+
+    snprintf(help, sizeof(help), "%s observation of %s %s", max ? "Largest" : "Smallest", histogram->base.name,
+             histogram->base.metrics->aggregator.running ?
+             "over the last aggregator interval" : "since the previous scrape");
+
+    writer->encoder->family(writer, &histogram->base, suffix, "gauge", help);
+
+    for (peer = histogram; peer; peer = peer->peer) {
+        if (!peer->min_max) {
+            continue;
+        }
+
+        list_foreach(peer->series, series)
+        {
+            if (prometheus_scrape_filter_skip(peer->base.metrics, filter, &series->base)) {
+                continue;
+            }
+
+            if (series->window_min > series->window_max) {
+                writer->encoder->sample_double(writer, &peer->base, suffix, &series->base, NAN);
+            } else {
+                writer->encoder->sample_u64(writer, &peer->base, suffix, &series->base,
+                                            max ? series->window_max : series->window_min);
+            }
+        }
+    }
+
+    writer->encoder->family_end(writer);
+} /* prometheus_metrics_render_extreme */
+
+/*
+ * Sampled histograms hold raw counts of the recorded observations,
+ * which are scaled up to estimates of all observations on output.
+ */
+
+static inline void
+prometheus_histogram_series_scale(
+    struct prometheus_histogram_series *series,
+    uint64_t                           *buckets,
+    uint64_t                           *sum,
+    uint64_t                           *count)
+{
+    uint64_t i;
+
+    if (!series->sample_every) {
+        return;
+    }
+
+    for (i = 0; i < series->num_buckets; i++) {
+        buckets[i] *= series->sample_every;
+    }
+
+    *sum   *= series->sample_every;
+    *count *= series->sample_every;
+} /* prometheus_histogram_series_scale */
+
+static inline int64_t
+prometheus_window_size(
+    int slots,
+    int with_sum)
+{
+    return (int64_t) slots * (with_sum ? 3 : 2) * sizeof(uint64_t);
+} /* prometheus_window_size */
+
+static void
+prometheus_window_init(
+    struct prometheus_window *window,
+    int                       slots,
+    int                       with_sum,
+    uint64_t                 *area)
+{
+    window->slots   = slots;
+    window->time_ns = area;
+    window->value   = area + slots;
+    window->sum     = with_sum ? area + 2 * slots : NULL;
+} /* prometheus_window_init */
+
+static void
+prometheus_window_push(
+    struct prometheus_window *window,
+    uint64_t                  now,
+    uint64_t                  value,
+    uint64_t                  sum)
+{
+    window->time_ns[window->head] = now;
+    window->value[window->head]   = value;
+
+    if (window->sum) {
+        window->sum[window->head] = sum;
+    }
+
+    window->head = (window->head + 1) % window->slots;
+
+    if (window->used < window->slots) {
+        window->used++;
+    }
+} /* prometheus_window_push */
+
+/*
+ * Difference between the newest and oldest slots of a window.  Fails
+ * until the aggregator has filled at least two slots.
+ */
+
+static int
+prometheus_window_delta(
+    struct prometheus_window *window,
+    uint64_t                 *elapsed_ns,
+    uint64_t                 *value,
+    uint64_t                 *sum)
+{
+    int newest, oldest;
+
+    if (window->used < 2) {
+        return -1;
+    }
+
+    newest = (window->head + window->slots - 1) % window->slots;
+    oldest = window->used < window->slots ? 0 : window->head;
+
+    *elapsed_ns = window->time_ns[newest] - window->time_ns[oldest];
+    *value      = window->value[newest] - window->value[oldest];
+
+    if (sum) {
+        *sum = window->sum[newest] - window->sum[oldest];
+    }
+
+    return *elapsed_ns ? 0 : -1;
+} /* prometheus_window_delta */
+
+static int
+prometheus_counter_series_window_rate(
+    struct prometheus_counter_series *series,
+    double                           *rate)
+{
+    uint64_t elapsed_ns, value;
+
+    if (prometheus_window_delta(&series->window, &elapsed_ns, &value, NULL)) {
+        return -1;
+    }
+
+    *rate = (double) value * 1e9 / elapsed_ns;
+
+    return 0;
+} /* prometheus_counter_series_window_rate */
+
+static int
+prometheus_histogram_series_window_rate(
+    struct prometheus_histogram_series *series,
+    double                             *rate,
+    double                             *average)
+{
+    uint64_t elapsed_ns, count, sum;
+
+    if (prometheus_window_delta(&series->window, &elapsed_ns, &count, &sum)) {
+        return -1;
+    }
+
+    /* Sampling scales sum and count alike, so only the rate needs it */
+    *rate    = (double) count * (series->sample_every ? series->sample_every : 1) * 1e9 / elapsed_ns;
+    *average = count ? (double) sum / count : NAN;
+
+    return 0;
+} /* prometheus_histogram_series_window_rate */
+
+static void
+prometheus_metrics_render_window(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    struct prometheus_histogram           *histogram,
+    const struct prometheus_scrape_filter *filter,
+    int                                    window_slots,
+    int                                    average)
+{
+    struct prometheus_histogram        *peer;
+    struct prometheus_histogram_series *series;
+    const char                         *suffix = average ? "_avg" : "_rate";
+    double                              values[2];
+    char                                help[PROMETHEUS_HELP_SIZE];
+
+    if (average) {
+        snprintf(help, sizeof(help), "Mean %s observation over the last %d aggregator intervals",
+                 histogram->base.name, window_slots - 1);
+    } else {
+        snprintf(help, sizeof(help), "Per second rate of %s observations over the last %d aggregator intervals",
+                 histogram->base.name, window_slots - 1);
+    }
+
+    writer->encoder->family(writer, &histogram->base, suffix, "gauge", help);
+
+    for (peer = histogram; peer; peer = peer->peer) {
+        if (!peer->window_slots) {
+            continue;
+        }
+
+        list_foreach(peer->series, series)
+        {
+            if (prometheus_scrape_filter_skip(peer->base.metrics, filter, &series->base)) {
+                continue;
+            }
+
+            prometheus_scrape_lock(metrics, &series->lock);
+
+            if (prometheus_histogram_series_window_rate(series, &values[0], &values[1])) {
+                values[average] = NAN;
+            }
+
+            pthread_mutex_unlock(&series->lock);
+
+            writer->encoder->sample_double(writer, &peer->base, suffix, &series->base, values[average]);
+        }
+    }
+
+    writer->encoder->family_end(writer);
+} /* prometheus_metrics_render_window */
+
+/*
+ * Metrics sharing a name across the registries of a tree are chained
+ * through their peer pointers by the tree render, and each render
+ * function emits a whole chain as a single family.  The peer chain is
+ * empty outside of a tree render.
+ */
+
+static void
+prometheus_metrics_render_counter(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    struct prometheus_counter             *counter,
+    const struct prometheus_scrape_filter *filter)
+{
+    struct prometheus_counter        *peer;
+    struct prometheus_counter_series *series;
+    struct prometheus_rollup_input   *inputs = NULL, *input;
+    uint64_t                          value;
+    double                            rate;
+    char                              help[PROMETHEUS_HELP_SIZE];
+    int                               i, n, num_peers = 0, rollups = 0, window_slots = 0;
+
+    for (peer = counter; peer; peer = peer->peer) {
+        prometheus_scrape_lock(metrics, &peer->lock);
+
+        num_peers++;
+        rollups |= peer->base.rollups != NULL;
+
+        if (!window_slots) {
+            window_slots = peer->window_slots;
+        }
+    }
+
+    if (rollups) {
+        inputs = prometheus_calloc(num_peers, sizeof(*inputs));
+    }
+
+    writer->encoder->family(writer, &counter->base, "", counter->base.type, counter->base.help);
+
+    for (peer = counter, input = inputs; peer; peer = peer->peer, input += !!input) {
+        n = 0;
+
+        if (peer->base.rollups) {
+            prometheus_rollup_input_init(input, &peer->base, peer->num_series, 0, 0);
+        }
+
+        list_foreach(peer->series, series)
+        {
+            i = n++;
+
+            if (prometheus_scrape_filter_skip(peer->base.metrics, filter, &series->base)) {
+                continue;
+            }
+
+            value = prometheus_counter_series_read(peer->base.metrics, series);
+
+            if (peer->base.rollups) {
+                input->series[i] = &series->base;
+                input->values[i] = value;
+            }
+
+            if (peer->base.rollup_replace) {
+                continue;
+            }
+
+            writer->encoder->sample_u64(writer, &peer->base, "", &series->base, value);
+        }
+
+        if (peer->base.rollups) {
+            input->num_series = n;
+            prometheus_metrics_render_rollups_replacing(writer, input);
+        }
+    }
+
+    writer->encoder->family_end(writer);
+
+    if (rollups) {
+        prometheus_metrics_render_rollup_families(writer, inputs, num_peers);
+
+        for (i = 0; i < num_peers; i++) {
+            prometheus_rollup_input_release(&inputs[i]);
+        }
+
+        free(inputs);
+    }
+
+    if (window_slots) {
+        snprintf(help, sizeof(help), "Per second rate of %s over the last %d aggregator intervals",
+                 counter->base.name, window_slots - 1);
+
+        writer->encoder->family(writer, &counter->base, "_rate", "gauge", help);
+
+        for (peer = counter; peer; peer = peer->peer) {
+            if (!peer->window_slots) {
+                continue;
+            }
+
+            list_foreach(peer->series, series)
+            {
+                if (prometheus_scrape_filter_skip(peer->base.metrics, filter, &series->base)) {
+                    continue;
+                }
+
+                prometheus_scrape_lock(metrics, &series->lock);
+
+                if (prometheus_counter_series_window_rate(series, &rate)) {
+                    rate = NAN;
+                }
+
+                pthread_mutex_unlock(&series->lock);
+
+                writer->encoder->sample_double(writer, &peer->base, "_rate", &series->base, rate);
+            }
+        }
+
+        writer->encoder->family_end(writer);
+    }
+
+    for (peer = counter; peer; peer = peer->peer) {
+        pthread_mutex_unlock(&peer->lock);
+    }
+} /* prometheus_metrics_render_counter */
+
+static void
+prometheus_metrics_render_gauge(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    struct prometheus_gauge               *gauge,
+    const struct prometheus_scrape_filter *filter)
+{
+    struct prometheus_gauge        *peer;
+    struct prometheus_gauge_series *series;
+    struct prometheus_rollup_input *inputs = NULL, *input;
+    uint64_t                        value;
+    int                             i, n, num_peers = 0, rollups = 0;
+
+    /* Rollup views reference the labels of the series until their families are emitted */
+    for (peer = gauge; peer; peer = peer->peer) {
+        prometheus_scrape_lock(metrics, &peer->lock);
+
+        num_peers++;
+        rollups |= peer->base.rollups != NULL;
+    }
+
+    if (rollups) {
+        inputs = prometheus_calloc(num_peers, sizeof(*inputs));
+    }
+
+    writer->encoder->family(writer, &gauge->base, "", gauge->base.type, gauge->base.help);
+
+    for (peer = gauge, input = inputs; peer; peer = peer->peer, input += !!input) {
+        n = 0;
+
+        if (peer->base.rollups) {
+            prometheus_rollup_input_init(input, &peer->base, peer->num_series, 0, 1);
+        }
+
+        list_foreach(peer->series, series)
+        {
+            i = n++;
+
+            if (prometheus_scrape_filter_skip(peer->base.metrics, filter, &series->base)) {
+                continue;
+            }
+
+            value = prometheus_gauge_series_read(peer->base.metrics, series);
+
+            if (peer->base.rollups) {
+                input->series[i] = &series->base;
+                input->values[i] = value;
+            }
+
+            if (peer->base.rollup_replace) {
+                continue;
+            }
+
+            /* Gauges fold as unsigned but are signed values */
+            writer->encoder->sample_i64(writer, &peer->base, "", &series->base, value);
+        }
+
+        if (peer->base.rollups) {
+            input->num_series = n;
+            prometheus_metrics_render_rollups_replacing(writer, input);
+        }
+    }
+
+    writer->encoder->family_end(writer);
+
+    if (rollups) {
+        prometheus_metrics_render_rollup_families(writer, inputs, num_peers);
+
+        for (i = 0; i < num_peers; i++) {
+            prometheus_rollup_input_release(&inputs[i]);
+        }
+
+        free(inputs);
+    }
+
+    for (peer = gauge; peer; peer = peer->peer) {
+        pthread_mutex_unlock(&peer->lock);
+    }
+} /* prometheus_metrics_render_gauge */
+
+static inline void
+prometheus_histogram_bucket_threshold(
+    struct prometheus_histogram *histogram,
+    int                          i,
+    char                        *buffer,
+    int                          buffer_size)
+{
+    if (i + 1 < histogram->count) {
+        if (histogram->type == PROMETHEUS_HISTOGRAM_EXPONENTIAL) {
+            snprintf(buffer, buffer_size, "%lu", (1UL << (i + 1)));
+        } else {
+            snprintf(buffer, buffer_size, "%lu", histogram->start + histogram->increment * (i + 1));
+        }
+    } else {
+        snprintf(buffer, buffer_size, "+Inf");
+    }
+} /* prometheus_histogram_bucket_threshold */
+
+static void
+prometheus_histogram_render_thresholds(struct prometheus_histogram *histogram)
+{
+    char threshold[64];
+    int  i;
+
+    histogram->le = prometheus_calloc(histogram->count + 1, sizeof(*histogram->le));
+
+    prometheus_self_account(histogram->base.metrics, 0, 0, (histogram->count + 1) * sizeof(*histogram->le));
+
+    for (i = 0; i < histogram->count; i++) {
+        prometheus_histogram_bucket_threshold(histogram, i, threshold, sizeof(threshold));
+        prometheus_fragment_printf(histogram->base.metrics, &histogram->le[i], "le=\"%s\"", threshold);
+    }
+} /* prometheus_histogram_render_thresholds */
+
+static void
+prometheus_metrics_emit_histogram_series(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    struct prometheus_histogram   *histogram,
+    struct prometheus_series_base *series_base,
+    const uint64_t                *buckets,
+    uint64_t                       sum,
+    uint64_t                       count)
+{
+    int i;
+
+    for (i = 0; i < histogram->count; i++) {
+
+        prometheus_metrics_emit_series_base(writer, histogram->base.metrics, "_bucket", base,
+                                            series_base, &histogram->le[i]);
+
+        prometheus_writer_u64_line(writer, buckets[i]);
+    }
+
+    prometheus_metrics_emit_series_base(writer, histogram->base.metrics, "_sum", base, series_base, NULL);
+
+    prometheus_writer_u64_line(writer, sum);
+
+    prometheus_metrics_emit_series_base(writer, histogram->base.metrics, "_count", base, series_base, NULL);
+
+    prometheus_writer_u64_line(writer, count);
+} /* prometheus_metrics_emit_histogram_series */
+
+/*
+ * The Prometheus text exposition format.  The HELP and TYPE lines of
+ * each metric and the labels of each series are fragments rendered
+ * when they were created.
+ */
+
+static void
+prometheus_text_family(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    const char                    *type,
+    const char                    *help)
+{
+    if (!*suffix) {
+        prometheus_writer_ref(writer, base->header.text, base->header.len);
+        return;
+    }
+
+    prometheus_writer_printf(writer, "# HELP %s%s %s\n# TYPE %s%s %s\n",
+                             base->name, suffix, help, base->name, suffix, type);
+} /* prometheus_text_family */
+
+static void
+prometheus_text_family_end(struct prometheus_writer *writer)
+{
+    prometheus_writer_write(writer, "\n", 1);
+} /* prometheus_text_family_end */
+
+static void
+prometheus_text_sample_u64(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    uint64_t                       value)
+{
+    prometheus_metrics_emit_series_base(writer, series->metrics, suffix, base, series, NULL);
+    prometheus_writer_u64_line(writer, value);
+} /* prometheus_text_sample_u64 */
+
+static void
+prometheus_text_sample_i64(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    int64_t                        value)
+{
+    prometheus_metrics_emit_series_base(writer, series->metrics, suffix, base, series, NULL);
+    prometheus_writer_i64_line(writer, value);
+} /* prometheus_text_sample_i64 */
+
+static void
+prometheus_text_sample_double(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    double                         value)
+{
+    prometheus_metrics_emit_series_base(writer, series->metrics, suffix, base, series, NULL);
+
+    if (isnan(value)) {
+        prometheus_writer_write(writer, "NaN\n", 4);
+    } else {
+        prometheus_writer_printf(writer, "%.9g\n", value);
+    }
+} /* prometheus_text_sample_double */
+
+static const struct prometheus_encoder prometheus_text_encoder = {
+    .family        = prometheus_text_family,
+    .family_end    = prometheus_text_family_end,
+    .sample_u64    = prometheus_text_sample_u64,
+    .sample_i64    = prometheus_text_sample_i64,
+    .sample_double = prometheus_text_sample_double,
+    .histogram     = prometheus_metrics_emit_histogram_series,
+};
+
+/* The le fragments of a histogram read le="<threshold>" */
+
+static inline void
+prometheus_writer_threshold(
+    struct prometheus_writer    *writer,
+    struct prometheus_histogram *histogram,
+    int                          i)
+{
+    prometheus_writer_write(writer, histogram->le[i].text + 4, histogram->le[i].len - 5);
+} /* prometheus_writer_threshold */
+
+/*
+ * JSON, as an array of families each holding an array of samples:
+ *
+ *   [{"name":"...","type":"...","help":"...","samples":[
+ *     {"labels":{"name":"value"},"value":1},
+ *     {"labels":{},"buckets":{"2":0,"+Inf":1},"sum":1,"count":1}]}]
+ *
+ * NaN is written as null.
+ */
+
+static void
+prometheus_writer_json_string(
+    struct prometheus_writer *writer,
+    const char               *str)
+{
+    const char *ch, *run;
+    char        escape[8];
+
+    prometheus_writer_write(writer, "\"", 1);
+
+    for (ch = run = str; *ch; ch++) {
+        if (*ch != '"' && *ch != '\\' && (unsigned char) *ch >= 0x20) {
+            continue;
+        }
+
+        prometheus_writer_write(writer, run, ch - run);
+
+        snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char) *ch);
+        prometheus_writer_write(writer, escape, 6);
+
+        run = ch + 1;
+    }
+
+    prometheus_writer_write(writer, run, ch - run);
+    prometheus_writer_write(writer, "\"", 1);
+} /* prometheus_writer_json_string */
+
+static void
+prometheus_json_begin(struct prometheus_writer *writer)
+{
+    prometheus_writer_write(writer, "[\n", 2);
+} /* prometheus_json_begin */
+
+static void
+prometheus_json_end(struct prometheus_writer *writer)
+{
+    prometheus_writer_write(writer, "\n]\n", 3);
+} /* prometheus_json_end */
+
+static void
+prometheus_json_family(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    const char                    *type,
+    const char                    *help)
+{
+    if (writer->families++) {
+        prometheus_writer_write(writer, ",\n", 2);
+    }
+
+    /* Metric names are legal identifiers and need no escaping */
+    prometheus_writer_printf(writer, "{\"name\":\"%s%s\",\"type\":\"%s\",\"help\":", base->name, suffix, type);
+    prometheus_writer_json_string(writer, help);
+    prometheus_writer_write(writer, ",\"samples\":[", 12);
+
+    writer->samples = 0;
+} /* prometheus_json_family */
+
+static void
+prometheus_json_family_end(struct prometheus_writer *writer)
+{
+    prometheus_writer_write(writer, "]}", 2);
+} /* prometheus_json_family_end */
+
+static void
+prometheus_json_series(
+    struct prometheus_writer      *writer,
+    struct prometheus_series_base *series)
+{
+    struct prometheus_metrics *metrics = series->metrics;
+    int                        i;
+
+    if (writer->samples++) {
+        prometheus_writer_write(writer, ",", 1);
+    }
+
+    prometheus_writer_write(writer, "\n{\"labels\":{", 12);
+
+    for (i = 0; i < metrics->label_count; i++) {
+        if (i) {
+            prometheus_writer_write(writer, ",", 1);
+        }
+
+        prometheus_writer_json_string(writer, metrics->label_names[i]);
+        prometheus_writer_write(writer, ":", 1);
+        prometheus_writer_json_string(writer, metrics->label_values[i]);
+    }
+
+    for (i = 0; i < series->label_count; i++) {
+        if (i || metrics->label_count) {
+            prometheus_writer_write(writer, ",", 1);
+        }
+
+        prometheus_writer_json_string(writer, series->label_names[i]);
+        prometheus_writer_write(writer, ":", 1);
+        prometheus_writer_json_string(writer, series->label_values[i]);
+    }
+
+    prometheus_writer_write(writer, "}", 1);
+} /* prometheus_json_series */
+
+static void
+prometheus_json_sample_u64(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    uint64_t                       value)
+{
+    prometheus_json_series(writer, series);
+    prometheus_writer_write(writer, ",\"value\":", 9);
+    prometheus_writer_u64(writer, value);
+    prometheus_writer_write(writer, "}", 1);
+} /* prometheus_json_sample_u64 */
+
+static void
+prometheus_json_sample_i64(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    int64_t                        value)
+{
+    prometheus_json_series(writer, series);
+    prometheus_writer_write(writer, ",\"value\":", 9);
+    prometheus_writer_i64(writer, value);
+    prometheus_writer_write(writer, "}", 1);
+} /* prometheus_json_sample_i64 */
+
+static void
+prometheus_json_sample_double(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    double                         value)
+{
+    prometheus_json_series(writer, series);
+
+    if (isfinite(value)) {
+        prometheus_writer_printf(writer, ",\"value\":%.9g}", value);
+    } else {
+        prometheus_writer_write(writer, ",\"value\":null}", 14);
+    }
+} /* prometheus_json_sample_double */
+
+static void
+prometheus_json_histogram(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    struct prometheus_histogram   *histogram,
+    struct prometheus_series_base *series,
+    const uint64_t                *buckets,
+    uint64_t                       sum,
+    uint64_t                       count)
+{
+    int i;
+
+    prometheus_json_series(writer, series);
+    prometheus_writer_write(writer, ",\"buckets\":{", 12);
+
+    for (i = 0; i < histogram->count; i++) {
+        prometheus_writer_write(writer, i ? ",\"" : "\"", i ? 2 : 1);
+        prometheus_writer_threshold(writer, histogram, i);
+        prometheus_writer_write(writer, "\":", 2);
+        prometheus_writer_u64(writer, buckets[i]);
+    }
+
+    prometheus_writer_write(writer, "},\"sum\":", 8);
+    prometheus_writer_u64(writer, sum);
+    prometheus_writer_write(writer, ",\"count\":", 9);
+    prometheus_writer_u64(writer, count);
+    prometheus_writer_write(writer, "}", 1);
+} /* prometheus_json_histogram */
+
+static const struct prometheus_encoder prometheus_json_encoder = {
+    .begin         = prometheus_json_begin,
+    .family        = prometheus_json_family,
+    .family_end    = prometheus_json_family_end,
+    .sample_u64    = prometheus_json_sample_u64,
+    .sample_i64    = prometheus_json_sample_i64,
+    .sample_double = prometheus_json_sample_double,
+    .histogram     = prometheus_json_histogram,
+    .end           = prometheus_json_end,
+};
+
+/*
+ * InfluxDB line protocol, laid out as Telegraf does for Prometheus
+ * metrics: one line per sample in the "prometheus" measurement, with
+ * the labels as tags and the sample name as the field key.
+ *
+ *   prometheus,host=node1,method=GET http_requests_total=10u
+ *
+ * Tag values have commas, equals signs, spaces and backslashes escaped.
+ * Line protocol cannot represent NaN, so such samples are left out,
+ * as are labels with empty values, which it does not allow as tags.
+ * Lines carry no timestamp and take the time of their arrival.
+ */
+
+static void
+prometheus_writer_influx_escape(
+    struct prometheus_writer *writer,
+    const char               *str)
+{
+    const char *ch, *run;
+
+    for (ch = run = str; *ch; ch++) {
+        if (*ch != ',' && *ch != '=' && *ch != ' ' && *ch != '\\') {
+            continue;
+        }
+
+        prometheus_writer_write(writer, run, ch - run);
+        prometheus_writer_write(writer, "\\", 1);
+
+        run = ch;
+    }
+
+    prometheus_writer_write(writer, run, ch - run);
+} /* prometheus_writer_influx_escape */
+
+static void
+prometheus_influx_family(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    const char                    *type,
+    const char                    *help)
+{
+    /* Line protocol has no notion of a family */
+} /* prometheus_influx_family */
+
+static void
+prometheus_influx_family_end(struct prometheus_writer *writer)
+{
+} /* prometheus_influx_family_end */
+
+static void
+prometheus_influx_series(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    struct prometheus_histogram   *histogram,
+    int                            bucket)
+{
+    struct prometheus_metrics *metrics = series->metrics;
+    int                        i;
+
+    prometheus_writer_write(writer, "prometheus", 10);
+
+    for (i = 0; i < metrics->label_count; i++) {
+        if (*metrics->label_values[i]) {
+            prometheus_writer_write(writer, ",", 1);
+            prometheus_writer_write(writer, metrics->label_names[i], strlen(metrics->label_names[i]));
+            prometheus_writer_write(writer, "=", 1);
+            prometheus_writer_influx_escape(writer, metrics->label_values[i]);
+        }
+    }
+
+    for (i = 0; i < series->label_count; i++) {
+        if (*series->label_values[i]) {
+            prometheus_writer_write(writer, ",", 1);
+            prometheus_writer_write(writer, series->label_names[i], prometheus_string_length(series->label_names[i]));
+            prometheus_writer_write(writer, "=", 1);
+            prometheus_writer_influx_escape(writer, series->label_values[i]);
+        }
+    }
+
+    if (histogram) {
+        prometheus_writer_write(writer, ",le=", 4);
+        prometheus_writer_threshold(writer, histogram, bucket);
+    }
+
+    prometheus_writer_write(writer, " ", 1);
+    prometheus_writer_write(writer, base->name, prometheus_string_length(base->name));
+    prometheus_writer_write(writer, suffix, strlen(suffix));
+    prometheus_writer_write(writer, "=", 1);
+} /* prometheus_influx_series */
+
+/* Integer fields carry a type suffix, without which line protocol reads them as floats */
+
+static inline void
+prometheus_influx_u64_line(
+    struct prometheus_writer *writer,
+    uint64_t                  value)
+{
+    prometheus_writer_u64(writer, value);
+    prometheus_writer_write(writer, "u\n", 2);
+} /* prometheus_influx_u64_line */
+
+static inline void
+prometheus_influx_i64_line(
+    struct prometheus_writer *writer,
+    int64_t                   value)
+{
+    prometheus_writer_i64(writer, value);
+    prometheus_writer_write(writer, "i\n", 2);
+} /* prometheus_influx_i64_line */
+
+static void
+prometheus_influx_sample_u64(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    uint64_t                       value)
+{
+    prometheus_influx_series(writer, base, suffix, series, NULL, 0);
+    prometheus_influx_u64_line(writer, value);
+} /* prometheus_influx_sample_u64 */
+
+static void
+prometheus_influx_sample_i64(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    int64_t                        value)
+{
+    prometheus_influx_series(writer, base, suffix, series, NULL, 0);
+    prometheus_influx_i64_line(writer, value);
+} /* prometheus_influx_sample_i64 */
+
+static void
+prometheus_influx_sample_double(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    const char                    *suffix,
+    struct prometheus_series_base *series,
+    double                         value)
+{
+    if (!isfinite(value)) {
+        return;
+    }
+
+    prometheus_influx_series(writer, base, suffix, series, NULL, 0);
+    prometheus_writer_printf(writer, "%.9g\n", value);
+} /* prometheus_influx_sample_double */
+
+static void
+prometheus_influx_histogram(
+    struct prometheus_writer      *writer,
+    struct prometheus_metric_base *base,
+    struct prometheus_histogram   *histogram,
+    struct prometheus_series_base *series,
+    const uint64_t                *buckets,
+    uint64_t                       sum,
+    uint64_t                       count)
+{
+    int i;
+
+    for (i = 0; i < histogram->count; i++) {
+        prometheus_influx_series(writer, base, "_bucket", series, histogram, i);
+        prometheus_influx_u64_line(writer, buckets[i]);
+    }
+
+    prometheus_influx_series(writer, base, "_sum", series, NULL, 0);
+    prometheus_influx_u64_line(writer, sum);
+
+    prometheus_influx_series(writer, base, "_count", series, NULL, 0);
+    prometheus_influx_u64_line(writer, count);
+} /* prometheus_influx_histogram */
+
+static const struct prometheus_encoder prometheus_influx_encoder = {
+    .family        = prometheus_influx_family,
+    .family_end    = prometheus_influx_family_end,
+    .sample_u64    = prometheus_influx_sample_u64,
+    .sample_i64    = prometheus_influx_sample_i64,
+    .sample_double = prometheus_influx_sample_double,
+    .histogram     = prometheus_influx_histogram,
+};
+
+static const struct prometheus_encoder *prometheus_encoders[] = {
+    [PROMETHEUS_FORMAT_TEXT]   = &prometheus_text_encoder,
+    [PROMETHEUS_FORMAT_JSON]   = &prometheus_json_encoder,
+    [PROMETHEUS_FORMAT_INFLUX] = &prometheus_influx_encoder,
+};
+
+static void
+prometheus_metrics_render_histogram(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    struct prometheus_histogram           *histogram,
+    const struct prometheus_scrape_filter *filter)
+{
+    struct prometheus_histogram        *peer;
+    struct prometheus_histogram_series *series;
+    struct prometheus_rollup_input     *inputs = NULL, *input;
+    uint64_t                           *dst;
+    uint64_t                            sum, total, nb;
+    char                                help[PROMETHEUS_HELP_SIZE];
+    int                                 i, n, num_peers = 0, rollups = 0, sampled = 0, min_max = 0, window_slots = 0;
+
+    for (peer = histogram; peer; peer = peer->peer) {
+        prometheus_scrape_lock(metrics, &peer->lock);
+
+        num_peers++;
+        rollups |= peer->base.rollups != NULL;
+        sampled |= peer->sample_every != 0;
+        min_max |= peer->min_max;
+
+        if (!window_slots) {
+            window_slots = peer->window_slots;
+        }
+    }
+
+    if (rollups) {
+        inputs = prometheus_calloc(num_peers, sizeof(*inputs));
+    }
+
+    writer->encoder->family(writer, &histogram->base, "", histogram->base.type, histogram->base.help);
+
+    for (peer = histogram, input = inputs; peer; peer = peer->peer, input += !!input) {
+        n  = 0;
+        nb = peer->count;
+
+        if (peer->base.rollups) {
+            prometheus_rollup_input_init(input, &peer->base, peer->num_series, nb, 0);
+        }
+
+        list_foreach(peer->series, series)
+        {
+            i = n++;
+
+            if (prometheus_scrape_filter_skip(peer->base.metrics, filter, &series->base)) {
+                continue;
+            }
+
+            /* Series feeding rollups are read straight into the rollup input */
+            dst = peer->base.rollups ? input->values + i * nb : series->buckets;
+
+            prometheus_histogram_series_read(peer->base.metrics, series, dst, &sum, &total);
+            prometheus_histogram_series_scale(series, dst, &sum, &total);
+
+            if (peer->min_max) {
+                prometheus_histogram_series_window(peer->base.metrics, series);
+            }
+
+            if (peer->base.rollups) {
+                input->series[i] = &series->base;
+                input->sums[i]   = sum;
+                input->counts[i] = total;
+            }
+
+            if (peer->base.rollup_replace) {
+                continue;
+            }
+
+            writer->encoder->histogram(writer, &peer->base, peer, &series->base, dst, sum, total);
+        }
+
+        if (peer->base.rollups) {
+            input->num_series = n;
+            prometheus_metrics_render_rollups_replacing(writer, input);
+        }
+    }
+
+    writer->encoder->family_end(writer);
+
+    if (rollups) {
+        prometheus_metrics_render_rollup_families(writer, inputs, num_peers);
+
+        for (i = 0; i < num_peers; i++) {
+            prometheus_rollup_input_release(&inputs[i]);
+        }
+
+        free(inputs);
+    }
+
+    if (sampled) {
+        snprintf(help, sizeof(help), "Observations of %s per recorded sample", histogram->base.name);
+
+        writer->encoder->family(writer, &histogram->base, "_sample_interval", "gauge", help);
+
+        for (peer = histogram; peer; peer = peer->peer) {
+            if (!peer->sample_every) {
+                continue;
+            }
+
+            list_foreach(peer->series, series)
+            {
+                if (prometheus_scrape_filter_skip(peer->base.metrics, filter, &series->base)) {
+                    continue;
+                }
+
+                writer->encoder->sample_u64(writer, &peer->base, "_sample_interval", &series->base,
+                                            peer->sample_every);
+            }
+        }
+
+        writer->encoder->family_end(writer);
+    }
+
+    if (min_max) {
+        prometheus_metrics_render_extreme(metrics, writer, histogram, filter, 0);
+        prometheus_metrics_render_extreme(metrics, writer, histogram, filter, 1);
+    }
+
+    if (window_slots) {
+        prometheus_metrics_render_window(metrics, writer, histogram, filter, window_slots, 0);
+        prometheus_metrics_render_window(metrics, writer, histogram, filter, window_slots, 1);
+    }
+
+    for (peer = histogram; peer; peer = peer->peer) {
+        pthread_mutex_unlock(&peer->lock);
+    }
+} /* prometheus_metrics_render_histogram */
+
+static void
+prometheus_metrics_render_metric(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    enum prometheus_metric_type            type,
+    void                                  *metric,
+    const struct prometheus_scrape_filter *filter)
+{
+    if (!prometheus_scrape_filter_selects(metrics, type, metric, filter)) {
+        return;
+    }
+
+    switch (type) {
+        case PROMETHEUS_METRIC_COUNTER:
+            prometheus_metrics_render_counter(metrics, writer, metric, filter);
+            break;
+        case PROMETHEUS_METRIC_GAUGE:
+            prometheus_metrics_render_gauge(metrics, writer, metric, filter);
+            break;
+        case PROMETHEUS_METRIC_HISTOGRAM:
+            prometheus_metrics_render_histogram(metrics, writer, metric, filter);
+            break;
+    } /* switch */
+} /* prometheus_metrics_render_metric */
+
+static int
+prometheus_scrape_filter_match_name(
+    const struct prometheus_scrape_filter *filter,
+    const char                            *name)
+{
+    int i;
+
+    if (!filter || (!filter->num_names && !filter->num_prefixes)) {
+        return 1;
+    }
+
+    for (i = 0; i < filter->num_names; i++) {
+        if (strcmp(name, filter->names[i]) == 0) {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < filter->num_prefixes; i++) {
+        if (strncmp(name, filter->prefixes[i], strlen(filter->prefixes[i])) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+} /* prometheus_scrape_filter_match_name */
+
+/*
+ * A registry with children is rendered as a whole tree, so that metrics
+ * of the same name in several registries come out as a single family.
+ * Registries are walked parent before child, each in its usual order,
+ * and a metric is rendered with every metric of its name elsewhere in
+ * the tree chained to it as peers.  The locks of every registry in the
+ * tree are held for the duration, parent before child, which keeps the
+ * tree stable and the peer chains private to this scrape.
+ */
+
+static int
+prometheus_metrics_index_find(
+    struct prometheus_metrics *metrics,
+    const char                *name);
+
+static void
+prometheus_metrics_tree_lock(
+    struct prometheus_metrics *scraper,
+    struct prometheus_metrics *metrics)
+{
+    struct prometheus_metrics *child;
+
+    /* Index entries already merged into a family in this scrape are marked with the new generation */
+    metrics->filter_gen++;
+
+    list_foreach(metrics->children, child)
+    {
+        prometheus_scrape_lock(scraper, &child->lock);
+        prometheus_metrics_tree_lock(scraper, child);
+    }
+} /* prometheus_metrics_tree_lock */
+
+static void
+prometheus_metrics_tree_unlock(struct prometheus_metrics *metrics)
+{
+    struct prometheus_metrics *child;
+
+    list_foreach(metrics->children, child)
+    {
+        prometheus_metrics_tree_unlock(child);
+        pthread_mutex_unlock(&child->lock);
+    }
+} /* prometheus_metrics_tree_unlock */
+
+/* Set the next metric in the peer chain of a metric, returning the previous one */
+
+static void *
+prometheus_metric_set_peer(
+    enum prometheus_metric_type type,
+    void                       *metric,
+    void                       *peer)
+{
+    void *prev = NULL;
+
+    switch (type) {
+        case PROMETHEUS_METRIC_COUNTER:
+            prev                                          = ((struct prometheus_counter *) metric)->peer;
+            ((struct prometheus_counter *) metric)->peer = peer;
+            break;
+        case PROMETHEUS_METRIC_GAUGE:
+            prev                                        = ((struct prometheus_gauge *) metric)->peer;
+            ((struct prometheus_gauge *) metric)->peer = peer;
+            break;
+        case PROMETHEUS_METRIC_HISTOGRAM:
+            prev                                            = ((struct prometheus_histogram *) metric)->peer;
+            ((struct prometheus_histogram *) metric)->peer = peer;
+            break;
+    } /* switch */
+
+    return prev;
+} /* prometheus_metric_set_peer */
+
+/*
+ * Chain the metrics of a name and type not yet rendered by this scrape
+ * after tail, in tree order, marking them rendered.  Returns the new
+ * tail of the chain.
+ */
+
+static void *
+prometheus_metrics_tree_chain(
+    struct prometheus_metrics  *metrics,
+    const char                 *name,
+    enum prometheus_metric_type type,
+    void                       *tail,
+    void                      **head)
+{
+    struct prometheus_metrics      *child;
+    struct prometheus_metric_index *entry;
+    int                             pos;
+
+    for (pos = prometheus_metrics_index_find(metrics, name);
+         pos < metrics->index_count && strcmp(metrics->index[pos].name, name) == 0;
+         pos++) {
+        entry = &metrics->index[pos];
+
+        if (entry->type != type || entry->filter_gen == metrics->filter_gen) {
+            continue;
+        }
+
+        entry->filter_gen = metrics->filter_gen;
+
+        if (tail) {
+            prometheus_metric_set_peer(type, tail, entry->metric);
+        } else {
+            *head = entry->metric;
+        }
+
+        tail = entry->metric;
+    }
+
+    list_foreach(metrics->children, child)
+    {
+        tail = prometheus_metrics_tree_chain(child, name, type, tail, head);
+    }
+
+    return tail;
+} /* prometheus_metrics_tree_chain */
+
+static void
+prometheus_metrics_render_merged(
+    struct prometheus_metrics             *scraper,
+    struct prometheus_writer              *writer,
+    const struct prometheus_scrape_filter *filter,
+    enum prometheus_metric_type            type,
+    const char                            *name)
+{
+    void *head = NULL, *metric, *next;
+
+    if (!prometheus_scrape_filter_match_name(filter, name) ||
+        !prometheus_metrics_tree_chain(scraper, name, type, NULL, &head)) {
+        return;
+    }
+
+    prometheus_metrics_render_metric(scraper, writer, type, head, filter);
+
+    for (metric = head; metric; metric = next) {
+        next = prometheus_metric_set_peer(type, metric, NULL);
+    }
+} /* prometheus_metrics_render_merged */
+
+static void
+prometheus_metrics_render_branch(
+    struct prometheus_metrics             *scraper,
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    const struct prometheus_scrape_filter *filter)
+{
+    struct prometheus_counter   *counter;
+    struct prometheus_gauge     *gauge;
+    struct prometheus_histogram *histogram;
+    struct prometheus_metrics   *child;
+
+    list_foreach(metrics->counters, counter)
+    {
+        prometheus_metrics_render_merged(scraper, writer, filter, PROMETHEUS_METRIC_COUNTER, counter->base.name);
+    }
+
+    list_foreach(metrics->gauges, gauge)
+    {
+        prometheus_metrics_render_merged(scraper, writer, filter, PROMETHEUS_METRIC_GAUGE, gauge->base.name);
+    }
+
+    list_foreach(metrics->histograms, histogram)
+    {
+        prometheus_metrics_render_merged(scraper, writer, filter, PROMETHEUS_METRIC_HISTOGRAM, histogram->base.name);
+    }
+
+    list_foreach(metrics->children, child)
+    {
+        prometheus_metrics_render_branch(scraper, child, writer, filter);
+    }
+} /* prometheus_metrics_render_branch */
+
+static void
+prometheus_metrics_render_tree(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    const struct prometheus_scrape_filter *filter)
+{
+    prometheus_metrics_tree_lock(metrics, metrics);
+
+    if (filter) {
+        prometheus_scrape_filter_resolve(metrics, filter);
+    }
+
+    prometheus_metrics_render_branch(metrics, metrics, writer, filter);
+
+    if (filter) {
+        prometheus_scrape_filter_release(metrics);
+    }
+
+    prometheus_metrics_tree_unlock(metrics);
+} /* prometheus_metrics_render_tree */
+
+/*
+ * Render the full exposition through the provided writer, in the
+ * format of its encoder.  The caller must hold metrics->lock.
+ */
+
+static void
+prometheus_metrics_render(
+    struct prometheus_metrics *metrics,
+    struct prometheus_writer  *writer)
+{
+    struct prometheus_counter   *counter;
+    struct prometheus_gauge     *gauge;
+    struct prometheus_histogram *histogram;
+    struct prometheus_metrics   *snapshot;
+
+    /* Shared contexts are rendered from the segment to include other processes */
+    if (metrics->segment) {
+        snapshot = prometheus_segment_snapshot(metrics->segment);
+
+        if (snapshot) {
+            prometheus_metrics_render(snapshot, writer);
+            prometheus_writer_sync(writer);
+            prometheus_metrics_destroy(snapshot);
+        }
+        return;
+    }
+
+    if (metrics->children) {
+        prometheus_metrics_render_tree(metrics, writer, NULL);
+        return;
+    }
+
+    list_foreach(metrics->counters, counter)
+    {
+        prometheus_metrics_render_counter(metrics, writer, counter, NULL);
+    }
+
+    list_foreach(metrics->gauges, gauge)
+    {
+        prometheus_metrics_render_gauge(metrics, writer, gauge, NULL);
+    }
+
+    list_foreach(metrics->histograms, histogram)
+    {
+        prometheus_metrics_render_histogram(metrics, writer, histogram, NULL);
+    }
+} /* prometheus_metrics_render */
+
+static void
+prometheus_metrics_render_document(
+    struct prometheus_metrics *metrics,
+    struct prometheus_writer  *writer)
+{
+    if (writer->encoder->begin) {
+        writer->encoder->begin(writer);
+    }
+
+    prometheus_metrics_render(metrics, writer);
+
+    if (writer->encoder->end) {
+        writer->encoder->end(writer);
+    }
+} /* prometheus_metrics_render_document */
+
+/*
+ * Position of the first index entry whose name does not sort before
+ * the given name.
+ */
+
+static int
+prometheus_metrics_index_find(
+    struct prometheus_metrics *metrics,
+    const char                *name)
+{
+    int lo = 0, hi = metrics->index_count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if (strcmp(metrics->index[mid].name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+} /* prometheus_metrics_index_find */
+
+static void
+prometheus_metrics_index_insert(
+    struct prometheus_metrics  *metrics,
+    const char                 *name,
+    enum prometheus_metric_type type,
+    void                       *metric)
+{
+    int pos, size;
+
+    if (metrics->index_count == metrics->index_size) {
+        size = metrics->index_size ? 2 * metrics->index_size : 16;
+
+        prometheus_self_account(metrics, 0, 0, (int64_t) (size - metrics->index_size) * sizeof(*metrics->index));
+
+        metrics->index      = realloc(metrics->index, size * sizeof(*metrics->index));
+        metrics->index_size = size;
+
+        if (!metrics->index) {
+            abort();
+        }
+    }
+
+    pos = prometheus_metrics_index_find(metrics, name);
+
+    memmove(&metrics->index[pos + 1], &metrics->index[pos], (metrics->index_count - pos) * sizeof(*metrics->index));
+
+    metrics->index[pos].name       = name;
+    metrics->index[pos].type       = type;
+    metrics->index[pos].metric     = metric;
+    metrics->index[pos].filter_gen = 0;
+
+    metrics->index_count++;
+} /* prometheus_metrics_index_insert */
+
+static void
+prometheus_metrics_index_remove(
+    struct prometheus_metrics *metrics,
+    const char                *name,
+    void                      *metric)
+{
+    int pos;
+
+    for (pos = prometheus_metrics_index_find(metrics, name); pos < metrics->index_count; pos++) {
+        if (metrics->index[pos].metric == metric) {
+            memmove(&metrics->index[pos], &metrics->index[pos + 1],
+                    (metrics->index_count - pos - 1) * sizeof(*metrics->index));
+            metrics->index_count--;
+            return;
+        }
+    }
+} /* prometheus_metrics_index_remove */
+
+/*
+ * Render an index entry unless an earlier name or prefix of the same
+ * scrape already matched it.
+ */
+
+static void
+prometheus_metrics_render_entry(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    const struct prometheus_scrape_filter *filter,
+    struct prometheus_metric_index        *entry)
+{
+    if (entry->filter_gen == metrics->filter_gen) {
+        return;
+    }
+
+    entry->filter_gen = metrics->filter_gen;
+
+    prometheus_metrics_render_metric(metrics, writer, entry->type, entry->metric, filter);
+} /* prometheus_metrics_render_entry */
+
+/*
+ * Render the metrics selected by a filter, looking each name and prefix
+ * up in the index so that metrics which do not match are never locked.
+ * The caller must hold metrics->lock.
+ */
+
+static void
+prometheus_metrics_render_filtered(
+    struct prometheus_metrics             *metrics,
+    struct prometheus_writer              *writer,
+    const struct prometheus_scrape_filter *filter)
+{
+    struct prometheus_metrics *snapshot;
+    int                        i, pos, len;
+
+    if (metrics->segment) {
+        snapshot = prometheus_segment_snapshot(metrics->segment);
+
+        if (snapshot) {
+            prometheus_metrics_render_filtered(snapshot, writer, filter);
+            prometheus_writer_sync(writer);
+            prometheus_metrics_destroy(snapshot);
+        }
+        return;
+    }
+
+    if (metrics->children) {
+        prometheus_metrics_render_tree(metrics, writer, filter);
+        return;
+    }
+
+    metrics->filter_gen++;
+
+    prometheus_scrape_filter_resolve(metrics, filter);
+
+    for (pos = 0; !filter->num_names && !filter->num_prefixes && pos < metrics->index_count; pos++) {
+        prometheus_metrics_render_entry(metrics, writer, filter, &metrics->index[pos]);
+    }
+
+    for (i = 0; i < filter->num_names; i++) {
+        for (pos = prometheus_metrics_index_find(metrics, filter->names[i]);
+             pos < metrics->index_count && strcmp(metrics->index[pos].name, filter->names[i]) == 0;
+             pos++) {
+            prometheus_metrics_render_entry(metrics, writer, filter, &metrics->index[pos]);
+        }
+    }
+
+    for (i = 0; i < filter->num_prefixes; i++) {
+        len = strlen(filter->prefixes[i]);
+
+        for (pos = prometheus_metrics_index_find(metrics, filter->prefixes[i]);
+             pos < metrics->index_count && strncmp(metrics->index[pos].name, filter->prefixes[i], len) == 0;
+             pos++) {
+            prometheus_metrics_render_entry(metrics, writer, filter, &metrics->index[pos]);
+        }
+    }
+
+    prometheus_scrape_filter_release(metrics);
+} /* prometheus_metrics_render_filtered */
+
+static int
+prometheus_compressor_grow(struct prometheus_compressor *compressor)
+{
+    if (!compressor->grow) {
+        return -1;
+    }
+
+    compressor->out_size *= 2;
+    compressor->out       = realloc(compressor->out, compressor->out_size);
+
+    if (!compressor->out) {
+        abort();
+    }
+
+    return 0;
+} /* prometheus_compressor_grow */
+
+static int
+prometheus_compressor_begin(
+    struct prometheus_compressor *compressor,
+    enum prometheus_encoding      encoding,
+    char                         *buffer,
+    int                           buffer_size,
+    int                           grow)
+{
+    compressor->encoding   = encoding;
+    compressor->out        = buffer;
+    compressor->out_size   = buffer_size;
+    compressor->out_length = 0;
+    compressor->grow       = grow;
+
+    if (!compressor->staging) {
+        compressor->staging = prometheus_calloc(1, PROMETHEUS_STAGING_SIZE);
+    }
+
+    switch (encoding) {
+#ifdef PROMETHEUS_HAVE_ZLIB
+        case PROMETHEUS_ENCODING_GZIP:
+            if (compressor->zstream_ready) {
+                return deflateReset(&compressor->zstream) == Z_OK ? 0 : -1;
+            }
+
+            /* windowBits 15 + 16 selects the gzip wrapper instead of zlib */
+            if (deflateInit2(&compressor->zstream, PROMETHEUS_GZIP_LEVEL, Z_DEFLATED,
+                             15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return -1;
+            }
+
+            compressor->zstream_ready = 1;
+            return 0;
+#endif /* ifdef PROMETHEUS_HAVE_ZLIB */
+#ifdef PROMETHEUS_HAVE_ZSTD
+        case PROMETHEUS_ENCODING_ZSTD:
+            if (compressor->zstd) {
+                return ZSTD_isError(ZSTD_CCtx_reset(compressor->zstd, ZSTD_reset_session_only)) ? -1 : 0;
+            }
+
+            compressor->zstd = ZSTD_createCCtx();
+
+            if (!compressor->zstd) {
+                abort();
+            }
+
+            ZSTD_CCtx_setParameter(compressor->zstd, ZSTD_c_compressionLevel, PROMETHEUS_ZSTD_LEVEL);
+            return 0;
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
+        default:
+            return -1;
+    } /* switch */
+} /* prometheus_compressor_begin */
+
+static int
+prometheus_compressor_consume(
+    struct prometheus_compressor *compressor,
+    const char                   *data,
+    int                           length,
+    int                           finish)
+{
+    switch (compressor->encoding) {
+#ifdef PROMETHEUS_HAVE_ZLIB
+        case PROMETHEUS_ENCODING_GZIP:
+        {
+            z_stream *zs = &compressor->zstream;
+            int       rc;
+
+            zs->next_in  = (Bytef *) data;
+            zs->avail_in = length;
+
+            for (;;) {
+                zs->next_out  = (Bytef *) compressor->out + compressor->out_length;
+                zs->avail_out = compressor->out_size - compressor->out_length;
+
+                rc = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+
+                compressor->out_length = compressor->out_size - zs->avail_out;
+
+                if (rc == Z_STREAM_ERROR) {
+                    return -1;
+                }
+
+                if (finish ? rc == Z_STREAM_END : zs->avail_in == 0) {
+                    return 0;
+                }
+
+                if (zs->avail_out == 0 && prometheus_compressor_grow(compressor)) {
+                    return -1;
+                }
+            }
+        }
+#endif /* ifdef PROMETHEUS_HAVE_ZLIB */
+#ifdef PROMETHEUS_HAVE_ZSTD
+        case PROMETHEUS_ENCODING_ZSTD:
+        {
+            ZSTD_inBuffer  in = { data, length, 0 };
+            ZSTD_outBuffer out;
+            size_t         remaining;
+
+            for (;;) {
+                out.dst  = compressor->out;
+                out.size = compressor->out_size;
+                out.pos  = compressor->out_length;
+
+                remaining = ZSTD_compressStream2(compressor->zstd, &out, &in,
+                                                 finish ? ZSTD_e_end : ZSTD_e_continue);
+
+                compressor->out_length = out.pos;
+
+                if (ZSTD_isError(remaining)) {
+                    return -1;
+                }
+
+                if (finish ? remaining == 0 : in.pos == in.size) {
+                    return 0;
+                }
+
+                if (out.pos == out.size && prometheus_compressor_grow(compressor)) {
+                    return -1;
+                }
+            }
+        }
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
+        default:
+            return -1;
+    } /* switch */
+} /* prometheus_compressor_consume */
+
+static int
+prometheus_compressor_flush(
+    struct prometheus_writer *writer,
+    int                       need)
+{
+    struct prometheus_compressor *compressor = writer->private_data;
+
+    if (need >= PROMETHEUS_STAGING_SIZE) {
+        return -1;
+    }
+
+    if (prometheus_compressor_consume(compressor, writer->base, writer->bp - writer->base, 0)) {
+        return -1;
+    }
+
+    writer->bp = writer->base;
+
+    return 0;
+} /* prometheus_compressor_flush */
+
+/* Compress the pending staging buffer and then a write too large for it */
+
+static int
+prometheus_compressor_direct(
+    struct prometheus_writer *writer,
+    const char               *str,
+    int                       len)
+{
+    if (prometheus_compressor_flush(writer, 0)) {
+        return -1;
+    }
+
+    return prometheus_compressor_consume(writer->private_data, str, len, 0);
+} /* prometheus_compressor_direct */
+
+static void
+prometheus_compressor_destroy(struct prometheus_compressor *compressor)
+{
+#ifdef PROMETHEUS_HAVE_ZLIB
+    if (compressor->zstream_ready) {
+        deflateEnd(&compressor->zstream);
+    }
+#endif /* ifdef PROMETHEUS_HAVE_ZLIB */
+#ifdef PROMETHEUS_HAVE_ZSTD
+    ZSTD_freeCCtx(compressor->zstd);
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
+
+    free(compressor->staging);
+} /* prometheus_compressor_destroy */
+
+static int
+prometheus_encoding_supported(enum prometheus_encoding encoding)
+{
+    switch (encoding) {
+        case PROMETHEUS_ENCODING_IDENTITY:
+            return 1;
+#ifdef PROMETHEUS_HAVE_ZLIB
+        case PROMETHEUS_ENCODING_GZIP:
+            return 1;
+#endif /* ifdef PROMETHEUS_HAVE_ZLIB */
+#ifdef PROMETHEUS_HAVE_ZSTD
+        case PROMETHEUS_ENCODING_ZSTD:
+            return 1;
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
+        default:
+            return 0;
+    } /* switch */
+} /* prometheus_encoding_supported */
+
+/*
+ * Take metrics->lock for a scrape and refresh the self metric gauges
+ * from the bookkeeping totals so that the scrape reports them.
+ */
+
+static inline void
+prometheus_self_scrape_begin(struct prometheus_metrics *metrics)
+{
+    struct prometheus_self_metrics *self = &metrics->self;
+
+    prometheus_scrape_lock(metrics, &metrics->lock);
+
+    if (self->series_gauge) {
+        prometheus_gauge_set(self->series_gauge, __atomic_load_n(&self->series, __ATOMIC_RELAXED));
+        prometheus_gauge_set(self->handles_gauge, __atomic_load_n(&self->handles, __ATOMIC_RELAXED));
+        prometheus_gauge_set(self->allocated_gauge, __atomic_load_n(&self->allocated_bytes, __ATOMIC_RELAXED));
+    }
+} /* prometheus_self_scrape_begin */
+
+/*
+ * Record a completed scrape.  Called with metrics->lock still held,
+ * which serializes updates to the self metric handles.
+ */
+
+static inline void
+prometheus_self_scrape_end(
+    struct prometheus_metrics *metrics,
+    uint64_t                   start,
+    int                        length)
+{
+    struct prometheus_self_metrics *self = &metrics->self;
+    uint64_t                        elapsed_us;
+
+    if (!self->scrape_duration) {
+        return;
+    }
+
+    elapsed_us = (prometheus_now_ns() - start) / 1000;
+
+    prometheus_histogram_sample(self->scrape_duration, elapsed_us ? elapsed_us : 1);
+    prometheus_counter_increment(self->scrapes);
+
+    if (length > 0) {
+        prometheus_counter_add(self->scrape_bytes, length);
+    }
+} /* prometheus_self_scrape_end */
+
+static int
+prometheus_writer_grow(
+    struct prometheus_writer *writer,
+    int                       need)
+{
+    int used = writer->bp - writer->base;
+    int size = writer->end - writer->base;
+
+    while (size - used <= need) {
+        size *= 2;
+    }
+
+    writer->base = realloc(writer->base, size);
+
+    if (!writer->base) {
+        abort();
+    }
+
+    writer->bp  = writer->base + used;
+    writer->end = writer->base + size;
+
+    return 0;
+} /* prometheus_writer_grow */
+
+/*
+ * Render a scrape in the requested encoding into *buffer.  If grow is
+ * set, *buffer must be heap allocated and is reallocated as required,
+ * with the final allocation and its size passed back to the caller.
+ * Returns the output length or -1.
+ */
+
+static int
+prometheus_metrics_render_encoded(
+    struct prometheus_metrics       *metrics,
+    const struct prometheus_encoder *encoder,
+    enum prometheus_encoding         encoding,
+    char                           **buffer,
+    int                             *buffer_size,
+    int                              grow)
+{
+    struct prometheus_compressor *compressor = &metrics->compressor;
+    struct prometheus_writer      writer     = { 0 };
+    int                           length     = -1;
+    uint64_t                      start      = prometheus_now_ns();
+
+    writer.encoder = encoder;
+
+    prometheus_self_scrape_begin(metrics);
+
+    if (encoding == PROMETHEUS_ENCODING_IDENTITY) {
+
+        writer.base  = *buffer;
+        writer.bp    = *buffer;
+        writer.end   = *buffer + *buffer_size;
+        writer.flush = grow ? prometheus_writer_grow : NULL;
+
+        prometheus_metrics_render_document(metrics, &writer);
+
+        *buffer      = writer.base;
+        *buffer_size = writer.end - writer.base;
+
+        if (!writer.error) {
+            *writer.bp = '\0';
+            length     = writer.bp - writer.base;
+        } else {
+            **buffer = '\0';
+        }
+
+    } else if (prometheus_compressor_begin(compressor, encoding, *buffer, *buffer_size, grow) == 0) {
+
+        writer.base         = compressor->staging;
+        writer.bp           = compressor->staging;
+        writer.end          = compressor->staging + PROMETHEUS_STAGING_SIZE;
+        writer.flush        = prometheus_compressor_flush;
+        writer.direct       = prometheus_compressor_direct;
+        writer.private_data = compressor;
+
+        prometheus_metrics_render_document(metrics, &writer);
+
+        if (!writer.error &&
+            prometheus_compressor_consume(compressor, writer.base, writer.bp - writer.base, 1) == 0) {
+            length = compressor->out_length;
+        }
+
+        *buffer      = compressor->out;
+        *buffer_size = compressor->out_size;
+    }
+
+    prometheus_self_scrape_end(metrics, start, length);
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return length;
+} /* prometheus_metrics_render_encoded */
+
+PUBLIC int
+prometheus_metrics_scrape(
+    struct prometheus_metrics *metrics,
+    char                      *buffer,
+    int                        buffer_size)
+{
+    if (!metrics || !buffer || buffer_size <= 0) {
+        return -1;
+    }
+
+    return prometheus_metrics_render_encoded(metrics, &prometheus_text_encoder, PROMETHEUS_ENCODING_IDENTITY,
+                                             &buffer, &buffer_size, 0);
 } /* prometheus_metrics_scrape */
 
-PUBLIC struct prometheus_counter *
-prometheus_metrics_create_counter(
+PUBLIC int
+prometheus_metrics_scrape_format(
+    struct prometheus_metrics *metrics,
+    enum prometheus_format     format,
+    char                      *buffer,
+    int                        buffer_size)
+{
+    if (!metrics || !buffer || buffer_size <= 0 ||
+        (unsigned) format >= sizeof(prometheus_encoders) / sizeof(prometheus_encoders[0])) {
+        return -1;
+    }
+
+    return prometheus_metrics_render_encoded(metrics, prometheus_encoders[format], PROMETHEUS_ENCODING_IDENTITY,
+                                             &buffer, &buffer_size, 0);
+} /* prometheus_metrics_scrape_format */
+
+PUBLIC int
+prometheus_metrics_scrape_compressed(
+    struct prometheus_metrics *metrics,
+    enum prometheus_encoding   encoding,
+    char                      *buffer,
+    int                        buffer_size)
+{
+    if (!metrics || !buffer || buffer_size <= 0) {
+        return -1;
+    }
+
+    return prometheus_metrics_render_encoded(metrics, &prometheus_text_encoder, encoding, &buffer, &buffer_size, 0);
+} /* prometheus_metrics_scrape_compressed */
+
+/*
+ * Scatter/gather scrapes pass the exposition to the callback in batches
+ * of iovecs, suitable for writev() or sendmsg().  The iovecs are only
+ * valid during the callback, which runs with the registry locked and so
+ * must not call back into it.  Returns the output length or -1.
+ */
+
+PUBLIC int
+prometheus_metrics_scrape_iov(
+    struct prometheus_metrics     *metrics,
+    prometheus_scrape_iov_callback callback,
+    void                          *private_data)
+{
+    struct prometheus_iov_sink *sink;
+    struct prometheus_writer    writer = { 0 };
+    int                         length = -1;
+    uint64_t                    start  = prometheus_now_ns();
+
+    if (!metrics || !callback) {
+        return -1;
+    }
+
+    sink = prometheus_calloc(1, sizeof(*sink));
+
+    sink->callback     = callback;
+    sink->private_data = private_data;
+    sink->mark         = sink->arena;
+
+    writer.base         = sink->arena;
+    writer.bp           = sink->arena;
+    writer.end          = sink->arena + PROMETHEUS_IOV_ARENA_SIZE;
+    writer.flush        = prometheus_writer_iov_flush;
+    writer.sink         = sink;
+    writer.encoder      = &prometheus_text_encoder;
+
+    prometheus_self_scrape_begin(metrics);
+
+    prometheus_metrics_render(metrics, &writer);
+
+    if (prometheus_writer_flush(&writer, 0) == 0) {
+        length = sink->length;
+    }
+
+    prometheus_self_scrape_end(metrics, start, length);
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    free(sink);
+
+    return length;
+} /* prometheus_metrics_scrape_iov */
+
+/*
+ * Parallel scrapes split the registry into contiguous runs of metrics,
+ * balanced by series count, and render each run into a private buffer
+ * on a pool worker.  The buffers are then concatenated in registry
+ * order, so the result is identical to a serial scrape.  The calling
+ * thread renders the first run itself.  The pool, its task array and
+ * the part buffers are reused across scrapes under metrics->lock.
+ */
+
+struct prometheus_scrape_task {
+    enum prometheus_metric_type type;
+    void                       *metric;
+    uint64_t                    weight;
+};
+
+struct prometheus_scrape_part {
+    struct prometheus_writer writer;
+    int                      first;
+    int                      last;
+};
+
+struct prometheus_scrape_worker {
+    struct prometheus_scrape_pool *pool;
+    pthread_t                      thread;
+    int                            index;
+};
+
+struct prometheus_scrape_pool {
+    struct prometheus_metrics       *metrics;
+    struct prometheus_scrape_worker *workers;
+    int                              num_workers;
+    struct prometheus_scrape_part   *parts;
+    struct prometheus_scrape_task   *tasks;
+    int                              num_tasks;
+    int                              max_tasks;
+    pthread_mutex_t                  lock;
+    pthread_cond_t                   work_cond;
+    pthread_cond_t                   done_cond;
+    uint64_t                         generation;
+    int                              pending;
+    int                              shutdown;
+};
+
+static void
+prometheus_scrape_part_render(
+    struct prometheus_scrape_pool *pool,
+    struct prometheus_scrape_part *part)
+{
+    struct prometheus_scrape_task *task;
+    int                            i;
+
+    part->writer.bp    = part->writer.base;
+    part->writer.error = 0;
+
+    for (i = part->first; i < part->last; i++) {
+        task = &pool->tasks[i];
+
+        switch (task->type) {
+            case PROMETHEUS_METRIC_COUNTER:
+                prometheus_metrics_render_counter(pool->metrics, &part->writer, task->metric, NULL);
+                break;
+            case PROMETHEUS_METRIC_GAUGE:
+                prometheus_metrics_render_gauge(pool->metrics, &part->writer, task->metric, NULL);
+                break;
+            case PROMETHEUS_METRIC_HISTOGRAM:
+                prometheus_metrics_render_histogram(pool->metrics, &part->writer, task->metric, NULL);
+                break;
+        } /* switch */
+    }
+} /* prometheus_scrape_part_render */
+
+static void *
+prometheus_scrape_worker_thread(void *arg)
+{
+    struct prometheus_scrape_worker *worker     = arg;
+    struct prometheus_scrape_pool   *pool       = worker->pool;
+    uint64_t                         generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+
+        while (!pool->shutdown && pool->generation == generation) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+
+        if (pool->shutdown) {
+            break;
+        }
+
+        generation = pool->generation;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        prometheus_scrape_part_render(pool, &pool->parts[worker->index]);
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+} /* prometheus_scrape_worker_thread */
+
+static void
+prometheus_scrape_pool_add_task(
+    struct prometheus_scrape_pool *pool,
+    enum prometheus_metric_type    type,
+    void                          *metric,
+    uint64_t                       weight)
+{
+    if (pool->num_tasks == pool->max_tasks) {
+        pool->max_tasks = pool->max_tasks ? pool->max_tasks * 2 : 64;
+        pool->tasks     = realloc(pool->tasks, pool->max_tasks * sizeof(*pool->tasks));
+
+        if (!pool->tasks) {
+            abort();
+        }
+    }
+
+    pool->tasks[pool->num_tasks].type   = type;
+    pool->tasks[pool->num_tasks].metric = metric;
+    pool->tasks[pool->num_tasks].weight = weight + 1;
+    pool->num_tasks++;
+} /* prometheus_scrape_pool_add_task */
+
+/*
+ * Render the registry in parallel and append the result to the writer.
+ * The caller must hold metrics->lock.
+ */
+
+static void
+prometheus_metrics_render_parallel(
+    struct prometheus_metrics *metrics,
+    struct prometheus_writer  *writer)
+{
+    struct prometheus_scrape_pool *pool = metrics->pool;
+    struct prometheus_counter     *counter;
+    struct prometheus_gauge       *gauge;
+    struct prometheus_histogram   *histogram;
+    struct prometheus_scrape_part *part;
+    uint64_t                       total = 0, cumulative = 0;
+    int                            i, p, num_parts, chunk;
+    const char                    *bp;
+
+    pool->num_tasks = 0;
+
+    /* Series counts are read unlocked; they only steer the partitioning */
+
+    list_foreach(metrics->counters, counter)
+    {
+        prometheus_scrape_pool_add_task(pool, PROMETHEUS_METRIC_COUNTER, counter, counter->num_series);
+    }
+
+    list_foreach(metrics->gauges, gauge)
+    {
+        prometheus_scrape_pool_add_task(pool, PROMETHEUS_METRIC_GAUGE, gauge, gauge->num_series);
+    }
+
+    list_foreach(metrics->histograms, histogram)
+    {
+        prometheus_scrape_pool_add_task(pool, PROMETHEUS_METRIC_HISTOGRAM, histogram,
+                                        histogram->num_series * (histogram->count + 2));
+    }
+
+    for (i = 0; i < pool->num_tasks; i++) {
+        total += pool->tasks[i].weight;
+    }
+
+    num_parts = pool->num_workers + 1;
+
+    for (i = 0, p = 0; p < num_parts; p++) {
+        pool->parts[p].first = i;
+
+        while (i < pool->num_tasks && (p == num_parts - 1 || cumulative < total * (p + 1) / num_parts)) {
+            cumulative += pool->tasks[i].weight;
+            i++;
+        }
+
+        pool->parts[p].last = i;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pool->pending = pool->num_workers;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    prometheus_scrape_part_render(pool, &pool->parts[0]);
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->pending) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    for (p = 0; p < num_parts; p++) {
+        part = &pool->parts[p];
+
+        for (bp = part->writer.base; bp < part->writer.bp; bp += chunk) {
+            chunk = part->writer.bp - bp;
+
+            if (chunk > PROMETHEUS_STAGING_SIZE / 2) {
+                chunk = PROMETHEUS_STAGING_SIZE / 2;
+            }
+
+            prometheus_writer_write(writer, bp, chunk);
+        }
+    }
+} /* prometheus_metrics_render_parallel */
+
+static void
+prometheus_scrape_pool_destroy(struct prometheus_scrape_pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (i = 0; i <= pool->num_workers; i++) {
+        free(pool->parts[i].writer.base);
+    }
+
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->workers);
+    free(pool->parts);
+    free(pool->tasks);
+    free(pool);
+} /* prometheus_scrape_pool_destroy */
+
+PUBLIC int
+prometheus_metrics_set_scrape_threads(
+    struct prometheus_metrics *metrics,
+    int                        num_threads)
+{
+    struct prometheus_scrape_pool *pool = NULL;
+    int                            i;
+
+    if (num_threads < 0) {
+        return -1;
+    }
+
+    if (num_threads > 1) {
+        pool              = prometheus_calloc(1, sizeof(*pool));
+        pool->metrics     = metrics;
+        pool->num_workers = num_threads - 1;
+        pool->workers     = prometheus_calloc(pool->num_workers, sizeof(*pool->workers));
+        pool->parts       = prometheus_calloc(num_threads, sizeof(*pool->parts));
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work_cond, NULL);
+        pthread_cond_init(&pool->done_cond, NULL);
+
+        for (i = 0; i < num_threads; i++) {
+            pool->parts[i].writer.base    = prometheus_calloc(1, PROMETHEUS_STAGING_SIZE);
+            pool->parts[i].writer.bp      = pool->parts[i].writer.base;
+            pool->parts[i].writer.end     = pool->parts[i].writer.base + PROMETHEUS_STAGING_SIZE;
+            pool->parts[i].writer.flush   = prometheus_writer_grow;
+            pool->parts[i].writer.encoder = &prometheus_text_encoder;
+        }
+
+        for (i = 0; i < pool->num_workers; i++) {
+            pool->workers[i].pool  = pool;
+            pool->workers[i].index = i + 1;
+
+            if (pthread_create(&pool->workers[i].thread, NULL, prometheus_scrape_worker_thread, &pool->workers[i])) {
+                pool->num_workers = i;
+                prometheus_scrape_pool_destroy(pool);
+                return -1;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&metrics->lock);
+
+    if (metrics->pool) {
+        prometheus_scrape_pool_destroy(metrics->pool);
+    }
+
+    metrics->pool = pool;
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return 0;
+} /* prometheus_metrics_set_scrape_threads */
+
+PUBLIC int
+prometheus_metrics_scrape_parallel(
+    struct prometheus_metrics *metrics,
+    char                      *buffer,
+    int                        buffer_size)
+{
+    struct prometheus_writer writer = { 0 };
+    uint64_t                 start  = prometheus_now_ns();
+    int                      length = -1;
+
+    if (!metrics || !buffer || buffer_size <= 0) {
+        return -1;
+    }
+
+    writer.base    = buffer;
+    writer.bp      = buffer;
+    writer.end     = buffer + buffer_size;
+    writer.encoder = &prometheus_text_encoder;
+
+    prometheus_self_scrape_begin(metrics);
+
+    /* Trees are rendered serially so that families can be merged across registries */
+    if (metrics->pool && !metrics->segment && !metrics->children) {
+        prometheus_metrics_render_parallel(metrics, &writer);
+    } else {
+        prometheus_metrics_render(metrics, &writer);
+    }
+
+    if (writer.error) {
+        *buffer = '\0';
+    } else {
+        *writer.bp = '\0';
+        length     = writer.bp - buffer;
+    }
+
+    prometheus_self_scrape_end(metrics, start, length);
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return length;
+} /* prometheus_metrics_scrape_parallel */
+
+PUBLIC struct prometheus_scrape_filter *
+prometheus_scrape_filter_create(void)
+{
+    return prometheus_calloc(1, sizeof(struct prometheus_scrape_filter));
+} /* prometheus_scrape_filter_create */
+
+static void
+prometheus_scrape_filter_append(
+    char     ***array,
+    int        *count,
+    const char *str)
+{
+    *array = realloc(*array, (*count + 1) * sizeof(char *));
+
+    if (!*array) {
+        abort();
+    }
+
+    (*array)[(*count)++] = prometheus_strdup(str);
+} /* prometheus_scrape_filter_append */
+
+PUBLIC int
+prometheus_scrape_filter_add_name(
+    struct prometheus_scrape_filter *filter,
+    const char                      *name)
+{
+    if (!prometheus_string_legal_name(name)) {
+        return -1;
+    }
+
+    prometheus_scrape_filter_append(&filter->names, &filter->num_names, name);
+
+    return 0;
+} /* prometheus_scrape_filter_add_name */
+
+PUBLIC int
+prometheus_scrape_filter_add_prefix(
+    struct prometheus_scrape_filter *filter,
+    const char                      *prefix)
+{
+    if (!prometheus_string_legal_name(prefix)) {
+        return -1;
+    }
+
+    prometheus_scrape_filter_append(&filter->prefixes, &filter->num_prefixes, prefix);
+
+    return 0;
+} /* prometheus_scrape_filter_add_prefix */
+
+PUBLIC int
+prometheus_scrape_filter_add_label(
+    struct prometheus_scrape_filter *filter,
+    const char                      *name,
+    const char                      *value)
+{
+    int num_labels = filter->num_labels;
+
+    if (!prometheus_string_legal_name(name) || !prometheus_string_legal_value(value)) {
+        return -1;
+    }
+
+    prometheus_scrape_filter_append(&filter->label_names, &num_labels, name);
+    prometheus_scrape_filter_append(&filter->label_values, &filter->num_labels, value);
+
+    return 0;
+} /* prometheus_scrape_filter_add_label */
+
+PUBLIC void
+prometheus_scrape_filter_destroy(struct prometheus_scrape_filter *filter)
+{
+    int i;
+
+    for (i = 0; i < filter->num_names; i++) {
+        free(filter->names[i]);
+    }
+
+    for (i = 0; i < filter->num_prefixes; i++) {
+        free(filter->prefixes[i]);
+    }
+
+    for (i = 0; i < filter->num_labels; i++) {
+        free(filter->label_names[i]);
+        free(filter->label_values[i]);
+    }
+
+    free(filter->names);
+    free(filter->prefixes);
+    free(filter->label_names);
+    free(filter->label_values);
+    free(filter);
+} /* prometheus_scrape_filter_destroy */
+
+PUBLIC int
+prometheus_metrics_scrape_filtered(
+    struct prometheus_metrics             *metrics,
+    const struct prometheus_scrape_filter *filter,
+    char                                  *buffer,
+    int                                    buffer_size)
+{
+    struct prometheus_writer writer = { 0 };
+    uint64_t                 start  = prometheus_now_ns();
+    int                      length = -1;
+
+    if (!metrics || !filter || !buffer || buffer_size <= 0) {
+        return -1;
+    }
+
+    writer.base    = buffer;
+    writer.bp      = buffer;
+    writer.end     = buffer + buffer_size;
+    writer.encoder = &prometheus_text_encoder;
+
+    prometheus_self_scrape_begin(metrics);
+
+    prometheus_metrics_render_filtered(metrics, &writer, filter);
+
+    if (writer.error) {
+        *buffer = '\0';
+    } else {
+        *writer.bp = '\0';
+        length     = writer.bp - buffer;
+    }
+
+    prometheus_self_scrape_end(metrics, start, length);
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return length;
+} /* prometheus_metrics_scrape_filtered */
+
+static void
+prometheus_scrape_result_put(struct prometheus_scrape_result *result)
+{
+    if (__atomic_sub_fetch(&result->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(result->data);
+        free(result);
+    }
+} /* prometheus_scrape_result_put */
+
+PUBLIC void
+prometheus_metrics_set_scrape_cache(
+    struct prometheus_metrics *metrics,
+    uint64_t                   min_interval_ms)
+{
+    pthread_mutex_lock(&metrics->cache.lock);
+    metrics->cache.interval_ns = min_interval_ms * 1000000UL;
+    pthread_mutex_unlock(&metrics->cache.lock);
+} /* prometheus_metrics_set_scrape_cache */
+
+PUBLIC struct prometheus_scrape_result *
+prometheus_metrics_scrape_cached(
+    struct prometheus_metrics *metrics,
+    enum prometheus_encoding   encoding)
+{
+    struct prometheus_scrape_cache  *cache = &metrics->cache;
+    struct prometheus_scrape_result *result;
+    uint64_t                         now;
+
+    if ((unsigned) encoding > PROMETHEUS_ENCODING_ZSTD || !prometheus_encoding_supported(encoding)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    /*
+     * Callers arriving while another caller is rendering wait for that
+     * render and share its result rather than walking the registry again.
+     */
+
+    for (;;) {
+        result = cache->result[encoding];
+        now    = prometheus_now_ns();
+
+        if (result && now - result->timestamp < cache->interval_ns) {
+            __atomic_add_fetch(&result->refcnt, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&cache->lock);
+            return result;
+        }
+
+        if (!cache->rendering[encoding]) {
+            break;
+        }
+
+        cache->waiters[encoding]++;
+        pthread_cond_wait(&cache->cond, &cache->lock);
+        cache->waiters[encoding]--;
+
+        if (cache->result[encoding] && cache->result[encoding] != result) {
+            result = cache->result[encoding];
+            __atomic_add_fetch(&result->refcnt, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&cache->lock);
+            return result;
+        }
+    }
+
+    cache->rendering[encoding] = 1;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    result       = prometheus_calloc(1, sizeof(*result));
+    result->size = PROMETHEUS_STAGING_SIZE;
+    result->data = malloc(result->size);
+
+    if (!result->data) {
+        abort();
+    }
+
+    result->timestamp = prometheus_now_ns();
+    result->length    = prometheus_metrics_render_encoded(metrics, &prometheus_text_encoder, encoding,
+                                                          &result->data, &result->size, 1);
+
+    /* One reference for the cache and one for the caller */
+    result->refcnt = 2;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->result[encoding]) {
+        prometheus_scrape_result_put(cache->result[encoding]);
+    }
+
+    cache->result[encoding]    = result;
+    cache->rendering[encoding] = 0;
+
+    if (cache->waiters[encoding]) {
+        pthread_cond_broadcast(&cache->cond);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return result;
+} /* prometheus_metrics_scrape_cached */
+
+PUBLIC const char *
+prometheus_scrape_result_data(struct prometheus_scrape_result *result)
+{
+    return result->data;
+} /* prometheus_scrape_result_data */
+
+PUBLIC int
+prometheus_scrape_result_length(struct prometheus_scrape_result *result)
+{
+    return result->length;
+} /* prometheus_scrape_result_length */
+
+PUBLIC void
+prometheus_scrape_result_release(struct prometheus_scrape_result *result)
+{
+    prometheus_scrape_result_put(result);
+} /* prometheus_scrape_result_release */
+
+PUBLIC enum prometheus_encoding
+prometheus_negotiate_encoding(const char *accept_encoding)
+{
+    static const enum prometheus_encoding preference[] = {
+        PROMETHEUS_ENCODING_ZSTD,
+        PROMETHEUS_ENCODING_GZIP,
+    };
+    static const char                    *names[] = {
+        [PROMETHEUS_ENCODING_GZIP] = "gzip",
+        [PROMETHEUS_ENCODING_ZSTD] = "zstd",
+    };
+    double                                quality[3]    = { -1.0, -1.0, -1.0 };
+    double                                wildcard      = -1.0, q, best_q = 0.0;
+    enum prometheus_encoding              best          = PROMETHEUS_ENCODING_IDENTITY;
+    const char                           *p, *token, *param;
+    int                                   token_len, i;
+
+    if (!accept_encoding) {
+        return PROMETHEUS_ENCODING_IDENTITY;
+    }
+
+    for (p = accept_encoding; *p;) {
+
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+
+        token = p;
+
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+
+        token_len = p - token;
+        q         = 1.0;
+
+        while (*p && *p != ',') {
+            param = p;
+            p++;
+
+            if (*param == ';') {
+                while (*p == ' ' || *p == '\t') {
+                    p++;
+                }
+
+                if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                    q = strtod(p + 2, NULL);
+                }
+            }
+        }
+
+        if (token_len == 1 && *token == '*') {
+            wildcard = q;
+            continue;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (token_len == (int) strlen(names[preference[i]]) &&
+                strncasecmp(token, names[preference[i]], token_len) == 0) {
+                quality[preference[i]] = q;
+            }
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        q = quality[preference[i]] >= 0.0 ? quality[preference[i]] : wildcard;
+
+        if (q > best_q && prometheus_encoding_supported(preference[i])) {
+            best   = preference[i];
+            best_q = q;
+        }
+    }
+
+    return best;
+} /* prometheus_negotiate_encoding */
+
+PUBLIC const char *
+prometheus_encoding_name(enum prometheus_encoding encoding)
+{
+    switch (encoding) {
+        case PROMETHEUS_ENCODING_GZIP:
+            return "gzip";
+        case PROMETHEUS_ENCODING_ZSTD:
+            return "zstd";
+        default:
+            return "identity";
+    } /* switch */
+} /* prometheus_encoding_name */
+
+/* CRC-32 (IEEE 802.3, reflected polynomial 0xedb88320) of each byte value */
+
+static const uint32_t prometheus_crc32_table[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+static uint32_t
+prometheus_crc32(
+    uint32_t    crc,
+    const void *data,
+    uint64_t    length)
+{
+    const uint8_t *p = data;
+
+    crc = ~crc;
+
+    while (length--) {
+        crc = prometheus_crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+} /* prometheus_crc32 */
+
+/*
+ * Build the checkpoint key of a series, the metric name followed by the
+ * label name and value pairs, each NUL terminated.
+ */
+
+static char *
+prometheus_checkpoint_key(
+    const char                    *name,
+    struct prometheus_series_base *base,
+    uint32_t                      *key_len)
+{
+    char *key, *bp;
+    int   i, len = strlen(name) + 1;
+
+    for (i = 0; i < base->label_count; i++) {
+        len += strlen(base->label_names[i]) + strlen(base->label_values[i]) + 2;
+    }
+
+    key = prometheus_calloc(1, len);
+    bp  = stpcpy(key, name) + 1;
+
+    for (i = 0; i < base->label_count; i++) {
+        bp = stpcpy(bp, base->label_names[i]) + 1;
+        bp = stpcpy(bp, base->label_values[i]) + 1;
+    }
+
+    *key_len = len;
+
+    return key;
+} /* prometheus_checkpoint_key */
+
+static struct prometheus_checkpoint_slot *
+prometheus_checkpoint_lookup(
+    struct prometheus_checkpoint *checkpoint,
+    const char                   *key,
+    uint32_t                      key_len)
+{
+    struct prometheus_checkpoint_slot *slot;
+    uint64_t                           hash = 14695981039346656037UL;
+    uint32_t                           i;
+
+    for (i = 0; i < key_len; i++) {
+        hash = (hash ^ (uint8_t) key[i]) * 1099511628211UL;
+    }
+
+    for (;; hash++) {
+        slot = &checkpoint->slots[hash & checkpoint->slot_mask];
+
+        if (!slot->key || (slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0)) {
+            return slot;
+        }
+    }
+} /* prometheus_checkpoint_lookup */
+
+/*
+ * Add the restored totals of a series, if there are any, into its saved
+ * totals.  Each restored entry is applied at most once.  The caller
+ * holds metrics->checkpoint.lock.
+ */
+
+static void
+prometheus_checkpoint_seed(
+    struct prometheus_checkpoint  *checkpoint,
+    enum prometheus_metric_type    type,
+    const char                    *name,
+    struct prometheus_series_base *base,
+    uint64_t                      *saved,
+    uint64_t                      *saved_sum,
+    uint64_t                      *saved_count,
+    uint64_t                       num_buckets)
+{
+    struct prometheus_checkpoint_slot *slot;
+    uint64_t                           value;
+    uint32_t                           key_len;
+    char                              *key;
+    uint64_t                           i;
+
+    if (!checkpoint->slots) {
+        return;
+    }
+
+    key  = prometheus_checkpoint_key(name, base, &key_len);
+    slot = prometheus_checkpoint_lookup(checkpoint, key, key_len);
+
+    free(key);
+
+    if (!slot->key || slot->applied || slot->type != type) {
+        return;
+    }
+
+    if (type == PROMETHEUS_METRIC_COUNTER && slot->num_values == 1) {
+        memcpy(&value, slot->values, sizeof(value));
+        *saved += value;
+    } else if (type == PROMETHEUS_METRIC_HISTOGRAM && slot->num_values == num_buckets + 2) {
+        memcpy(&value, slot->values, sizeof(value));
+        *saved_sum += value;
+        memcpy(&value, slot->values + sizeof(value), sizeof(value));
+        *saved_count += value;
+
+        for (i = 0; i < num_buckets; i++) {
+            memcpy(&value, slot->values + (i + 2) * sizeof(value), sizeof(value));
+            saved[i] += value;
+        }
+    } else {
+        return;
+    }
+
+    slot->applied = 1;
+} /* prometheus_checkpoint_seed */
+
+static void
+prometheus_checkpoint_put_entry(
+    struct prometheus_writer      *writer,
+    enum prometheus_metric_type    type,
+    const char                    *name,
+    struct prometheus_series_base *base,
+    const uint64_t                *values,
+    int                            num_values)
+{
+    struct prometheus_checkpoint_entry entry = { 0 };
+    char                              *key;
+
+    key = prometheus_checkpoint_key(name, base, &entry.key_len);
+
+    entry.type       = type;
+    entry.num_values = num_values;
+
+    prometheus_writer_write(writer, (const char *) &entry, sizeof(entry));
+    prometheus_writer_write(writer, key, entry.key_len);
+    prometheus_writer_write(writer, (const char *) values, num_values * sizeof(uint64_t));
+
+    free(key);
+} /* prometheus_checkpoint_put_entry */
+
+/*
+ * Read and validate one checkpoint file, returning its contents or NULL
+ * if it is missing, truncated or fails its checksum.
+ */
+
+static char *
+prometheus_checkpoint_read(
+    const char *path,
+    int         index)
+{
+    struct prometheus_checkpoint_header *header;
+    char                                 file[PATH_MAX];
+    struct stat                          st;
+    uint32_t                             crc;
+    char                                *data;
+    int                                  fd;
+
+    snprintf(file, sizeof(file), "%s.%d", path, index);
+
+    fd = open(file, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*header)) {
+        close(fd);
+        return NULL;
+    }
+
+    data = prometheus_calloc(1, st.st_size);
+
+    if (read(fd, data, st.st_size) != st.st_size) {
+        close(fd);
+        free(data);
+        return NULL;
+    }
+
+    close(fd);
+
+    header = (struct prometheus_checkpoint_header *) data;
+    crc    = header->crc;
+
+    header->crc = 0;
+
+    if (memcmp(header->magic, PROMETHEUS_CHECKPOINT_MAGIC, sizeof(PROMETHEUS_CHECKPOINT_MAGIC)) ||
+        header->version != PROMETHEUS_CHECKPOINT_VERSION ||
+        header->length != (uint64_t) st.st_size ||
+        prometheus_crc32(0, data, st.st_size) != crc) {
+        free(data);
+        return NULL;
+    }
+
+    header->crc = crc;
+
+    return data;
+} /* prometheus_checkpoint_read */
+
+/* Return the newest valid checkpoint under path, or NULL if there is none */
+
+static char *
+prometheus_checkpoint_read_latest(const char *path)
+{
+    struct prometheus_checkpoint_header *header0, *header1;
+    char                                *data0, *data1;
+
+    data0 = prometheus_checkpoint_read(path, 0);
+    data1 = prometheus_checkpoint_read(path, 1);
+
+    if (data0 && data1) {
+        header0 = (struct prometheus_checkpoint_header *) data0;
+        header1 = (struct prometheus_checkpoint_header *) data1;
+
+        if (header0->sequence > header1->sequence) {
+            free(data1);
+            return data0;
+        } else {
+            free(data0);
+            return data1;
+        }
+    }
+
+    return data0 ? data0 : data1;
+} /* prometheus_checkpoint_read_latest */
+
+static int
+prometheus_checkpoint_write(struct prometheus_metrics *metrics)
+{
+    struct prometheus_checkpoint        *checkpoint = &metrics->checkpoint;
+    struct prometheus_checkpoint_header  header     = { 0 };
+    struct prometheus_writer             writer     = { 0 };
+    struct prometheus_metrics           *source     = metrics;
+    struct prometheus_counter           *counter;
+    struct prometheus_counter_series    *counter_series;
+    struct prometheus_histogram         *histogram;
+    struct prometheus_histogram_series  *histogram_series;
+    uint64_t                            *values     = NULL;
+    uint64_t                             max_values = 0, total;
+    char                                 file[PATH_MAX];
+    int                                  fd, rc = -1;
+
+    writer.base  = prometheus_calloc(1, PROMETHEUS_STAGING_SIZE);
+    writer.bp    = writer.base + sizeof(header);
+    writer.end   = writer.base + PROMETHEUS_STAGING_SIZE;
+    writer.flush = prometheus_writer_grow;
+
+    /* Shared contexts checkpoint the aggregate of every process from the segment */
+    if (metrics->segment) {
+        source = prometheus_segment_snapshot(metrics->segment);
+
+        if (!source) {
+            free(writer.base);
+            return -1;
+        }
+    }
+
+    /* Totals are gathered under the locks and written out after they are dropped */
+
+    prometheus_scrape_lock(source, &source->lock);
+
+    list_foreach(source->counters, counter)
+    {
+        prometheus_scrape_lock(source, &counter->lock);
+
+        list_foreach(counter->series, counter_series)
+        {
+            total = prometheus_counter_series_read(source, counter_series);
+
+            prometheus_checkpoint_put_entry(&writer, PROMETHEUS_METRIC_COUNTER, counter->base.name,
+                                            &counter_series->base, &total, 1);
+            header.num_entries++;
+        }
+
+        pthread_mutex_unlock(&counter->lock);
+    }
+
+    list_foreach(source->histograms, histogram)
+    {
+        prometheus_scrape_lock(source, &histogram->lock);
+
+        if (max_values < histogram->count + 2) {
+            max_values = histogram->count + 2;
+            free(values);
+            values = prometheus_calloc(max_values, sizeof(uint64_t));
+        }
+
+        list_foreach(histogram->series, histogram_series)
+        {
+            prometheus_histogram_series_read(source, histogram_series, values + 2, &values[0], &values[1]);
+
+            prometheus_checkpoint_put_entry(&writer, PROMETHEUS_METRIC_HISTOGRAM, histogram->base.name,
+                                            &histogram_series->base, values, histogram->count + 2);
+            header.num_entries++;
+        }
+
+        pthread_mutex_unlock(&histogram->lock);
+    }
+
+    pthread_mutex_unlock(&source->lock);
+
+    if (source != metrics) {
+        prometheus_metrics_destroy(source);
+    }
+
+    free(values);
+
+    if (writer.error) {
+        free(writer.base);
+        return -1;
+    }
+
+    memcpy(header.magic, PROMETHEUS_CHECKPOINT_MAGIC, sizeof(PROMETHEUS_CHECKPOINT_MAGIC));
+    header.version   = PROMETHEUS_CHECKPOINT_VERSION;
+    header.sequence  = ++checkpoint->sequence;
+    header.timestamp = time(NULL);
+    header.length    = writer.bp - writer.base;
+
+    memcpy(writer.base, &header, sizeof(header));
+
+    header.crc = prometheus_crc32(0, writer.base, header.length);
+
+    memcpy(writer.base, &header, sizeof(header));
+
+    /* Overwrite the older of the two files so the newer stays intact until this one is durable */
+
+    snprintf(file, sizeof(file), "%s.%d", checkpoint->path, (int) (header.sequence & 1));
+
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd >= 0) {
+        if (write(fd, writer.base, header.length) == (ssize_t) header.length && fsync(fd) == 0) {
+            rc = 0;
+        }
+        close(fd);
+    }
+
+    free(writer.base);
+
+    return rc;
+} /* prometheus_checkpoint_write */
+
+PUBLIC int
+prometheus_metrics_set_checkpoint(
+    struct prometheus_metrics *metrics,
+    const char                *path,
+    uint64_t                   interval_ms)
+{
+    struct prometheus_checkpoint *checkpoint = &metrics->checkpoint;
+    char                         *data;
+
+    pthread_mutex_lock(&checkpoint->lock);
+
+    free(checkpoint->path);
+
+    checkpoint->path        = path ? prometheus_strdup(path) : NULL;
+    checkpoint->interval_ns = interval_ms * 1000000UL;
+    checkpoint->last_ns     = prometheus_now_ns();
+
+    /* Continue the sequence of any existing checkpoints so the newest is overwritten last */
+
+    if (path && (data = prometheus_checkpoint_read_latest(path))) {
+        if (checkpoint->sequence < ((struct prometheus_checkpoint_header *) data)->sequence) {
+            checkpoint->sequence = ((struct prometheus_checkpoint_header *) data)->sequence;
+        }
+        free(data);
+    }
+
+    pthread_mutex_unlock(&checkpoint->lock);
+
+    return 0;
+} /* prometheus_metrics_set_checkpoint */
+
+PUBLIC int
+prometheus_metrics_checkpoint(struct prometheus_metrics *metrics)
+{
+    struct prometheus_checkpoint *checkpoint = &metrics->checkpoint;
+    int                           rc         = -1;
+
+    pthread_mutex_lock(&checkpoint->lock);
+
+    if (checkpoint->path) {
+        rc                  = prometheus_checkpoint_write(metrics);
+        checkpoint->last_ns = prometheus_now_ns();
+    }
+
+    pthread_mutex_unlock(&checkpoint->lock);
+
+    return rc;
+} /* prometheus_metrics_checkpoint */
+
+/*
+ * Called by the aggregator after each pass to write any checkpoint that
+ * is due, and once more as it stops so that a clean shutdown loses
+ * nothing.
+ */
+
+static void
+prometheus_checkpoint_tick(
+    struct prometheus_metrics *metrics,
+    int                        force)
+{
+    struct prometheus_checkpoint *checkpoint = &metrics->checkpoint;
+
+    pthread_mutex_lock(&checkpoint->lock);
+
+    if (checkpoint->path && checkpoint->interval_ns &&
+        (force || prometheus_now_ns() - checkpoint->last_ns >= checkpoint->interval_ns)) {
+        prometheus_checkpoint_write(metrics);
+        checkpoint->last_ns = prometheus_now_ns();
+    }
+
+    pthread_mutex_unlock(&checkpoint->lock);
+} /* prometheus_checkpoint_tick */
+
+PUBLIC int
+prometheus_metrics_restore_checkpoint(
+    struct prometheus_metrics *metrics,
+    const char                *path)
+{
+    struct prometheus_checkpoint        *checkpoint = &metrics->checkpoint;
+    struct prometheus_checkpoint_header *header;
+    struct prometheus_checkpoint_entry   entry;
+    struct prometheus_checkpoint_slot   *slot;
+    struct prometheus_counter           *counter;
+    struct prometheus_counter_series    *counter_series;
+    struct prometheus_histogram         *histogram;
+    struct prometheus_histogram_series  *histogram_series;
+    char                                *data, *bp, *end;
+    uint64_t                             i;
+
+    /* Every worker seeds its own copy of a series, so a shared context would restore totals many times */
+    if (metrics->segment) {
+        return -1;
+    }
+
+    data = prometheus_checkpoint_read_latest(path);
+
+    if (!data) {
+        return -1;
+    }
+
+    header = (struct prometheus_checkpoint_header *) data;
+
+    pthread_mutex_lock(&checkpoint->lock);
+
+    free(checkpoint->restored);
+    free(checkpoint->slots);
+
+    if (checkpoint->sequence < header->sequence) {
+        checkpoint->sequence = header->sequence;
+    }
+
+    for (checkpoint->slot_mask = 63; checkpoint->slot_mask < 2 * header->num_entries;
+         checkpoint->slot_mask = checkpoint->slot_mask * 2 + 1) {
+    }
+
+    checkpoint->restored = data;
+    checkpoint->slots    = prometheus_calloc(checkpoint->slot_mask + 1, sizeof(*checkpoint->slots));
+
+    bp  = data + sizeof(*header);
+    end = data + header->length;
+
+    for (i = 0; i < header->num_entries && bp + sizeof(entry) <= end; i++) {
+        memcpy(&entry, bp, sizeof(entry));
+        bp += sizeof(entry);
+
+        if (bp + entry.key_len + entry.num_values * sizeof(uint64_t) > end) {
+            break;
+        }
+
+        slot = prometheus_checkpoint_lookup(checkpoint, bp, entry.key_len);
+
+        slot->key        = bp;
+        slot->key_len    = entry.key_len;
+        slot->type       = entry.type;
+        slot->num_values = entry.num_values;
+        slot->values     = bp + entry.key_len;
+        slot->applied    = 0;
+
+        bp += entry.key_len + entry.num_values * sizeof(uint64_t);
+    }
+
+    /* Seed series that already exist, later series are seeded as they are created */
+
+    pthread_mutex_lock(&metrics->lock);
+
+    list_foreach(metrics->counters, counter)
+    {
+        pthread_mutex_lock(&counter->lock);
+
+        list_foreach(counter->series, counter_series)
+        {
+            pthread_mutex_lock(&counter_series->lock);
+            prometheus_checkpoint_seed(checkpoint, PROMETHEUS_METRIC_COUNTER, counter->base.name,
+                                       &counter_series->base, &counter_series->saved, NULL, NULL, 0);
+            pthread_mutex_unlock(&counter_series->lock);
+        }
+
+        pthread_mutex_unlock(&counter->lock);
+    }
+
+    list_foreach(metrics->histograms, histogram)
+    {
+        pthread_mutex_lock(&histogram->lock);
+
+        list_foreach(histogram->series, histogram_series)
+        {
+            pthread_mutex_lock(&histogram_series->lock);
+            prometheus_checkpoint_seed(checkpoint, PROMETHEUS_METRIC_HISTOGRAM, histogram->base.name,
+                                       &histogram_series->base, histogram_series->saved,
+                                       &histogram_series->saved_sum, &histogram_series->saved_count,
+                                       histogram_series->num_buckets);
+            pthread_mutex_unlock(&histogram_series->lock);
+        }
+
+        pthread_mutex_unlock(&histogram->lock);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    pthread_mutex_unlock(&checkpoint->lock);
+
+    return 0;
+} /* prometheus_metrics_restore_checkpoint */
+
+/*
+ * The background aggregator folds handle values into the per-series
+ * snapshots one metric at a time, dropping metrics->lock between
+ * metrics so that scrapes and metric creation are not held off for
+ * the duration of a full pass.  The cursor is advanced by the metric
+ * destroy functions if they remove the metric it points at.
+ */
+
+static void
+prometheus_aggregator_fold_counters(struct prometheus_metrics *metrics)
+{
+    struct prometheus_aggregator     *aggregator = &metrics->aggregator;
+    struct prometheus_counter        *counter;
+    struct prometheus_counter_series *series;
+    uint64_t                          now = prometheus_now_ns();
+    int                               idx;
+
+    pthread_mutex_lock(&metrics->lock);
+
+    aggregator->counter_cursor = metrics->counters;
+
+    while ((counter = aggregator->counter_cursor)) {
+
+        pthread_mutex_lock(&counter->lock);
+
+        aggregator->counter_cursor = counter->next;
+
+        pthread_mutex_unlock(&metrics->lock);
+
+        list_foreach(counter->series, series)
+        {
+            pthread_mutex_lock(&series->lock);
+            idx                   = prometheus_snapshot_write_begin(&series->snapshot_seq);
+            series->snapshot[idx] = prometheus_counter_series_fold(series);
+            prometheus_snapshot_write_end(&series->snapshot_seq);
+
+            if (series->window.slots) {
+                prometheus_window_push(&series->window, now, series->snapshot[idx], 0);
+            }
+
+            pthread_mutex_unlock(&series->lock);
+        }
+
+        pthread_mutex_unlock(&counter->lock);
+
+        pthread_mutex_lock(&metrics->lock);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+} /* prometheus_aggregator_fold_counters */
+
+static void
+prometheus_aggregator_fold_gauges(struct prometheus_metrics *metrics)
+{
+    struct prometheus_aggregator   *aggregator = &metrics->aggregator;
+    struct prometheus_gauge        *gauge;
+    struct prometheus_gauge_series *series;
+    int                             idx;
+
+    pthread_mutex_lock(&metrics->lock);
+
+    aggregator->gauge_cursor = metrics->gauges;
+
+    while ((gauge = aggregator->gauge_cursor)) {
+
+        pthread_mutex_lock(&gauge->lock);
+
+        aggregator->gauge_cursor = gauge->next;
+
+        pthread_mutex_unlock(&metrics->lock);
+
+        list_foreach(gauge->series, series)
+        {
+            pthread_mutex_lock(&series->lock);
+            idx                   = prometheus_snapshot_write_begin(&series->snapshot_seq);
+            series->snapshot[idx] = prometheus_gauge_series_fold(series);
+            prometheus_snapshot_write_end(&series->snapshot_seq);
+            pthread_mutex_unlock(&series->lock);
+        }
+
+        pthread_mutex_unlock(&gauge->lock);
+
+        pthread_mutex_lock(&metrics->lock);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+} /* prometheus_aggregator_fold_gauges */
+
+static void
+prometheus_aggregator_fold_histograms(struct prometheus_metrics *metrics)
+{
+    struct prometheus_aggregator       *aggregator = &metrics->aggregator;
+    struct prometheus_histogram        *histogram;
+    struct prometheus_histogram_series *series;
+    uint64_t                            now = prometheus_now_ns();
+    int                                 idx;
+
+    pthread_mutex_lock(&metrics->lock);
+
+    aggregator->histogram_cursor = metrics->histograms;
+
+    while ((histogram = aggregator->histogram_cursor)) {
+
+        pthread_mutex_lock(&histogram->lock);
+
+        aggregator->histogram_cursor = histogram->next;
+
+        pthread_mutex_unlock(&metrics->lock);
+
+        list_foreach(histogram->series, series)
+        {
+            pthread_mutex_lock(&series->lock);
+
+            if (!series->snapshot_buckets[0]) {
+                series->snapshot_buckets[0] = prometheus_calloc(series->num_buckets, sizeof(uint64_t));
+                series->snapshot_buckets[1] = prometheus_calloc(series->num_buckets, sizeof(uint64_t));
+            }
+
+            idx = prometheus_snapshot_write_begin(&series->snapshot_seq);
+
+            prometheus_histogram_series_fold(series, series->snapshot_buckets[idx],
+                                             &series->snapshot_sum[idx], &series->snapshot_count[idx]);
+
+            prometheus_snapshot_write_end(&series->snapshot_seq);
+
+            if (series->window.slots) {
+                prometheus_window_push(&series->window, now, series->snapshot_count[idx], series->snapshot_sum[idx]);
+            }
+
+            if (histogram->min_max) {
+                prometheus_histogram_series_roll_window(series);
+            }
+
+            pthread_mutex_unlock(&series->lock);
+        }
+
+        pthread_mutex_unlock(&histogram->lock);
+
+        pthread_mutex_lock(&metrics->lock);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+} /* prometheus_aggregator_fold_histograms */
+
+static void *
+prometheus_aggregator_thread(void *arg)
+{
+    struct prometheus_metrics    *metrics    = arg;
+    struct prometheus_aggregator *aggregator = &metrics->aggregator;
+    struct timespec               deadline;
+    uint64_t                      wake;
+
+    /* On Linux the nice value of a thread can be set through its tid */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), aggregator->nice);
+
+    pthread_mutex_lock(&aggregator->lock);
+
+    while (!aggregator->stop) {
+
+        pthread_mutex_unlock(&aggregator->lock);
+
+        /*
+         * Shared contexts are read from the segment rather than from
+         * snapshots of this process's handles, so only checkpoints run.
+         */
+
+        if (!metrics->segment) {
+            prometheus_aggregator_fold_counters(metrics);
+            prometheus_aggregator_fold_gauges(metrics);
+            prometheus_aggregator_fold_histograms(metrics);
+        }
+
+        /*
+         * Scrapes only switch to snapshots once a full pass has completed,
+         * so snapshots left over from a previous run are never served.
+         */
+
+        if (!metrics->aggregator.running && !metrics->segment) {
+            pthread_mutex_lock(&metrics->lock);
+            metrics->aggregator.running = 1;
+            pthread_mutex_unlock(&metrics->lock);
+        }
+
+        prometheus_checkpoint_tick(metrics, 0);
+
+        pthread_mutex_lock(&aggregator->lock);
+
+        wake             = prometheus_now_ns() + aggregator->interval_ns;
+        deadline.tv_sec  = wake / 1000000000UL;
+        deadline.tv_nsec = wake % 1000000000UL;
+
+        while (!aggregator->stop &&
+               pthread_cond_timedwait(&aggregator->cond, &aggregator->lock, &deadline) != ETIMEDOUT) {
+        }
+    }
+
+    pthread_mutex_unlock(&aggregator->lock);
+
+    prometheus_checkpoint_tick(metrics, 1);
+
+    return NULL;
+} /* prometheus_aggregator_thread */
+
+PUBLIC int
+prometheus_metrics_start_aggregator(
+    struct prometheus_metrics *metrics,
+    uint64_t                   interval_ms,
+    int                        nice)
+{
+    struct prometheus_aggregator *aggregator = &metrics->aggregator;
+    int                           rc;
+
+    pthread_mutex_lock(&aggregator->lock);
+
+    if (aggregator->started) {
+        pthread_mutex_unlock(&aggregator->lock);
+        return -1;
+    }
+
+    aggregator->interval_ns = interval_ms * 1000000UL;
+    aggregator->nice        = nice;
+    aggregator->stop        = 0;
+
+    rc = pthread_create(&aggregator->thread, NULL, prometheus_aggregator_thread, metrics);
+
+    aggregator->started = (rc == 0);
+
+    pthread_mutex_unlock(&aggregator->lock);
+
+    return rc ? -1 : 0;
+} /* prometheus_metrics_start_aggregator */
+
+PUBLIC void
+prometheus_metrics_stop_aggregator(struct prometheus_metrics *metrics)
+{
+    struct prometheus_aggregator *aggregator = &metrics->aggregator;
+
+    pthread_mutex_lock(&aggregator->lock);
+
+    if (!aggregator->started) {
+        pthread_mutex_unlock(&aggregator->lock);
+        return;
+    }
+
+    aggregator->stop = 1;
+    pthread_cond_signal(&aggregator->cond);
+
+    pthread_mutex_unlock(&aggregator->lock);
+
+    pthread_join(aggregator->thread, NULL);
+
+    /* started is guarded by aggregator->lock and running by metrics->lock */
+    pthread_mutex_lock(&aggregator->lock);
+    pthread_mutex_lock(&metrics->lock);
+
+    aggregator->running = 0;
+    aggregator->started = 0;
+
+    pthread_mutex_unlock(&metrics->lock);
+    pthread_mutex_unlock(&aggregator->lock);
+} /* prometheus_metrics_stop_aggregator */
+
+/*
+ * Prometheus remote-write support.  The registry is encoded as a
+ * WriteRequest protobuf, with one TimeSeries per exposed sample, and
+ * the result is compressed with the snappy block format as the
+ * remote-write protocol requires.  Both encoders are implemented here
+ * to avoid external dependencies.
+ *
+ *   message WriteRequest { repeated TimeSeries timeseries = 1; }
+ *   message TimeSeries   { repeated Label labels = 1; repeated Sample samples = 2; }
+ *   message Label        { string name = 1; string value = 2; }
+ *   message Sample       { double value = 1; int64 timestamp = 2; }
+ */
+
+#define PROMETHEUS_PB_LEN(field)     (((field) << 3) | 2)
+#define PROMETHEUS_PB_VARINT(field)  (((field) << 3) | 0)
+#define PROMETHEUS_PB_FIXED64(field) (((field) << 3) | 1)
+
+#define PROMETHEUS_REMOTE_WRITE_MAX_LABELS 64
+
+struct prometheus_pb_label {
+    const char *name;
+    const char *value;
+    const char *suffix;
+    int         name_len;
+    int         value_len;
+    int         suffix_len;
+};
+
+static inline int
+prometheus_pb_varint_size(uint64_t value)
+{
+    int size = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+
+    return size;
+} /* prometheus_pb_varint_size */
+
+static inline void
+prometheus_pb_varint(
+    struct prometheus_writer *writer,
+    uint64_t                  value)
+{
+    char buf[10];
+    int  len = 0;
+
+    while (value >= 0x80) {
+        buf[len++] = (value & 0x7f) | 0x80;
+        value    >>= 7;
+    }
+
+    buf[len++] = value;
+
+    prometheus_writer_write(writer, buf, len);
+} /* prometheus_pb_varint */
+
+static inline int
+prometheus_pb_label_size(struct prometheus_pb_label *label)
+{
+    int value_len = label->value_len + label->suffix_len;
+
+    return 1 + prometheus_pb_varint_size(label->name_len) + label->name_len +
+           1 + prometheus_pb_varint_size(value_len) + value_len;
+} /* prometheus_pb_label_size */
+
+static int
+prometheus_pb_label_compare(
+    const void *a,
+    const void *b)
+{
+    return strcmp(((const struct prometheus_pb_label *) a)->name, ((const struct prometheus_pb_label *) b)->name);
+} /* prometheus_pb_label_compare */
+
+/*
+ * Encode one TimeSeries holding a single sample.  Remote-write requires
+ * the labels of a series to be sorted by name.  The metric name and its
+ * suffix are written as one __name__ value without being copied.  A
+ * series with more than PROMETHEUS_REMOTE_WRITE_MAX_LABELS labels fails
+ * the encode rather than being sent with a different identity.
+ */
+
+static void
+prometheus_remote_write_series(
+    struct prometheus_writer      *writer,
+    struct prometheus_metrics     *metrics,
+    struct prometheus_metric_base *metric_base,
+    const char                    *metric_suffix,
+    struct prometheus_series_base *series_base,
+    const char                    *label_name,
+    const char                    *label_value,
+    double                         value,
+    int64_t                        timestamp)
+{
+    struct prometheus_pb_label labels[PROMETHEUS_REMOTE_WRITE_MAX_LABELS] = { { 0 } };
+    int                        num_labels = 0, i, series_size, sample_size;
+    uint64_t                   bits;
+
+    if (1 + metrics->label_count + series_base->label_count + !!label_name > PROMETHEUS_REMOTE_WRITE_MAX_LABELS) {
+        writer->error = 1;
+        return;
+    }
+
+    labels[num_labels].name         = "__name__";
+    labels[num_labels].value        = metric_base->name;
+    labels[num_labels].value_len    = metric_base->name_len;
+    labels[num_labels].suffix       = metric_suffix;
+    labels[num_labels++].suffix_len = strlen(metric_suffix);
+
+    for (i = 0; i < metrics->label_count; i++) {
+        labels[num_labels].name    = metrics->label_names[i];
+        labels[num_labels++].value = metrics->label_values[i];
+    }
+
+    for (i = 0; i < series_base->label_count; i++) {
+        labels[num_labels].name    = series_base->label_names[i];
+        labels[num_labels++].value = series_base->label_values[i];
+    }
+
+    if (label_name) {
+        labels[num_labels].name    = label_name;
+        labels[num_labels++].value = label_value;
+    }
+
+    qsort(labels, num_labels, sizeof(labels[0]), prometheus_pb_label_compare);
+
+    sample_size = 1 + 8 + 1 + prometheus_pb_varint_size(timestamp);
+    series_size = 1 + prometheus_pb_varint_size(sample_size) + sample_size;
+
+    for (i = 0; i < num_labels; i++) {
+        labels[i].name_len = strlen(labels[i].name);
+
+        if (!labels[i].suffix) {
+            labels[i].value_len = strlen(labels[i].value);
+        }
+
+        series_size += 1 + prometheus_pb_varint_size(prometheus_pb_label_size(&labels[i])) +
+            prometheus_pb_label_size(&labels[i]);
+    }
+
+    prometheus_pb_varint(writer, PROMETHEUS_PB_LEN(1));
+    prometheus_pb_varint(writer, series_size);
+
+    for (i = 0; i < num_labels; i++) {
+        prometheus_pb_varint(writer, PROMETHEUS_PB_LEN(1));
+        prometheus_pb_varint(writer, prometheus_pb_label_size(&labels[i]));
+        prometheus_pb_varint(writer, PROMETHEUS_PB_LEN(1));
+        prometheus_pb_varint(writer, labels[i].name_len);
+        prometheus_writer_write(writer, labels[i].name, labels[i].name_len);
+        prometheus_pb_varint(writer, PROMETHEUS_PB_LEN(2));
+        prometheus_pb_varint(writer, labels[i].value_len + labels[i].suffix_len);
+        prometheus_writer_write(writer, labels[i].value, labels[i].value_len);
+
+        if (labels[i].suffix_len) {
+            prometheus_writer_write(writer, labels[i].suffix, labels[i].suffix_len);
+        }
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    bits = htole64(bits);
+
+    prometheus_pb_varint(writer, PROMETHEUS_PB_LEN(2));
+    prometheus_pb_varint(writer, sample_size);
+    prometheus_pb_varint(writer, PROMETHEUS_PB_FIXED64(1));
+    prometheus_writer_write(writer, (const char *) &bits, sizeof(bits));
+    prometheus_pb_varint(writer, PROMETHEUS_PB_VARINT(2));
+    prometheus_pb_varint(writer, timestamp);
+} /* prometheus_remote_write_series */
+
+static void
+prometheus_remote_write_render(
+    struct prometheus_metrics *metrics,
+    struct prometheus_writer  *writer,
+    int64_t                    timestamp,
+    int                        flags)
+{
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *counter_series;
+    struct prometheus_gauge            *gauge;
+    struct prometheus_gauge_series     *gauge_series;
+    struct prometheus_histogram        *histogram;
+    struct prometheus_histogram_series *histogram_series;
+    char                                bucket_threshold[64];
+    uint64_t                            value, sum, total;
+    int                                 changed_only = flags & PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY;
+    int                                 i;
+
+    list_foreach(metrics->counters, counter)
+    {
+        prometheus_scrape_lock(metrics, &counter->lock);
+
+        list_foreach(counter->series, counter_series)
+        {
+            value = prometheus_counter_series_read(metrics, counter_series);
+
+            counter_series->pending = !changed_only || !counter_series->pushed || counter_series->pushed_value != value;
+
+            if (!counter_series->pending) {
+                continue;
+            }
+
+            counter_series->pending_value = value;
+
+            prometheus_remote_write_series(writer, metrics, &counter->base, "", &counter_series->base,
+                                           NULL, NULL, value, timestamp);
+        }
+
+        pthread_mutex_unlock(&counter->lock);
+    }
+
+    list_foreach(metrics->gauges, gauge)
+    {
+        prometheus_scrape_lock(metrics, &gauge->lock);
+
+        list_foreach(gauge->series, gauge_series)
+        {
+            value = prometheus_gauge_series_read(metrics, gauge_series);
+
+            gauge_series->pending = !changed_only || !gauge_series->pushed || gauge_series->pushed_value != value;
+
+            if (!gauge_series->pending) {
+                continue;
+            }
+
+            gauge_series->pending_value = value;
+
+            prometheus_remote_write_series(writer, metrics, &gauge->base, "", &gauge_series->base,
+                                           NULL, NULL, (int64_t) value, timestamp);
+        }
+
+        pthread_mutex_unlock(&gauge->lock);
+    }
+
+    list_foreach(metrics->histograms, histogram)
+    {
+        prometheus_scrape_lock(metrics, &histogram->lock);
+
+        list_foreach(histogram->series, histogram_series)
+        {
+            prometheus_histogram_series_read(metrics, histogram_series, histogram_series->buckets, &sum, &total);
+            prometheus_histogram_series_scale(histogram_series, histogram_series->buckets, &sum, &total);
+
+            histogram_series->pending = !changed_only || !histogram_series->pushed ||
+                histogram_series->pushed_count != total || histogram_series->pushed_sum != sum;
+
+            if (!histogram_series->pending) {
+                continue;
+            }
+
+            histogram_series->pending_count = total;
+            histogram_series->pending_sum   = sum;
+
+            for (i = 0; i < histogram->count; i++) {
+                prometheus_histogram_bucket_threshold(histogram, i, bucket_threshold, sizeof(bucket_threshold));
+
+                prometheus_remote_write_series(writer, metrics, &histogram->base, "_bucket", &histogram_series->base,
+                                               "le", bucket_threshold, histogram_series->buckets[i], timestamp);
+            }
+
+            prometheus_remote_write_series(writer, metrics, &histogram->base, "_sum", &histogram_series->base,
+                                           NULL, NULL, sum, timestamp);
+            prometheus_remote_write_series(writer, metrics, &histogram->base, "_count", &histogram_series->base,
+                                           NULL, NULL, total, timestamp);
+        }
+
+        pthread_mutex_unlock(&histogram->lock);
+    }
+} /* prometheus_remote_write_render */
+
+static inline uint32_t
+prometheus_snappy_load32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+} /* prometheus_snappy_load32 */
+
+static inline uint8_t *
+prometheus_snappy_literal(
+    uint8_t       *op,
+    const uint8_t *literal,
+    int            len)
+{
+    int n = len - 1;
+
+    if (n < 60) {
+        *op++ = n << 2;
+    } else if (n < 256) {
+        *op++ = 60 << 2;
+        *op++ = n;
+    } else {
+        *op++ = 61 << 2;
+        *op++ = n & 0xff;
+        *op++ = n >> 8;
+    }
+
+    memcpy(op, literal, len);
+
+    return op + len;
+} /* prometheus_snappy_literal */
+
+static inline uint8_t *
+prometheus_snappy_copy(
+    uint8_t *op,
+    int      offset,
+    int      len)
+{
+    while (len >= 68) {
+        *op++ = ((64 - 1) << 2) | 2;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        len  -= 64;
+    }
+
+    if (len > 64) {
+        *op++ = ((60 - 1) << 2) | 2;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        len  -= 60;
+    }
+
+    if (len < 12 && offset < 2048) {
+        *op++ = 1 | ((len - 4) << 2) | ((offset >> 8) << 5);
+        *op++ = offset & 0xff;
+    } else {
+        *op++ = ((len - 1) << 2) | 2;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+    }
+
+    return op;
+} /* prometheus_snappy_copy */
+
+static inline int
+prometheus_snappy_max_length(int length)
+{
+    return 32 + length + length / 6;
+} /* prometheus_snappy_max_length */
+
+/*
+ * Snappy block compression.  Input is processed in independent 64KB
+ * blocks so that match offsets always fit the two byte copy format.
+ * The output buffer must hold prometheus_snappy_max_length() bytes.
+ */
+
+static int
+prometheus_snappy_compress(
+    const uint8_t *input,
+    int            length,
+    uint8_t       *output)
+{
+    uint16_t       table[1 << 14];
+    uint8_t       *op = output;
+    const uint8_t *block, *ip, *candidate, *next_emit;
+    uint32_t       hash;
+    uint64_t       remaining = length;
+    int            block_len, matched, skip;
+
+    while (remaining >= 0x80) {
+        *op++       = (remaining & 0x7f) | 0x80;
+        remaining >>= 7;
+    }
+
+    *op++ = remaining;
+
+    for (block = input; block < input + length; block += block_len) {
+
+        block_len = input + length - block;
+
+        if (block_len > 65536) {
+            block_len = 65536;
+        }
+
+        next_emit = block;
+
+        if (block_len >= 15) {
+
+            memset(table, 0, sizeof(table));
+
+            ip   = block + 1;
+            skip = 32;
+
+            while (ip < block + block_len - 15) {
+
+                hash      = (prometheus_snappy_load32(ip) * 0x1e35a7bd) >> 18;
+                candidate = block + table[hash];
+                table[hash] = ip - block;
+
+                if (prometheus_snappy_load32(candidate) != prometheus_snappy_load32(ip) || candidate >= ip) {
+                    /* Step faster through data that is not compressing */
+                    ip += skip++ >> 5;
+                    continue;
+                }
+
+                skip = 32;
+
+                if (ip > next_emit) {
+                    op = prometheus_snappy_literal(op, next_emit, ip - next_emit);
+                }
+
+                matched = 4;
+
+                while (ip + matched < block + block_len && candidate[matched] == ip[matched]) {
+                    matched++;
+                }
+
+                op = prometheus_snappy_copy(op, ip - candidate, matched);
+
+                ip       += matched;
+                next_emit = ip;
+            }
+        }
+
+        if (next_emit < block + block_len) {
+            op = prometheus_snappy_literal(op, next_emit, block + block_len - next_emit);
+        }
+    }
+
+    return op - output;
+} /* prometheus_snappy_compress */
+
+PUBLIC int
+prometheus_metrics_remote_write_encode(
+    struct prometheus_metrics *metrics,
+    int64_t                    timestamp_ms,
+    int                        flags,
+    char                      *buffer,
+    int                        buffer_size)
+{
+    struct prometheus_remote_write *rw     = &metrics->remote_write;
+    struct prometheus_writer        writer = { 0 };
+    struct prometheus_metrics      *snapshot;
+    struct timespec                 ts;
+    int                             length = -1, max_length;
+
+    if (!buffer || buffer_size <= 0) {
+        return -1;
+    }
+
+    /*
+     * Shared contexts push the aggregate of every process from the segment.
+     * A snapshot keeps no pushed state, so only full pushes are possible.
+     */
+    if (metrics->segment) {
+        if (flags & PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY) {
+            return -1;
+        }
+
+        snapshot = prometheus_segment_snapshot(metrics->segment);
+
+        if (snapshot) {
+            length = prometheus_metrics_remote_write_encode(snapshot, timestamp_ms, flags, buffer, buffer_size);
+            prometheus_metrics_destroy(snapshot);
+        }
+
+        return length;
+    }
+
+    if (!timestamp_ms) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        timestamp_ms = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    prometheus_scrape_lock(metrics, &metrics->lock);
+
+    if (!rw->protobuf) {
+        rw->protobuf_size = PROMETHEUS_STAGING_SIZE;
+        rw->protobuf      = prometheus_calloc(1, rw->protobuf_size);
+    }
+
+    writer.base  = rw->protobuf;
+    writer.bp    = rw->protobuf;
+    writer.end   = rw->protobuf + rw->protobuf_size;
+    writer.flush = prometheus_writer_grow;
+
+    prometheus_remote_write_render(metrics, &writer, timestamp_ms, flags);
+
+    rw->protobuf      = writer.base;
+    rw->protobuf_size = writer.end - writer.base;
+    rw->staged        = 0;
+
+    if (writer.error) {
+        pthread_mutex_unlock(&metrics->lock);
+        return -1;
+    }
+
+    max_length = prometheus_snappy_max_length(writer.bp - writer.base);
+
+    /* Compress in place when the caller's buffer is large enough for the worst case */
+
+    if (buffer_size >= max_length) {
+        length = prometheus_snappy_compress((uint8_t *) writer.base, writer.bp - writer.base, (uint8_t *) buffer);
+    } else {
+        if (rw->compressed_size < max_length) {
+            free(rw->compressed);
+            rw->compressed_size = max_length;
+            rw->compressed      = prometheus_calloc(1, max_length);
+        }
+
+        length = prometheus_snappy_compress((uint8_t *) writer.base, writer.bp - writer.base,
+                                            (uint8_t *) rw->compressed);
+
+        if (length <= buffer_size) {
+            memcpy(buffer, rw->compressed, length);
+        } else {
+            length = -1;
+        }
+    }
+
+    rw->staged = (length >= 0);
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return length;
+} /* prometheus_metrics_remote_write_encode */
+
+/*
+ * Record the values sent by the last successful encode as pushed, so
+ * that the next PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY encode leaves them
+ * out.  Until then the series are considered unsent.
+ */
+
+PUBLIC int
+prometheus_metrics_remote_write_commit(struct prometheus_metrics *metrics)
+{
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *counter_series;
+    struct prometheus_gauge            *gauge;
+    struct prometheus_gauge_series     *gauge_series;
+    struct prometheus_histogram        *histogram;
+    struct prometheus_histogram_series *histogram_series;
+
+    pthread_mutex_lock(&metrics->lock);
+
+    if (!metrics->remote_write.staged) {
+        pthread_mutex_unlock(&metrics->lock);
+        return -1;
+    }
+
+    metrics->remote_write.staged = 0;
+
+    list_foreach(metrics->counters, counter)
+    {
+        pthread_mutex_lock(&counter->lock);
+
+        list_foreach(counter->series, counter_series)
+        {
+            if (counter_series->pending) {
+                counter_series->pushed       = 1;
+                counter_series->pushed_value = counter_series->pending_value;
+                counter_series->pending      = 0;
+            }
+        }
+
+        pthread_mutex_unlock(&counter->lock);
+    }
+
+    list_foreach(metrics->gauges, gauge)
+    {
+        pthread_mutex_lock(&gauge->lock);
+
+        list_foreach(gauge->series, gauge_series)
+        {
+            if (gauge_series->pending) {
+                gauge_series->pushed       = 1;
+                gauge_series->pushed_value = gauge_series->pending_value;
+                gauge_series->pending      = 0;
+            }
+        }
+
+        pthread_mutex_unlock(&gauge->lock);
+    }
+
+    list_foreach(metrics->histograms, histogram)
+    {
+        pthread_mutex_lock(&histogram->lock);
+
+        list_foreach(histogram->series, histogram_series)
+        {
+            if (histogram_series->pending) {
+                histogram_series->pushed       = 1;
+                histogram_series->pushed_count = histogram_series->pending_count;
+                histogram_series->pushed_sum   = histogram_series->pending_sum;
+                histogram_series->pending      = 0;
+            }
+        }
+
+        pthread_mutex_unlock(&histogram->lock);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return 0;
+} /* prometheus_metrics_remote_write_commit */
+
+PUBLIC int
+prometheus_metrics_enable_self_metrics(struct prometheus_metrics *metrics)
+{
+    struct prometheus_self_metrics *self = &metrics->self;
+    struct prometheus_histogram    *duration;
+    struct prometheus_counter      *scrapes, *bytes, *lock_wait;
+    struct prometheus_gauge        *series, *handles, *allocated;
+
+    pthread_mutex_lock(&metrics->lock);
+
+    if (self->enabled) {
+        pthread_mutex_unlock(&metrics->lock);
+        return 0;
+    }
+
+    self->enabled = 1;
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    duration = prometheus_metrics_create_histogram_exponential(metrics,
+                                                               "prometheus_c_scrape_duration_microseconds",
+                                                               "Time taken to render a scrape", 24);
+    scrapes = prometheus_metrics_create_counter(metrics, "prometheus_c_scrapes_total",
+                                                "Number of scrapes rendered");
+    bytes = prometheus_metrics_create_counter(metrics, "prometheus_c_scrape_bytes_total",
+                                              "Bytes of scrape output produced");
+    lock_wait = prometheus_metrics_create_counter(metrics, "prometheus_c_scrape_lock_wait_nanoseconds_total",
+                                                  "Time scrapes spent blocked acquiring locks");
+    series = prometheus_metrics_create_gauge(metrics, "prometheus_c_series",
+                                             "Number of live metric series");
+    handles = prometheus_metrics_create_gauge(metrics, "prometheus_c_handles",
+                                              "Number of live metric handles");
+    allocated = prometheus_metrics_create_gauge(metrics, "prometheus_c_allocated_bytes",
+                                                "Bytes allocated for metrics, series and handles");
+
+    pthread_mutex_lock(&metrics->lock);
+
+    self->scrape_duration = prometheus_histogram_series_create_instance(
+        prometheus_histogram_create_series(duration, NULL, NULL, 0));
+    self->scrapes = prometheus_counter_series_create_instance(
+        prometheus_counter_create_series(scrapes, NULL, NULL, 0));
+    self->scrape_bytes = prometheus_counter_series_create_instance(
+        prometheus_counter_create_series(bytes, NULL, NULL, 0));
+    self->lock_wait = prometheus_counter_series_create_instance(
+        prometheus_counter_create_series(lock_wait, NULL, NULL, 0));
+    self->series_gauge = prometheus_gauge_series_create_instance(
+        prometheus_gauge_create_series(series, NULL, NULL, 0));
+    self->handles_gauge = prometheus_gauge_series_create_instance(
+        prometheus_gauge_create_series(handles, NULL, NULL, 0));
+    self->allocated_gauge = prometheus_gauge_series_create_instance(
+        prometheus_gauge_create_series(allocated, NULL, NULL, 0));
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return 0;
+} /* prometheus_metrics_enable_self_metrics */
+
+static inline void *
+prometheus_segment_ptr(
+    struct prometheus_segment *segment,
+    uint64_t                   offset)
+{
+    return (char *) segment->header + offset;
+} /* prometheus_segment_ptr */
+
+static inline void *
+prometheus_segment_payload(
+    struct prometheus_segment *segment,
+    uint64_t                   offset)
+{
+    return (char *) segment->header + offset + sizeof(struct prometheus_segment_record);
+} /* prometheus_segment_payload */
+
+static inline int
+prometheus_segment_owns(
+    struct prometheus_segment *segment,
+    void                      *ptr)
+{
+    return segment && (char *) ptr >= (char *) segment->header &&
+           (char *) ptr < (char *) segment->header + segment->size;
+} /* prometheus_segment_owns */
+
+static inline char *
+prometheus_segment_put_string(
+    char       *dst,
+    const char *str)
+{
+    int len = strlen(str) + 1;
+
+    memcpy(dst, str, len);
+
+    return dst + len;
+} /* prometheus_segment_put_string */
+
+static inline int
+prometheus_segment_labels_size(
+    const char **label_names,
+    const char **label_values,
+    int          label_count)
+{
+    int i, size = 0;
+
+    for (i = 0; i < label_count; i++) {
+        size += strlen(label_names[i]) + strlen(label_values[i]) + 2;
+    }
+
+    return size;
+} /* prometheus_segment_labels_size */
+
+static inline void
+prometheus_segment_put_labels(
+    char        *dst,
+    const char **label_names,
+    const char **label_values,
+    int          label_count)
+{
+    int i;
+
+    for (i = 0; i < label_count; i++) {
+        dst = prometheus_segment_put_string(dst, label_names[i]);
+        dst = prometheus_segment_put_string(dst, label_values[i]);
+    }
+} /* prometheus_segment_put_labels */
+
+/*
+ * The segment lock is shared by every process mapping the segment, so
+ * it is robust against a worker exiting while holding it.  A fold that
+ * was interrupted leaves the generation odd, which is corrected here.
+ */
+
+static inline void
+prometheus_segment_lock(struct prometheus_segment_header *header)
+{
+    if (pthread_mutex_lock(&header->lock) == EOWNERDEAD) {
+        if (header->generation & 1) {
+            __atomic_add_fetch(&header->generation, 1, __ATOMIC_ACQ_REL);
+        }
+
+        pthread_mutex_consistent(&header->lock);
+    }
+} /* prometheus_segment_lock */
+
+/*
+ * Allocate a zeroed record in PENDING state.  Handle records are taken
+ * from the free list when one of the same length is available.  Like
+ * prometheus_calloc(), running out of space aborts.
+ */
+
+static uint64_t
+prometheus_segment_alloc(
+    struct prometheus_segment    *segment,
+    enum prometheus_segment_kind  kind,
+    uint64_t                      parent,
+    uint64_t                      payload_length)
+{
+    struct prometheus_segment_header *header = segment->header;
+    struct prometheus_segment_record *record;
+    uint64_t                          length, offset = 0, *link;
+
+    length = (sizeof(*record) + payload_length + PROMETHEUS_SEGMENT_ALIGN - 1) & ~(PROMETHEUS_SEGMENT_ALIGN - 1);
+
+    prometheus_segment_lock(header);
+
+    if (kind == PROMETHEUS_SEGMENT_HANDLE) {
+        for (link = &header->free_list; *link; link = &record->next_free) {
+            record = prometheus_segment_ptr(segment, *link);
+
+            if (record->length == length) {
+                offset = *link;
+                *link  = record->next_free;
+                break;
+            }
+        }
+    }
+
+    if (!offset) {
+        if (header->used + length > header->size) {
+            abort();
+        }
+
+        offset = header->used;
+    }
+
+    record = prometheus_segment_ptr(segment, offset);
+
+    memset(record, 0, length);
+
+    record->length = length;
+    record->kind   = kind;
+    record->owner  = getpid();
+    record->parent = parent;
+
+    if (offset == header->used) {
+        __atomic_store_n(&header->used, offset + length, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&header->lock);
+
+    return offset;
+} /* prometheus_segment_alloc */
+
+static inline void
+prometheus_segment_set_state(
+    struct prometheus_segment    *segment,
+    uint64_t                      offset,
+    enum prometheus_segment_state state)
+{
+    struct prometheus_segment_record *record = prometheus_segment_ptr(segment, offset);
+
+    __atomic_store_n(&record->state, state, __ATOMIC_RELEASE);
+} /* prometheus_segment_set_state */
+
+/*
+ * Mark a metric or series record dead when it is destroyed by the
+ * process that created it.  Descriptions inherited across fork() stay
+ * live so that other processes' handles remain visible, as does
+ * everything when the whole context is destroyed, so that the final
+ * totals of an exited process are still reported.
+ */
+
+static inline void
+prometheus_segment_retire(
+    struct prometheus_segment *segment,
+    uint64_t                   offset)
+{
+    struct prometheus_segment_record *record = prometheus_segment_ptr(segment, offset);
+
+    if (!segment->detaching && record->owner == (uint32_t) getpid()) {
+        prometheus_segment_set_state(segment, offset, PROMETHEUS_SEGMENT_DEAD);
+    }
+} /* prometheus_segment_retire */
+
+static uint64_t
+prometheus_segment_create_metric(
+    struct prometheus_segment     *segment,
+    struct prometheus_metric_base *base,
+    enum prometheus_metric_type    type,
+    struct prometheus_histogram   *histogram)
+{
+    struct prometheus_segment_metric *metric;
+    uint64_t                          offset;
+    char                             *strings;
+
+    offset = prometheus_segment_alloc(segment, PROMETHEUS_SEGMENT_METRIC, 0,
+                                      sizeof(*metric) + strlen(base->name) + strlen(base->help) + 2);
+
+    metric       = prometheus_segment_payload(segment, offset);
+    metric->type = type;
+
+    if (histogram) {
+        metric->histogram_type = histogram->type;
+        metric->num_buckets    = histogram->count;
+        metric->start          = histogram->start;
+        metric->increment      = histogram->increment;
+    }
+
+    strings = prometheus_segment_put_string(metric->strings, base->name);
+    prometheus_segment_put_string(strings, base->help);
+
+    prometheus_segment_set_state(segment, offset, PROMETHEUS_SEGMENT_LIVE);
+
+    return offset;
+} /* prometheus_segment_create_metric */
+
+static uint64_t
+prometheus_segment_create_series(
+    struct prometheus_segment     *segment,
+    uint64_t                       metric_offset,
+    struct prometheus_series_base *base,
+    int                            num_buckets)
+{
+    struct prometheus_segment_series *series;
+    uint64_t                          offset;
+
+    offset = prometheus_segment_alloc(segment, PROMETHEUS_SEGMENT_SERIES, metric_offset,
+                                      sizeof(*series) + num_buckets * sizeof(uint64_t) +
+                                      prometheus_segment_labels_size((const char **) base->label_names,
+                                                                     (const char **) base->label_values,
+                                                                     base->label_count));
+
+    series              = prometheus_segment_payload(segment, offset);
+    series->num_buckets = num_buckets;
+    series->label_count = base->label_count;
+
+    prometheus_segment_put_labels((char *) &series->buckets[num_buckets], (const char **) base->label_names,
+                                  (const char **) base->label_values, base->label_count);
+
+    prometheus_segment_set_state(segment, offset, PROMETHEUS_SEGMENT_LIVE);
+
+    return offset;
+} /* prometheus_segment_create_series */
+
+/*
+ * Allocate a live handle record for a series and return the handle
+ * memory inside it.  The handle itself is updated in place by the
+ * owning process, so readers see its values without any locking.
+ */
+
+static void *
+prometheus_segment_create_handle(
+    struct prometheus_segment *segment,
+    uint64_t                   series_offset,
+    int                        handle_size,
+    int                        num_buckets,
+    void                      *local)
+{
+    struct prometheus_segment_handle *handle;
+    uint64_t                          offset;
+
+    offset = prometheus_segment_alloc(segment, PROMETHEUS_SEGMENT_HANDLE, series_offset,
+                                      PROMETHEUS_SEGMENT_HANDLE_OFFSET - sizeof(struct prometheus_segment_record) +
+                                      handle_size + num_buckets * sizeof(uint64_t));
+
+    handle                 = prometheus_segment_payload(segment, offset);
+    handle->value_offset   = PROMETHEUS_SEGMENT_HANDLE_OFFSET;
+    handle->buckets_offset = num_buckets ? PROMETHEUS_SEGMENT_HANDLE_OFFSET + handle_size : 0;
+    handle->local          = (uintptr_t) local;
+
+    prometheus_segment_set_state(segment, offset, PROMETHEUS_SEGMENT_LIVE);
+
+    return prometheus_segment_ptr(segment, offset + PROMETHEUS_SEGMENT_HANDLE_OFFSET);
+} /* prometheus_segment_create_handle */
+
+/* Return the private handle of the handle memory returned above */
+
+static inline void *
+prometheus_segment_handle_local(
+    struct prometheus_segment *segment,
+    void                      *hdl)
+{
+    uint64_t offset = (char *) hdl - (char *) segment->header - PROMETHEUS_SEGMENT_HANDLE_OFFSET;
+
+    return (void *) (uintptr_t) ((struct prometheus_segment_handle *) prometheus_segment_payload(segment, offset))->
+           local;
+} /* prometheus_segment_handle_local */
+
+/*
+ * Fold the final values of a live handle record into its series and put
+ * the record on the free list.  The caller holds the segment lock and
+ * has made the generation odd.
+ */
+
+static void
+prometheus_segment_fold_handle(
+    struct prometheus_segment *segment,
+    uint64_t                   offset)
+{
+    struct prometheus_segment_header *header = segment->header;
+    struct prometheus_segment_record *record = prometheus_segment_ptr(segment, offset);
+    struct prometheus_segment_handle *handle = prometheus_segment_payload(segment, offset);
+    struct prometheus_segment_series *series = prometheus_segment_payload(segment, record->parent);
+    const uint64_t                   *value, *buckets;
+    int                               i;
+
+    value = (const uint64_t *) ((char *) record + handle->value_offset);
+
+    series->saved += value[0];
+
+    /* Only histogram handles carry buckets, and a count after the sum */
+    if (handle->buckets_offset) {
+        buckets              = (const uint64_t *) ((char *) record + handle->buckets_offset);
+        series->saved_count += value[1];
+
+        for (i = 0; i < series->num_buckets; i++) {
+            series->buckets[i] += buckets[i];
+        }
+    }
+
+    __atomic_store_n(&record->state, PROMETHEUS_SEGMENT_FREE, __ATOMIC_RELEASE);
+
+    record->next_free = header->free_list;
+    header->free_list = offset;
+} /* prometheus_segment_fold_handle */
+
+/*
+ * Release a handle allocated by prometheus_segment_create_handle().
+ * Handles inherited across fork() belong to the parent and are left
+ * alone.
+ */
+
+static void
+prometheus_segment_destroy_handle(
+    struct prometheus_segment *segment,
+    void                      *hdl)
+{
+    struct prometheus_segment_header *header = segment->header;
+    struct prometheus_segment_record *record;
+    uint64_t                          offset;
+
+    offset = (char *) hdl - (char *) header - PROMETHEUS_SEGMENT_HANDLE_OFFSET;
+    record = prometheus_segment_ptr(segment, offset);
+
+    if (record->owner != (uint32_t) getpid()) {
+        return;
+    }
+
+    prometheus_segment_lock(header);
+
+    __atomic_add_fetch(&header->generation, 1, __ATOMIC_ACQ_REL);
+
+    prometheus_segment_fold_handle(segment, offset);
+
+    __atomic_add_fetch(&header->generation, 1, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_unlock(&header->lock);
+} /* prometheus_segment_destroy_handle */
+
+PUBLIC int
+prometheus_metrics_reap_process(
+    struct prometheus_metrics *metrics,
+    int                        pid)
+{
+    struct prometheus_segment        *segment = metrics->segment;
+    struct prometheus_segment_header *header;
+    struct prometheus_segment_record *record;
+    uint64_t                          offset;
+    int                               reaped = 0;
+
+    if (!segment) {
+        return 0;
+    }
+
+    header = segment->header;
+
+    prometheus_segment_lock(header);
+
+    __atomic_add_fetch(&header->generation, 1, __ATOMIC_ACQ_REL);
+
+    for (offset = header->record_offset; offset < header->used; offset += record->length) {
+        record = prometheus_segment_ptr(segment, offset);
+
+        if (record->kind == PROMETHEUS_SEGMENT_HANDLE && record->state == PROMETHEUS_SEGMENT_LIVE &&
+            record->owner == (uint32_t) pid) {
+            prometheus_segment_fold_handle(segment, offset);
+            reaped++;
+        }
+    }
+
+    __atomic_add_fetch(&header->generation, 1, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_unlock(&header->lock);
+
+    return reaped;
+} /* prometheus_metrics_reap_process */
+
+PUBLIC struct prometheus_metrics *
+prometheus_metrics_create_shared(
+    const char *path,
+    uint64_t    size,
+    char      **label_names,
+    char      **label_values,
+    int         label_count)
+{
+    struct prometheus_metrics        *metrics;
+    struct prometheus_segment_header *header;
+    struct prometheus_segment_labels *labels;
+    pthread_mutexattr_t               attr;
+    uint64_t                          offset;
+    int                               fd;
+
+    if (size < 4096) {
+        return NULL;
+    }
+
+    if (path) {
+        /* Replace rather than truncate so readers never map a half-built segment */
+        unlink(path);
+
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+        if (fd < 0) {
+            return NULL;
+        }
+
+        if (ftruncate(fd, size)) {
+            close(fd);
+            unlink(path);
+            return NULL;
+        }
+
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        close(fd);
+    } else {
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (header == MAP_FAILED) {
+        if (path) {
+            unlink(path);
+        }
+        return NULL;
+    }
+
+    metrics = prometheus_metrics_create(label_names, label_values, label_count);
+
+    metrics->segment         = prometheus_calloc(1, sizeof(*metrics->segment));
+    metrics->segment->header = header;
+    metrics->segment->size   = size;
+
+    header->version       = PROMETHEUS_SEGMENT_VERSION;
+    header->record_offset = (sizeof(*header) + PROMETHEUS_SEGMENT_ALIGN - 1) & ~(PROMETHEUS_SEGMENT_ALIGN - 1);
+    header->size          = size;
+    header->used          = header->record_offset;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    offset = prometheus_segment_alloc(metrics->segment, PROMETHEUS_SEGMENT_LABELS, 0,
+                                      sizeof(*labels) +
+                                      prometheus_segment_labels_size((const char **) label_names,
+                                                                     (const char **) label_values, label_count));
+
+    labels              = prometheus_segment_payload(metrics->segment, offset);
+    labels->label_count = label_count;
+
+    prometheus_segment_put_labels(labels->strings, (const char **) label_names, (const char **) label_values,
+                                  label_count);
+
+    prometheus_segment_set_state(metrics->segment, offset, PROMETHEUS_SEGMENT_LIVE);
+
+    /* Publish the magic last, once the rest of the header is valid */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, PROMETHEUS_SEGMENT_MAGIC, sizeof(PROMETHEUS_SEGMENT_MAGIC));
+
+    return metrics;
+} /* prometheus_metrics_create_shared */
+
+PUBLIC struct prometheus_segment *
+prometheus_segment_open(const char *path)
+{
+    struct prometheus_segment        *segment;
+    struct prometheus_segment_header *header;
+    struct stat                       st;
+    int                               fd;
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*header)) {
+        close(fd);
+        return NULL;
+    }
+
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (memcmp(header->magic, PROMETHEUS_SEGMENT_MAGIC, sizeof(PROMETHEUS_SEGMENT_MAGIC)) ||
+        header->version != PROMETHEUS_SEGMENT_VERSION || header->size > (uint64_t) st.st_size) {
+        munmap(header, st.st_size);
+        return NULL;
+    }
+
+    segment         = prometheus_calloc(1, sizeof(*segment));
+    segment->header = header;
+    segment->size   = st.st_size;
+
+    return segment;
+} /* prometheus_segment_open */
+
+PUBLIC void
+prometheus_segment_close(struct prometheus_segment *segment)
+{
+    munmap(segment->header, segment->size);
+    free(segment);
+} /* prometheus_segment_close */
+
+struct prometheus_segment_entry {
+    uint64_t offset;
+    int      type;
+    void    *object;
+};
+
+/*
+ * Records describing the same metric or series, such as the same series
+ * created independently by several worker processes, are merged into a
+ * single object when the segment is loaded.  Keys are the metric name,
+ * or the parent metric and the series label strings.
+ */
+
+struct prometheus_segment_key {
+    const void *parent;
+    const char *key;
+    int         key_len;
+    int         type;
+    void       *object;
+};
+
+struct prometheus_segment_loader {
+    struct prometheus_metrics       *metrics;
+    struct prometheus_segment_entry *metrics_index;
+    struct prometheus_segment_entry *series_index;
+    int                              num_metrics;
+    int                              num_series;
+    struct prometheus_segment_key   *keys;
+    uint64_t                         key_mask;
+};
+
+static void *
+prometheus_segment_entry_find(
+    struct prometheus_segment_entry *entries,
+    int                              num_entries,
+    uint64_t                         offset,
+    int                             *type)
+{
+    int lo = 0, hi = num_entries - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+
+        if (entries[mid].offset == offset) {
+            *type = entries[mid].type;
+            return entries[mid].object;
+        } else if (entries[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return NULL;
+} /* prometheus_segment_entry_find */
+
+static struct prometheus_segment_key *
+prometheus_segment_key_lookup(
+    struct prometheus_segment_loader *loader,
+    const void                       *parent,
+    const char                       *key,
+    int                               key_len)
+{
+    struct prometheus_segment_key *slot;
+    uint64_t                       hash = 14695981039346656037UL ^ (uintptr_t) parent;
+    int                            i;
+
+    for (i = 0; i < key_len; i++) {
+        hash = (hash ^ (uint8_t) key[i]) * 1099511628211UL;
+    }
+
+    for (;; hash++) {
+        slot = &loader->keys[hash & loader->key_mask];
+
+        if (!slot->object ||
+            (slot->parent == parent && slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0)) {
+            slot->parent  = parent;
+            slot->key     = key;
+            slot->key_len = key_len;
+            return slot;
+        }
+    }
+} /* prometheus_segment_key_lookup */
+
+static const char *
+prometheus_segment_get_labels(
+    const char  *strings,
+    int          label_count,
+    const char **label_names,
+    const char **label_values)
+{
+    int i;
+
+    for (i = 0; i < label_count; i++) {
+        if (label_names) {
+            label_names[i]  = strings;
+            label_values[i] = strings + strlen(strings) + 1;
+        }
+
+        strings += strlen(strings) + 1;
+        strings += strlen(strings) + 1;
+    }
+
+    return strings;
+} /* prometheus_segment_get_labels */
+
+static void
+prometheus_segment_accumulate(
+    int             metric_type,
+    void           *series,
+    const uint64_t *value,
+    uint64_t        count,
+    const uint64_t *buckets,
+    int             num_buckets)
+{
+    struct prometheus_histogram_series *histogram_series;
+    int                                 i;
+
+    switch (metric_type) {
+        case PROMETHEUS_METRIC_COUNTER:
+            ((struct prometheus_counter_series *) series)->saved += *value;
+            break;
+        case PROMETHEUS_METRIC_GAUGE:
+            ((struct prometheus_gauge_series *) series)->saved += *value;
+            break;
+        case PROMETHEUS_METRIC_HISTOGRAM:
+            histogram_series = series;
+
+            histogram_series->saved_sum   += *value;
+            histogram_series->saved_count += count;
+
+            for (i = 0; buckets && i < histogram_series->num_buckets && i < num_buckets; i++) {
+                histogram_series->saved[i] += buckets[i];
+            }
+            break;
+    } /* switch */
+} /* prometheus_segment_accumulate */
+
+static void
+prometheus_segment_load_metric(
+    struct prometheus_segment_loader *loader,
+    uint64_t                          offset,
+    struct prometheus_segment_metric *segment_metric)
+{
+    struct prometheus_segment_entry *entry = &loader->metrics_index[loader->num_metrics];
+    struct prometheus_segment_key   *slot;
+    const char                      *name = segment_metric->strings;
+    const char                      *help = name + strlen(name) + 1;
+
+    slot = prometheus_segment_key_lookup(loader, NULL, name, strlen(name));
+
+    if (slot->object) {
+        if (slot->type != segment_metric->type) {
+            return;
+        }
+    } else {
+        switch (segment_metric->type) {
+            case PROMETHEUS_METRIC_COUNTER:
+                slot->object = prometheus_metrics_create_counter(loader->metrics, name, help);
+                break;
+            case PROMETHEUS_METRIC_GAUGE:
+                slot->object = prometheus_metrics_create_gauge(loader->metrics, name, help);
+                break;
+            case PROMETHEUS_METRIC_HISTOGRAM:
+                if (segment_metric->histogram_type == PROMETHEUS_HISTOGRAM_EXPONENTIAL) {
+                    slot->object = prometheus_metrics_create_histogram_exponential(loader->metrics, name, help,
+                                                                                   segment_metric->num_buckets);
+                } else {
+                    slot->object = prometheus_metrics_create_histogram_linear(loader->metrics, name, help,
+                                                                              segment_metric->start,
+                                                                              segment_metric->increment,
+                                                                              segment_metric->num_buckets);
+                }
+
+                if (slot->object && segment_metric->sample_every) {
+                    prometheus_histogram_set_sampling(slot->object, segment_metric->sample_every);
+                }
+                break;
+        } /* switch */
+
+        if (!slot->object) {
+            return;
+        }
+
+        slot->type = segment_metric->type;
+    }
+
+    entry->offset = offset;
+    entry->type   = slot->type;
+    entry->object = slot->object;
+
+    loader->num_metrics++;
+} /* prometheus_segment_load_metric */
+
+static void
+prometheus_segment_load_series(
+    struct prometheus_segment_loader *loader,
+    uint64_t                          offset,
+    uint64_t                          metric_offset,
+    struct prometheus_segment_series *segment_series)
+{
+    struct prometheus_segment_entry *entry = &loader->series_index[loader->num_series];
+    struct prometheus_segment_key   *slot;
+    const char                      *strings, **label_names, **label_values;
+    void                            *metric;
+    int                              type, count = segment_series->label_count;
+
+    metric = prometheus_segment_entry_find(loader->metrics_index, loader->num_metrics, metric_offset, &type);
+
+    if (!metric) {
+        return;
+    }
+
+    strings = (const char *) &segment_series->buckets[segment_series->num_buckets];
+
+    slot = prometheus_segment_key_lookup(loader, metric, strings,
+                                         prometheus_segment_get_labels(strings, count, NULL, NULL) - strings);
+
+    if (!slot->object) {
+        label_names  = prometheus_calloc(count, sizeof(char *));
+        label_values = prometheus_calloc(count, sizeof(char *));
+
+        prometheus_segment_get_labels(strings, count, label_names, label_values);
+
+        switch (type) {
+            case PROMETHEUS_METRIC_COUNTER:
+                slot->object = prometheus_counter_create_series(metric, label_names, label_values, count);
+                break;
+            case PROMETHEUS_METRIC_GAUGE:
+                slot->object = prometheus_gauge_create_series(metric, label_names, label_values, count);
+                break;
+            case PROMETHEUS_METRIC_HISTOGRAM:
+                slot->object = prometheus_histogram_create_series(metric, label_names, label_values, count);
+                break;
+        } /* switch */
+
+        free(label_names);
+        free(label_values);
+
+        if (!slot->object) {
+            return;
+        }
+    }
+
+    prometheus_segment_accumulate(type, slot->object, &segment_series->saved, segment_series->saved_count,
+                                  segment_series->buckets, segment_series->num_buckets);
+
+    entry->offset = offset;
+    entry->type   = type;
+    entry->object = slot->object;
+
+    loader->num_series++;
+} /* prometheus_segment_load_series */
+
+static void
+prometheus_segment_load_handle(
+    struct prometheus_segment_loader *loader,
+    struct prometheus_segment_record *record)
+{
+    struct prometheus_segment_handle *handle = (struct prometheus_segment_handle *) (record + 1);
+    const uint64_t                   *value  = (const uint64_t *) ((char *) record + handle->value_offset);
+    void                             *series;
+    int                               type;
+
+    series = prometheus_segment_entry_find(loader->series_index, loader->num_series, record->parent, &type);
+
+    if (!series) {
+        return;
+    }
+
+    if (type == PROMETHEUS_METRIC_HISTOGRAM && handle->buckets_offset) {
+        prometheus_segment_accumulate(type, series, value, value[1],
+                                      (const uint64_t *) ((char *) record + handle->buckets_offset),
+                                      ((struct prometheus_histogram_series *) series)->num_buckets);
+    } else {
+        prometheus_segment_accumulate(type, series, value, 0, NULL, 0);
+    }
+} /* prometheus_segment_load_handle */
+
+/*
+ * Build a private registry from the segment contents, with each series
+ * holding the sum of its folded totals and its live handles.  Metrics
+ * and series are created first and handles are added in a second pass,
+ * since a recycled handle record may precede its series.
+ */
+
+static struct prometheus_metrics *
+prometheus_segment_load(struct prometheus_segment *segment)
+{
+    struct prometheus_segment_header *header = segment->header;
+    struct prometheus_segment_record *record;
+    struct prometheus_segment_labels *labels;
+    struct prometheus_segment_loader  loader = { 0 };
+    const char                      **label_names, **label_values;
+    uint64_t                          offset, used, num_keys = 0;
+    int                               pass;
+
+    used = __atomic_load_n(&header->used, __ATOMIC_ACQUIRE);
+
+    if (used > segment->size) {
+        return NULL;
+    }
+
+    for (pass = 0; pass < 3; pass++) {
+
+        if (pass == 1) {
+            for (loader.key_mask = 63; loader.key_mask < 2 * num_keys; loader.key_mask = loader.key_mask * 2 + 1) {
+            }
+
+            loader.keys          = prometheus_calloc(loader.key_mask + 1, sizeof(*loader.keys));
+            loader.metrics_index = prometheus_calloc(num_keys + 1, sizeof(*loader.metrics_index));
+            loader.series_index  = prometheus_calloc(num_keys + 1, sizeof(*loader.series_index));
+        }
+
+        for (offset = header->record_offset; offset + sizeof(*record) <= used; offset += record->length) {
+
+            record = prometheus_segment_ptr(segment, offset);
+
+            if (record->length < sizeof(*record) || offset + record->length > used) {
+                break;
+            }
+
+            if (__atomic_load_n(&record->state, __ATOMIC_ACQUIRE) != PROMETHEUS_SEGMENT_LIVE) {
+                continue;
+            }
+
+            switch (record->kind) {
+                case PROMETHEUS_SEGMENT_LABELS:
+                    if (pass != 1 || loader.metrics) {
+                        break;
+                    }
+
+                    labels       = (struct prometheus_segment_labels *) (record + 1);
+                    label_names  = prometheus_calloc(labels->label_count, sizeof(char *));
+                    label_values = prometheus_calloc(labels->label_count, sizeof(char *));
+
+                    prometheus_segment_get_labels(labels->strings, labels->label_count, label_names, label_values);
+
+                    loader.metrics = prometheus_metrics_create((char **) label_names, (char **) label_values,
+                                                               labels->label_count);
+
+                    free(label_names);
+                    free(label_values);
+                    break;
+                case PROMETHEUS_SEGMENT_METRIC:
+                    if (pass == 0) {
+                        num_keys++;
+                    } else if (pass == 1 && loader.metrics) {
+                        prometheus_segment_load_metric(&loader, offset,
+                                                       (struct prometheus_segment_metric *) (record + 1));
+                    }
+                    break;
+                case PROMETHEUS_SEGMENT_SERIES:
+                    if (pass == 0) {
+                        num_keys++;
+                    } else if (pass == 1 && loader.metrics) {
+                        prometheus_segment_load_series(&loader, offset, record->parent,
+                                                       (struct prometheus_segment_series *) (record + 1));
+                    }
+                    break;
+                case PROMETHEUS_SEGMENT_HANDLE:
+                    if (pass == 2) {
+                        prometheus_segment_load_handle(&loader, record);
+                    }
+                    break;
+            } /* switch */
+        }
+    }
+
+    free(loader.keys);
+    free(loader.metrics_index);
+    free(loader.series_index);
+
+    return loader.metrics;
+} /* prometheus_segment_load */
+
+/*
+ * Load the segment, retrying if a handle was folded into its series
+ * part way through, as it might then have been counted twice.
+ */
+
+static struct prometheus_metrics *
+prometheus_segment_snapshot(struct prometheus_segment *segment)
+{
+    struct prometheus_metrics *metrics = NULL;
+    uint64_t                   generation;
+    int                        attempt;
+
+    for (attempt = 0; attempt < 16; attempt++) {
+
+        generation = __atomic_load_n(&segment->header->generation, __ATOMIC_ACQUIRE);
+
+        if (generation & 1) {
+            sched_yield();
+            continue;
+        }
+
+        if (metrics) {
+            prometheus_metrics_destroy(metrics);
+        }
+
+        metrics = prometheus_segment_load(segment);
+
+        if (!metrics || __atomic_load_n(&segment->header->generation, __ATOMIC_ACQUIRE) == generation) {
+            break;
+        }
+    }
+
+    return metrics;
+} /* prometheus_segment_snapshot */
+
+PUBLIC int
+prometheus_segment_scrape(
+    struct prometheus_segment *segment,
+    char                      *buffer,
+    int                        buffer_size)
+{
+    struct prometheus_metrics *metrics;
+    int                        length;
+
+    metrics = prometheus_segment_snapshot(segment);
+
+    if (!metrics) {
+        return -1;
+    }
+
+    length = prometheus_metrics_scrape(metrics, buffer, buffer_size);
+
+    prometheus_metrics_destroy(metrics);
+
+    return length;
+} /* prometheus_segment_scrape */
+
+/*
+ * Handles are cache line aligned so that handles updated by different
+ * threads never share a line.  Handles created together are carved out
+ * of a single block, which is freed when the last of them is destroyed.
+ */
+
+struct prometheus_handle_block {
+    int64_t refcnt;
+} __attribute__((aligned(64)));
+
+static inline void *
+prometheus_calloc_aligned(size_t size)
+{
+    void *ptr;
+
+    if (posix_memalign(&ptr, 64, size)) {
+        abort();
+    }
+
+    memset(ptr, 0, size);
+
+    return ptr;
+} /* prometheus_calloc_aligned */
+
+static inline void *
+prometheus_handle_block_alloc(
+    int                              count,
+    size_t                           size,
+    struct prometheus_handle_block **block)
+{
+    if (count == 1) {
+        *block = NULL;
+        return prometheus_calloc_aligned(size);
+    }
+
+    *block           = prometheus_calloc_aligned(sizeof(**block) + count * size);
+    (*block)->refcnt = count;
+
+    return *block + 1;
+} /* prometheus_handle_block_alloc */
+
+static inline void
+prometheus_handle_free(
+    void                           *hdl,
+    struct prometheus_handle_block *block)
+{
+    if (!block) {
+        free(hdl);
+    } else if (__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(block);
+    }
+} /* prometheus_handle_free */
+
+/* Label names are shared by every series in a batch, so they are only checked once */
+
+static inline int
+prometheus_labels_legal(
+    const char **label_names,
+    const char **label_values,
+    int          num_labels,
+    int          num_series)
+{
+    int i;
+
+    for (i = 0; i < num_labels; i++) {
+        if (!prometheus_string_legal_name(label_names[i])) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < num_labels * num_series; i++) {
+        if (!prometheus_string_legal_value(label_values[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+} /* prometheus_labels_legal */
+
+/*
+ * Seed a newly created series from a restored checkpoint.  This is done
+ * after the metric lock is dropped, as the checkpoint lock is taken
+ * before the metric locks elsewhere.
+ */
+
+static void
+prometheus_counter_series_seed(
+    struct prometheus_counter        *counter,
+    struct prometheus_counter_series *series)
+{
+    struct prometheus_checkpoint *checkpoint = &counter->base.metrics->checkpoint;
+
+    if (!__atomic_load_n(&checkpoint->slots, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&checkpoint->lock);
+    pthread_mutex_lock(&series->lock);
+
+    prometheus_checkpoint_seed(checkpoint, PROMETHEUS_METRIC_COUNTER, counter->base.name, &series->base,
+                               &series->saved, NULL, NULL, 0);
+
+    pthread_mutex_unlock(&series->lock);
+    pthread_mutex_unlock(&checkpoint->lock);
+} /* prometheus_counter_series_seed */
+
+static void
+prometheus_histogram_series_seed(
+    struct prometheus_histogram        *histogram,
+    struct prometheus_histogram_series *series)
+{
+    struct prometheus_checkpoint *checkpoint = &histogram->base.metrics->checkpoint;
+
+    if (!__atomic_load_n(&checkpoint->slots, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&checkpoint->lock);
+    pthread_mutex_lock(&series->lock);
+
+    prometheus_checkpoint_seed(checkpoint, PROMETHEUS_METRIC_HISTOGRAM, histogram->base.name, &series->base,
+                               series->saved, &series->saved_sum, &series->saved_count, series->num_buckets);
+
+    pthread_mutex_unlock(&series->lock);
+    pthread_mutex_unlock(&checkpoint->lock);
+} /* prometheus_histogram_series_seed */
+
+static struct prometheus_metrics *
+prometheus_metrics_root(struct prometheus_metrics *metrics)
+{
+    while (metrics->parent) {
+        metrics = metrics->parent;
+    }
+
+    return metrics;
+} /* prometheus_metrics_root */
+
+static int
+prometheus_metrics_name_find(
+    struct prometheus_metrics *root,
+    const char                *name)
+{
+    int lo = 0, hi = root->names_count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if (strcmp(root->names[mid].name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+} /* prometheus_metrics_name_find */
+
+/*
+ * Claim a name for a metric about to be created in a registry of the
+ * tree.  Fails if the name is in use with another type.
+ */
+
+static int
+prometheus_metrics_name_claim(
+    struct prometheus_metrics  *metrics,
+    const char                 *name,
+    enum prometheus_metric_type type)
+{
+    struct prometheus_metrics *root = prometheus_metrics_root(metrics);
+    int                        pos, size;
+
+    pthread_mutex_lock(&root->names_lock);
+
+    pos = prometheus_metrics_name_find(root, name);
+
+    if (pos < root->names_count && strcmp(root->names[pos].name, name) == 0) {
+        if (root->names[pos].type != type) {
+            pthread_mutex_unlock(&root->names_lock);
+            return -1;
+        }
+
+        root->names[pos].refs++;
+
+        pthread_mutex_unlock(&root->names_lock);
+        return 0;
+    }
+
+    if (root->names_count == root->names_size) {
+        size = root->names_size ? 2 * root->names_size : 16;
+
+        prometheus_self_account(root, 0, 0, (int64_t) (size - root->names_size) * sizeof(*root->names));
+
+        root->names      = realloc(root->names, size * sizeof(*root->names));
+        root->names_size = size;
+
+        if (!root->names) {
+            abort();
+        }
+    }
+
+    memmove(&root->names[pos + 1], &root->names[pos], (root->names_count - pos) * sizeof(*root->names));
+
+    root->names[pos].name = prometheus_strdup(name);
+    root->names[pos].type = type;
+    root->names[pos].refs = 1;
+
+    root->names_count++;
+
+    pthread_mutex_unlock(&root->names_lock);
+
+    return 0;
+} /* prometheus_metrics_name_claim */
+
+static void
+prometheus_metrics_name_release(
+    struct prometheus_metrics *metrics,
+    const char                *name)
+{
+    struct prometheus_metrics *root = prometheus_metrics_root(metrics);
+    int                        pos;
+
+    pthread_mutex_lock(&root->names_lock);
+
+    pos = prometheus_metrics_name_find(root, name);
+
+    if (pos < root->names_count && strcmp(root->names[pos].name, name) == 0 && --root->names[pos].refs == 0) {
+        free(root->names[pos].name);
+
+        memmove(&root->names[pos], &root->names[pos + 1], (root->names_count - pos - 1) * sizeof(*root->names));
+
+        root->names_count--;
+    }
+
+    pthread_mutex_unlock(&root->names_lock);
+} /* prometheus_metrics_name_release */
+
+PUBLIC struct prometheus_counter *
+prometheus_metrics_create_counter(
+    struct prometheus_metrics *metrics,
+    const char                *name,
+    const char                *help)
+{
+    struct prometheus_counter *counter;
+
+    if (!prometheus_string_legal_name(name)) {
+        return NULL;
+    }
+
+    if (prometheus_metrics_name_claim(metrics, name, PROMETHEUS_METRIC_COUNTER)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&metrics->lock);
+
+    counter = prometheus_calloc(1, sizeof(*counter));
+
+    prometheus_metric_base_init(&counter->base, metrics, name, help, "counter");
+
+    prometheus_self_account(metrics, 0, 0, sizeof(*counter));
+
+    pthread_mutex_init(&counter->lock, NULL);
+
+    list_append(metrics->counters, counter);
+
+    prometheus_metrics_index_insert(metrics, counter->base.name, PROMETHEUS_METRIC_COUNTER, counter);
+
+    if (metrics->segment) {
+        counter->base.segment_offset = prometheus_segment_create_metric(metrics->segment, &counter->base,
+                                                                       PROMETHEUS_METRIC_COUNTER, NULL);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return counter;
+} /* prometheus_metrics_add_counter */
+
+PUBLIC int
+prometheus_counter_create_series_batch(
+    struct prometheus_counter         *counter,
+    const char                       **label_names,
+    const char                       **label_values,
+    int                                num_labels,
+    int                                num_series,
+    struct prometheus_counter_series **series)
+{
+    struct prometheus_metrics        *metrics = counter->base.metrics;
+    struct prometheus_counter_series *discard = NULL, *next;
+    struct prometheus_series_base    *found;
+    int64_t                           size;
+    int                               i, created = 0;
+
+    if (!prometheus_metric_base_labels_match(&counter->base, label_names, num_labels) ||
+        !prometheus_labels_legal(label_names, label_values, num_labels, num_series)) {
+        return -1;
+    }
+
+    /* A sliding window, if enabled, follows the labels in the same allocation */
+
+    size = sizeof(**series) + prometheus_series_labels_size(&counter->base, num_labels) +
+           prometheus_window_size(counter->window_slots, 0);
+
+    /* Build every series before taking the metric lock, then link them under a single hold */
+
+    for (i = 0; i < num_series; i++) {
+        series[i] = prometheus_calloc(1, size);
+
+        prometheus_series_base_init(&series[i]->base, &counter->base, num_labels, label_names,
+                                    label_values + i * num_labels, (char **) (series[i] + 1));
+
+        if (counter->window_slots) {
+            prometheus_window_init(&series[i]->window, counter->window_slots, 0,
+                                   (uint64_t *) (series[i]->base.label_values + num_labels));
+        }
+
+        if (counter->base.vec) {
+            series[i]->base.vec_hash = prometheus_vec_hash(label_values + i * num_labels, num_labels);
+        }
+
+        pthread_mutex_init(&series[i]->lock, NULL);
+    }
+
+    pthread_mutex_lock(&counter->lock);
+
+    for (i = 0; i < num_series; i++) {
+        /* A metric with a label schema holds a single series per value tuple */
+        if (counter->base.vec) {
+            found = prometheus_vec_find(&counter->base, series[i]->base.vec_hash, label_values + i * num_labels);
+
+            if (found) {
+                series[i]->next = discard;
+                discard         = series[i];
+                series[i]       = container_of(found, struct prometheus_counter_series, base);
+                continue;
+            }
+
+            prometheus_vec_insert(&counter->base, &series[i]->base);
+        }
+
+        list_append(counter->series, series[i]);
+
+        if (metrics->segment) {
+            series[i]->base.segment_offset = prometheus_segment_create_series(metrics->segment,
+                                                                              counter->base.segment_offset,
+                                                                              &series[i]->base, 0);
+        }
+
+        created++;
+    }
+
+    counter->num_series += created;
+
+    prometheus_self_account(metrics, created, 0, created * size);
+
+    pthread_mutex_unlock(&counter->lock);
+
+    while (discard) {
+        next = discard->next;
+
+        prometheus_series_base_destroy(&discard->base);
+        pthread_mutex_destroy(&discard->lock);
+        free(discard);
+
+        discard = next;
+    }
+
+    for (i = 0; i < num_series; i++) {
+        prometheus_counter_series_seed(counter, series[i]);
+    }
+
+    return 0;
+} /* prometheus_counter_create_series_batch */
+
+PUBLIC struct prometheus_counter_series *
+prometheus_counter_create_series(
+    struct prometheus_counter *counter,
+    const char               **label_names,
+    const char               **label_values,
+    int                        num_labels)
+{
+    struct prometheus_counter_series *series;
+
+    if (prometheus_counter_create_series_batch(counter, label_names, label_values, num_labels, 1, &series)) {
+        return NULL;
+    }
+
+    return series;
+} /* prometheus_counter_add_series */
+
+PUBLIC int
+prometheus_counter_declare_labels(
+    struct prometheus_counter *counter,
+    const char               **label_names,
+    int                        num_labels)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&counter->lock);
+
+    if (!counter->series) {
+        rc = prometheus_metric_base_declare_labels(&counter->base, label_names, num_labels);
+    }
+
+    pthread_mutex_unlock(&counter->lock);
+
+    return rc;
+} /* prometheus_counter_declare_labels */
+
+PUBLIC int
+prometheus_counter_add_rollup(
+    struct prometheus_counter *counter,
+    const char               **drop_labels,
+    int                        num_drop,
+    uint32_t                   flags)
+{
+    int rc;
+
+    pthread_mutex_lock(&counter->lock);
+    rc = prometheus_metric_base_add_rollup(&counter->base, drop_labels, num_drop, flags);
+    pthread_mutex_unlock(&counter->lock);
+
+    return rc;
+} /* prometheus_counter_add_rollup */
+
+PUBLIC int
+prometheus_counter_set_window(
+    struct prometheus_counter *counter,
+    int                        num_intervals)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&counter->lock);
+
+    /* Windows are sized when a series is allocated */
+    if (!counter->series && num_intervals > 0) {
+        counter->window_slots = num_intervals + 1;
+        rc                    = 0;
+    }
+
+    pthread_mutex_unlock(&counter->lock);
+
+    return rc;
+} /* prometheus_counter_set_window */
+
+PUBLIC int
+prometheus_counter_series_rate(
+    struct prometheus_counter_series *series,
+    double                           *rate)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&series->lock);
+
+    if (series->window.slots) {
+        rc = prometheus_counter_series_window_rate(series, rate);
+    }
+
+    pthread_mutex_unlock(&series->lock);
+
+    return rc;
+} /* prometheus_counter_series_rate */
+
+PUBLIC struct prometheus_counter_series *
+prometheus_counter_lookup_series(
+    struct prometheus_counter *counter,
+    const char               **label_values)
+{
+    struct prometheus_series_base    *found;
+    struct prometheus_counter_series *series;
+    uint64_t                          hash;
+
+    if (!counter->base.vec) {
+        return NULL;
+    }
+
+    hash = prometheus_vec_hash(label_values, counter->base.label_count);
+
+    pthread_mutex_lock(&counter->lock);
+    found = prometheus_vec_find(&counter->base, hash, label_values);
+    pthread_mutex_unlock(&counter->lock);
+
+    if (found) {
+        return container_of(found, struct prometheus_counter_series, base);
+    }
+
+    /* Creation returns the winner if another lookup added the same values meanwhile */
+    if (prometheus_counter_create_series_batch(counter, (const char **) counter->base.label_names, label_values,
+                                               counter->base.label_count, 1, &series)) {
+        return NULL;
+    }
+
+    return series;
+} /* prometheus_counter_lookup_series */
+
+PUBLIC int
+prometheus_counter_series_create_instances(
+    struct prometheus_counter_series    *series,
+    int                                  num_instances,
+    struct prometheus_counter_instance **instances)
+{
+    struct prometheus_segment        *segment = series->base.metrics->segment;
+    struct prometheus_counter_handle *hdls    = NULL, *hdl;
+    struct prometheus_handle_block   *block   = NULL;
+    int                               i;
+
+    if (num_instances <= 0) {
+        return -1;
+    }
+
+    hdls = prometheus_handle_block_alloc(num_instances, sizeof(*hdls), &block);
+
+    pthread_mutex_lock(&series->lock);
+
+    for (i = 0; i < num_instances; i++) {
+        hdl        = &hdls[i];
+        hdl->block = block;
+
+        /* Shared handles keep their value in the segment and their links here */
+        if (segment) {
+            hdl->instance = prometheus_segment_create_handle(segment, series->base.segment_offset,
+                                                             sizeof(*hdl->instance), 0, hdl);
+        } else {
+            hdl->instance = &hdl->counter;
+        }
+
+        list_append(series->head, hdl);
+
+        instances[i] = hdl->instance;
+    }
+
+    pthread_mutex_unlock(&series->lock);
+
+    prometheus_self_account(series->base.metrics, 0, num_instances, num_instances * sizeof(*hdl));
+
+    return 0;
+} /* prometheus_counter_series_create_instances */
+
+PUBLIC struct prometheus_counter_instance *
+prometheus_counter_series_create_instance(struct prometheus_counter_series *series)
+{
+    struct prometheus_counter_instance *instance;
+
+    prometheus_counter_series_create_instances(series, 1, &instance);
+
+    return instance;
+} /* prometheus_counter_create_instance */
+
+
+PUBLIC struct prometheus_gauge *
+prometheus_metrics_create_gauge(
+    struct prometheus_metrics *metrics,
+    const char                *name,
+    const char                *help)
+{
+    struct prometheus_gauge   *gauge;
+
+    if (!prometheus_string_legal_name(name)) {
+        return NULL;
+    }
+
+    if (prometheus_metrics_name_claim(metrics, name, PROMETHEUS_METRIC_GAUGE)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&metrics->lock);
+
+    gauge = prometheus_calloc(1, sizeof(*gauge));
+
+    prometheus_metric_base_init(&gauge->base, metrics, name, help, "gauge");
+
+    prometheus_self_account(metrics, 0, 0, sizeof(*gauge));
+
+    pthread_mutex_init(&gauge->lock, NULL);
+
+    list_append(metrics->gauges, gauge);
+
+    prometheus_metrics_index_insert(metrics, gauge->base.name, PROMETHEUS_METRIC_GAUGE, gauge);
+
+    if (metrics->segment) {
+        gauge->base.segment_offset = prometheus_segment_create_metric(metrics->segment, &gauge->base,
+                                                                       PROMETHEUS_METRIC_GAUGE, NULL);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return gauge;
+} /* prometheus_metrics_add_gauge */
+
+PUBLIC int
+prometheus_gauge_create_series_batch(
+    struct prometheus_gauge         *gauge,
+    const char                     **label_names,
+    const char                     **label_values,
+    int                              num_labels,
+    int                              num_series,
+    struct prometheus_gauge_series **series)
+{
+    struct prometheus_metrics      *metrics = gauge->base.metrics;
+    struct prometheus_gauge_series *discard = NULL, *next;
+    struct prometheus_series_base  *found;
+    int64_t                         size;
+    int                             i, created = 0;
+
+    if (!prometheus_metric_base_labels_match(&gauge->base, label_names, num_labels) ||
+        !prometheus_labels_legal(label_names, label_values, num_labels, num_series)) {
+        return -1;
+    }
+
+    size = sizeof(**series) + prometheus_series_labels_size(&gauge->base, num_labels);
+
+    /* Build every series before taking the metric lock, then link them under a single hold */
+
+    for (i = 0; i < num_series; i++) {
+        series[i] = prometheus_calloc(1, size);
+
+        prometheus_series_base_init(&series[i]->base, &gauge->base, num_labels, label_names,
+                                    label_values + i * num_labels, (char **) (series[i] + 1));
+
+        if (gauge->base.vec) {
+            series[i]->base.vec_hash = prometheus_vec_hash(label_values + i * num_labels, num_labels);
+        }
+
+        pthread_mutex_init(&series[i]->lock, NULL);
+    }
+
+    pthread_mutex_lock(&gauge->lock);
+
+    for (i = 0; i < num_series; i++) {
+        /* A metric with a label schema holds a single series per value tuple */
+        if (gauge->base.vec) {
+            found = prometheus_vec_find(&gauge->base, series[i]->base.vec_hash, label_values + i * num_labels);
+
+            if (found) {
+                series[i]->next = discard;
+                discard         = series[i];
+                series[i]       = container_of(found, struct prometheus_gauge_series, base);
+                continue;
+            }
+
+            prometheus_vec_insert(&gauge->base, &series[i]->base);
+        }
+
+        list_append(gauge->series, series[i]);
+
+        if (metrics->segment) {
+            series[i]->base.segment_offset = prometheus_segment_create_series(metrics->segment,
+                                                                              gauge->base.segment_offset,
+                                                                              &series[i]->base, 0);
+        }
+
+        created++;
+    }
+
+    gauge->num_series += created;
+
+    prometheus_self_account(metrics, created, 0, created * size);
+
+    pthread_mutex_unlock(&gauge->lock);
+
+    while (discard) {
+        next = discard->next;
+
+        prometheus_series_base_destroy(&discard->base);
+        pthread_mutex_destroy(&discard->lock);
+        free(discard);
+
+        discard = next;
+    }
+
+    return 0;
+} /* prometheus_gauge_create_series_batch */
+
+PUBLIC struct prometheus_gauge_series *
+prometheus_gauge_create_series(
+    struct prometheus_gauge *gauge,
+    const char             **label_names,
+    const char             **label_values,
+    int                      num_labels)
+{
+    struct prometheus_gauge_series *series;
+
+    if (prometheus_gauge_create_series_batch(gauge, label_names, label_values, num_labels, 1, &series)) {
+        return NULL;
+    }
+
+    return series;
+} /* prometheus_gauge_add_series */
+
+PUBLIC int
+prometheus_gauge_declare_labels(
+    struct prometheus_gauge *gauge,
+    const char             **label_names,
+    int                      num_labels)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&gauge->lock);
+
+    if (!gauge->series) {
+        rc = prometheus_metric_base_declare_labels(&gauge->base, label_names, num_labels);
+    }
+
+    pthread_mutex_unlock(&gauge->lock);
+
+    return rc;
+} /* prometheus_gauge_declare_labels */
+
+PUBLIC int
+prometheus_gauge_add_rollup(
+    struct prometheus_gauge *gauge,
+    const char             **drop_labels,
+    int                      num_drop,
+    uint32_t                 flags)
+{
+    int rc;
+
+    pthread_mutex_lock(&gauge->lock);
+    rc = prometheus_metric_base_add_rollup(&gauge->base, drop_labels, num_drop, flags);
+    pthread_mutex_unlock(&gauge->lock);
+
+    return rc;
+} /* prometheus_gauge_add_rollup */
+
+PUBLIC struct prometheus_gauge_series *
+prometheus_gauge_lookup_series(
+    struct prometheus_gauge *gauge,
+    const char             **label_values)
+{
+    struct prometheus_series_base  *found;
+    struct prometheus_gauge_series *series;
+    uint64_t                        hash;
+
+    if (!gauge->base.vec) {
+        return NULL;
+    }
+
+    hash = prometheus_vec_hash(label_values, gauge->base.label_count);
+
+    pthread_mutex_lock(&gauge->lock);
+    found = prometheus_vec_find(&gauge->base, hash, label_values);
+    pthread_mutex_unlock(&gauge->lock);
+
+    if (found) {
+        return container_of(found, struct prometheus_gauge_series, base);
+    }
+
+    /* Creation returns the winner if another lookup added the same values meanwhile */
+    if (prometheus_gauge_create_series_batch(gauge, (const char **) gauge->base.label_names, label_values,
+                                             gauge->base.label_count, 1, &series)) {
+        return NULL;
+    }
+
+    return series;
+} /* prometheus_gauge_lookup_series */
+
+PUBLIC int
+prometheus_gauge_series_create_instances(
+    struct prometheus_gauge_series    *series,
+    int                                num_instances,
+    struct prometheus_gauge_instance **instances)
+{
+    struct prometheus_segment      *segment = series->base.metrics->segment;
+    struct prometheus_gauge_handle *hdls    = NULL, *hdl;
+    struct prometheus_handle_block *block   = NULL;
+    int                             i;
+
+    if (num_instances <= 0) {
+        return -1;
+    }
+
+    hdls = prometheus_handle_block_alloc(num_instances, sizeof(*hdls), &block);
+
+    pthread_mutex_lock(&series->lock);
+
+    for (i = 0; i < num_instances; i++) {
+        hdl        = &hdls[i];
+        hdl->block = block;
+
+        /* Shared handles keep their value in the segment and their links here */
+        if (segment) {
+            hdl->instance = prometheus_segment_create_handle(segment, series->base.segment_offset,
+                                                             sizeof(*hdl->instance), 0, hdl);
+        } else {
+            hdl->instance = &hdl->gauge;
+        }
+
+        list_append(series->head, hdl);
+
+        instances[i] = hdl->instance;
+    }
+
+    pthread_mutex_unlock(&series->lock);
+
+    prometheus_self_account(series->base.metrics, 0, num_instances, num_instances * sizeof(*hdl));
+
+    return 0;
+} /* prometheus_gauge_series_create_instances */
+
+PUBLIC struct prometheus_gauge_instance *
+prometheus_gauge_series_create_instance(struct prometheus_gauge_series *series)
+{
+    struct prometheus_gauge_instance *instance;
+
+    prometheus_gauge_series_create_instances(series, 1, &instance);
+
+    return instance;
+} /* prometheus_gauge_series_create_instance */
+
+PUBLIC struct prometheus_histogram *
+prometheus_metrics_create_histogram_exponential(
     struct prometheus_metrics *metrics,
     const char                *name,
-    const char                *help)
+    const char                *help,
+    uint64_t                   count)
 {
-    struct prometheus_counter *counter;
+    struct prometheus_histogram *histogram;
 
     if (!prometheus_string_legal_name(name)) {
         return NULL;
     }
 
+    if (prometheus_metrics_name_claim(metrics, name, PROMETHEUS_METRIC_HISTOGRAM)) {
+        return NULL;
+    }
+
     pthread_mutex_lock(&metrics->lock);
 
-    counter = prometheus_calloc(1, sizeof(*counter));
+    histogram = prometheus_calloc(1, sizeof(*histogram));
 
-    prometheus_metric_base_init(&counter->base, name, help, "counter");
+    prometheus_metric_base_init(&histogram->base, metrics, name, help, "histogram");
 
-    pthread_mutex_init(&counter->lock, NULL);
+    prometheus_self_account(metrics, 0, 0, sizeof(*histogram));
 
-    list_append(metrics->counters, counter);
+    histogram->type  = PROMETHEUS_HISTOGRAM_EXPONENTIAL;
+    histogram->count = count;
+
+    prometheus_histogram_render_thresholds(histogram);
+
+    pthread_mutex_init(&histogram->lock, NULL);
+
+    list_append(metrics->histograms, histogram);
+
+    prometheus_metrics_index_insert(metrics, histogram->base.name, PROMETHEUS_METRIC_HISTOGRAM, histogram);
+
+    if (metrics->segment) {
+        histogram->base.segment_offset = prometheus_segment_create_metric(metrics->segment, &histogram->base,
+                                                                          PROMETHEUS_METRIC_HISTOGRAM, histogram);
+    }
 
     pthread_mutex_unlock(&metrics->lock);
 
-    return counter;
-} /* prometheus_metrics_add_counter */
+    return histogram;
+} /* prometheus_metrics_add_histogram */
 
-PUBLIC struct prometheus_counter_series *
-prometheus_counter_create_series(
-    struct prometheus_counter *counter,
-    const char               **label_names,
-    const char               **label_values,
-    int                        num_labels)
+
+PUBLIC struct prometheus_histogram *
+prometheus_metrics_create_histogram_linear(
+    struct prometheus_metrics *metrics,
+    const char                *name,
+    const char                *help,
+    uint64_t                   start,
+    uint64_t                   increment,
+    uint64_t                   count)
 {
-    struct prometheus_counter_series *series;
-    int                               i;
+    struct prometheus_histogram *histogram;
 
-    for (i = 0; i < num_labels; i++) {
-        if (!prometheus_string_legal_name(label_names[i])) {
-            return NULL;
+    if (!prometheus_string_legal_name(name)) {
+        return NULL;
+    }
+
+    if (prometheus_metrics_name_claim(metrics, name, PROMETHEUS_METRIC_HISTOGRAM)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&metrics->lock);
+
+    histogram = prometheus_calloc(1, sizeof(*histogram));
+
+    prometheus_metric_base_init(&histogram->base, metrics, name, help, "histogram");
+
+    prometheus_self_account(metrics, 0, 0, sizeof(*histogram));
+
+    histogram->type      = PROMETHEUS_HISTOGRAM_LINEAR;
+    histogram->count     = count;
+    histogram->start     = start;
+    histogram->increment = increment;
+
+    prometheus_histogram_render_thresholds(histogram);
+
+    pthread_mutex_init(&histogram->lock, NULL);
+
+    list_append(metrics->histograms, histogram);
+
+    prometheus_metrics_index_insert(metrics, histogram->base.name, PROMETHEUS_METRIC_HISTOGRAM, histogram);
+
+    if (metrics->segment) {
+        histogram->base.segment_offset = prometheus_segment_create_metric(metrics->segment, &histogram->base,
+                                                                          PROMETHEUS_METRIC_HISTOGRAM, histogram);
+    }
+
+    pthread_mutex_unlock(&metrics->lock);
+
+    return histogram;
+} /* prometheus_metrics_add_histogram */
+
+PUBLIC int
+prometheus_histogram_create_series_batch(
+    struct prometheus_histogram         *histogram,
+    const char                         **label_names,
+    const char                         **label_values,
+    int                                  num_labels,
+    int                                  num_series,
+    struct prometheus_histogram_series **series)
+{
+    struct prometheus_metrics          *metrics = histogram->base.metrics;
+    struct prometheus_histogram_series *discard = NULL, *next;
+    struct prometheus_series_base      *found;
+    int64_t                             size;
+    int                                 i, created = 0;
+
+    if (!prometheus_metric_base_labels_match(&histogram->base, label_names, num_labels) ||
+        !prometheus_labels_legal(label_names, label_values, num_labels, num_series)) {
+        return -1;
+    }
+
+    /* The scratch and saved bucket arrays and any sliding window follow the labels in the same allocation */
+
+    size = sizeof(**series) + prometheus_series_labels_size(&histogram->base, num_labels) +
+           2 * histogram->count * sizeof(uint64_t) + prometheus_window_size(histogram->window_slots, 1);
+
+    /* Build every series before taking the metric lock, then link them under a single hold */
+
+    for (i = 0; i < num_series; i++) {
+        series[i] = prometheus_calloc(1, size);
+
+        prometheus_series_base_init(&series[i]->base, &histogram->base, num_labels, label_names,
+                                    label_values + i * num_labels, (char **) (series[i] + 1));
+
+        series[i]->buckets      = (uint64_t *) (series[i]->base.label_values + num_labels);
+        series[i]->saved        = series[i]->buckets + histogram->count;
+        series[i]->type         = histogram->type;
+        series[i]->num_buckets  = histogram->count;
+        series[i]->start        = histogram->start;
+        series[i]->increment    = histogram->increment;
+        series[i]->sample_every = histogram->sample_every;
+        series[i]->min_max      = histogram->min_max;
+        series[i]->saved_min    = UINT64_MAX;
+
+        if (histogram->window_slots) {
+            prometheus_window_init(&series[i]->window, histogram->window_slots, 1,
+                                   series[i]->saved + histogram->count);
         }
 
-        if (!prometheus_string_legal_value(label_values[i])) {
-            return NULL;
+        if (histogram->base.vec) {
+            series[i]->base.vec_hash = prometheus_vec_hash(label_values + i * num_labels, num_labels);
         }
+
+        pthread_mutex_init(&series[i]->lock, NULL);
     }
 
-    pthread_mutex_lock(&counter->lock);
+    pthread_mutex_lock(&histogram->lock);
 
-    series = prometheus_calloc(1, sizeof(*series));
+    for (i = 0; i < num_series; i++) {
+        /* A metric with a label schema holds a single series per value tuple */
+        if (histogram->base.vec) {
+            found = prometheus_vec_find(&histogram->base, series[i]->base.vec_hash, label_values + i * num_labels);
 
-    prometheus_series_base_init(&series->base, num_labels, label_names, label_values);
+            if (found) {
+                series[i]->next = discard;
+                discard         = series[i];
+                series[i]       = container_of(found, struct prometheus_histogram_series, base);
+                continue;
+            }
 
-    pthread_mutex_init(&series->lock, NULL);
+            prometheus_vec_insert(&histogram->base, &series[i]->base);
+        }
 
-    list_append(counter->series, series);
+        list_append(histogram->series, series[i]);
 
-    pthread_mutex_unlock(&counter->lock);
+        if (metrics->segment) {
+            series[i]->base.segment_offset = prometheus_segment_create_series(metrics->segment,
+                                                                              histogram->base.segment_offset,
+                                                                              &series[i]->base, histogram->count);
+        }
 
-    return series;
-} /* prometheus_counter_add_series */
+        created++;
+    }
 
-PUBLIC struct prometheus_counter_instance *
-prometheus_counter_series_create_instance(struct prometheus_counter_series *series)
-{
-    struct prometheus_counter_handle *hdl;
+    histogram->num_series += created;
 
-    pthread_mutex_lock(&series->lock);
+    prometheus_self_account(metrics, created, 0, created * size);
 
-    hdl = prometheus_calloc(1, sizeof(*hdl));
+    pthread_mutex_unlock(&histogram->lock);
 
-    list_append(series->head, hdl);
+    while (discard) {
+        next = discard->next;
 
-    pthread_mutex_unlock(&series->lock);
+        prometheus_series_base_destroy(&discard->base);
+        pthread_mutex_destroy(&discard->lock);
+        free(discard);
 
-    return &hdl->counter;
-} /* prometheus_counter_create_instance */
+        discard = next;
+    }
 
+    for (i = 0; i < num_series; i++) {
+        prometheus_histogram_series_seed(histogram, series[i]);
+    }
 
-PUBLIC struct prometheus_gauge *
-prometheus_metrics_create_gauge(
-    struct prometheus_metrics *metrics,
-    const char                *name,
-    const char                *help)
+    return 0;
+} /* prometheus_histogram_create_series_batch */
+
+PUBLIC struct prometheus_histogram_series *
+prometheus_histogram_create_series(
+    struct prometheus_histogram *histogram,
+    const char                 **label_names,
+    const char                 **label_values,
+    int                          num_labels)
+{
+    struct prometheus_histogram_series *series;
+
+    if (prometheus_histogram_create_series_batch(histogram, label_names, label_values, num_labels, 1, &series)) {
+        return NULL;
+    }
+
+    return series;
+} /* prometheus_histogram_add_series */
+
+PUBLIC int
+prometheus_histogram_declare_labels(
+    struct prometheus_histogram *histogram,
+    const char                 **label_names,
+    int                          num_labels)
 {
-    struct prometheus_gauge *gauge;
+    int rc = -1;
 
-    if (!prometheus_string_legal_name(name)) {
-        return NULL;
+    pthread_mutex_lock(&histogram->lock);
+
+    if (!histogram->series) {
+        rc = prometheus_metric_base_declare_labels(&histogram->base, label_names, num_labels);
     }
 
-    pthread_mutex_lock(&metrics->lock);
+    pthread_mutex_unlock(&histogram->lock);
 
-    gauge = prometheus_calloc(1, sizeof(*gauge));
+    return rc;
+} /* prometheus_histogram_declare_labels */
 
-    prometheus_metric_base_init(&gauge->base, name, help, "gauge");
+PUBLIC int
+prometheus_histogram_add_rollup(
+    struct prometheus_histogram *histogram,
+    const char                 **drop_labels,
+    int                          num_drop,
+    uint32_t                     flags)
+{
+    int rc;
 
-    pthread_mutex_init(&gauge->lock, NULL);
+    pthread_mutex_lock(&histogram->lock);
+    rc = prometheus_metric_base_add_rollup(&histogram->base, drop_labels, num_drop, flags);
+    pthread_mutex_unlock(&histogram->lock);
 
-    list_append(metrics->gauges, gauge);
+    return rc;
+} /* prometheus_histogram_add_rollup */
 
-    pthread_mutex_unlock(&metrics->lock);
+PUBLIC int
+prometheus_histogram_set_sampling(
+    struct prometheus_histogram *histogram,
+    uint32_t                     sample_every)
+{
+    struct prometheus_segment_metric *segment_metric;
+    int                               rc = -1;
 
-    return gauge;
-} /* prometheus_metrics_add_gauge */
+    pthread_mutex_lock(&histogram->lock);
 
-PUBLIC struct prometheus_gauge_series *
-prometheus_gauge_create_series(
-    struct prometheus_gauge *gauge,
-    const char             **label_names,
-    const char             **label_values,
-    int                      num_labels)
-{
-    struct prometheus_gauge_series *series;
-    int                             i;
+    /* Every handle of a histogram must record at the same rate for scaling to hold */
+    if (!histogram->series && sample_every) {
+        histogram->sample_every = sample_every > 1 ? sample_every : 0;
 
-    for (i = 0; i < num_labels; i++) {
-        if (!prometheus_string_legal_name(label_names[i])) {
-            return NULL;
+        if (histogram->base.segment_offset) {
+            segment_metric = prometheus_segment_payload(histogram->base.metrics->segment,
+                                                        histogram->base.segment_offset);
+            segment_metric->sample_every = histogram->sample_every;
         }
 
-        if (!prometheus_string_legal_value(label_values[i])) {
-            return NULL;
-        }
+        rc = 0;
     }
 
-    pthread_mutex_lock(&gauge->lock);
-
-    series = prometheus_calloc(1, sizeof(*series));
+    pthread_mutex_unlock(&histogram->lock);
 
-    prometheus_series_base_init(&series->base, num_labels, label_names, label_values);
+    return rc;
+} /* prometheus_histogram_set_sampling */
+
+/*
+ * Batched samples are processed a chunk at a time.  Each chunk has its
+ * bucket indices, sum and extremes computed in branch free passes that
+ * the compiler vectorizes, leaving only the bucket increments serial.
+ * Linear indices divide by the increment through a reciprocal computed
+ * once per batch, exact for offsets below 2^31, and any offset past the
+ * last bucket's threshold goes to the last bucket without dividing.
+ */
+
+#define PROMETHEUS_HISTOGRAM_CHUNK 64
+
+PROMETHEUS_TARGET_CLONES static void
+prometheus_histogram_index_exponential(
+    const int64_t *values,
+    int            count,
+    uint32_t       last,
+    uint32_t      *index,
+    uint64_t      *sum)
+{
+    uint64_t total = 0, value, idx;
+    int      i;
+
+    for (i = 0; i < count; i++) {
+        value    = values[i];
+        idx      = 63 - __builtin_clzll(value | 1);
+        index[i] = idx < last ? idx : last;
+        total   += value;
+    }
 
-    pthread_mutex_init(&series->lock, NULL);
+    *sum += total;
+} /* prometheus_histogram_index_exponential */
+
+PROMETHEUS_TARGET_CLONES static void
+prometheus_histogram_index_linear(
+    const int64_t *values,
+    int            count,
+    uint64_t       start,
+    uint64_t       limit,
+    uint32_t       mult,
+    uint32_t       shift,
+    uint32_t       last,
+    uint32_t      *index,
+    uint64_t      *sum)
+{
+    uint64_t total = 0, value, offset, idx;
+    int      i;
+
+    for (i = 0; i < count; i++) {
+        value    = values[i];
+        offset   = value - start;
+        idx      = ((uint64_t) (uint32_t) offset * mult) >> shift;
+        index[i] = offset < limit ? idx : last;
+        total   += value;
+    }
 
-    list_append(gauge->series, series);
+    *sum += total;
+} /* prometheus_histogram_index_linear */
 
-    pthread_mutex_unlock(&gauge->lock);
+PROMETHEUS_TARGET_CLONES static void
+prometheus_histogram_extremes(
+    const int64_t *values,
+    int            count,
+    uint64_t      *min,
+    uint64_t      *max)
+{
+    uint64_t lo = *min, hi = *max, value;
+    int      i;
 
-    return series;
-} /* prometheus_gauge_add_series */
+    for (i = 0; i < count; i++) {
+        value = values[i];
+        lo    = value < lo ? value : lo;
+        hi    = value > hi ? value : hi;
+    }
 
-PUBLIC struct prometheus_gauge_instance *
-prometheus_gauge_series_create_instance(struct prometheus_gauge_series *series)
+    *min = lo;
+    *max = hi;
+} /* prometheus_histogram_extremes */
+
+/*
+ * Multiplier and shift dividing offsets below 2^31 exactly by the
+ * increment, with m = ceil(2^(31 + l) / increment) for l = ceil(log2
+ * increment).  Returns -1 if the thresholds reach 2^31, for which the
+ * batch divides each value instead.
+ */
+
+static int
+prometheus_histogram_reciprocal(
+    uint64_t  increment,
+    uint64_t  last,
+    uint64_t *limit,
+    uint32_t *mult,
+    uint32_t *shift)
 {
-    struct prometheus_gauge_handle *hdl;
+    uint64_t m;
+    int      l;
 
-    pthread_mutex_lock(&series->lock);
+    if (!increment || (last && increment > ((1ULL << 31) - 1) / last)) {
+        return -1;
+    }
 
-    hdl = prometheus_calloc(1, sizeof(*hdl));
+    l = increment > 1 ? 64 - __builtin_clzll(increment - 1) : 0;
+    m = ((1ULL << (31 + l)) + increment - 1) / increment;
 
-    list_append(series->head, hdl);
+    if (m > UINT32_MAX) {
+        return -1;
+    }
 
-    pthread_mutex_unlock(&series->lock);
+    *limit = increment * last;
+    *mult  = m;
+    *shift = 31 + l;
 
-    return &hdl->gauge;
-} /* prometheus_gauge_series_create_instance */
+    return 0;
+} /* prometheus_histogram_reciprocal */
 
-PUBLIC struct prometheus_histogram *
-prometheus_metrics_create_histogram_exponential(
-    struct prometheus_metrics *metrics,
-    const char                *name,
-    const char                *help,
-    uint64_t                   count)
+PUBLIC void
+prometheus_histogram_sample_many(
+    struct prometheus_histogram_instance *instance,
+    const int64_t                        *values,
+    int                                   count)
 {
-    struct prometheus_histogram *histogram;
+    uint32_t index[PROMETHEUS_HISTOGRAM_CHUNK];
+    uint64_t sum = 0, last = instance->num_buckets - 1, limit = 0, idx;
+    uint32_t mult = 0, shift = 0;
+    int      i, j, n, divide = 0;
+
+    if (instance->sample_every) {
+        for (i = 0; i < count; i++) {
+            prometheus_histogram_sample(instance, values[i]);
+        }
+        return;
+    }
 
-    if (!prometheus_string_legal_name(name)) {
-        return NULL;
+    if (instance->type != PROMETHEUS_HISTOGRAM_EXPONENTIAL) {
+        divide = prometheus_histogram_reciprocal(instance->increment, last, &limit, &mult, &shift);
     }
 
-    pthread_mutex_lock(&metrics->lock);
+    for (i = 0; i < count; i += n) {
+        n = count - i < PROMETHEUS_HISTOGRAM_CHUNK ? count - i : PROMETHEUS_HISTOGRAM_CHUNK;
+
+        if (instance->type == PROMETHEUS_HISTOGRAM_EXPONENTIAL) {
+            prometheus_histogram_index_exponential(values + i, n, last, index, &sum);
+        } else if (!divide) {
+            prometheus_histogram_index_linear(values + i, n, instance->start, limit, mult, shift, last, index, &sum);
+        } else {
+            for (j = 0; j < n; j++) {
+                idx      = (values[i + j] - instance->start) / instance->increment;
+                index[j] = idx < last ? idx : last;
+                sum     += values[i + j];
+            }
+        }
 
-    histogram = prometheus_calloc(1, sizeof(*histogram));
+        if (instance->min_max) {
+            prometheus_histogram_extremes(values + i, n, &instance->min, &instance->max);
+        }
 
-    prometheus_metric_base_init(&histogram->base, name, help, "histogram");
+        for (j = 0; j < n; j++) {
+            instance->buckets[index[j]]++;
+        }
+    }
 
-    histogram->type  = PROMETHEUS_HISTOGRAM_EXPONENTIAL;
-    histogram->count = count;
+    instance->sum   += sum;
+    instance->count += count;
+} /* prometheus_histogram_sample_many */
 
-    pthread_mutex_init(&histogram->lock, NULL);
+PUBLIC int
+prometheus_histogram_set_min_max(
+    struct prometheus_histogram *histogram,
+    int                          enable)
+{
+    int rc = -1;
 
-    list_append(metrics->histograms, histogram);
+    pthread_mutex_lock(&histogram->lock);
 
-    pthread_mutex_unlock(&metrics->lock);
+    /* Handles copy the setting when they are created */
+    if (!histogram->series) {
+        histogram->min_max = !!enable;
+        rc                 = 0;
+    }
 
-    return histogram;
-} /* prometheus_metrics_add_histogram */
+    pthread_mutex_unlock(&histogram->lock);
 
+    return rc;
+} /* prometheus_histogram_set_min_max */
 
-PUBLIC struct prometheus_histogram *
-prometheus_metrics_create_histogram_linear(
-    struct prometheus_metrics *metrics,
-    const char                *name,
-    const char                *help,
-    uint64_t                   start,
-    uint64_t                   increment,
-    uint64_t                   count)
+PUBLIC int
+prometheus_histogram_set_window(
+    struct prometheus_histogram *histogram,
+    int                          num_intervals)
 {
-    struct prometheus_histogram *histogram;
+    int rc = -1;
 
-    if (!prometheus_string_legal_name(name)) {
-        return NULL;
-    }
+    pthread_mutex_lock(&histogram->lock);
 
-    pthread_mutex_lock(&metrics->lock);
+    /* Windows are sized when a series is allocated */
+    if (!histogram->series && num_intervals > 0) {
+        histogram->window_slots = num_intervals + 1;
+        rc                      = 0;
+    }
 
-    histogram = prometheus_calloc(1, sizeof(*histogram));
+    pthread_mutex_unlock(&histogram->lock);
 
-    prometheus_metric_base_init(&histogram->base, name, help, "histogram");
+    return rc;
+} /* prometheus_histogram_set_window */
 
-    histogram->type      = PROMETHEUS_HISTOGRAM_LINEAR;
-    histogram->count     = count;
-    histogram->start     = start;
-    histogram->increment = increment;
+PUBLIC int
+prometheus_histogram_series_rate(
+    struct prometheus_histogram_series *series,
+    double                             *rate,
+    double                             *average)
+{
+    double ignored;
+    int    rc = -1;
 
-    pthread_mutex_init(&histogram->lock, NULL);
+    pthread_mutex_lock(&series->lock);
 
-    list_append(metrics->histograms, histogram);
+    if (series->window.slots) {
+        rc = prometheus_histogram_series_window_rate(series, rate ? rate : &ignored, average ? average : &ignored);
+    }
 
-    pthread_mutex_unlock(&metrics->lock);
+    pthread_mutex_unlock(&series->lock);
 
-    return histogram;
-} /* prometheus_metrics_add_histogram */
+    return rc;
+} /* prometheus_histogram_series_rate */
 
 PUBLIC struct prometheus_histogram_series *
-prometheus_histogram_create_series(
+prometheus_histogram_lookup_series(
     struct prometheus_histogram *histogram,
-    const char                 **label_names,
-    const char                 **label_values,
-    int                          num_labels)
+    const char                 **label_values)
 {
+    struct prometheus_series_base      *found;
     struct prometheus_histogram_series *series;
-    int                                 i;
-
-    for (i = 0; i < num_labels; i++) {
-        if (!prometheus_string_legal_name(label_names[i])) {
-            return NULL;
-        }
+    uint64_t                            hash;
 
-        if (!prometheus_string_legal_value(label_values[i])) {
-            return NULL;
-        }
+    if (!histogram->base.vec) {
+        return NULL;
     }
 
+    hash = prometheus_vec_hash(label_values, histogram->base.label_count);
+
     pthread_mutex_lock(&histogram->lock);
+    found = prometheus_vec_find(&histogram->base, hash, label_values);
+    pthread_mutex_unlock(&histogram->lock);
 
-    series = prometheus_calloc(1, sizeof(*series));
+    if (found) {
+        return container_of(found, struct prometheus_histogram_series, base);
+    }
 
-    prometheus_series_base_init(&series->base, num_labels, label_names, label_values);
+    /* Creation returns the winner if another lookup added the same values meanwhile */
+    if (prometheus_histogram_create_series_batch(histogram, (const char **) histogram->base.label_names, label_values,
+                                                 histogram->base.label_count, 1, &series)) {
+        return NULL;
+    }
 
-    series->buckets     = prometheus_calloc(histogram->count, sizeof(uint64_t));
-    series->saved       = prometheus_calloc(histogram->count, sizeof(uint64_t));
-    series->type        = histogram->type;
-    series->num_buckets = histogram->count;
-    series->start       = histogram->start;
-    series->increment   = histogram->increment;
+    return series;
+} /* prometheus_histogram_lookup_series */
 
-    pthread_mutex_init(&series->lock, NULL);
+PUBLIC int
+prometheus_histogram_series_create_instances(
+    struct prometheus_histogram_series    *series,
+    int                                    num_instances,
+    struct prometheus_histogram_instance **instances)
+{
+    struct prometheus_segment            *segment = series->base.metrics->segment;
+    struct prometheus_histogram_handle   *hdl;
+    struct prometheus_histogram_instance *instance;
+    struct prometheus_handle_block       *block = NULL;
+    char                                 *hdls  = NULL;
+    uint64_t                            stride;
+    int                                 i;
 
-    list_append(histogram->series, series);
+    if (num_instances <= 0) {
+        return -1;
+    }
 
-    pthread_mutex_unlock(&histogram->lock);
+    /*
+     * Each handle is followed by its buckets, padded out to keep the next
+     * handle aligned.  Shared handles keep their buckets in the segment.
+     */
 
-    return series;
-} /* prometheus_histogram_add_series */
+    stride = sizeof(*hdl) + (segment ? 0 : ((series->num_buckets * sizeof(uint64_t) + 63) & ~63ULL));
 
-PUBLIC struct prometheus_histogram_instance *
-prometheus_histogram_series_create_instance(struct prometheus_histogram_series *series)
-{
-    struct prometheus_histogram_handle *hdl;
+    hdls = prometheus_handle_block_alloc(num_instances, stride, &block);
 
     pthread_mutex_lock(&series->lock);
 
-    hdl = prometheus_calloc(1, sizeof(*hdl));
+    for (i = 0; i < num_instances; i++) {
+        hdl        = (struct prometheus_histogram_handle *) (hdls + i * stride);
+        hdl->block = block;
+
+        if (segment) {
+            instance          = prometheus_segment_create_handle(segment, series->base.segment_offset,
+                                                                 sizeof(*instance), series->num_buckets, hdl);
+            instance->buckets = (uint64_t *) (instance + 1);
+        } else {
+            instance          = &hdl->histogram;
+            instance->buckets = (uint64_t *) (hdl + 1);
+        }
+
+        instance->type         = series->type;
+        instance->num_buckets  = series->num_buckets;
+        instance->start        = series->start;
+        instance->increment    = series->increment;
+        instance->sample_every = series->sample_every;
+        instance->min_max      = series->min_max;
+        instance->min          = UINT64_MAX;
+        instance->max          = 0;
+
+        if (series->sample_every) {
+            instance->rng       = ((uintptr_t) instance * 0x9e3779b97f4a7c15UL) | 1;
+            instance->countdown = prometheus_histogram_countdown(instance);
+        }
+
+        hdl->instance = instance;
 
-    hdl->histogram.buckets     = prometheus_calloc(series->num_buckets, sizeof(uint64_t));
-    hdl->histogram.type        = series->type;
-    hdl->histogram.num_buckets = series->num_buckets;
-    hdl->histogram.start       = series->start;
-    hdl->histogram.increment   = series->increment;
+        list_append(series->head, hdl);
 
-    list_append(series->head, hdl);
+        instances[i] = instance;
+    }
 
     pthread_mutex_unlock(&series->lock);
 
-    return &hdl->histogram;
+    prometheus_self_account(series->base.metrics, 0, num_instances,
+                            num_instances * (sizeof(*hdl) + series->num_buckets * sizeof(uint64_t)));
+
+    return 0;
+} /* prometheus_histogram_series_create_instances */
+
+PUBLIC struct prometheus_histogram_instance *
+prometheus_histogram_series_create_instance(struct prometheus_histogram_series *series)
+{
+    struct prometheus_histogram_instance *instance;
+
+    prometheus_histogram_series_create_instances(series, 1, &instance);
+
+    return instance;
 } /* prometheus_histogram_series_create_instance */
 
 PUBLIC void
@@ -795,18 +9382,27 @@ prometheus_counter_series_destroy_instance(
     struct prometheus_counter_series   *series,
     struct prometheus_counter_instance *instance)
 {
+    struct prometheus_segment        *segment = series->base.metrics->segment;
     struct prometheus_counter_handle *hdl;
+    int                               shared = prometheus_segment_owns(segment, instance);
 
-    hdl = container_of(instance, struct prometheus_counter_handle, counter);
+    hdl = shared ? prometheus_segment_handle_local(segment, instance) :
+          container_of(instance, struct prometheus_counter_handle, counter);
 
     pthread_mutex_lock(&series->lock);
 
-    series->saved += hdl->counter.value;
+    series->saved += instance->value;
     list_delete(series->head, hdl);
 
     pthread_mutex_unlock(&series->lock);
 
-    free(hdl);
+    prometheus_self_account(series->base.metrics, 0, -1, -(int64_t) sizeof(*hdl));
+
+    if (shared) {
+        prometheus_segment_destroy_handle(segment, instance);
+    }
+
+    prometheus_handle_free(hdl, hdl->block);
 } /* prometheus_counter_series_destroy_instance */
 
 PUBLIC void
@@ -816,14 +9412,32 @@ prometheus_counter_destroy_series(
 {
     pthread_mutex_lock(&counter->lock);
     list_delete(counter->series, series);
+    counter->num_series--;
+
+    if (counter->base.vec) {
+        prometheus_vec_remove(&counter->base, &series->base);
+    }
+
     pthread_mutex_unlock(&counter->lock);
 
+    /* Wait out a scrape whose output may still reference the series labels */
+    pthread_mutex_lock(&series->base.metrics->lock);
+    pthread_mutex_unlock(&series->base.metrics->lock);
+
     while (series->head) {
-        prometheus_counter_series_destroy_instance(series, &series->head->counter);
+        prometheus_counter_series_destroy_instance(series, series->head->instance);
+    }
+
+    if (series->base.segment_offset) {
+        prometheus_segment_retire(series->base.metrics->segment, series->base.segment_offset);
     }
 
     pthread_mutex_destroy(&series->lock);
 
+    prometheus_self_account(series->base.metrics, -1, 0,
+                            -(int64_t) (sizeof(*series) + prometheus_series_base_size(&series->base) +
+                                        prometheus_window_size(series->window.slots, 0)));
+
     prometheus_series_base_destroy(&series->base);
 
     free(series);
@@ -837,15 +9451,33 @@ prometheus_counter_destroy(
     struct prometheus_counter *counter)
 {
     pthread_mutex_lock(&metrics->lock);
+
+    if (metrics->aggregator.counter_cursor == counter) {
+        metrics->aggregator.counter_cursor = counter->next;
+    }
+
     list_delete(metrics->counters, counter);
+    prometheus_metrics_index_remove(metrics, counter->base.name, counter);
     pthread_mutex_unlock(&metrics->lock);
 
+    prometheus_metrics_name_release(metrics, counter->base.name);
+
     while (counter->series) {
         prometheus_counter_destroy_series(counter, counter->series);
     }
 
+    /* Wait out an aggregator pass that may still be holding the lock */
+    pthread_mutex_lock(&counter->lock);
+    pthread_mutex_unlock(&counter->lock);
+
     pthread_mutex_destroy(&counter->lock);
 
+    if (counter->base.segment_offset) {
+        prometheus_segment_retire(metrics->segment, counter->base.segment_offset);
+    }
+
+    prometheus_self_account(metrics, 0, 0, -(int64_t) sizeof(*counter));
+
     prometheus_metric_base_destroy(&counter->base);
 
     free(counter);
@@ -857,18 +9489,27 @@ prometheus_gauge_series_destroy_instance(
     struct prometheus_gauge_series   *series,
     struct prometheus_gauge_instance *instance)
 {
+    struct prometheus_segment      *segment = series->base.metrics->segment;
     struct prometheus_gauge_handle *hdl;
+    int                             shared = prometheus_segment_owns(segment, instance);
 
-    hdl = container_of(instance, struct prometheus_gauge_handle, gauge);
+    hdl = shared ? prometheus_segment_handle_local(segment, instance) :
+          container_of(instance, struct prometheus_gauge_handle, gauge);
 
     pthread_mutex_lock(&series->lock);
 
-    series->saved += hdl->gauge.value;
+    series->saved += instance->value;
     list_delete(series->head, hdl);
 
     pthread_mutex_unlock(&series->lock);
 
-    free(hdl);
+    prometheus_self_account(series->base.metrics, 0, -1, -(int64_t) sizeof(*hdl));
+
+    if (shared) {
+        prometheus_segment_destroy_handle(segment, instance);
+    }
+
+    prometheus_handle_free(hdl, hdl->block);
 } /* prometheus_gauge_series_destroy_instance */
 
 PUBLIC void
@@ -878,14 +9519,31 @@ prometheus_gauge_destroy_series(
 {
     pthread_mutex_lock(&gauge->lock);
     list_delete(gauge->series, series);
+    gauge->num_series--;
+
+    if (gauge->base.vec) {
+        prometheus_vec_remove(&gauge->base, &series->base);
+    }
+
     pthread_mutex_unlock(&gauge->lock);
 
+    /* Wait out a scrape whose output may still reference the series labels */
+    pthread_mutex_lock(&series->base.metrics->lock);
+    pthread_mutex_unlock(&series->base.metrics->lock);
+
     while (series->head) {
-        prometheus_gauge_series_destroy_instance(series, &series->head->gauge);
+        prometheus_gauge_series_destroy_instance(series, series->head->instance);
+    }
+
+    if (series->base.segment_offset) {
+        prometheus_segment_retire(series->base.metrics->segment, series->base.segment_offset);
     }
 
     pthread_mutex_destroy(&series->lock);
 
+    prometheus_self_account(series->base.metrics, -1, 0,
+                            -(int64_t) (sizeof(*series) + prometheus_series_base_size(&series->base)));
+
     prometheus_series_base_destroy(&series->base);
 
     free(series);
@@ -897,15 +9555,33 @@ prometheus_gauge_destroy(
     struct prometheus_gauge   *gauge)
 {
     pthread_mutex_lock(&metrics->lock);
+
+    if (metrics->aggregator.gauge_cursor == gauge) {
+        metrics->aggregator.gauge_cursor = gauge->next;
+    }
+
     list_delete(metrics->gauges, gauge);
+    prometheus_metrics_index_remove(metrics, gauge->base.name, gauge);
     pthread_mutex_unlock(&metrics->lock);
 
+    prometheus_metrics_name_release(metrics, gauge->base.name);
+
     while (gauge->series) {
         prometheus_gauge_destroy_series(gauge, gauge->series);
     }
 
+    /* Wait out an aggregator pass that may still be holding the lock */
+    pthread_mutex_lock(&gauge->lock);
+    pthread_mutex_unlock(&gauge->lock);
+
     pthread_mutex_destroy(&gauge->lock);
 
+    if (gauge->base.segment_offset) {
+        prometheus_segment_retire(metrics->segment, gauge->base.segment_offset);
+    }
+
+    prometheus_self_account(metrics, 0, 0, -(int64_t) sizeof(*gauge));
+
     prometheus_metric_base_destroy(&gauge->base);
 
     free(gauge);
@@ -917,10 +9593,13 @@ prometheus_histogram_series_destroy_instance(
     struct prometheus_histogram_series   *series,
     struct prometheus_histogram_instance *instance)
 {
+    struct prometheus_segment          *segment = series->base.metrics->segment;
     struct prometheus_histogram_handle *hdl;
+    int                                 shared = prometheus_segment_owns(segment, instance);
     int                                 i;
 
-    hdl = container_of(instance, struct prometheus_histogram_handle, histogram);
+    hdl = shared ? prometheus_segment_handle_local(segment, instance) :
+          container_of(instance, struct prometheus_histogram_handle, histogram);
 
     pthread_mutex_lock(&series->lock);
 
@@ -930,13 +9609,20 @@ prometheus_histogram_series_destroy_instance(
 
     series->saved_sum   += instance->sum;
     series->saved_count += instance->count;
+    series->saved_min    = instance->min < series->saved_min ? instance->min : series->saved_min;
+    series->saved_max    = instance->max > series->saved_max ? instance->max : series->saved_max;
 
     list_delete(series->head, hdl);
 
     pthread_mutex_unlock(&series->lock);
 
-    free(hdl->histogram.buckets);
-    free(hdl);
+    prometheus_self_account(series->base.metrics, 0, -1, -(int64_t) (sizeof(*hdl) + series->num_buckets * sizeof(uint64_t)));
+
+    if (shared) {
+        prometheus_segment_destroy_handle(segment, instance);
+    }
+
+    prometheus_handle_free(hdl, hdl->block);
 } /* prometheus_histogram_series_destroy_instance */
 
 PUBLIC void
@@ -946,18 +9632,37 @@ prometheus_histogram_destroy_series(
 {
     pthread_mutex_lock(&histogram->lock);
     list_delete(histogram->series, series);
+    histogram->num_series--;
+
+    if (histogram->base.vec) {
+        prometheus_vec_remove(&histogram->base, &series->base);
+    }
+
     pthread_mutex_unlock(&histogram->lock);
 
+    /* Wait out a scrape whose output may still reference the series labels */
+    pthread_mutex_lock(&series->base.metrics->lock);
+    pthread_mutex_unlock(&series->base.metrics->lock);
+
     while (series->head) {
-        prometheus_histogram_series_destroy_instance(series, &series->head->histogram);
+        prometheus_histogram_series_destroy_instance(series, series->head->instance);
+    }
+
+    if (series->base.segment_offset) {
+        prometheus_segment_retire(series->base.metrics->segment, series->base.segment_offset);
     }
 
     pthread_mutex_destroy(&series->lock);
 
+    prometheus_self_account(series->base.metrics, -1, 0,
+                            -(int64_t) (sizeof(*series) + prometheus_series_base_size(&series->base) +
+                                        2 * series->num_buckets * sizeof(uint64_t) +
+                                        prometheus_window_size(series->window.slots, 1)));
+
     prometheus_series_base_destroy(&series->base);
 
-    free(series->buckets);
-    free(series->saved);
+    free(series->snapshot_buckets[0]);
+    free(series->snapshot_buckets[1]);
     free(series);
 } /* prometheus_histogram_destroy_series */
 
@@ -966,17 +9671,43 @@ prometheus_histogram_destroy(
     struct prometheus_metrics   *metrics,
     struct prometheus_histogram *histogram)
 {
+    int i;
 
     pthread_mutex_lock(&metrics->lock);
+
+    if (metrics->aggregator.histogram_cursor == histogram) {
+        metrics->aggregator.histogram_cursor = histogram->next;
+    }
+
     list_delete(metrics->histograms, histogram);
+    prometheus_metrics_index_remove(metrics, histogram->base.name, histogram);
     pthread_mutex_unlock(&metrics->lock);
 
+    prometheus_metrics_name_release(metrics, histogram->base.name);
+
     while (histogram->series) {
         prometheus_histogram_destroy_series(histogram, histogram->series);
     }
 
+    /* Wait out an aggregator pass that may still be holding the lock */
+    pthread_mutex_lock(&histogram->lock);
+    pthread_mutex_unlock(&histogram->lock);
+
     pthread_mutex_destroy(&histogram->lock);
 
+    if (histogram->base.segment_offset) {
+        prometheus_segment_retire(metrics->segment, histogram->base.segment_offset);
+    }
+
+    for (i = 0; i < histogram->count; i++) {
+        prometheus_fragment_release(metrics, &histogram->le[i]);
+    }
+
+    prometheus_self_account(metrics, 0, 0,
+                            -(int64_t) (sizeof(*histogram) + (histogram->count + 1) * sizeof(*histogram->le)));
+
+    free(histogram->le);
+
     prometheus_metric_base_destroy(&histogram->base);
 
     free(histogram);
@@ -987,6 +9718,29 @@ prometheus_metrics_destroy(struct prometheus_metrics *metrics)
 {
     int i;
 
+    /* Unlinking is all a child needs of its parent, so the parent lock is held only briefly */
+    if (metrics->parent) {
+        pthread_mutex_lock(&metrics->parent->lock);
+        list_delete(metrics->parent->children, metrics);
+        pthread_mutex_unlock(&metrics->parent->lock);
+    }
+
+    while (metrics->children) {
+        prometheus_metrics_destroy(metrics->children);
+    }
+
+    prometheus_metrics_stop_aggregator(metrics);
+
+    if (metrics->pool) {
+        prometheus_scrape_pool_destroy(metrics->pool);
+    }
+
+    memset(&metrics->self, 0, sizeof(metrics->self));
+
+    if (metrics->segment) {
+        metrics->segment->detaching = 1;
+    }
+
     while (metrics->counters) {
         prometheus_counter_destroy(metrics, metrics->counters);
     }
@@ -1006,6 +9760,40 @@ prometheus_metrics_destroy(struct prometheus_metrics *metrics)
 
     pthread_mutex_destroy(&metrics->lock);
 
+    prometheus_compressor_destroy(&metrics->compressor);
+
+    free(metrics->remote_write.protobuf);
+    free(metrics->remote_write.compressed);
+
+    if (metrics->segment) {
+        prometheus_segment_close(metrics->segment);
+    }
+
+    for (i = 0; i <= PROMETHEUS_ENCODING_ZSTD; i++) {
+        if (metrics->cache.result[i]) {
+            prometheus_scrape_result_put(metrics->cache.result[i]);
+        }
+    }
+
+    /* Every interned string has been released along with the metrics and series */
+    free(metrics->strings.buckets);
+    pthread_mutex_destroy(&metrics->strings.lock);
+
+    free(metrics->checkpoint.path);
+    free(metrics->checkpoint.restored);
+    free(metrics->checkpoint.slots);
+    pthread_mutex_destroy(&metrics->checkpoint.lock);
+
+    pthread_cond_destroy(&metrics->aggregator.cond);
+    pthread_mutex_destroy(&metrics->aggregator.lock);
+    pthread_cond_destroy(&metrics->cache.cond);
+    pthread_mutex_destroy(&metrics->cache.lock);
+
+    /* Every name of the tree has been released along with its metrics */
+    free(metrics->names);
+    pthread_mutex_destroy(&metrics->names_lock);
+
+    free(metrics->index);
     free(metrics->label_names);
     free(metrics->label_values);
     free(metrics);
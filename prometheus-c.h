@@ -5,7 +5,12 @@
 #pragma once
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 struct prometheus_metrics;
+struct prometheus_scrape_result;
+struct prometheus_scrape_filter;
+struct prometheus_segment;
 
 struct prometheus_counter;
 struct prometheus_counter_series;
@@ -37,6 +42,24 @@ struct prometheus_histogram_instance {
     uint64_t  num_buckets;
     uint64_t *buckets;
     enum prometheus_histogram_type type;
+    uint32_t  sample_every;
+    uint32_t  countdown;
+    uint32_t  min_max;
+    uint64_t  rng;
+    uint64_t  min;
+    uint64_t  max;
+};
+
+enum prometheus_encoding {
+    PROMETHEUS_ENCODING_IDENTITY,
+    PROMETHEUS_ENCODING_GZIP,
+    PROMETHEUS_ENCODING_ZSTD,
+};
+
+enum prometheus_format {
+    PROMETHEUS_FORMAT_TEXT,
+    PROMETHEUS_FORMAT_JSON,
+    PROMETHEUS_FORMAT_INFLUX,
 };
 
 struct prometheus_metrics * prometheus_metrics_create(
@@ -44,6 +67,23 @@ struct prometheus_metrics * prometheus_metrics_create(
     char **label_values,
     int    label_count);
 
+struct prometheus_metrics * prometheus_metrics_create_child(
+    struct prometheus_metrics *parent,
+    char                     **label_names,
+    char                     **label_values,
+    int                        label_count);
+
+struct prometheus_metrics * prometheus_metrics_create_shared(
+    const char *path,
+    uint64_t    size,
+    char      **label_names,
+    char      **label_values,
+    int         label_count);
+
+int prometheus_metrics_reap_process(
+    struct prometheus_metrics *metrics,
+    int                        pid);
+
 void prometheus_metrics_destroy(
     struct prometheus_metrics *metrics);
 
@@ -52,6 +92,129 @@ int prometheus_metrics_scrape(
     char                      *buffer,
     int                        buffer_size);
 
+int prometheus_metrics_scrape_format(
+    struct prometheus_metrics *metrics,
+    enum prometheus_format     format,
+    char                      *buffer,
+    int                        buffer_size);
+
+struct prometheus_scrape_filter * prometheus_scrape_filter_create(void);
+
+int prometheus_scrape_filter_add_name(
+    struct prometheus_scrape_filter *filter,
+    const char                      *name);
+
+int prometheus_scrape_filter_add_prefix(
+    struct prometheus_scrape_filter *filter,
+    const char                      *prefix);
+
+int prometheus_scrape_filter_add_label(
+    struct prometheus_scrape_filter *filter,
+    const char                      *name,
+    const char                      *value);
+
+void prometheus_scrape_filter_destroy(
+    struct prometheus_scrape_filter *filter);
+
+int prometheus_metrics_scrape_filtered(
+    struct prometheus_metrics             *metrics,
+    const struct prometheus_scrape_filter *filter,
+    char                                  *buffer,
+    int                                    buffer_size);
+
+typedef int (*prometheus_scrape_iov_callback)(
+    const struct iovec *iov,
+    int                 iovcnt,
+    void               *private_data);
+
+int prometheus_metrics_scrape_iov(
+    struct prometheus_metrics     *metrics,
+    prometheus_scrape_iov_callback callback,
+    void                          *private_data);
+
+int prometheus_metrics_scrape_compressed(
+    struct prometheus_metrics *metrics,
+    enum prometheus_encoding   encoding,
+    char                      *buffer,
+    int                        buffer_size);
+
+enum prometheus_encoding prometheus_negotiate_encoding(
+    const char *accept_encoding);
+
+const char * prometheus_encoding_name(
+    enum prometheus_encoding encoding);
+
+void prometheus_metrics_set_scrape_cache(
+    struct prometheus_metrics *metrics,
+    uint64_t                   min_interval_ms);
+
+struct prometheus_scrape_result * prometheus_metrics_scrape_cached(
+    struct prometheus_metrics *metrics,
+    enum prometheus_encoding   encoding);
+
+const char * prometheus_scrape_result_data(
+    struct prometheus_scrape_result *result);
+
+int prometheus_scrape_result_length(
+    struct prometheus_scrape_result *result);
+
+void prometheus_scrape_result_release(
+    struct prometheus_scrape_result *result);
+
+int prometheus_metrics_start_aggregator(
+    struct prometheus_metrics *metrics,
+    uint64_t                   interval_ms,
+    int                        nice);
+
+void prometheus_metrics_stop_aggregator(
+    struct prometheus_metrics *metrics);
+
+int prometheus_metrics_set_scrape_threads(
+    struct prometheus_metrics *metrics,
+    int                        num_threads);
+
+int prometheus_metrics_scrape_parallel(
+    struct prometheus_metrics *metrics,
+    char                      *buffer,
+    int                        buffer_size);
+
+int prometheus_metrics_enable_self_metrics(
+    struct prometheus_metrics *metrics);
+
+struct prometheus_segment * prometheus_segment_open(
+    const char *path);
+
+void prometheus_segment_close(
+    struct prometheus_segment *segment);
+
+int prometheus_segment_scrape(
+    struct prometheus_segment *segment,
+    char                      *buffer,
+    int                        buffer_size);
+
+int prometheus_metrics_set_checkpoint(
+    struct prometheus_metrics *metrics,
+    const char                *path,
+    uint64_t                   interval_ms);
+
+int prometheus_metrics_checkpoint(
+    struct prometheus_metrics *metrics);
+
+int prometheus_metrics_restore_checkpoint(
+    struct prometheus_metrics *metrics,
+    const char                *path);
+
+#define PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY 0x1
+
+int prometheus_metrics_remote_write_encode(
+    struct prometheus_metrics *metrics,
+    int64_t                    timestamp_ms,
+    int                        flags,
+    char                      *buffer,
+    int                        buffer_size);
+
+int prometheus_metrics_remote_write_commit(
+    struct prometheus_metrics *metrics);
 
 struct prometheus_counter * prometheus_metrics_create_counter(
     struct prometheus_metrics *metrics,
@@ -68,6 +231,39 @@ struct prometheus_counter_series * prometheus_counter_create_series(
     const char               **label_values,
     int                        num_labels);
 
+int prometheus_counter_create_series_batch(
+    struct prometheus_counter         *counter,
+    const char                       **label_names,
+    const char                       **label_values,
+    int                                num_labels,
+    int                                num_series,
+    struct prometheus_counter_series **series);
+
+int prometheus_counter_declare_labels(
+    struct prometheus_counter *counter,
+    const char               **label_names,
+    int                        num_labels);
+
+#define PROMETHEUS_ROLLUP_REPLACE 0x1
+
+int prometheus_counter_add_rollup(
+    struct prometheus_counter *counter,
+    const char               **drop_labels,
+    int                        num_drop,
+    uint32_t                   flags);
+
+int prometheus_counter_set_window(
+    struct prometheus_counter *counter,
+    int                        num_intervals);
+
+int prometheus_counter_series_rate(
+    struct prometheus_counter_series *series,
+    double                           *rate);
+
+struct prometheus_counter_series * prometheus_counter_lookup_series(
+    struct prometheus_counter *counter,
+    const char               **label_values);
+
 void prometheus_counter_destroy_series(
     struct prometheus_counter        *counter,
     struct prometheus_counter_series *series);
@@ -75,6 +271,11 @@ void prometheus_counter_destroy_series(
 struct prometheus_counter_instance * prometheus_counter_series_create_instance(
     struct prometheus_counter_series *series);
 
+int prometheus_counter_series_create_instances(
+    struct prometheus_counter_series    *series,
+    int                                  num_instances,
+    struct prometheus_counter_instance **instances);
+
 void prometheus_counter_series_destroy_instance(
     struct prometheus_counter_series   *series,
     struct prometheus_counter_instance *instance);
@@ -93,6 +294,22 @@ prometheus_counter_add(
     instance->value += value;
 } /* prometheus_counter_instance_add */
 
+static inline void
+prometheus_counter_add_many(
+    struct prometheus_counter_instance *instance,
+    const uint64_t                     *values,
+    int                                 count)
+{
+    uint64_t sum = 0;
+    int      i;
+
+    for (i = 0; i < count; i++) {
+        sum += values[i];
+    }
+
+    instance->value += sum;
+} /* prometheus_counter_add_many */
+
 struct prometheus_gauge * prometheus_metrics_create_gauge(
     struct prometheus_metrics *metrics,
     const char                *name,
@@ -109,6 +326,29 @@ struct prometheus_gauge_series * prometheus_gauge_create_series(
     const char             **label_values,
     int                      num_labels);
 
+int prometheus_gauge_create_series_batch(
+    struct prometheus_gauge         *gauge,
+    const char                     **label_names,
+    const char                     **label_values,
+    int                              num_labels,
+    int                              num_series,
+    struct prometheus_gauge_series **series);
+
+int prometheus_gauge_declare_labels(
+    struct prometheus_gauge *gauge,
+    const char             **label_names,
+    int                      num_labels);
+
+int prometheus_gauge_add_rollup(
+    struct prometheus_gauge *gauge,
+    const char             **drop_labels,
+    int                      num_drop,
+    uint32_t                 flags);
+
+struct prometheus_gauge_series * prometheus_gauge_lookup_series(
+    struct prometheus_gauge *gauge,
+    const char             **label_values);
+
 void
 prometheus_gauge_destroy_series(
     struct prometheus_gauge        *gauge,
@@ -117,6 +357,11 @@ prometheus_gauge_destroy_series(
 struct prometheus_gauge_instance * prometheus_gauge_series_create_instance(
     struct prometheus_gauge_series *series);
 
+int prometheus_gauge_series_create_instances(
+    struct prometheus_gauge_series    *series,
+    int                                num_instances,
+    struct prometheus_gauge_instance **instances);
+
 void prometheus_gauge_series_destroy_instance(
     struct prometheus_gauge_series   *series,
     struct prometheus_gauge_instance *instance);
@@ -163,18 +408,84 @@ struct prometheus_histogram_series * prometheus_histogram_create_series(
     const char                 **label_values,
     int                          num_labels);
 
+int prometheus_histogram_create_series_batch(
+    struct prometheus_histogram         *histogram,
+    const char                         **label_names,
+    const char                         **label_values,
+    int                                  num_labels,
+    int                                  num_series,
+    struct prometheus_histogram_series **series);
+
+int prometheus_histogram_declare_labels(
+    struct prometheus_histogram *histogram,
+    const char                 **label_names,
+    int                          num_labels);
+
+int prometheus_histogram_add_rollup(
+    struct prometheus_histogram *histogram,
+    const char                 **drop_labels,
+    int                          num_drop,
+    uint32_t                     flags);
+
+struct prometheus_histogram_series * prometheus_histogram_lookup_series(
+    struct prometheus_histogram *histogram,
+    const char                 **label_values);
+
 void prometheus_histogram_destroy_series(
     struct prometheus_histogram        *histogram,
     struct prometheus_histogram_series *series);
 
+int prometheus_histogram_set_sampling(
+    struct prometheus_histogram *histogram,
+    uint32_t                     sample_every);
+
+int prometheus_histogram_set_min_max(
+    struct prometheus_histogram *histogram,
+    int                          enable);
+
+int prometheus_histogram_set_window(
+    struct prometheus_histogram *histogram,
+    int                          num_intervals);
+
+int prometheus_histogram_series_rate(
+    struct prometheus_histogram_series *series,
+    double                             *rate,
+    double                             *average);
+
 
 struct prometheus_histogram_instance * prometheus_histogram_series_create_instance(
     struct prometheus_histogram_series *series);
 
+int prometheus_histogram_series_create_instances(
+    struct prometheus_histogram_series    *series,
+    int                                    num_instances,
+    struct prometheus_histogram_instance **instances);
+
 void prometheus_histogram_series_destroy_instance(
     struct prometheus_histogram_series   *series,
     struct prometheus_histogram_instance *instance);
 
+/*
+ * A sampled histogram records one in sample_every observations.  The
+ * gap to the next recorded observation is drawn uniformly from
+ * [1, 2 * sample_every - 1] so that periodic workloads do not alias
+ * with the sampling.
+ */
+
+static inline uint32_t
+prometheus_histogram_countdown(struct prometheus_histogram_instance *instance)
+{
+    uint64_t x = instance->rng;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    instance->rng = x;
+
+    return 1 + x % (2 * (uint64_t) instance->sample_every - 1);
+} /* prometheus_histogram_countdown */
+
 static inline void
 prometheus_histogram_sample(
     struct prometheus_histogram_instance *instance,
@@ -182,8 +493,22 @@ prometheus_histogram_sample(
 {
     uint64_t i;
 
+    /* Extremes see every observation passed here, including those sampling drops */
+    if (instance->min_max) {
+        instance->min = (uint64_t) value < instance->min ? (uint64_t) value : instance->min;
+        instance->max = (uint64_t) value > instance->max ? (uint64_t) value : instance->max;
+    }
+
+    if (instance->sample_every) {
+        if (--instance->countdown) {
+            return;
+        }
+
+        instance->countdown = prometheus_histogram_countdown(instance);
+    }
+
     if (instance->type == PROMETHEUS_HISTOGRAM_EXPONENTIAL) {
-        i = 63 - __builtin_clzll(value);
+        i = 63 - __builtin_clzll((uint64_t) value | 1);
     } else {
         i = (value - instance->start) / instance->increment;
     }
@@ -198,3 +523,107 @@ prometheus_histogram_sample(
     instance->count++;
 } /* prometheus_histogram_instance_sample */
 
+/*
+ * Record a batch of samples, with the same result as sampling each value
+ * in turn.  Bucket indices are computed by vector kernels picked for the
+ * CPU when the library is loaded, and sum and count are updated once per
+ * batch.
+ */
+
+void prometheus_histogram_sample_many(
+    struct prometheus_histogram_instance *instance,
+    const int64_t                        *values,
+    int                                   count);
+
+/*
+ * Latency timing.  Timestamps are raw cycle counter ticks (the TSC on
+ * x86 when it is invariant, cntvct on arm64) and are only converted to
+ * the requested unit when a sample is recorded, using a fixed point
+ * multiplier calibrated once when the first metrics context is created.
+ * Elsewhere, or before calibration, ticks are CLOCK_MONOTONIC ns.
+ */
+
+enum prometheus_time_unit {
+    PROMETHEUS_TIME_NS,
+    PROMETHEUS_TIME_US,
+    PROMETHEUS_TIME_MS,
+    PROMETHEUS_TIME_NUM_UNITS,
+};
+
+#define PROMETHEUS_CLOCK_SHIFT 40
+
+struct prometheus_clock {
+    int      cycles;
+    uint64_t mult[PROMETHEUS_TIME_NUM_UNITS];
+};
+
+extern struct prometheus_clock prometheus_clock;
+
+static inline uint64_t
+prometheus_clock_ticks(void)
+{
+    struct timespec ts;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (prometheus_clock.cycles) {
+        return __builtin_ia32_rdtsc();
+    }
+#elif defined(__aarch64__)
+    uint64_t ticks;
+
+    if (prometheus_clock.cycles) {
+        __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (ticks));
+        return ticks;
+    }
+#endif /* if defined(__x86_64__) || defined(__i386__) */
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+} /* prometheus_clock_ticks */
+
+/* (a * b) >> PROMETHEUS_CLOCK_SHIFT, from a 128 bit product built in 32 bit halves where there is no __int128 */
+
+static inline uint64_t
+prometheus_clock_scale(
+    uint64_t a,
+    uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    return ((unsigned __int128) a * b) >> PROMETHEUS_CLOCK_SHIFT;
+#else  /* ifdef __SIZEOF_INT128__ */
+    uint64_t lo    = (a & 0xffffffff) * (b & 0xffffffff);
+    uint64_t mid1  = (a >> 32) * (b & 0xffffffff);
+    uint64_t mid2  = (a & 0xffffffff) * (b >> 32);
+    uint64_t hi    = (a >> 32) * (b >> 32);
+    uint64_t carry = (lo >> 32) + (mid1 & 0xffffffff) + (mid2 & 0xffffffff);
+
+    lo  = (carry << 32) | (lo & 0xffffffff);
+    hi += (mid1 >> 32) + (mid2 >> 32) + (carry >> 32);
+
+    return (hi << (64 - PROMETHEUS_CLOCK_SHIFT)) | (lo >> PROMETHEUS_CLOCK_SHIFT);
+#endif /* ifdef __SIZEOF_INT128__ */
+} /* prometheus_clock_scale */
+
+static inline uint64_t
+prometheus_clock_elapsed(
+    uint64_t                  start,
+    enum prometheus_time_unit unit)
+{
+    return prometheus_clock_scale(prometheus_clock_ticks() - start, prometheus_clock.mult[unit]);
+} /* prometheus_clock_elapsed */
+
+static inline void
+prometheus_histogram_sample_elapsed(
+    struct prometheus_histogram_instance *instance,
+    uint64_t                              start,
+    enum prometheus_time_unit             unit)
+{
+    /* Skip reading the clock for observations a sampled histogram drops, unless the extremes need them */
+    if (instance->sample_every && instance->countdown > 1 && !instance->min_max) {
+        instance->countdown--;
+        return;
+    }
+
+    prometheus_histogram_sample(instance, prometheus_clock_elapsed(start, unit));
+} /* prometheus_histogram_sample_elapsed */
@@ -0,0 +1,103 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics            *metrics;
+    struct prometheus_counter            *counter;
+    struct prometheus_counter_series     *counter_series;
+    struct prometheus_counter_instance   *counter_instance;
+    struct prometheus_histogram          *histogram;
+    struct prometheus_histogram_series   *histogram_series;
+    struct prometheus_histogram_instance *histogram_instance;
+    char                                  buffer[4096];
+    int                                   i;
+
+    metrics = prometheus_metrics_create((char *[]) { "global" }, (char *[]) { "root" }, 1);
+
+    counter          = prometheus_metrics_create_counter(metrics, "test_counter", "Test counter");
+    counter_series   = prometheus_counter_create_series(counter, (const char *[]) { "test" }, (const char *[]) { "test1" }, 1);
+    counter_instance = prometheus_counter_series_create_instance(counter_series);
+
+    histogram          = prometheus_metrics_create_histogram_exponential(metrics, "test_histogram", "Test histogram", 4);
+    histogram_series   = prometheus_histogram_create_series(histogram, (const char *[]) { "test" }, (const char *[]) { "test1" }, 1);
+    histogram_instance = prometheus_histogram_series_create_instance(histogram_series);
+
+    prometheus_counter_add(counter_instance, 10);
+    prometheus_histogram_sample(histogram_instance, 5);
+
+    if (prometheus_metrics_start_aggregator(metrics, 10, 19)) {
+        fprintf(stderr, "failed to start aggregator\n");
+        return 1;
+    }
+
+    usleep(100000);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_counter{global=\"root\",test=\"test1\"} 10\n") ||
+        !strstr(buffer, "test_histogram_count{global=\"root\",test=\"test1\"} 1\n")) {
+        fprintf(stderr, "snapshot scrape missing values:\n%s\n", buffer);
+        return 1;
+    }
+
+    prometheus_counter_add(counter_instance, 10);
+
+    usleep(100000);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_counter{global=\"root\",test=\"test1\"} 20\n")) {
+        fprintf(stderr, "snapshot was not refreshed:\n%s\n", buffer);
+        return 1;
+    }
+
+    printf("%s\n", buffer);
+
+    prometheus_metrics_stop_aggregator(metrics);
+
+    prometheus_metrics_destroy(metrics);
+
+    /* The aggregator rolls the extremes window, so scrapes do not reset it for each other */
+
+    metrics = prometheus_metrics_create((char *[]) { "global" }, (char *[]) { "root" }, 1);
+
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "test_histogram", "Test histogram", 4);
+
+    prometheus_histogram_set_min_max(histogram, 1);
+
+    histogram_series   = prometheus_histogram_create_series(histogram, (const char *[]) { "test" }, (const char *[]) { "test1" }, 1);
+    histogram_instance = prometheus_histogram_series_create_instance(histogram_series);
+
+    prometheus_metrics_start_aggregator(metrics, 200, 19);
+
+    usleep(50000);
+
+    prometheus_histogram_sample(histogram_instance, 5);
+
+    usleep(250000);
+
+    for (i = 0; i < 2; i++) {
+        prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+        if (!strstr(buffer, "test_histogram_min{global=\"root\",test=\"test1\"} 5\n")) {
+            fprintf(stderr, "scrape %d did not see the aggregator window:\n%s\n", i, buffer);
+            return 1;
+        }
+    }
+
+    prometheus_metrics_stop_aggregator(metrics);
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
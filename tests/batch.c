@@ -0,0 +1,143 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+/* Batched samples must land exactly where one at a time samples do */
+
+static int
+check_sample_many(struct prometheus_histogram_instance *one)
+{
+    struct prometheus_histogram_instance many = *one;
+    uint64_t                             buckets[16] = { 0 };
+    int64_t                              values[150];
+    uint64_t                             i;
+
+    many.buckets = buckets;
+
+    for (i = 0; i < one->num_buckets; i++) {
+        buckets[i] = one->buckets[i];
+    }
+
+    for (i = 0; i < 150; i++) {
+        values[i] = (i * 2654435761UL) % (1UL << (i % 40));
+        prometheus_histogram_sample(one, values[i]);
+    }
+
+    prometheus_histogram_sample_many(&many, values, 150);
+
+    if (many.sum != one->sum || many.count != one->count) {
+        return 1;
+    }
+
+    for (i = 0; i < one->num_buckets; i++) {
+        if (buckets[i] != one->buckets[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+} /* check_sample_many */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics            *metrics;
+    struct prometheus_counter            *counter;
+    struct prometheus_histogram          *histogram;
+    struct prometheus_counter_series     *series[3];
+    struct prometheus_histogram_series   *hseries;
+    struct prometheus_counter_instance   *instances[4];
+    struct prometheus_histogram_instance *hinstances[2], *linear;
+    const uint64_t                        increments[] = { 1, 7, 1000, 65537, 1UL << 40 };
+    char                                  name[64];
+    const char                           *names[]  = { "core", "queue" };
+    const char                           *values[] = { "0", "rx", "1", "rx", "2", "tx" };
+    const char                           *bad[]    = { "0", "rx", "1", "r\"x" };
+    const uint64_t                        adds[]   = { 5, 6, 7 };
+    char                                  buffer[8192];
+    int                                   i;
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    counter   = prometheus_metrics_create_counter(metrics, "test_batch", "Batch counter");
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "test_batch_latency", "Batch histogram", 8);
+
+    /* An illegal value anywhere in the batch creates nothing */
+    if (prometheus_counter_create_series_batch(counter, names, bad, 2, 2, series) == 0) {
+        fprintf(stderr, "illegal batch accepted\n");
+        return 1;
+    }
+
+    if (prometheus_counter_create_series_batch(counter, names, values, 2, 3, series)) {
+        fprintf(stderr, "batch series creation failed\n");
+        return 1;
+    }
+
+    if (prometheus_counter_series_create_instances(series[2], 4, instances)) {
+        fprintf(stderr, "batch instance creation failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        if ((unsigned long) instances[i] & 63) {
+            fprintf(stderr, "instance %d is not cache line aligned\n", i);
+            return 1;
+        }
+
+        prometheus_counter_add(instances[i], i + 1);
+    }
+
+    prometheus_counter_add_many(instances[0], adds, 3);
+
+    /* Destroying part of a batch keeps the rest, and its totals, intact */
+    prometheus_counter_series_destroy_instance(series[2], instances[1]);
+
+    hseries = prometheus_histogram_create_series(histogram, NULL, NULL, 0);
+
+    prometheus_histogram_series_create_instances(hseries, 2, hinstances);
+
+    prometheus_histogram_sample(hinstances[0], 3);
+    prometheus_histogram_sample(hinstances[1], 100);
+
+    histogram = prometheus_metrics_create_histogram_linear(metrics, "test_batch_linear", "Batch linear", 100, 1000, 12);
+    linear    = prometheus_histogram_series_create_instance(prometheus_histogram_create_series(histogram, NULL, NULL, 0));
+
+    if (check_sample_many(hinstances[1]) || check_sample_many(linear)) {
+        fprintf(stderr, "batched samples differ from single samples\n");
+        return 1;
+    }
+
+    /* Linear batches divide by a reciprocal, or by the increment when the thresholds pass 2^31 */
+    for (i = 0; i < 5; i++) {
+        snprintf(name, sizeof(name), "test_batch_increment_%lu", increments[i]);
+        histogram = prometheus_metrics_create_histogram_linear(metrics, name, "Batch increment", 100, increments[i],
+                                                               16);
+        linear = prometheus_histogram_series_create_instance(prometheus_histogram_create_series(histogram, NULL,
+                                                                                                NULL, 0));
+
+        if (check_sample_many(linear)) {
+            fprintf(stderr, "batched samples with increment %lu differ from single samples\n", increments[i]);
+            return 1;
+        }
+    }
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "test_batch{core=\"2\",queue=\"tx\"} 28\n") ||
+        !strstr(buffer, "test_batch{core=\"0\",queue=\"rx\"} 0\n") ||
+        !strstr(buffer, "test_batch_latency_count{} 152\n")) {
+        fprintf(stderr, "unexpected batch output\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
@@ -0,0 +1,99 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "prometheus-c.h"
+
+#define NUM_THREADS 8
+
+static struct prometheus_metrics *metrics;
+
+static void *
+scrape_thread(void *arg)
+{
+    struct prometheus_scrape_result *result;
+    int                              i;
+
+    for (i = 0; i < 1000; i++) {
+        result = prometheus_metrics_scrape_cached(metrics, PROMETHEUS_ENCODING_IDENTITY);
+
+        if (prometheus_scrape_result_length(result) <= 0) {
+            return (void *) 1;
+        }
+
+        prometheus_scrape_result_release(result);
+    }
+
+    return NULL;
+} /* scrape_thread */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *series;
+    struct prometheus_counter_instance *instance;
+    struct prometheus_scrape_result    *result1, *result2;
+    pthread_t                           threads[NUM_THREADS];
+    void                               *rc;
+    int                                 i, failed = 0;
+
+    metrics = prometheus_metrics_create((char *[]) { "global" }, (char *[]) { "root" }, 1);
+
+    counter  = prometheus_metrics_create_counter(metrics, "test_counter", "Test counter");
+    series   = prometheus_counter_create_series(counter, (const char *[]) { "test" }, (const char *[]) { "test1" }, 1);
+    instance = prometheus_counter_series_create_instance(series);
+
+    prometheus_counter_add(instance, 10);
+
+    prometheus_metrics_set_scrape_cache(metrics, 60000);
+
+    result1 = prometheus_metrics_scrape_cached(metrics, PROMETHEUS_ENCODING_IDENTITY);
+
+    prometheus_counter_add(instance, 10);
+
+    /* Within the refresh interval the same rendered result is shared */
+    result2 = prometheus_metrics_scrape_cached(metrics, PROMETHEUS_ENCODING_IDENTITY);
+
+    if (result1 != result2 || !strstr(prometheus_scrape_result_data(result2), "} 10\n")) {
+        fprintf(stderr, "cached result was not reused\n");
+        return 1;
+    }
+
+    prometheus_scrape_result_release(result2);
+
+    prometheus_metrics_set_scrape_cache(metrics, 0);
+
+    result2 = prometheus_metrics_scrape_cached(metrics, PROMETHEUS_ENCODING_IDENTITY);
+
+    if (result1 == result2 || !strstr(prometheus_scrape_result_data(result2), "} 20\n")) {
+        fprintf(stderr, "cached result was not refreshed\n");
+        return 1;
+    }
+
+    /* result1 remains valid until released even though the cache replaced it */
+    printf("%s\n", prometheus_scrape_result_data(result1));
+
+    prometheus_scrape_result_release(result1);
+    prometheus_scrape_result_release(result2);
+
+    prometheus_metrics_set_scrape_cache(metrics, 1);
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, scrape_thread, NULL);
+    }
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], &rc);
+        failed |= rc != NULL;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return failed;
+} /* main */
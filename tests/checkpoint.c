@@ -0,0 +1,113 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "prometheus-c.h"
+
+static struct prometheus_metrics *
+create(
+    struct prometheus_counter_instance   **counter_instance,
+    struct prometheus_histogram_instance **histogram_instance)
+{
+    struct prometheus_metrics   *metrics;
+    struct prometheus_counter   *counter;
+    struct prometheus_histogram *histogram;
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    counter           = prometheus_metrics_create_counter(metrics, "test_counter", "Test counter");
+    *counter_instance = prometheus_counter_series_create_instance(
+        prometheus_counter_create_series(counter, (const char *[]) { "test" }, (const char *[]) { "test1" }, 1));
+
+    histogram           = prometheus_metrics_create_histogram_exponential(metrics, "test_histogram", "Test histogram", 4);
+    *histogram_instance = prometheus_histogram_series_create_instance(
+        prometheus_histogram_create_series(histogram, NULL, NULL, 0));
+
+    return metrics;
+} /* create */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics            *metrics;
+    struct prometheus_counter_instance   *counter_instance;
+    struct prometheus_histogram_instance *histogram_instance;
+    static char                           buffer[65536];
+    char                                  path[64], file[80];
+    int                                   fd, failed = 0;
+
+    snprintf(path, sizeof(path), "/tmp/prometheus-c-checkpoint-%d", getpid());
+
+    metrics = create(&counter_instance, &histogram_instance);
+
+    prometheus_metrics_set_checkpoint(metrics, path, 0);
+
+    prometheus_counter_add(counter_instance, 10);
+    prometheus_histogram_sample(histogram_instance, 5);
+    prometheus_metrics_checkpoint(metrics);
+
+    prometheus_counter_add(counter_instance, 5);
+    prometheus_metrics_checkpoint(metrics);
+
+    prometheus_metrics_destroy(metrics);
+
+    /* A restarted process picks up the totals from the newest checkpoint */
+
+    metrics = create(&counter_instance, &histogram_instance);
+
+    prometheus_counter_add(counter_instance, 1);
+
+    if (prometheus_metrics_restore_checkpoint(metrics, path) != 0) {
+        fprintf(stderr, "failed to restore checkpoint\n");
+        failed = 1;
+    }
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_counter{test=\"test1\"} 16\n") ||
+        !strstr(buffer, "test_histogram_sum{} 5\n") ||
+        !strstr(buffer, "test_histogram_count{} 1\n")) {
+        fprintf(stderr, "unexpected totals after restore:\n%s", buffer);
+        failed = 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    /* Corrupting the newest checkpoint falls back to the older one */
+
+    snprintf(file, sizeof(file), "%s.0", path);
+
+    fd = open(file, O_WRONLY);
+
+    if (fd < 0 || pwrite(fd, "XXXX", 4, 64) != 4) {
+        fprintf(stderr, "failed to corrupt %s\n", file);
+        failed = 1;
+    }
+
+    close(fd);
+
+    metrics = create(&counter_instance, &histogram_instance);
+
+    prometheus_metrics_restore_checkpoint(metrics, path);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_counter{test=\"test1\"} 10\n")) {
+        fprintf(stderr, "unexpected totals after restoring older checkpoint:\n%s", buffer);
+        failed = 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    unlink(file);
+    snprintf(file, sizeof(file), "%s.1", path);
+    unlink(file);
+
+    return failed;
+} /* main */
@@ -0,0 +1,130 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics          *metrics, *module, *backend;
+    struct prometheus_counter          *counter, *zone;
+    struct prometheus_counter_series   *series;
+    struct prometheus_counter_instance *instance;
+    struct prometheus_gauge            *gauge;
+    struct prometheus_gauge_series     *gauge_series;
+    struct prometheus_gauge_instance   *gauge_instance;
+    struct prometheus_scrape_filter    *filter;
+    char                                buffer[8192];
+
+    metrics = prometheus_metrics_create((char *[]) { "host" }, (char *[]) { "node1" }, 1);
+
+    counter  = prometheus_metrics_create_counter(metrics, "daemon_ops", "Daemon operations");
+    series   = prometheus_counter_create_series(counter, NULL, NULL, 0);
+    instance = prometheus_counter_series_create_instance(series);
+    prometheus_counter_add(instance, 1);
+
+    module  = prometheus_metrics_create_child(metrics, (char *[]) { "export" }, (char *[]) { "export1" }, 1);
+    backend = prometheus_metrics_create_child(module, (char *[]) { "backend" }, (char *[]) { "disk0" }, 1);
+
+    counter  = prometheus_metrics_create_counter(module, "export_ops", "Export operations");
+    series   = prometheus_counter_create_series(counter, NULL, NULL, 0);
+    instance = prometheus_counter_series_create_instance(series);
+    prometheus_counter_add(instance, 5);
+
+    gauge          = prometheus_metrics_create_gauge(backend, "backend_queue_depth", "Backend queue depth");
+    gauge_series   = prometheus_gauge_create_series(gauge, NULL, NULL, 0);
+    gauge_instance = prometheus_gauge_series_create_instance(gauge_series);
+    prometheus_gauge_set(gauge_instance, 3);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "daemon_ops{host=\"node1\"} 1\n") ||
+        !strstr(buffer, "export_ops{host=\"node1\",export=\"export1\"} 5\n") ||
+        !strstr(buffer, "backend_queue_depth{host=\"node1\",export=\"export1\",backend=\"disk0\"} 3\n")) {
+        fprintf(stderr, "child registries missing from the parent scrape\n");
+        return 1;
+    }
+
+    filter = prometheus_scrape_filter_create();
+    prometheus_scrape_filter_add_prefix(filter, "backend_");
+
+    prometheus_metrics_scrape_filtered(metrics, filter, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "backend_queue_depth{") || strstr(buffer, "export_ops") || strstr(buffer, "daemon_ops")) {
+        fprintf(stderr, "filtered scrape did not descend into children:\n%s\n", buffer);
+        return 1;
+    }
+
+    prometheus_scrape_filter_destroy(filter);
+
+    /* Destroying a child detaches and frees its whole subtree */
+    prometheus_metrics_destroy(module);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "daemon_ops{host=\"node1\"} 1\n") ||
+        strstr(buffer, "export_ops") || strstr(buffer, "backend_queue_depth")) {
+        fprintf(stderr, "destroyed child still scraped:\n%s\n", buffer);
+        return 1;
+    }
+
+    /* Metrics of the same name in sibling registries are rendered as one family */
+    module   = prometheus_metrics_create_child(metrics, (char *[]) { "export" }, (char *[]) { "export2" }, 1);
+    counter  = prometheus_metrics_create_counter(module, "export_ops", "Export operations");
+    series   = prometheus_counter_create_series(counter, NULL, NULL, 0);
+    instance = prometheus_counter_series_create_instance(series);
+    prometheus_counter_add(instance, 2);
+
+    module   = prometheus_metrics_create_child(metrics, (char *[]) { "export" }, (char *[]) { "export3" }, 1);
+    counter  = prometheus_metrics_create_counter(module, "export_ops", "Export operations");
+    series   = prometheus_counter_create_series(counter, NULL, NULL, 0);
+    instance = prometheus_counter_series_create_instance(series);
+    prometheus_counter_add(instance, 3);
+
+    zone = prometheus_metrics_create_counter(metrics, "zone_ops", "Zone operations");
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "# TYPE export_ops counter\n"
+                "export_ops{host=\"node1\",export=\"export2\"} 2\n"
+                "export_ops{host=\"node1\",export=\"export3\"} 3\n") ||
+        strstr(strstr(buffer, "# TYPE export_ops") + 1, "# TYPE export_ops")) {
+        fprintf(stderr, "sibling families were not merged\n");
+        return 1;
+    }
+
+    /* Families keep the order of their registries rather than being sorted by name */
+    if (!strstr(buffer, "# TYPE zone_ops") || strstr(buffer, "# TYPE zone_ops") > strstr(buffer, "# TYPE export_ops")) {
+        fprintf(stderr, "tree scrape reordered the families\n");
+        return 1;
+    }
+
+    /* A name is used with one type across the tree */
+    if (prometheus_metrics_create_gauge(module, "daemon_ops", "Daemon operations") ||
+        prometheus_metrics_create_histogram_linear(metrics, "export_ops", "Export operations", 0, 1, 4) ||
+        !prometheus_metrics_create_counter(module, "daemon_ops", "Daemon operations")) {
+        fprintf(stderr, "conflicting metric types were not rejected\n");
+        return 1;
+    }
+
+    /* Names are released with the last metric using them, including those of destroyed children */
+    prometheus_counter_destroy(metrics, zone);
+
+    if (!prometheus_metrics_create_gauge(module, "zone_ops", "Zone operations") ||
+        !prometheus_metrics_create_counter(metrics, "backend_queue_depth", "Backend queue depth")) {
+        fprintf(stderr, "released names were not reusable with another type\n");
+        return 1;
+    }
+
+    /* Children left attached are destroyed along with the parent */
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
@@ -0,0 +1,116 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef PROMETHEUS_HAVE_ZSTD
+#include <zstd.h>
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics          *metrics;
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *series;
+    struct prometheus_counter_instance *instance;
+    char                                label[32];
+    char                               *plain, *compressed, *inflated, *help;
+    int                                 plain_len, compressed_len, i, pass;
+    z_stream                            zs = { 0 };
+
+    plain      = malloc(4 * 1024 * 1024);
+    compressed = malloc(4 * 1024 * 1024);
+    inflated   = malloc(4 * 1024 * 1024);
+
+    if (prometheus_negotiate_encoding("br;q=1.0, gzip;q=0.5, *;q=0") != PROMETHEUS_ENCODING_GZIP ||
+        prometheus_negotiate_encoding("gzip;q=0") != PROMETHEUS_ENCODING_IDENTITY ||
+        prometheus_negotiate_encoding(NULL) != PROMETHEUS_ENCODING_IDENTITY) {
+        fprintf(stderr, "encoding negotiation failed\n");
+        return 1;
+    }
+
+    metrics = prometheus_metrics_create((char *[]) { "global" }, (char *[]) { "root" }, 1);
+
+    counter = prometheus_metrics_create_counter(metrics, "test_counter", "Test counter");
+
+    /* A help string larger than the staging buffer is compressed directly */
+    help = malloc(100 * 1024);
+    memset(help, 'h', 100 * 1024 - 1);
+    help[100 * 1024 - 1] = '\0';
+
+    prometheus_metrics_create_gauge(metrics, "test_long_help", help);
+
+    /* Enough series to span several staging buffer flushes */
+    for (i = 0; i < 20000; i++) {
+        snprintf(label, sizeof(label), "series%d", i);
+        series   = prometheus_counter_create_series(counter, (const char *[]) { "test" }, (const char *[]) { label }, 1);
+        instance = prometheus_counter_series_create_instance(series);
+        prometheus_counter_add(instance, i);
+    }
+
+    plain_len = prometheus_metrics_scrape(metrics, plain, 4 * 1024 * 1024);
+
+    /* Scrape twice to exercise reuse of the compressor state */
+    for (pass = 0; pass < 2; pass++) {
+
+        compressed_len = prometheus_metrics_scrape_compressed(metrics, PROMETHEUS_ENCODING_GZIP,
+                                                              compressed, 4 * 1024 * 1024);
+
+        if (plain_len <= 0 || compressed_len <= 0 || compressed_len >= plain_len) {
+            fprintf(stderr, "scrape failed plain %d compressed %d\n", plain_len, compressed_len);
+            return 1;
+        }
+
+        inflateInit2(&zs, 15 + 16);
+        zs.next_in   = (Bytef *) compressed;
+        zs.avail_in  = compressed_len;
+        zs.next_out  = (Bytef *) inflated;
+        zs.avail_out = 4 * 1024 * 1024;
+
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END ||
+            zs.total_out != plain_len ||
+            memcmp(plain, inflated, plain_len) != 0) {
+            fprintf(stderr, "gzip output does not match plain scrape\n");
+            return 1;
+        }
+
+        inflateEnd(&zs);
+    }
+
+    printf("plain %d bytes, gzip %d bytes\n", plain_len, compressed_len);
+
+#ifdef PROMETHEUS_HAVE_ZSTD
+    compressed_len = prometheus_metrics_scrape_compressed(metrics, PROMETHEUS_ENCODING_ZSTD,
+                                                          compressed, 4 * 1024 * 1024);
+
+    if (compressed_len <= 0 ||
+        ZSTD_decompress(inflated, 4 * 1024 * 1024, compressed, compressed_len) != (size_t) plain_len ||
+        memcmp(plain, inflated, plain_len) != 0) {
+        fprintf(stderr, "zstd output does not match plain scrape\n");
+        return 1;
+    }
+
+    printf("zstd %d bytes\n", compressed_len);
+#endif /* ifdef PROMETHEUS_HAVE_ZSTD */
+
+    if (prometheus_metrics_scrape_compressed(metrics, PROMETHEUS_ENCODING_GZIP, compressed, 64) != -1) {
+        fprintf(stderr, "undersized buffer was not rejected\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    free(plain);
+    free(compressed);
+    free(inflated);
+    free(help);
+
+    return 0;
+} /* main */
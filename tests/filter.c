@@ -0,0 +1,121 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+static int
+occurrences(
+    const char *buffer,
+    const char *str)
+{
+    const char *ptr;
+    int         count = 0;
+
+    for (ptr = strstr(buffer, str); ptr; ptr = strstr(ptr + 1, str)) {
+        count++;
+    }
+
+    return count;
+} /* occurrences */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics       *metrics;
+    struct prometheus_counter       *requests, *errors;
+    struct prometheus_gauge         *connections;
+    struct prometheus_histogram     *latency;
+    struct prometheus_scrape_filter *filter;
+    const char                      *method[] = { "method" };
+    char                             buffer[8192];
+
+    metrics = prometheus_metrics_create((char *[]) { "host" }, (char *[]) { "node1" }, 1);
+
+    requests    = prometheus_metrics_create_counter(metrics, "app_requests", "Requests");
+    errors      = prometheus_metrics_create_counter(metrics, "app_errors", "Errors");
+    connections = prometheus_metrics_create_gauge(metrics, "db_connections", "Connections");
+    latency     = prometheus_metrics_create_histogram_exponential(metrics, "app_latency", "Latency", 4);
+
+    prometheus_counter_create_series(requests, method, (const char *[]) { "GET" }, 1);
+    prometheus_counter_create_series(requests, method, (const char *[]) { "POST" }, 1);
+    prometheus_counter_create_series(errors, method, (const char *[]) { "GET" }, 1);
+    prometheus_gauge_create_series(connections, NULL, NULL, 0);
+    prometheus_histogram_create_series(latency, method, (const char *[]) { "GET" }, 1);
+
+    filter = prometheus_scrape_filter_create();
+
+    if (prometheus_scrape_filter_add_prefix(filter, "app re") == 0) {
+        fprintf(stderr, "illegal prefix accepted\n");
+        return 1;
+    }
+
+    /* A metric matched by both a name and a prefix is rendered once */
+    prometheus_scrape_filter_add_name(filter, "db_connections");
+    prometheus_scrape_filter_add_name(filter, "app_requests");
+    prometheus_scrape_filter_add_prefix(filter, "app_re");
+
+    prometheus_metrics_scrape_filtered(metrics, filter, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (occurrences(buffer, "# TYPE app_requests counter\n") != 1 ||
+        occurrences(buffer, "# TYPE db_connections gauge\n") != 1 ||
+        occurrences(buffer, "app_requests{host=\"node1\",method=") != 2 ||
+        strstr(buffer, "app_errors") || strstr(buffer, "app_latency")) {
+        fprintf(stderr, "name filter selected the wrong metrics\n");
+        return 1;
+    }
+
+    prometheus_scrape_filter_destroy(filter);
+
+    /* Label matchers alone select series across every metric */
+    filter = prometheus_scrape_filter_create();
+    prometheus_scrape_filter_add_label(filter, "method", "GET");
+    prometheus_scrape_filter_add_label(filter, "host", "node1");
+
+    prometheus_metrics_scrape_filtered(metrics, filter, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "app_requests{host=\"node1\",method=\"GET\"} 0\n") ||
+        !strstr(buffer, "app_errors{host=\"node1\",method=\"GET\"} 0\n") ||
+        !strstr(buffer, "app_latency_count{host=\"node1\",method=\"GET\"} 0\n") ||
+        strstr(buffer, "POST") || strstr(buffer, "db_connections")) {
+        fprintf(stderr, "label filter selected the wrong series\n");
+        return 1;
+    }
+
+    prometheus_scrape_filter_destroy(filter);
+
+    /* Metrics with no matching series are left out entirely, header included */
+    filter = prometheus_scrape_filter_create();
+    prometheus_scrape_filter_add_label(filter, "method", "PUT");
+
+    if (prometheus_metrics_scrape_filtered(metrics, filter, buffer, sizeof(buffer)) != 0 || buffer[0]) {
+        fprintf(stderr, "label filter with no matches rendered:\n%s\n", buffer);
+        return 1;
+    }
+
+    prometheus_scrape_filter_destroy(filter);
+
+    prometheus_counter_destroy(metrics, errors);
+
+    filter = prometheus_scrape_filter_create();
+    prometheus_scrape_filter_add_prefix(filter, "app_");
+
+    prometheus_metrics_scrape_filtered(metrics, filter, buffer, sizeof(buffer));
+
+    if (strstr(buffer, "app_errors") || !strstr(buffer, "app_latency") || !strstr(buffer, "app_requests")) {
+        fprintf(stderr, "destroyed metric still indexed\n");
+        return 1;
+    }
+
+    prometheus_scrape_filter_destroy(filter);
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
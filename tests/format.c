@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics          *metrics;
+    struct prometheus_counter          *requests;
+    struct prometheus_gauge            *temperature;
+    struct prometheus_histogram        *latency;
+    struct prometheus_counter_series   *requests_series;
+    struct prometheus_gauge_series     *temperature_series;
+    struct prometheus_histogram_series *latency_series;
+    const char                         *path[] = { "path" };
+    char                                buffer[8192], text[8192];
+
+    metrics = prometheus_metrics_create((char *[]) { "host" }, (char *[]) { "node1" }, 1);
+
+    requests    = prometheus_metrics_create_counter(metrics, "app_requests", "Requests \"served\"");
+    temperature = prometheus_metrics_create_gauge(metrics, "app_temperature", "Temperature");
+    latency     = prometheus_metrics_create_histogram_exponential(metrics, "app_latency", "Latency", 2);
+
+    requests_series    = prometheus_counter_create_series(requests, path, (const char *[]) { "/a b,c" }, 1);
+    temperature_series = prometheus_gauge_create_series(temperature, NULL, NULL, 0);
+    latency_series     = prometheus_histogram_create_series(latency, path, (const char *[]) { "C:\\" }, 1);
+
+    prometheus_counter_add(prometheus_counter_series_create_instance(requests_series), 7);
+    prometheus_gauge_set(prometheus_gauge_series_create_instance(temperature_series), -3);
+    prometheus_histogram_sample(prometheus_histogram_series_create_instance(latency_series), 1);
+
+    /* The text format is the plain scrape */
+    prometheus_metrics_scrape(metrics, text, sizeof(text));
+
+    if (prometheus_metrics_scrape_format(metrics, PROMETHEUS_FORMAT_TEXT, buffer, sizeof(buffer)) < 0 ||
+        strcmp(buffer, text)) {
+        fprintf(stderr, "text format differs from scrape\n");
+        return 1;
+    }
+
+    if (prometheus_metrics_scrape_format(metrics, PROMETHEUS_FORMAT_JSON, buffer, sizeof(buffer)) < 0) {
+        fprintf(stderr, "JSON scrape failed\n");
+        return 1;
+    }
+
+    printf("%s\n", buffer);
+
+    if (buffer[0] != '[' ||
+        !strstr(buffer, "{\"name\":\"app_requests\",\"type\":\"counter\",\"help\":\"Requests \\u0022served\\u0022\"") ||
+        !strstr(buffer, "{\"labels\":{\"host\":\"node1\",\"path\":\"/a b,c\"},\"value\":7}") ||
+        !strstr(buffer, "{\"labels\":{\"host\":\"node1\"},\"value\":-3}") ||
+        !strstr(buffer, "\"path\":\"C:\\u005c\"},\"buckets\":{\"2\":1,\"+Inf\":0},\"sum\":1,\"count\":1}")) {
+        fprintf(stderr, "JSON scrape is malformed\n");
+        return 1;
+    }
+
+    if (prometheus_metrics_scrape_format(metrics, PROMETHEUS_FORMAT_INFLUX, buffer, sizeof(buffer)) < 0) {
+        fprintf(stderr, "line protocol scrape failed\n");
+        return 1;
+    }
+
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "prometheus,host=node1,path=/a\\ b\\,c app_requests=7u\n") ||
+        !strstr(buffer, "prometheus,host=node1 app_temperature=-3i\n") ||
+        !strstr(buffer, "prometheus,host=node1,path=C:\\\\,le=+Inf app_latency_bucket=0u\n") ||
+        !strstr(buffer, "prometheus,host=node1,path=C:\\\\ app_latency_count=1u\n") ||
+        strstr(buffer, "# HELP")) {
+        fprintf(stderr, "line protocol scrape is malformed\n");
+        return 1;
+    }
+
+    if (prometheus_metrics_scrape_format(metrics, (enum prometheus_format) 99, buffer, sizeof(buffer)) != -1) {
+        fprintf(stderr, "unknown format accepted\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
@@ -3,6 +3,8 @@
 // SPDX-License-Identifier: LGPL-2.1-only
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include "prometheus-c.h"
 
 int
@@ -12,7 +14,7 @@ main(
 {
     struct prometheus_metrics        *metrics;
     struct prometheus_gauge          *gauge1, *gauge2;
-    struct prometheus_gauge_series   *series11, *series12, *series21, *series22;
+    struct prometheus_gauge_series   *series11, *series12, *series21, *series22, *negative, *minimum;
     struct prometheus_gauge_instance *instance11, *instance12, *instance21, *instance22;
     char                              buffer[4096];
 
@@ -41,9 +43,22 @@ main(
     prometheus_gauge_add(instance21, 30);
     prometheus_gauge_add(instance22, 40);
 
+    negative = prometheus_gauge_create_series(gauge2, (const char *[]) { "test" }, (const char *[]) { "test3" }, 1);
+    minimum  = prometheus_gauge_create_series(gauge2, (const char *[]) { "test" }, (const char *[]) { "test4" }, 1);
+
+    prometheus_gauge_set(prometheus_gauge_series_create_instance(negative), -5);
+    prometheus_gauge_set(prometheus_gauge_series_create_instance(minimum), INT64_MIN);
+
     prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
     printf("%s\n", buffer);
 
+    if (!strstr(buffer, "test_gauge1{global=\"root\",test=\"test1\"} 110\n") ||
+        !strstr(buffer, "test_gauge2{global=\"root\",test=\"test3\"} -5\n") ||
+        !strstr(buffer, "test_gauge2{global=\"root\",test=\"test4\"} -9223372036854775808\n")) {
+        fprintf(stderr, "gauge values were not rendered as signed integers\n");
+        return 1;
+    }
+
     prometheus_metrics_destroy(metrics);
 
     return 0;
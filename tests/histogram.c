@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "prometheus-c.h"
 
 int
@@ -24,6 +25,8 @@ main(
     histogram1 = prometheus_metrics_create_histogram_exponential(metrics, "test_histogram1", "Test histogram1", 16);
     histogram2 = prometheus_metrics_create_histogram_linear(metrics, "test_histogram2", "Test histogram2", 10, 10, 10);
 
+    prometheus_histogram_set_min_max(histogram1, 1);
+
     series11 = prometheus_histogram_create_series(histogram1,
                                                   (const char *[]) { "test" }, (const char *[]) { "test1" },
                                                   1);
@@ -42,6 +45,12 @@ main(
     instance21 = prometheus_histogram_series_create_instance(series21);
     instance22 = prometheus_histogram_series_create_instance(series22);
 
+    /* Handles copy the setting when they are created, so it cannot change once there are series */
+    if (prometheus_histogram_set_min_max(histogram2, 1) != -1) {
+        fprintf(stderr, "min/max enabled on a histogram with series\n");
+        return 1;
+    }
+
     prometheus_histogram_sample(instance11, 100);
     prometheus_histogram_sample(instance12, 200);
     prometheus_histogram_sample(instance21, 300);
@@ -52,9 +61,31 @@ main(
     prometheus_histogram_sample(instance21, 31);
     prometheus_histogram_sample(instance22, 41);
 
-    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    prometheus_metrics_scrape(metrics, buffer, 1024 * 1024);
     printf("%s\n", buffer);
 
+    if (!strstr(buffer, "test_histogram1_min{global=\"root\",test=\"test1\"} 11\n") ||
+        !strstr(buffer, "test_histogram1_max{global=\"root\",test=\"test1\"} 100\n") ||
+        !strstr(buffer, "test_histogram1_max{global=\"root\",test=\"test2\"} 200\n") ||
+        strstr(buffer, "test_histogram2_min")) {
+        fprintf(stderr, "unexpected min/max output\n");
+        return 1;
+    }
+
+    /* Each scrape starts a new window, and destroyed handles still count in theirs */
+    prometheus_histogram_sample(instance11, 5);
+    prometheus_histogram_series_destroy_instance(series11, instance11);
+
+    prometheus_metrics_scrape(metrics, buffer, 1024 * 1024);
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "test_histogram1_min{global=\"root\",test=\"test1\"} 5\n") ||
+        !strstr(buffer, "test_histogram1_max{global=\"root\",test=\"test1\"} 5\n") ||
+        !strstr(buffer, "test_histogram1_max{global=\"root\",test=\"test2\"} NaN\n")) {
+        fprintf(stderr, "min/max window was not reset\n");
+        return 1;
+    }
+
     prometheus_metrics_destroy(metrics);
 
     free(buffer);
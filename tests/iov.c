@@ -0,0 +1,112 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "prometheus-c.h"
+
+struct sink {
+    int fd;
+    int calls;
+    int fail;
+};
+
+static int
+write_iov(
+    const struct iovec *iov,
+    int                 iovcnt,
+    void               *private_data)
+{
+    struct sink *sink = private_data;
+    ssize_t      len  = 0;
+    int          i;
+
+    sink->calls++;
+
+    if (sink->fail) {
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    return writev(sink->fd, iov, iovcnt) == len ? 0 : -1;
+} /* write_iov */
+
+static char expected[1024 * 1024];
+static char actual[1024 * 1024];
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics          *metrics;
+    struct prometheus_counter          *requests;
+    struct prometheus_gauge            *connections;
+    struct prometheus_histogram        *latency;
+    struct prometheus_counter_series   *series;
+    struct prometheus_histogram_series *latency_series;
+    struct sink                         sink = { 0 };
+    const char                         *names[] = { "method", "path" };
+    char                                path[32];
+    FILE                               *file;
+    int                                 i, length;
+
+    metrics = prometheus_metrics_create((char *[]) { "host" }, (char *[]) { "node1" }, 1);
+
+    requests    = prometheus_metrics_create_counter(metrics, "app_requests_total", "Requests served by path");
+    connections = prometheus_metrics_create_gauge(metrics, "db_connections", "Connections");
+    latency     = prometheus_metrics_create_histogram_exponential(metrics, "app_latency", "Latency", 8);
+
+    /* Enough series to take several batches through the callback */
+    for (i = 0; i < 4000; i++) {
+        snprintf(path, sizeof(path), "/api/v1/resource/%d", i);
+
+        series = prometheus_counter_create_series(requests, names, (const char *[]) { "GET", path }, 2);
+
+        prometheus_counter_add(prometheus_counter_series_create_instance(series), i);
+    }
+
+    prometheus_gauge_create_series(connections, NULL, NULL, 0);
+
+    latency_series = prometheus_histogram_create_series(latency, names, (const char *[]) { "GET", "/" }, 2);
+    prometheus_histogram_sample(prometheus_histogram_series_create_instance(latency_series), 100);
+
+    file    = tmpfile();
+    sink.fd = fileno(file);
+
+    length = prometheus_metrics_scrape_iov(metrics, write_iov, &sink);
+
+    if (prometheus_metrics_scrape(metrics, expected, sizeof(expected)) != length) {
+        fprintf(stderr, "scatter/gather scrape length %d differs from scrape\n", length);
+        return 1;
+    }
+
+    if (sink.calls < 2) {
+        fprintf(stderr, "scatter/gather scrape was not batched\n");
+        return 1;
+    }
+
+    if (pread(sink.fd, actual, sizeof(actual), 0) != length || memcmp(actual, expected, length)) {
+        fprintf(stderr, "scatter/gather scrape differs from scrape\n");
+        return 1;
+    }
+
+    fclose(file);
+
+    /* A failing callback fails the scrape */
+    sink.fail = 1;
+
+    if (prometheus_metrics_scrape_iov(metrics, write_iov, &sink) != -1) {
+        fprintf(stderr, "callback failure was not reported\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
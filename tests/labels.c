@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics          *metrics;
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *get, *put, *again, *created;
+    struct prometheus_counter_instance *instance;
+    char                                method[16];
+    char                                buffer[8192];
+    int                                 i;
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    counter = prometheus_metrics_create_counter(metrics, "test_requests", "Requests by method and status");
+
+    if (prometheus_counter_lookup_series(counter, (const char *[]) { "GET", "200" })) {
+        fprintf(stderr, "lookup without a schema succeeded\n");
+        return 1;
+    }
+
+    if (prometheus_counter_declare_labels(counter, (const char *[]) { "method", "status" }, 2)) {
+        fprintf(stderr, "declaring labels failed\n");
+        return 1;
+    }
+
+    get   = prometheus_counter_lookup_series(counter, (const char *[]) { "GET", "200" });
+    put   = prometheus_counter_lookup_series(counter, (const char *[]) { "PUT", "200" });
+    again = prometheus_counter_lookup_series(counter, (const char *[]) { "GET", "200" });
+
+    if (!get || !put || get == put || get != again) {
+        fprintf(stderr, "lookup did not map value tuples to series\n");
+        return 1;
+    }
+
+    /* Explicit creation must follow the schema and finds the existing series */
+    if (prometheus_counter_create_series(counter, (const char *[]) { "status", "method" },
+                                         (const char *[]) { "200", "GET" }, 2)) {
+        fprintf(stderr, "series with mismatched label names accepted\n");
+        return 1;
+    }
+
+    created = prometheus_counter_create_series(counter, (const char *[]) { "method", "status" },
+                                               (const char *[]) { "GET", "200" }, 2);
+
+    if (created != get) {
+        fprintf(stderr, "duplicate value tuple created a second series\n");
+        return 1;
+    }
+
+    /* Enough distinct tuples to grow the index */
+    for (i = 0; i < 100; i++) {
+        snprintf(method, sizeof(method), "M%d", i);
+        instance = prometheus_counter_series_create_instance(
+            prometheus_counter_lookup_series(counter, (const char *[]) { method, "500" }));
+        prometheus_counter_add(instance, i);
+    }
+
+    prometheus_counter_destroy_series(counter, put);
+
+    put = prometheus_counter_lookup_series(counter, (const char *[]) { "PUT", "200" });
+
+    instance = prometheus_counter_series_create_instance(get);
+    prometheus_counter_add(instance, 7);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!put || !strstr(buffer, "test_requests{method=\"GET\",status=\"200\"} 7\n") ||
+        !strstr(buffer, "test_requests{method=\"M42\",status=\"500\"} 42\n")) {
+        fprintf(stderr, "unexpected labeled output\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
@@ -0,0 +1,175 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "prometheus-c.h"
+
+#define NUM_WORKERS 4
+
+static void
+worker(
+    struct prometheus_metrics        *metrics,
+    struct prometheus_counter        *counter,
+    struct prometheus_counter_series *series,
+    int                               index)
+{
+    struct prometheus_counter_instance *instance, *shared_instance;
+    struct prometheus_counter_series   *shared_series;
+
+    /* Links to the instance the parent created before fork stay private to this worker */
+    instance = prometheus_counter_series_create_instance(series);
+    prometheus_counter_add(instance, 100 * (index + 1));
+
+    /* Every worker creates the same series after fork, which a scrape merges */
+    shared_series = prometheus_counter_create_series(counter, (const char *[]) { "kind" },
+                                                     (const char *[]) { "worker" }, 1);
+    shared_instance = prometheus_counter_series_create_instance(shared_series);
+    prometheus_counter_add(shared_instance, 10);
+
+    /* Half the workers clean up, folding their handles, and half just exit */
+    if (index & 1) {
+        prometheus_metrics_destroy(metrics);
+    }
+
+    _exit(0);
+} /* worker */
+
+static long
+self_handles(const char *buffer)
+{
+    const char *p = strstr(buffer, "\nprometheus_c_handles");
+
+    return p ? strtol(strchr(p + 1, ' '), NULL, 10) : -1;
+} /* self_handles */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics          *metrics, *restored;
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *series;
+    struct prometheus_counter_instance *parent_instance;
+    static char                         buffer[65536];
+    char                                path[] = "/tmp/prometheus-multiprocess-XXXXXX";
+    pid_t                               pids[NUM_WORKERS];
+    long                                handles;
+    int                                 i, status, fd, failed = 0;
+
+    metrics = prometheus_metrics_create_shared(NULL, 1024 * 1024, NULL, NULL, 0);
+
+    if (!metrics) {
+        fprintf(stderr, "failed to create shared metrics\n");
+        return 1;
+    }
+
+    counter = prometheus_metrics_create_counter(metrics, "test_counter", "Test counter");
+    series  = prometheus_counter_create_series(counter, (const char *[]) { "kind" }, (const char *[]) { "base" }, 1);
+
+    parent_instance = prometheus_counter_series_create_instance(series);
+    prometheus_counter_add(parent_instance, 5);
+
+    for (i = 0; i < NUM_WORKERS; i++) {
+        pids[i] = fork();
+
+        if (pids[i] == 0) {
+            worker(metrics, counter, series, i);
+        }
+    }
+
+    for (i = 0; i < NUM_WORKERS; i++) {
+        waitpid(pids[i], &status, 0);
+    }
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_counter{kind=\"base\"} 1005\n") ||
+        !strstr(buffer, "test_counter{kind=\"worker\"} 40\n")) {
+        fprintf(stderr, "unexpected aggregate before reaping:\n%s", buffer);
+        failed = 1;
+    }
+
+    /* Reaping the workers that just exited recycles their handles without losing their totals */
+
+    if (prometheus_metrics_reap_process(metrics, pids[0]) != 2 ||
+        prometheus_metrics_reap_process(metrics, pids[2]) != 2 ||
+        prometheus_metrics_reap_process(metrics, pids[1]) != 0) {
+        fprintf(stderr, "unexpected number of handles reaped\n");
+        failed = 1;
+    }
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_counter{kind=\"base\"} 1005\n") ||
+        !strstr(buffer, "test_counter{kind=\"worker\"} 40\n")) {
+        fprintf(stderr, "unexpected aggregate after reaping:\n%s", buffer);
+        failed = 1;
+    }
+
+    /* Destroying the series only walks the parent's own handles */
+
+    prometheus_metrics_enable_self_metrics(metrics);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    handles = self_handles(buffer);
+
+    prometheus_counter_destroy_series(counter, series);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (self_handles(buffer) != handles - 1 || strstr(buffer, "kind=\"base\"")) {
+        fprintf(stderr, "destroying the series touched other handles:\n%s", buffer);
+        failed = 1;
+    }
+
+    /* Checkpoints and remote-write pushes cover every process, not just this one */
+
+    fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+
+    prometheus_metrics_set_checkpoint(metrics, path, 0);
+
+    if (prometheus_metrics_checkpoint(metrics) ||
+        prometheus_metrics_restore_checkpoint(metrics, path) != -1) {
+        fprintf(stderr, "shared checkpoint failed\n");
+        failed = 1;
+    }
+
+    restored = prometheus_metrics_create(NULL, NULL, 0);
+    prometheus_metrics_restore_checkpoint(restored, path);
+
+    prometheus_counter_create_series(prometheus_metrics_create_counter(restored, "test_counter", "Test counter"),
+                                     (const char *[]) { "kind" }, (const char *[]) { "worker" }, 1);
+
+    prometheus_metrics_scrape(restored, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_counter{kind=\"worker\"} 40\n")) {
+        fprintf(stderr, "checkpoint does not hold the aggregate:\n%s", buffer);
+        failed = 1;
+    }
+
+    prometheus_metrics_destroy(restored);
+
+    for (i = 0; i < 2; i++) {
+        snprintf(buffer, sizeof(buffer), "%s.%d", path, i);
+        unlink(buffer);
+    }
+
+    if (prometheus_metrics_remote_write_encode(metrics, 1000, 0, buffer, sizeof(buffer)) <= 0 ||
+        prometheus_metrics_remote_write_encode(metrics, 1000, PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY,
+                                               buffer, sizeof(buffer)) != -1) {
+        fprintf(stderr, "unexpected shared remote-write result\n");
+        failed = 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return failed;
+} /* main */
@@ -0,0 +1,90 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+#define BUFFER_SIZE (16 * 1024 * 1024)
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics   *metrics;
+    struct prometheus_counter   *counter;
+    struct prometheus_gauge     *gauge;
+    struct prometheus_histogram *histogram;
+    char                         name[64], label[64];
+    const char                  *label_names[] = { "test" };
+    const char                  *label_values[] = { label };
+    char                        *serial, *parallel;
+    int                          serial_len, parallel_len, i, j, threads;
+
+    serial   = malloc(BUFFER_SIZE);
+    parallel = malloc(BUFFER_SIZE);
+
+    metrics = prometheus_metrics_create((char *[]) { "global" }, (char *[]) { "root" }, 1);
+
+    /* Uneven series counts so that partitions do not line up with metric boundaries */
+    for (i = 0; i < 50; i++) {
+        snprintf(name, sizeof(name), "test_counter%d", i);
+        counter = prometheus_metrics_create_counter(metrics, name, "Test counter");
+
+        for (j = 0; j < i * 37; j++) {
+            snprintf(label, sizeof(label), "series%d", j);
+            prometheus_counter_add(prometheus_counter_series_create_instance(
+                                       prometheus_counter_create_series(counter, label_names, label_values, 1)), i * j);
+        }
+
+        snprintf(name, sizeof(name), "test_gauge%d", i);
+        gauge = prometheus_metrics_create_gauge(metrics, name, "Test gauge");
+
+        for (j = 0; j < (50 - i) * 11; j++) {
+            snprintf(label, sizeof(label), "series%d", j);
+            prometheus_gauge_set(prometheus_gauge_series_create_instance(
+                                     prometheus_gauge_create_series(gauge, label_names, label_values, 1)), i + j);
+        }
+
+        snprintf(name, sizeof(name), "test_histogram%d", i);
+        histogram = prometheus_metrics_create_histogram_exponential(metrics, name, "Test histogram", 16);
+
+        for (j = 0; j < i % 7 * 13; j++) {
+            snprintf(label, sizeof(label), "series%d", j);
+            prometheus_histogram_sample(prometheus_histogram_series_create_instance(
+                                            prometheus_histogram_create_series(histogram, label_names, label_values, 1)),
+                                        i * j + 1);
+        }
+    }
+
+    serial_len = prometheus_metrics_scrape(metrics, serial, BUFFER_SIZE);
+
+    for (threads = 0; threads <= 8; threads++) {
+
+        prometheus_metrics_set_scrape_threads(metrics, threads);
+
+        parallel_len = prometheus_metrics_scrape_parallel(metrics, parallel, BUFFER_SIZE);
+
+        if (serial_len <= 0 || parallel_len != serial_len || memcmp(serial, parallel, serial_len) != 0) {
+            fprintf(stderr, "parallel scrape with %d threads differs from serial scrape\n", threads);
+            return 1;
+        }
+    }
+
+    if (prometheus_metrics_scrape_parallel(metrics, parallel, serial_len) != -1) {
+        fprintf(stderr, "undersized buffer was not rejected\n");
+        return 1;
+    }
+
+    printf("serial and parallel scrapes match, %d bytes\n", serial_len);
+
+    prometheus_metrics_destroy(metrics);
+
+    free(serial);
+    free(parallel);
+
+    return 0;
+} /* main */
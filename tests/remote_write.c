@@ -0,0 +1,288 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+static uint64_t
+read_varint(
+    const uint8_t **p,
+    const uint8_t  *end)
+{
+    uint64_t value = 0;
+    int      shift = 0;
+
+    while (*p < end) {
+        value |= (uint64_t) (**p & 0x7f) << shift;
+        shift += 7;
+
+        if (!(*(*p)++ & 0x80)) {
+            break;
+        }
+    }
+
+    return value;
+} /* read_varint */
+
+static int
+snappy_decompress(
+    const uint8_t *ip,
+    int            length,
+    uint8_t       *output,
+    int            output_size)
+{
+    const uint8_t *end = ip + length;
+    uint64_t       expected;
+    int            op = 0, len, offset, tag;
+
+    expected = read_varint(&ip, end);
+
+    if (expected > (uint64_t) output_size) {
+        return -1;
+    }
+
+    while (ip < end) {
+        tag = *ip++;
+
+        if ((tag & 3) == 0) {
+            len = (tag >> 2) + 1;
+
+            if (len == 61) {
+                len = ip[0] + 1;
+                ip += 1;
+            } else if (len == 62) {
+                len = (ip[0] | (ip[1] << 8)) + 1;
+                ip += 2;
+            }
+
+            if (op + len > output_size || ip + len > end) {
+                return -1;
+            }
+
+            memcpy(output + op, ip, len);
+            ip += len;
+            op += len;
+            continue;
+        }
+
+        if ((tag & 3) == 1) {
+            len    = ((tag >> 2) & 7) + 4;
+            offset = ((tag >> 5) << 8) | ip[0];
+            ip    += 1;
+        } else if ((tag & 3) == 2) {
+            len    = (tag >> 2) + 1;
+            offset = ip[0] | (ip[1] << 8);
+            ip    += 2;
+        } else {
+            return -1;
+        }
+
+        if (offset == 0 || offset > op || op + len > output_size) {
+            return -1;
+        }
+
+        while (len--) {
+            output[op] = output[op - offset];
+            op++;
+        }
+    }
+
+    return op == (int) expected ? op : -1;
+} /* snappy_decompress */
+
+/*
+ * Walk a WriteRequest, counting the timeseries and returning the value
+ * of the series whose __name__ matches.
+ */
+
+static int
+count_series(
+    const uint8_t *p,
+    int            length,
+    const char    *name,
+    double        *value)
+{
+    const uint8_t *end = p + length, *ts_end, *sub_end, *label_name, *label_value;
+    uint64_t       len, label_name_len, label_value_len;
+    int            count = 0, matched;
+    double         sample;
+
+    while (p < end) {
+        if (read_varint(&p, end) != ((1 << 3) | 2)) {
+            return -1;
+        }
+
+        len     = read_varint(&p, end);
+        ts_end  = p + len;
+        matched = 0;
+        sample  = 0;
+        count++;
+
+        while (p < ts_end) {
+            switch (read_varint(&p, ts_end)) {
+                case (1 << 3) | 2:
+                    len         = read_varint(&p, ts_end);
+                    sub_end     = p + len;
+                    label_name  = label_value = NULL;
+                    label_name_len = label_value_len = 0;
+
+                    while (p < sub_end) {
+                        if (read_varint(&p, sub_end) == ((1 << 3) | 2)) {
+                            label_name_len = read_varint(&p, sub_end);
+                            label_name     = p;
+                            p             += label_name_len;
+                        } else {
+                            label_value_len = read_varint(&p, sub_end);
+                            label_value     = p;
+                            p              += label_value_len;
+                        }
+                    }
+
+                    if (label_name && label_name_len == 8 && memcmp(label_name, "__name__", 8) == 0 &&
+                        label_value_len == strlen(name) && memcmp(label_value, name, label_value_len) == 0) {
+                        matched = 1;
+                    }
+                    break;
+                case (2 << 3) | 2:
+                    len     = read_varint(&p, ts_end);
+                    sub_end = p + len;
+
+                    if (read_varint(&p, sub_end) != ((1 << 3) | 1)) {
+                        return -1;
+                    }
+
+                    memcpy(&sample, p, sizeof(sample));
+                    p = sub_end;
+                    break;
+                default:
+                    return -1;
+            } /* switch */
+        }
+
+        if (matched) {
+            *value = sample;
+        }
+    }
+
+    return count;
+} /* count_series */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_counter          *counter;
+    struct prometheus_counter_series   *series;
+    struct prometheus_counter_instance *instance;
+    struct prometheus_histogram        *histogram;
+    struct prometheus_histogram_series *histogram_series;
+    static char                         buffer[65536], small[64], long_name[400];
+    static uint8_t                      decoded[262144];
+    double                              value = 0;
+    int                                 length, decoded_length, count, pass, failed = 0;
+
+    struct prometheus_metrics          *metrics = prometheus_metrics_create((char *[]) { "global" },
+                                                                            (char *[]) { "root" }, 1);
+
+    counter  = prometheus_metrics_create_counter(metrics, "test_counter", "Test counter");
+    series   = prometheus_counter_create_series(counter, (const char *[]) { "test" }, (const char *[]) { "test1" }, 1);
+    instance = prometheus_counter_series_create_instance(series);
+
+    histogram        = prometheus_metrics_create_histogram_exponential(metrics, "test_histogram", "Test histogram", 8);
+    histogram_series = prometheus_histogram_create_series(histogram, NULL, NULL, 0);
+
+    prometheus_histogram_series_create_instance(histogram_series);
+
+    prometheus_counter_add(instance, 42);
+
+    length = prometheus_metrics_remote_write_encode(metrics, 1000, 0, buffer, sizeof(buffer));
+
+    decoded_length = snappy_decompress((uint8_t *) buffer, length, decoded, sizeof(decoded));
+
+    /* One counter series plus 8 buckets, _sum and _count for the histogram */
+
+    count = count_series(decoded, decoded_length, "test_counter", &value);
+
+    if (length <= 0 || decoded_length <= 0 || count != 11 || value != 42) {
+        fprintf(stderr, "full push: length %d decoded %d series %d value %f\n",
+                length, decoded_length, count, value);
+        failed = 1;
+    }
+
+    prometheus_metrics_remote_write_commit(metrics);
+
+    /* Nothing changed since the last push, so no series are sent */
+
+    length         = prometheus_metrics_remote_write_encode(metrics, 2000, PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY, buffer, sizeof(buffer));
+    decoded_length = snappy_decompress((uint8_t *) buffer, length, decoded, sizeof(decoded));
+
+    if (length <= 0 || decoded_length != 0) {
+        fprintf(stderr, "unchanged push: length %d decoded %d\n", length, decoded_length);
+        failed = 1;
+    }
+
+    prometheus_counter_increment(instance);
+
+    /* A failed encode does not count the change as pushed */
+
+    if (prometheus_metrics_remote_write_encode(metrics, 3000, PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY, small, 4) != -1 ||
+        prometheus_metrics_remote_write_commit(metrics) != -1) {
+        fprintf(stderr, "undersized changed push was not rejected\n");
+        failed = 1;
+    }
+
+    /* Nor does a successful encode which is not committed, as when the POST fails */
+
+    for (pass = 0; pass < 2; pass++) {
+        length         = prometheus_metrics_remote_write_encode(metrics, 3000, PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY, buffer, sizeof(buffer));
+        decoded_length = snappy_decompress((uint8_t *) buffer, length, decoded, sizeof(decoded));
+        count          = count_series(decoded, decoded_length, "test_counter", &value);
+
+        if (count != 1 || value != 43) {
+            fprintf(stderr, "changed push %d: series %d value %f\n", pass, count, value);
+            failed = 1;
+        }
+    }
+
+    prometheus_metrics_remote_write_commit(metrics);
+
+    length = prometheus_metrics_remote_write_encode(metrics, 3500, PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY, buffer, sizeof(buffer));
+
+    if (snappy_decompress((uint8_t *) buffer, length, decoded, sizeof(decoded)) != 0) {
+        fprintf(stderr, "committed push was sent again\n");
+        failed = 1;
+    }
+
+    /* Long metric names are sent whole */
+
+    memset(long_name, 'x', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+
+    prometheus_counter_series_create_instance(
+        prometheus_counter_create_series(prometheus_metrics_create_counter(metrics, long_name, "Long name"),
+                                         NULL, NULL, 0));
+
+    length         = prometheus_metrics_remote_write_encode(metrics, 3700, PROMETHEUS_REMOTE_WRITE_CHANGED_ONLY, buffer, sizeof(buffer));
+    decoded_length = snappy_decompress((uint8_t *) buffer, length, decoded, sizeof(decoded));
+    count          = count_series(decoded, decoded_length, long_name, &value);
+
+    if (count != 1 || value != 0) {
+        fprintf(stderr, "long name push: series %d\n", count);
+        failed = 1;
+    }
+
+    /* A buffer too small for the request is an error */
+
+    if (prometheus_metrics_remote_write_encode(metrics, 4000, 0, small, sizeof(small)) != -1) {
+        fprintf(stderr, "undersized buffer was not rejected\n");
+        failed = 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return failed;
+} /* main */
@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics          *metrics;
+    struct prometheus_counter          *counter;
+    struct prometheus_gauge            *gauge;
+    struct prometheus_histogram        *histogram, *size;
+    struct prometheus_counter_series   *counter_series[4];
+    struct prometheus_gauge_series     *gauge_series[4];
+    struct prometheus_histogram_series *histogram_series[4], *size_series[4];
+    const char                         *names[]  = { "share", "client" };
+    const char                         *values[] = { "a", "c1", "a", "c2", "b", "c1", "b", "c3" };
+    const char                         *client[] = { "client" };
+    char                                buffer[16384], before[16384];
+    const char                         *raw, *view, *family;
+    int                                 i, len;
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    counter   = prometheus_metrics_create_counter(metrics, "test_bytes", "Bytes transferred");
+    gauge     = prometheus_metrics_create_gauge(metrics, "test_sessions", "Open sessions");
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "test_latency", "Latency", 4);
+    size      = prometheus_metrics_create_histogram_exponential(metrics, "test_size", "Size", 4);
+
+    if (prometheus_counter_add_rollup(counter, (const char *[]) { "bad label" }, 1, 0) == 0) {
+        fprintf(stderr, "illegal rollup label accepted\n");
+        return 1;
+    }
+
+    prometheus_gauge_add_rollup(gauge, names, 2, PROMETHEUS_ROLLUP_REPLACE);
+    prometheus_histogram_add_rollup(histogram, client, 1, PROMETHEUS_ROLLUP_REPLACE);
+    prometheus_histogram_add_rollup(size, client, 1, 0);
+
+    prometheus_counter_create_series_batch(counter, names, values, 2, 4, counter_series);
+    prometheus_gauge_create_series_batch(gauge, names, values, 2, 4, gauge_series);
+    prometheus_histogram_create_series_batch(histogram, names, values, 2, 4, histogram_series);
+    prometheus_histogram_create_series_batch(size, names, values, 2, 4, size_series);
+
+    for (i = 0; i < 4; i++) {
+        prometheus_counter_add(prometheus_counter_series_create_instance(counter_series[i]), 10 * (i + 1));
+        prometheus_gauge_set(prometheus_gauge_series_create_instance(gauge_series[i]), i + 1);
+        prometheus_histogram_sample(prometheus_histogram_series_create_instance(histogram_series[i]), 3);
+        prometheus_histogram_sample(prometheus_histogram_series_create_instance(size_series[i]), 5);
+    }
+
+    prometheus_metrics_scrape(metrics, before, sizeof(before));
+
+    prometheus_counter_add_rollup(counter, client, 1, 0);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    /* Views alongside the raw series leave the raw family as it was */
+    family = strstr(before, "# HELP test_bytes ");
+    len    = strstr(family, "\n\n") + 2 - family;
+
+    raw = strstr(buffer, "# HELP test_bytes ");
+
+    if (!raw || strncmp(raw, family, len) || strstr(buffer, "test_bytes{share=\"a\"}")) {
+        fprintf(stderr, "counter rollup changed the raw family\n");
+        return 1;
+    }
+
+    if (!strstr(buffer, "# HELP test_bytes:sum_without_client Bytes transferred, summed without client\n"
+                "# TYPE test_bytes:sum_without_client counter\n"
+                "test_bytes:sum_without_client{share=\"a\"} 30\n"
+                "test_bytes:sum_without_client{share=\"b\"} 70\n\n")) {
+        fprintf(stderr, "counter rollup missing\n");
+        return 1;
+    }
+
+    /* Histogram views form their own family after the raw one */
+    raw  = strstr(buffer, "test_size_count{share=\"b\",client=\"c3\"} 1\n\n");
+    view = strstr(buffer, "# TYPE test_size:sum_without_client histogram\n");
+
+    if (!raw || !view || view < raw || strstr(buffer, "test_size_count{share=\"b\"}") ||
+        !strstr(view, "test_size:sum_without_client_bucket{share=\"a\",le=\"8\"} 2\n") ||
+        !strstr(view, "test_size:sum_without_client_count{share=\"b\"} 2\n")) {
+        fprintf(stderr, "histogram rollup missing or out of order\n");
+        return 1;
+    }
+
+    /* Views that replace the raw series are all that is emitted */
+    if (!strstr(buffer, "test_sessions{} 10\n") || strstr(buffer, "test_sessions{share") ||
+        !strstr(buffer, "test_latency_bucket{share=\"b\",le=\"4\"} 2\n") ||
+        !strstr(buffer, "test_latency_sum{share=\"a\"} 6\n") ||
+        !strstr(buffer, "test_latency_count{share=\"a\"} 2\n") || strstr(buffer, "test_latency_count{share=\"a\",")) {
+        fprintf(stderr, "replacing rollups wrong\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
@@ -0,0 +1,98 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prometheus-c.h"
+
+static uint64_t
+scraped_value(
+    const char *buffer,
+    const char *line)
+{
+    const char *ptr = strstr(buffer, line);
+
+    return ptr ? strtoull(ptr + strlen(line), NULL, 10) : 0;
+} /* scraped_value */
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics            *metrics;
+    struct prometheus_histogram          *histogram;
+    struct prometheus_histogram_series   *series;
+    struct prometheus_histogram_instance *instance;
+    int64_t                               values[1000];
+    uint64_t                              count, bucket;
+    char                                  buffer[8192];
+    int                                   i;
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "test_sampled", "Sampled histogram", 8);
+
+    if (prometheus_histogram_set_sampling(histogram, 10)) {
+        fprintf(stderr, "setting the sample rate failed\n");
+        return 1;
+    }
+
+    series   = prometheus_histogram_create_series(histogram, NULL, NULL, 0);
+    instance = prometheus_histogram_series_create_instance(series);
+
+    if (prometheus_histogram_set_sampling(histogram, 100) == 0) {
+        fprintf(stderr, "sample rate changed after series were created\n");
+        return 1;
+    }
+
+    for (i = 0; i < 1000; i++) {
+        values[i] = 5;
+    }
+
+    for (i = 0; i < 50000; i++) {
+        prometheus_histogram_sample(instance, 5);
+    }
+
+    for (i = 0; i < 50; i++) {
+        prometheus_histogram_sample_many(instance, values, 1000);
+    }
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    /* Estimates are scaled back up to all 100000 observations */
+    count  = scraped_value(buffer, "test_sampled_count{} ");
+    bucket = scraped_value(buffer, "test_sampled_bucket{le=\"8\"} ");
+
+    if (count < 90000 || count > 110000 || count % 10 || bucket != count ||
+        scraped_value(buffer, "test_sampled_sum{} ") != 5 * count ||
+        scraped_value(buffer, "test_sampled_sample_interval{} ") != 10) {
+        fprintf(stderr, "sampled estimates out of range\n");
+        return 1;
+    }
+
+    /* Timed observations that sampling drops still reach the extremes */
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "test_timed", "Sampled timer", 8);
+
+    prometheus_histogram_set_sampling(histogram, 1000);
+    prometheus_histogram_set_min_max(histogram, 1);
+
+    series   = prometheus_histogram_create_series(histogram, NULL, NULL, 0);
+    instance = prometheus_histogram_series_create_instance(series);
+
+    prometheus_histogram_sample_elapsed(instance, prometheus_clock_ticks(), PROMETHEUS_TIME_NS);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+
+    if (!strstr(buffer, "test_timed_max{} ") || strstr(buffer, "test_timed_max{} NaN")) {
+        fprintf(stderr, "timed observation dropped by sampling missed the extremes:\n%s\n", buffer);
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
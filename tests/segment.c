@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics            *metrics;
+    struct prometheus_segment            *segment;
+    struct prometheus_counter            *counter;
+    struct prometheus_counter_series     *counter_series;
+    struct prometheus_counter_instance   *instance1, *instance2;
+    struct prometheus_gauge              *gauge;
+    struct prometheus_gauge_instance     *gauge_instance;
+    struct prometheus_histogram          *histogram;
+    struct prometheus_histogram_instance *histogram_instance;
+    static char                           local[65536], remote[65536];
+    char                                  path[64];
+    int                                   local_length, remote_length, failed = 0;
+
+    snprintf(path, sizeof(path), "/tmp/prometheus-c-segment-%d", getpid());
+
+    metrics = prometheus_metrics_create_shared(path, 1024 * 1024, (char *[]) { "global" }, (char *[]) { "root" }, 1);
+
+    if (!metrics) {
+        fprintf(stderr, "failed to create segment %s\n", path);
+        return 1;
+    }
+
+    counter        = prometheus_metrics_create_counter(metrics, "test_counter", "Test counter");
+    counter_series = prometheus_counter_create_series(counter, (const char *[]) { "test" },
+                                                      (const char *[]) { "test1" }, 1);
+    instance1 = prometheus_counter_series_create_instance(counter_series);
+    instance2 = prometheus_counter_series_create_instance(counter_series);
+
+    gauge          = prometheus_metrics_create_gauge(metrics, "test_gauge", "Test gauge");
+    gauge_instance = prometheus_gauge_series_create_instance(prometheus_gauge_create_series(gauge, NULL, NULL, 0));
+
+    histogram          = prometheus_metrics_create_histogram_exponential(metrics, "test_histogram", "Test histogram", 8);
+    histogram_instance = prometheus_histogram_series_create_instance(
+        prometheus_histogram_create_series(histogram, NULL, NULL, 0));
+
+    prometheus_counter_add(instance1, 10);
+    prometheus_counter_add(instance2, 5);
+    prometheus_gauge_set(gauge_instance, 42);
+    prometheus_histogram_sample(histogram_instance, 3);
+    prometheus_histogram_sample(histogram_instance, 100);
+
+    /* A destroyed handle is folded into the series and its record recycled */
+    prometheus_counter_series_destroy_instance(counter_series, instance2);
+    instance2 = prometheus_counter_series_create_instance(counter_series);
+    prometheus_counter_add(instance2, 1);
+
+    segment = prometheus_segment_open(path);
+
+    if (!segment) {
+        fprintf(stderr, "failed to open segment %s\n", path);
+        prometheus_metrics_destroy(metrics);
+        unlink(path);
+        return 1;
+    }
+
+    /* The out-of-process view must match an in-process scrape exactly */
+
+    local_length  = prometheus_metrics_scrape(metrics, local, sizeof(local));
+    remote_length = prometheus_segment_scrape(segment, remote, sizeof(remote));
+
+    if (local_length <= 0 || local_length != remote_length || memcmp(local, remote, local_length)) {
+        fprintf(stderr, "segment scrape mismatch\nlocal:\n%.*s\nsegment:\n%.*s\n",
+                local_length, local, remote_length, remote);
+        failed = 1;
+    }
+
+    if (!strstr(remote, "test_counter{global=\"root\",test=\"test1\"} 16")) {
+        fprintf(stderr, "counter total missing from segment scrape\n");
+        failed = 1;
+    }
+
+    prometheus_segment_close(segment);
+    prometheus_metrics_destroy(metrics);
+    unlink(path);
+
+    return failed;
+} /* main */
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics            *metrics;
+    struct prometheus_histogram          *histogram;
+    struct prometheus_histogram_series   *series;
+    struct prometheus_histogram_instance *instance;
+    struct timespec                       delay = { 0, 20000000 };
+    uint64_t                              start, ms, us;
+    char                                  buffer[4096];
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "test_latency_ms", "Latency in ms", 12);
+    series    = prometheus_histogram_create_series(histogram, NULL, NULL, 0);
+    instance  = prometheus_histogram_series_create_instance(series);
+
+    start = prometheus_clock_ticks();
+
+    nanosleep(&delay, NULL);
+
+    us = prometheus_clock_elapsed(start, PROMETHEUS_TIME_US);
+    ms = prometheus_clock_elapsed(start, PROMETHEUS_TIME_MS);
+
+    prometheus_histogram_sample_elapsed(instance, start, PROMETHEUS_TIME_MS);
+
+    printf("cycle counter %s, slept %lu us, %lu ms\n", prometheus_clock.cycles ? "in use" : "unavailable", us, ms);
+
+    if (us < 20000 || us > 1000000 || ms < 20 || ms > 1000 || ms > us / 1000 + 1) {
+        fprintf(stderr, "elapsed time out of range\n");
+        return 1;
+    }
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "test_latency_ms_count{} 1\n")) {
+        fprintf(stderr, "elapsed sample was not recorded\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */
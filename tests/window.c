@@ -0,0 +1,99 @@
+// SPDX-FileCopyrightText: 2025 Ben Jarvis
+//
+// SPDX-License-Identifier: LGPL-2.1-only
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "prometheus-c.h"
+
+int
+main(
+    int    argc,
+    char **argv)
+{
+    struct prometheus_metrics            *metrics;
+    struct prometheus_counter            *counter;
+    struct prometheus_counter_series     *counter_series;
+    struct prometheus_counter_instance   *counter_instance;
+    struct prometheus_histogram          *histogram;
+    struct prometheus_histogram_series   *histogram_series;
+    struct prometheus_histogram_instance *histogram_instance;
+    char                                  buffer[8192];
+    double                                rate, average;
+    int                                   i;
+
+    metrics = prometheus_metrics_create(NULL, NULL, 0);
+
+    counter   = prometheus_metrics_create_counter(metrics, "test_window", "Windowed counter");
+    histogram = prometheus_metrics_create_histogram_exponential(metrics, "test_window_latency", "Windowed histogram", 8);
+
+    if (prometheus_counter_set_window(counter, 10) || prometheus_histogram_set_window(histogram, 10)) {
+        fprintf(stderr, "enabling windows failed\n");
+        return 1;
+    }
+
+    counter_series     = prometheus_counter_create_series(counter, NULL, NULL, 0);
+    counter_instance   = prometheus_counter_series_create_instance(counter_series);
+    histogram_series   = prometheus_histogram_create_series(histogram, NULL, NULL, 0);
+    histogram_instance = prometheus_histogram_series_create_instance(histogram_series);
+
+    if (prometheus_counter_set_window(counter, 20) == 0) {
+        fprintf(stderr, "window changed after series were created\n");
+        return 1;
+    }
+
+    /* Nothing is known until the aggregator has filled two slots */
+    if (prometheus_counter_series_rate(counter_series, &rate) == 0) {
+        fprintf(stderr, "rate reported without an aggregator\n");
+        return 1;
+    }
+
+    if (prometheus_metrics_start_aggregator(metrics, 10, 19)) {
+        fprintf(stderr, "failed to start aggregator\n");
+        return 1;
+    }
+
+    for (i = 0; i < 300; i++) {
+        prometheus_counter_add(counter_instance, 1);
+        prometheus_histogram_sample(histogram_instance, 100);
+        usleep(1000);
+    }
+
+    if (prometheus_counter_series_rate(counter_series, &rate) ||
+        prometheus_histogram_series_rate(histogram_series, NULL, &average)) {
+        fprintf(stderr, "window queries failed\n");
+        return 1;
+    }
+
+    if (rate < 50 || rate > 1500 || average != 100) {
+        fprintf(stderr, "unexpected rate %f average %f\n", rate, average);
+        return 1;
+    }
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "# TYPE test_window_rate gauge\n") ||
+        !strstr(buffer, "test_window_latency_avg{} 100\n")) {
+        fprintf(stderr, "window gauges missing from scrape\n");
+        return 1;
+    }
+
+    /* Once the window has slid past the last update the rate falls to zero */
+    usleep(300000);
+
+    prometheus_metrics_scrape(metrics, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+
+    if (!strstr(buffer, "test_window_rate{} 0\n") ||
+        !strstr(buffer, "test_window_latency_rate{} 0\n") ||
+        !strstr(buffer, "test_window_latency_avg{} NaN\n")) {
+        fprintf(stderr, "idle window not reported as idle\n");
+        return 1;
+    }
+
+    prometheus_metrics_destroy(metrics);
+
+    return 0;
+} /* main */